@@ -309,6 +309,8 @@
 
     __block NSString *backupDir = [NSString stringWithString:backupPath];
     __block NSString *workDir = [[NSBundle mainBundle] resourcePath];
+    NSArray *cachePaths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+    __block NSString *cacheDir = cachePaths.count > 0 ? [[cachePaths objectAtIndex:0] stringByAppendingPathComponent:@"WechatExporter"] : nil;
     typeof(self) __weak weakSelf = self;
     
     [self setUIEnabled:NO withCancellable:NO];
@@ -319,6 +321,10 @@
         {
             Exporter exp([workDir UTF8String], [backupDir UTF8String], "", strongSelf->m_logger, NULL);
             exp.setLanguageCode([[self getCurrentLanguageCode] UTF8String]);
+            if (nil != cacheDir)
+            {
+                exp.setCacheDirectory([cacheDir UTF8String]);
+            }
             exp.loadUsersAndSessions();
             exp.swapUsersAndSessions(strongSelf->m_usersAndSessions);
         }
@@ -11,114 +11,208 @@
 
 std::atomic_uint32_t AsyncExecutor::m_nextTaskId(1u);
 
+// Worker of the current thread, tasks added by it are kept in its own deques
+static thread_local const AsyncExecutor* t_executor = NULL;
+static thread_local int t_workerIndex = 0;
+
 uint32_t AsyncExecutor::genNextTaskId()
 {
     return m_nextTaskId.fetch_add(1);
 }
 
-AsyncExecutor::Thread::Thread(AsyncExecutor *executor) : m_executor(executor),
-      m_thread(new std::thread(&AsyncExecutor::Thread::ThreadFunc, this))
+AsyncExecutor::AsyncExecutor(int reserve_threads, int max_threads, Callback *callback) :
+    m_callback(callback),
+    m_nthreads(0),
+    m_nextWorker(0),
+    m_numberOfQueued(0),
+    m_threads_waiting(0),
+    m_shutdown(false),
+    m_reserve_threads(reserve_threads),
+    m_max_threads(max_threads),
+    m_nrunning(0)
 {
+    if (m_max_threads <= 0)
+    {
+        m_max_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+    if (m_reserve_threads > m_max_threads)
+    {
+        m_reserve_threads = m_max_threads;
+    }
+    m_workers.reserve(m_max_threads);
+    for (int idx = 0; idx < m_max_threads; ++idx)
+    {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
 }
 
-AsyncExecutor::Thread::~Thread()
+AsyncExecutor::~AsyncExecutor()
 {
-    m_thread->join();
-    m_thread.reset();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shutdown = true;
+        m_cv.notify_all();
+    }
+    
+    for (std::vector<std::unique_ptr<Worker>>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        if ((*it)->thread.joinable())
+        {
+            (*it)->thread.join();
+        }
+    }
 }
 
-void AsyncExecutor::Thread::ThreadFunc()
+// m_mutex is held
+void AsyncExecutor::startThread(int index)
 {
-#if !defined(NDEBUG) || defined(DBG_PERF)
-    std::string tname = m_executor->m_tag + std::to_string(++m_executor->m_tid);
-    setThreadName(tname.c_str());
-#endif
+    Worker* worker = m_workers[index].get();
+    if (worker->thread.joinable())
+    {
+        worker->thread.join();
+    }
+    worker->thread = std::thread(&AsyncExecutor::ThreadFunc, this, index);
+    worker->running = true;
+    ++m_nrunning;
+    if (index >= m_nthreads)
+    {
+        m_nthreads = index + 1;
+    }
+}
+
+void AsyncExecutor::startThreads(size_t numberOfTasks)
+{
+    int nrunning = m_nrunning.load();
+    if (nrunning > 0 && (nrunning >= m_max_threads || m_threads_waiting.load() >= static_cast<int>(numberOfTasks)))
+    {
+        return;
+    }
     
-    m_executor->ThreadFunc();
-    std::unique_lock<std::mutex> lock(m_executor->m_mutex);
-    m_executor->m_nthreads--;
-    m_executor->m_dead_threads.push_back(this);
-    if ((m_executor->m_shutdown) && (m_executor->m_nthreads == 0))
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int numberOfIdleThreads = m_threads_waiting.load();
+    // Threads are started as the tasks come, workers quit when idle are started again too
+    for (int index = 0; index < m_max_threads && numberOfIdleThreads < static_cast<int>(numberOfTasks); ++index)
     {
-        m_executor->m_shutdown_cv.notify_one();
+        if (!m_workers[index]->running)
+        {
+            startThread(index);
+            ++numberOfIdleThreads;
+        }
     }
 }
 
 void AsyncExecutor::addTask(AsyncExecutor::Task* task)
 {
-    std::lock_guard<std::mutex> lock(m_mutex);
+    pushTasks(&task, 1);
+}
 
-    // Add works to the callbacks list
-    m_tasks.push(task);
+void AsyncExecutor::addTasks(const std::vector<Task *>& tasks)
+{
+    if (!tasks.empty())
+    {
+        pushTasks(&tasks[0], tasks.size());
+    }
+}
 
-    // Increase pool size or notify as needed
-    if (m_threads_waiting == 0 && m_nthreads < m_max_threads)
+void AsyncExecutor::pushTasks(Task* const* tasks, size_t numberOfTasks)
+{
+    startThreads(numberOfTasks);
+    
+    int index = 0;
+    if (t_executor == this)
     {
-        // Kick off a new thread
-        m_nthreads++;
-        new Thread(this);
+        index = t_workerIndex;
     }
     else
     {
-        m_cv.notify_one();
+        index = static_cast<int>(m_nextWorker.fetch_add(1) % static_cast<unsigned int>(m_nthreads.load()));
     }
-
-    // Also use this chance to harvest dead threads
-    if (!m_dead_threads.empty())
+    
     {
-        DestroyThreads(&m_dead_threads);
+        Worker* worker = m_workers[index].get();
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        for (size_t idx = 0; idx < numberOfTasks; ++idx)
+        {
+            int priority = tasks[idx]->getPriority();
+            worker->tasks[priority].push_back(tasks[idx]);
+            worker->sizes[priority].fetch_add(1);
+        }
+        m_numberOfQueued.fetch_add(static_cast<int64_t>(numberOfTasks));
     }
-}
-
-AsyncExecutor::AsyncExecutor(int reserve_threads, int max_threads, Callback *callback) :
-    m_callback(callback),
-    m_shutdown(false),
-    m_reserve_threads(reserve_threads),
-    m_max_threads(max_threads),
-    m_nthreads(0),
-    m_threads_waiting(0)
-{
-#ifndef NDEBUG
-    m_tid = 0;
-#endif
-    /*
-    for (int i = 0; i < m_reserve_threads; i++)
+    
+    // A worker going to sleep or quitting registers itself as waiting before checking m_numberOfQueued,
+    // so either it sees the tasks or it is handled here
+    if (m_threads_waiting.load() > 0 || m_shutdown)
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        m_nthreads++;
-        new Thread(this);
+        if (m_nrunning == 0)
+        {
+            // All workers quit after shutdown, but tasks are still coming (from the callbacks of other executors)
+            startThread(0);
+        }
+        else if (numberOfTasks == 1)
+        {
+            m_cv.notify_one();
+        }
+        else
+        {
+            m_cv.notify_all();
+        }
     }
-     */
 }
 
-AsyncExecutor::~AsyncExecutor()
+// m_mutex of the worker is held
+AsyncExecutor::Task* AsyncExecutor::popTask(Worker* worker, int priority, bool front)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    m_shutdown = true;
-    m_cv.notify_all();
-
-    while (m_nthreads != 0)
+    std::deque<Task *>& tasks = worker->tasks[priority];
+    if (tasks.empty())
     {
-        m_shutdown_cv.wait(lock);
+        return NULL;
     }
-
-    DestroyThreads(&m_dead_threads);
+    Task* task = NULL;
+    if (front)
+    {
+        task = tasks.front();
+        tasks.pop_front();
+    }
+    else
+    {
+        task = tasks.back();
+        tasks.pop_back();
+    }
+    worker->sizes[priority].fetch_sub(1);
+    m_numberOfQueued.fetch_sub(1);
+    return task;
 }
 
-void AsyncExecutor::DestroyThreads(std::list<Thread*> *threads)
+// Higher priority first: own deque, then the others
+AsyncExecutor::Task* AsyncExecutor::takeTask(int index)
 {
-    for (auto it = threads->begin(); it != threads->end(); it = threads->erase(it))
+    int nthreads = m_nthreads.load();
+    for (int priority = 0; priority < NUMBER_OF_PRIORITIES; ++priority)
     {
-        delete *it;
+        for (int offset = 0; offset < nthreads; ++offset)
+        {
+            Worker* worker = m_workers[(index + offset) % nthreads].get();
+            if (worker->sizes[priority].load(std::memory_order_relaxed) == 0)
+            {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            Task* task = popTask(worker, priority, offset == 0);
+            if (NULL != task)
+            {
+                return task;
+            }
+        }
     }
+    return NULL;
 }
 
 size_t AsyncExecutor::getNumberOfQueue() const
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    size_t size = m_tasks.size();
-    
-    return size;
+    int64_t size = m_numberOfQueued.load();
+    return size > 0 ? static_cast<size_t>(size) : 0;
 }
 
 void AsyncExecutor::shutdown()
@@ -132,7 +226,7 @@ void AsyncExecutor::shutdown()
 bool AsyncExecutor::waitForCompltion(unsigned int ms)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
-    if (m_nthreads != 0)
+    if (m_nrunning != 0)
     {
         if (ms == 0)
         {
@@ -153,48 +247,46 @@ bool AsyncExecutor::waitForCompltion(unsigned int ms)
 
 void AsyncExecutor::cancel()
 {
-    std::queue<Task *> tasks;
+    std::vector<Task *> tasks;
     {
         std::unique_lock<std::mutex> lock(m_mutex);
-        tasks.swap(m_tasks);
-		m_shutdown = true;
-		m_cv.notify_all();
+        m_shutdown = true;
+        
+        for (std::vector<std::unique_ptr<Worker>>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+        {
+            std::lock_guard<std::mutex> workerLock((*it)->mutex);
+            for (int priority = 0; priority < NUMBER_OF_PRIORITIES; ++priority)
+            {
+                std::deque<Task *>& queued = (*it)->tasks[priority];
+                m_numberOfQueued.fetch_sub(static_cast<int64_t>(queued.size()));
+                tasks.insert(tasks.end(), queued.begin(), queued.end());
+                queued.clear();
+                (*it)->sizes[priority] = 0;
+            }
+        }
+        m_cv.notify_all();
     }
     
-    while (!tasks.empty())
+    for (std::vector<Task *>::iterator it = tasks.begin(); it != tasks.end(); ++it)
     {
-        auto task = tasks.front();
-        tasks.pop();
-        delete task;
+        delete *it;
     }
 }
 
-void AsyncExecutor::ThreadFunc()
+void AsyncExecutor::ThreadFunc(int index)
 {
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    std::string tname = m_tag + std::to_string(index + 1);
+    setThreadName(tname.c_str());
+#endif
+    t_executor = this;
+    t_workerIndex = index;
+    
     for (;;)
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-
-        // Wait until work is available or we are shutting down.
-        if (!m_shutdown && m_tasks.empty())
+        Task* task = takeTask(index);
+        if (NULL != task)
         {
-            // If there are too many threads waiting, then quit this thread
-            if (m_threads_waiting >= m_reserve_threads)
-            {
-                break;
-            }
-
-            m_threads_waiting++;
-            m_cv.wait(lock);
-            m_threads_waiting--;
-        }
-        
-        // Drain callbacks before considering shutdown to ensure all work gets completed.
-        if (!m_tasks.empty())
-        {
-            auto task = m_tasks.front();
-            m_tasks.pop();
-            lock.unlock();
             if (NULL != m_callback)
             {
                 m_callback->onTaskStart(this, task);
@@ -205,10 +297,35 @@ void AsyncExecutor::ThreadFunc()
                 m_callback->onTaskComplete(this, task, succeeded);
             }
             delete task;
+            continue;
         }
-        else if (m_shutdown)
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Registered as waiting before checking the queue, so a task added meanwhile either is seen here or wakes it up
+        m_threads_waiting.fetch_add(1);
+        if (m_numberOfQueued.load() > 0)
         {
+            // Added after the deques were checked
+            m_threads_waiting.fetch_sub(1);
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        // Drain tasks before considering shutdown to ensure all work gets completed.
+        // Idle workers beyond reserve_threads quit too, one is kept waiting so that the tasks added meanwhile wake it up
+        if (m_shutdown || m_threads_waiting.load() > std::max(m_reserve_threads, 1))
+        {
+            // Quit with m_mutex still held, a task added from now on starts a worker again
+            m_threads_waiting.fetch_sub(1);
+            t_executor = NULL;
+            m_workers[index]->running = false;
+            if (--m_nrunning == 0)
+            {
+                m_shutdown_cv.notify_all();
+            }
             break;
         }
+        m_cv.wait(lock);
+        m_threads_waiting.fetch_sub(1);
     }
 }
@@ -13,12 +13,19 @@
 #include <mutex>
 #include <atomic>
 #include <thread>
-#include <queue>
-#include <list>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <string>
 
 class AsyncExecutor
 {
 public:
+    // Lower value runs first
+    static const int PRIORITY_HIGH = 0;
+    static const int PRIORITY_NORMAL = 1;
+    static const int PRIORITY_LOW = 2;
+    static const int NUMBER_OF_PRIORITIES = 3;
     
     class Task
     {
@@ -38,7 +45,7 @@ public:
             return "";
         }
 
-        Task() : m_taskId(0u), m_userData(NULL)
+        Task() : m_taskId(0u), m_userData(NULL), m_priority(PRIORITY_NORMAL)
         {
         }
         virtual ~Task() {}
@@ -63,9 +70,20 @@ public:
             m_userData = userData;
         }
         
+        int getPriority() const
+        {
+            return m_priority;
+        }
+        
+        void setPriority(int priority)
+        {
+            m_priority = (priority < PRIORITY_HIGH || priority >= NUMBER_OF_PRIORITIES) ? PRIORITY_NORMAL : priority;
+        }
+        
     private:
         uint32_t        m_taskId;
         const void*     m_userData;
+        int             m_priority;
     };
     
     class Callback
@@ -77,24 +95,40 @@ public:
     };
     
 protected:
-    class Thread
+    // Each worker owns a deque per priority: it takes the oldest task of its own and steals the newest one of the others.
+    // Tasks added by a worker (from the callbacks) stay in its own deques
+    struct Worker
     {
-    public:
-        Thread(AsyncExecutor* executor);
-        ~Thread();
-    private:
-        AsyncExecutor* m_executor;
-        std::unique_ptr<std::thread> m_thread;
-        void ThreadFunc();
+        std::mutex mutex;
+        std::deque<Task *> tasks[NUMBER_OF_PRIORITIES];
+        std::atomic<int> sizes[NUMBER_OF_PRIORITIES];   // Changed with mutex held, read without it to skip empty deques
+        std::thread thread;
+        bool running;   // Changed with m_mutex of the executor held
         
+        Worker() : running(false)
+        {
+            for (int priority = 0; priority < NUMBER_OF_PRIORITIES; ++priority)
+            {
+                sizes[priority] = 0;
+            }
+        }
     };
 
 public:
+    // Threads are started as the tasks come, up to max_threads (0 for the number of cores) while no worker is idle.
+    // Idle workers beyond reserve_threads quit, all of them after shutdown, and are started again by new tasks
     explicit AsyncExecutor(int reserve_threads, int max_threads, Callback *callback);
     ~AsyncExecutor();
 
     static uint32_t genNextTaskId();
     void addTask(Task *task);
+    // One round of locking and waking up for all tasks
+    void addTasks(const std::vector<Task *>& tasks);
+    template <class InputIt>
+    void addTasks(InputIt first, InputIt last)
+    {
+        addTasks(std::vector<Task *>(first, last));
+    }
     
     size_t getNumberOfQueue() const;
     void shutdown();
@@ -114,25 +148,31 @@ protected:
     Callback* m_callback;
 #if !defined(NDEBUG) || defined(DBG_PERF)
     std::string m_tag;
-    uint32_t m_tid;
 #endif
     
+    std::vector<std::unique_ptr<Worker>> m_workers;   // Sized to max_threads, the first m_nthreads have been started
+    std::atomic<int> m_nthreads;
+    std::atomic<unsigned int> m_nextWorker;
+    std::atomic<int64_t> m_numberOfQueued;  // Changed with the mutex of a worker held
+    std::atomic<int> m_threads_waiting;
+    
+    // Guards sleeping/waking up and starting/stopping of workers
     mutable std::mutex m_mutex;
     std::condition_variable m_cv;
     std::condition_variable m_shutdown_cv;
-    bool m_shutdown;
-    std::queue<Task *> m_tasks;
+    std::atomic<bool> m_shutdown;
     int m_reserve_threads;
     int m_max_threads;
-    int m_nthreads;
-
-    int m_threads_waiting;
-    std::list<Thread*> m_dead_threads;
+    std::atomic<int> m_nrunning;    // Changed with m_mutex held
     
     static std::atomic_uint32_t m_nextTaskId;
 
-    void ThreadFunc();
-    static void DestroyThreads(std::list<Thread*>* m_threads);
+    void ThreadFunc(int index);
+    Task* takeTask(int index);
+    void pushTasks(Task* const* tasks, size_t numberOfTasks);
+    Task* popTask(Worker* worker, int priority, bool front);
+    void startThreads(size_t numberOfTasks);
+    void startThread(int index);
     
 };
 
@@ -10,6 +10,8 @@
 #include <curl/curl.h>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <algorithm>
 #ifdef _WIN32
 #include <atlstr.h>
 #ifndef NDEBUG
@@ -18,6 +20,15 @@
 #endif
 #include "FileSystem.h"
 #include "Utils.h"
+#include "WechatObjects.h"
+
+#define HTTP_CACHE_INDEX_FILE   "index.dat"
+#define HTTP_CACHE_MAGIC        0x43485857  // WXHC
+#define HTTP_CACHE_VERSION      1
+
+#define DOWNLOAD_BACKOFF_BASE   250     // ms
+#define DOWNLOAD_BACKOFF_MAX    30000   // ms
+#define DOWNLOAD_HOST_FAILURES  3       // consecutive errors to back off the host
 
 // #define FAKE_DOWNLOAD
 size_t writeHttpDataToBuffer(void *buffer, size_t size, size_t nmemb, void *user_p)
@@ -35,16 +46,97 @@ size_t writeHttpDataToBuffer(void *buffer, size_t size, size_t nmemb, void *user
     return 0;
 }
 
+// DNS cache and TLS sessions are shared by all download threads.
+// Connections are not: libcurl doesn't support a connection cache used by easy handles on several threads at once,
+// each thread keeps its connections in its own easy handle instead
+static CURLSH* s_curlShare = NULL;
+static std::mutex s_curlShareMutexes[CURL_LOCK_DATA_LAST];
+
+static void lockCurlShare(CURL *, curl_lock_data data, curl_lock_access, void *)
+{
+    s_curlShareMutexes[data].lock();
+}
+
+static void unlockCurlShare(CURL *, curl_lock_data data, void *)
+{
+    s_curlShareMutexes[data].unlock();
+}
+
+// The easy handle is kept by the thread, so the connections of it are reused by the following downloads and httpGet calls
+class CurlHandle
+{
+public:
+    CurlHandle() : m_curl(NULL)
+    {
+    }
+    
+    ~CurlHandle()
+    {
+        if (NULL != m_curl)
+        {
+            curl_easy_cleanup(m_curl);
+        }
+    }
+    
+    CURL* acquire()
+    {
+        if (NULL == m_curl)
+        {
+            m_curl = curl_easy_init();
+        }
+        else
+        {
+            // Options are reset, but live connections and caches are kept
+            curl_easy_reset(m_curl);
+        }
+        if (NULL != m_curl && NULL != s_curlShare)
+        {
+            curl_easy_setopt(m_curl, CURLOPT_SHARE, s_curlShare);
+        }
+        return m_curl;
+    }
+    
+private:
+    CURL* m_curl;
+};
+
+static thread_local CurlHandle t_curlHandle;
+
 void DownloadTask::initialize()
 {
     curl_global_init(CURL_GLOBAL_ALL);
+    
+    s_curlShare = curl_share_init();
+    if (NULL != s_curlShare)
+    {
+        curl_share_setopt(s_curlShare, CURLSHOPT_LOCKFUNC, lockCurlShare);
+        curl_share_setopt(s_curlShare, CURLSHOPT_UNLOCKFUNC, unlockCurlShare);
+        curl_share_setopt(s_curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(s_curlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
 }
 
 void DownloadTask::uninitialize()
 {
+    // It fails if any easy handle still uses it, leave it to the process then
+    if (NULL != s_curlShare && curl_share_cleanup(s_curlShare) == CURLSHE_OK)
+    {
+        s_curlShare = NULL;
+    }
     curl_global_cleanup();
 }
 
+static void setCommonHttpOptions(CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    // HTTP/2 over TLS if the CDN supports it, the connection is reused by the next download of the thread
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+}
+
 bool DownloadTask::httpGet(const std::string& url, const std::vector<std::pair<std::string, std::string>>& headers, long& httpStatus, std::vector<unsigned char>& body)
 {
     httpStatus = 0;
@@ -55,7 +147,11 @@ bool DownloadTask::httpGet(const std::string& url, const std::vector<std::pair<s
     
 #ifndef FAKE_DOWNLOAD
     // User-Agent: WeChat/7.0.15.33 CFNetwork/978.0.7 Darwin/18.6.0
-    curl = curl_easy_init();
+    curl = t_curlHandle.acquire();
+    if (NULL == curl)
+    {
+        return false;
+    }
     
 #ifndef NDEBUG
     struct curl_slist *host = NULL;
@@ -95,13 +191,9 @@ bool DownloadTask::httpGet(const std::string& url, const std::vector<std::pair<s
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
     }
     // curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgent.c_str());
-    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);
+    setCommonHttpOptions(curl);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &::writeHttpDataToBuffer);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void *>(&body));
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
 
     res = curl_easy_perform(curl);
     if (res == CURLE_OK)
@@ -109,15 +201,18 @@ bool DownloadTask::httpGet(const std::string& url, const std::vector<std::pair<s
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
         // m_error = curl_easy_strerror(res);
     }
-    curl_easy_cleanup(curl);
+    // The handle is reused, don't keep the lists and the buffer in it
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
 #ifndef NDEBUG
     if (NULL != host)
     {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, NULL);
         curl_slist_free_all(host);
     }
 #endif
     if (NULL != chunk)
     {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
         curl_slist_free_all(chunk);
     }
 #endif // no FAKE_DOWNLOAD
@@ -136,7 +231,551 @@ size_t writeTaskHttpData(void *buffer, size_t size, size_t nmemb, void *user_p)
     return 0;
 }
 
-DownloadTask::DownloadTask(const std::string &url, const std::string& output, const std::string& defaultFile, time_t mtime, const std::string& name/* = ""*/) : m_url(url), m_output(output), m_default(defaultFile), m_mtime(mtime), m_retries(0), m_name(name)
+size_t writeTaskHttpHeader(char *buffer, size_t size, size_t nitems, void *user_p)
+{
+    DownloadTask *task = reinterpret_cast<DownloadTask *>(user_p);
+    if (NULL != task)
+    {
+        return task->writeHeader(buffer, size * nitems);
+    }
+    
+    return 0;
+}
+
+HttpCache::HttpCache(const std::string& dir, uint64_t maxBytes) : m_dir(dir), m_maxBytes(maxBytes), m_revalidating(false), m_numberOfHits(0), m_numberOfRevalidated(0), m_numberOfStored(0)
+{
+}
+
+bool HttpCache::load()
+{
+    std::vector<unsigned char> buffer;
+    if (!readFile(combinePath(m_dir, HTTP_CACHE_INDEX_FILE), buffer) || buffer.empty())
+    {
+        return false;
+    }
+    
+    const char* data = reinterpret_cast<const char *>(&buffer[0]);
+    const char* end = data + buffer.size();
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if (!unserializeUInt32(data, end, magic) || magic != HTTP_CACHE_MAGIC || !unserializeUInt32(data, end, version) || version != HTTP_CACHE_VERSION
+        || !unserializeUInt32(data, end, count))
+    {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string url;
+    HTTP_CACHE_ENTRY entry;
+    uint32_t sizeHigh = 0;
+    uint32_t sizeLow = 0;
+    for (uint32_t idx = 0; idx < count; ++idx)
+    {
+        if (!unserializeString(data, end, url) || !unserializeString(data, end, entry.etag) || !unserializeString(data, end, entry.lastModified)
+            || !unserializeString(data, end, entry.hash) || !unserializeUInt32(data, end, sizeHigh) || !unserializeUInt32(data, end, sizeLow)
+            || !unserializeUInt32(data, end, entry.accessTime))
+        {
+            m_entries.clear();
+            return false;
+        }
+        entry.size = (static_cast<uint64_t>(sizeHigh) << 32) | sizeLow;
+        m_entries[url] = entry;
+    }
+    
+    return true;
+}
+
+bool HttpCache::save()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    
+    // hash => (size, number of urls)
+    std::map<std::string, std::pair<uint64_t, uint32_t>> contents;
+    uint64_t totalBytes = 0;
+    for (std::map<std::string, HTTP_CACHE_ENTRY>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+    {
+        std::pair<uint64_t, uint32_t>& content = contents[it->second.hash];
+        if (content.second++ == 0)
+        {
+            content.first = it->second.size;
+            totalBytes += it->second.size;
+        }
+    }
+    
+    if (totalBytes > m_maxBytes)
+    {
+        std::vector<std::pair<uint32_t, std::string>> urls;
+        urls.reserve(m_entries.size());
+        for (std::map<std::string, HTTP_CACHE_ENTRY>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+        {
+            urls.push_back(std::pair<uint32_t, std::string>(it->second.accessTime, it->first));
+        }
+        std::sort(urls.begin(), urls.end());
+        for (std::vector<std::pair<uint32_t, std::string>>::const_iterator it = urls.cbegin(); it != urls.cend() && totalBytes > m_maxBytes; ++it)
+        {
+            std::map<std::string, HTTP_CACHE_ENTRY>::iterator itEntry = m_entries.find(it->second);
+            std::pair<uint64_t, uint32_t>& content = contents[itEntry->second.hash];
+            if (--content.second == 0)
+            {
+                totalBytes -= content.first;
+                m_replacedHashes.insert(itEntry->second.hash);
+            }
+            m_entries.erase(itEntry);
+        }
+    }
+    
+    // Contents which are not referenced by any url any more
+    for (std::set<std::string>::const_iterator it = m_replacedHashes.cbegin(); it != m_replacedHashes.cend(); ++it)
+    {
+        std::map<std::string, std::pair<uint64_t, uint32_t>>::const_iterator itContent = contents.find(*it);
+        if (itContent == contents.cend() || itContent->second.second == 0)
+        {
+            deleteFile(getContentPath(*it));
+        }
+    }
+    m_replacedHashes.clear();
+    
+    std::string buffer;
+    serializeUInt32(buffer, HTTP_CACHE_MAGIC);
+    serializeUInt32(buffer, HTTP_CACHE_VERSION);
+    serializeUInt32(buffer, static_cast<uint32_t>(m_entries.size()));
+    for (std::map<std::string, HTTP_CACHE_ENTRY>::const_iterator it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+    {
+        serializeString(buffer, it->first);
+        serializeString(buffer, it->second.etag);
+        serializeString(buffer, it->second.lastModified);
+        serializeString(buffer, it->second.hash);
+        serializeUInt32(buffer, static_cast<uint32_t>(it->second.size >> 32));
+        serializeUInt32(buffer, static_cast<uint32_t>(it->second.size));
+        serializeUInt32(buffer, it->second.accessTime);
+    }
+    
+    makeDirectory(m_dir);
+    std::string fileName = combinePath(m_dir, HTTP_CACHE_INDEX_FILE);
+    return writeFile(fileName + ".tmp", buffer) && moveFile(fileName + ".tmp", fileName);
+}
+
+bool HttpCache::find(const std::string& url, HTTP_CACHE_ENTRY& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, HTTP_CACHE_ENTRY>::iterator it = m_entries.find(url);
+    if (it == m_entries.end())
+    {
+        return false;
+    }
+    if (!existsFile(getContentPath(it->second.hash)))
+    {
+        m_entries.erase(it);
+        return false;
+    }
+    it->second.accessTime = getUnixTimeStamp();
+    entry = it->second;
+    return true;
+}
+
+bool HttpCache::copyTo(const HTTP_CACHE_ENTRY& entry, const std::string& output, time_t mtime)
+{
+    return ::copyFile(getContentPath(entry.hash), output, mtime, 0);
+}
+
+bool HttpCache::put(const std::string& url, const std::string& path, const std::string& etag, const std::string& lastModified)
+{
+    std::ifstream ifs;
+    if (!openInputFile(ifs, path))
+    {
+        return false;
+    }
+    
+    // Hashed and copied in one pass by chunks, the name of the content is only known at the end.
+    // The same content may be stored by another download at the same time
+    makeDirectory(m_dir);
+    std::string tmpPath = combinePath(m_dir, "put." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp");
+    FileWriter writer;
+    writer.open(tmpPath);
+    MD5_CONTEXT context;
+    md5Init(context);
+    std::vector<char> buffer(FileWriter::DEFAULT_BUFFER_SIZE);
+    uint64_t size = 0;
+    bool failed = false;
+    while (!failed && ifs)
+    {
+        ifs.read(&buffer[0], buffer.size());
+        std::streamsize length = ifs.gcount();
+        if (length <= 0)
+        {
+            break;
+        }
+        size += static_cast<uint64_t>(length);
+        md5Update(context, &buffer[0], static_cast<size_t>(length));
+        failed = size > m_maxBytes || !writer.write(&buffer[0], static_cast<size_t>(length));
+    }
+    failed = failed || ifs.bad() || size == 0;
+    ifs.close();
+    if (!writer.close() || failed)
+    {
+        deleteFile(tmpPath);
+        return false;
+    }
+    
+    unsigned char digest[MD5_DIGEST_SIZE];
+    md5Final(context, digest);
+    
+    HTTP_CACHE_ENTRY entry;
+    entry.etag = etag;
+    entry.lastModified = lastModified;
+    entry.hash = hexEncode(digest, MD5_DIGEST_SIZE);
+    entry.size = size;
+    entry.accessTime = getUnixTimeStamp();
+    
+    std::string contentPath = getContentPath(entry.hash);
+    if (existsFile(contentPath))
+    {
+        deleteFile(tmpPath);
+    }
+    else
+    {
+        makeDirectory(combinePath(m_dir, entry.hash.substr(0, 2)));
+        if (!moveFile(tmpPath, contentPath))
+        {
+            deleteFile(tmpPath);
+            return false;
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, HTTP_CACHE_ENTRY>::iterator it = m_entries.find(url);
+    if (it != m_entries.end())
+    {
+        if (it->second.hash != entry.hash)
+        {
+            m_replacedHashes.insert(it->second.hash);
+        }
+        it->second = entry;
+    }
+    else
+    {
+        m_entries.insert(std::pair<std::string, HTTP_CACHE_ENTRY>(url, entry));
+    }
+    ++m_numberOfStored;
+    return true;
+}
+
+std::string HttpCache::getContentPath(const std::string& hash) const
+{
+    return combinePath(m_dir, hash.substr(0, 2), hash);
+}
+
+static std::string getHostOfUrl(const std::string& url)
+{
+    std::string::size_type start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    std::string::size_type end = url.find_first_of(":/?#", start);
+    return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+DownloadScheduler::DownloadScheduler(AsyncExecutor *executor, unsigned int maxConcurrency, unsigned int maxConcurrencyPerHost) : m_executor(executor), m_maxConcurrency(maxConcurrency), m_maxConcurrencyPerHost(maxConcurrencyPerHost), m_numberOfInFlight(0), m_numberOfPending(0), m_cancelled(false), m_random(static_cast<unsigned int>(std::chrono::steady_clock::now().time_since_epoch().count()))
+{
+}
+
+DownloadScheduler::~DownloadScheduler()
+{
+    cancel();
+}
+
+void DownloadScheduler::enqueue(DownloadTask *task, int priority, std::vector<AsyncExecutor::Task *>& readyTasks)
+{
+    if (priority < 0 || priority >= NUMBER_OF_DOWNLOAD_PRIORITIES)
+    {
+        priority = DOWNLOAD_PRIORITY_DEFAULT;
+    }
+    task->setDownloadPriority(priority);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hosts[task->getHost()].pendingTasks[priority].push(task);
+    ++m_numberOfPending;
+    dispatch(readyTasks);
+}
+
+// m_mutex is held
+void DownloadScheduler::releaseSlot(const std::string& host)
+{
+    std::map<std::string, HOST_STATE>::iterator it = m_hosts.find(host);
+    if (it != m_hosts.end() && it->second.numberOfInFlight > 0)
+    {
+        --it->second.numberOfInFlight;
+        --m_numberOfInFlight;
+    }
+}
+
+void DownloadScheduler::release(const std::string& host, std::vector<AsyncExecutor::Task *>& readyTasks)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    releaseSlot(host);
+    dispatch(readyTasks);
+}
+
+void DownloadScheduler::retry(DownloadTask *task, std::vector<AsyncExecutor::Task *>& readyTasks)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    releaseSlot(task->getHost());
+    if (m_cancelled)
+    {
+        lock.unlock();
+        delete task;
+        return;
+    }
+    TimePoint dueTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(getBackoffDelay(task->getRetries()));
+    m_hosts[task->getHost()].delayedTasks.insert(std::pair<TimePoint, DownloadTask *>(dueTime, task));
+    ++m_numberOfPending;
+    dispatch(readyTasks);
+}
+
+// Picks the task of the highest priority among the hosts having room in their windows, the least loaded host goes first.
+// Hosts in backoff are skipped and the due retries are moved into the pending queues first
+void DownloadScheduler::dispatch(std::vector<AsyncExecutor::Task *>& readyTasks)
+{
+    TimePoint now = std::chrono::steady_clock::now();
+    for (std::map<std::string, HOST_STATE>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+    {
+        std::multimap<TimePoint, DownloadTask *>& delayedTasks = it->second.delayedTasks;
+        while (!delayedTasks.empty() && delayedTasks.begin()->first <= now)
+        {
+            DownloadTask *task = delayedTasks.begin()->second;
+            it->second.pendingTasks[task->getDownloadPriority()].push(task);
+            delayedTasks.erase(delayedTasks.begin());
+        }
+    }
+    
+    while (!m_cancelled && m_numberOfPending > 0 && m_numberOfInFlight < m_maxConcurrency)
+    {
+        HOST_STATE *selectedHost = NULL;
+        for (int priority = 0; priority < NUMBER_OF_DOWNLOAD_PRIORITIES && NULL == selectedHost; ++priority)
+        {
+            double minLoad = 0;
+            for (std::map<std::string, HOST_STATE>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+            {
+                HOST_STATE& state = it->second;
+                unsigned int window = std::max(1u, static_cast<unsigned int>(state.window));
+                if (state.pendingTasks[priority].empty() || state.numberOfInFlight >= window || state.backoffUntil > now)
+                {
+                    continue;
+                }
+                double load = state.numberOfInFlight / state.window;
+                if (NULL == selectedHost || load < minLoad)
+                {
+                    selectedHost = &state;
+                    minLoad = load;
+                }
+            }
+            if (NULL != selectedHost)
+            {
+                readyTasks.push_back(selectedHost->pendingTasks[priority].front());
+                selectedHost->pendingTasks[priority].pop();
+            }
+        }
+        if (NULL == selectedHost)
+        {
+            break;
+        }
+        ++selectedHost->numberOfInFlight;
+        ++m_numberOfInFlight;
+        --m_numberOfPending;
+    }
+    
+    TimePoint wakeup;
+    if (!m_cancelled && getNextWakeup(wakeup))
+    {
+        if (!m_timer.joinable())
+        {
+            m_timer = std::thread(&DownloadScheduler::timerFunc, this);
+        }
+        m_cv.notify_all();
+    }
+}
+
+// m_mutex is held. The earliest time a waiting task becomes runnable: a retry is due or the backoff of a host ends.
+// Tasks only waiting for room in the windows are dispatched when the running ones are released
+bool DownloadScheduler::getNextWakeup(TimePoint& wakeup) const
+{
+    TimePoint now = std::chrono::steady_clock::now();
+    bool found = false;
+    for (std::map<std::string, HOST_STATE>::const_iterator it = m_hosts.cbegin(); it != m_hosts.cend(); ++it)
+    {
+        const HOST_STATE& state = it->second;
+        bool hasPendingTasks = false;
+        for (int priority = 0; priority < NUMBER_OF_DOWNLOAD_PRIORITIES && !hasPendingTasks; ++priority)
+        {
+            hasPendingTasks = !state.pendingTasks[priority].empty();
+        }
+        TimePoint time;
+        if (hasPendingTasks && state.backoffUntil > now)
+        {
+            time = state.backoffUntil;
+        }
+        else if (!state.delayedTasks.empty())
+        {
+            time = std::max(state.delayedTasks.begin()->first, state.backoffUntil);
+        }
+        else
+        {
+            continue;
+        }
+        if (!found || time < wakeup)
+        {
+            wakeup = time;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void DownloadScheduler::timerFunc()
+{
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    setThreadName("dl-timer");
+#endif
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cancelled)
+    {
+        TimePoint wakeup;
+        if (!getNextWakeup(wakeup))
+        {
+            m_cv.wait(lock);
+        }
+        else if (wakeup > std::chrono::steady_clock::now())
+        {
+            m_cv.wait_until(lock, wakeup);
+        }
+        if (m_cancelled)
+        {
+            break;
+        }
+        
+        std::vector<AsyncExecutor::Task *> readyTasks;
+        dispatch(readyTasks);
+        if (!readyTasks.empty())
+        {
+            lock.unlock();
+            m_executor->addTasks(readyTasks);
+            lock.lock();
+        }
+    }
+}
+
+// Exponential backoff with jitter: [delay / 2, delay)
+unsigned int DownloadScheduler::getBackoffDelay(unsigned int attempt)
+{
+    unsigned int delay = DOWNLOAD_BACKOFF_BASE << std::min(attempt - 1, 7u);
+    delay = std::min(delay, static_cast<unsigned int>(DOWNLOAD_BACKOFF_MAX));
+    return delay / 2 + static_cast<unsigned int>(m_random() % (delay / 2 + 1));
+}
+
+void DownloadScheduler::report(const std::string& host, unsigned int latency, bool failed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    HOST_STATE& state = m_hosts[host];
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    ++state.numberOfRequests;
+    if (failed)
+    {
+        ++state.numberOfErrors;
+        ++state.consecutiveErrors;
+        // Multiplicative decrease once per round trip, errors of the requests in flight come together
+        if (now >= state.nextDecrease)
+        {
+            state.window = std::max(1.0, state.window / 2);
+            state.nextDecrease = now + std::chrono::milliseconds(std::max(state.avgLatency, 100u));
+        }
+        // An occasional error only delays the retry of its own request, the host is paused when it keeps failing
+        if (state.consecutiveErrors >= DOWNLOAD_HOST_FAILURES)
+        {
+            state.backoffUntil = now + std::chrono::milliseconds(getBackoffDelay(state.consecutiveErrors - DOWNLOAD_HOST_FAILURES + 1));
+        }
+        return;
+    }
+    
+    state.consecutiveErrors = 0;
+    if (state.minLatency == 0 || latency < state.minLatency)
+    {
+        state.minLatency = std::max(latency, 1u);
+    }
+    state.avgLatency = (state.avgLatency == 0) ? latency : (state.avgLatency * 7 + latency) / 8;
+    if (latency > state.minLatency * 2 + 100)
+    {
+        // Latency inflation: the host or the link is saturated, shrink the window once per round trip
+        if (now >= state.nextDecrease)
+        {
+            state.window = std::max(1.0, state.window * 0.75);
+            state.nextDecrease = now + std::chrono::milliseconds(state.avgLatency);
+        }
+    }
+    else
+    {
+        state.window = std::min(static_cast<double>(m_maxConcurrencyPerHost), state.window + 1.0 / state.window);
+    }
+}
+
+size_t DownloadScheduler::getNumberOfPending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_numberOfPending;
+}
+
+bool DownloadScheduler::isIdle() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_numberOfPending == 0 && m_numberOfInFlight == 0;
+}
+
+void DownloadScheduler::cancel()
+{
+    std::vector<DownloadTask *> tasks;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        for (std::map<std::string, HOST_STATE>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it)
+        {
+            for (int priority = 0; priority < NUMBER_OF_DOWNLOAD_PRIORITIES; ++priority)
+            {
+                std::queue<DownloadTask *>& pendingTasks = it->second.pendingTasks[priority];
+                while (!pendingTasks.empty())
+                {
+                    tasks.push_back(pendingTasks.front());
+                    pendingTasks.pop();
+                }
+            }
+            for (std::multimap<TimePoint, DownloadTask *>::iterator itTask = it->second.delayedTasks.begin(); itTask != it->second.delayedTasks.end(); ++itTask)
+            {
+                tasks.push_back(itTask->second);
+            }
+            it->second.delayedTasks.clear();
+        }
+        m_numberOfPending = 0;
+        m_cv.notify_all();
+    }
+    if (m_timer.joinable() && m_timer.get_id() != std::this_thread::get_id())
+    {
+        m_timer.join();
+    }
+    for (std::vector<DownloadTask *>::iterator it = tasks.begin(); it != tasks.end(); ++it)
+    {
+        delete *it;
+    }
+}
+
+std::string DownloadScheduler::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string stats;
+    for (std::map<std::string, HOST_STATE>::const_iterator it = m_hosts.cbegin(); it != m_hosts.cend(); ++it)
+    {
+        const HOST_STATE& state = it->second;
+        stats += formatString("%s: %u requests, %u errors, window %.1f, latency %u/%u ms\n", it->first.c_str(), state.numberOfRequests, state.numberOfErrors, state.window, state.minLatency, state.avgLatency);
+    }
+    return stats;
+}
+
+DownloadTask::DownloadTask(const std::string &url, const std::string& output, const std::string& defaultFile, time_t mtime, const std::string& name/* = ""*/) : m_url(url), m_output(output), m_default(defaultFile), m_mtime(mtime), m_retries(0), m_name(name), m_host(getHostOfUrl(url)), m_scheduler(NULL), m_downloadPriority(DOWNLOAD_PRIORITY_DEFAULT), m_attempt(0), m_retrying(false), m_httpCache(NULL), m_revalidating(false)
 {
 #ifndef NDEBUG
     if (m_output.empty())
@@ -151,35 +790,89 @@ unsigned int DownloadTask::getRetries() const
     return m_retries;
 }
 
-bool DownloadTask::run()
+DownloadTask* DownloadTask::createRetryTask() const
 {
-    std::string* urls[] = { &m_url, &m_urlBackup };
-    
-    for (int item = 0; item < sizeof(urls) / sizeof(std::string*); ++item)
+    DownloadTask *task = new DownloadTask(m_url, m_output, m_default, m_mtime, m_name);
+    task->setTaskId(getTaskId());
+    task->setUserData(getUserData());
+    task->setPriority(getPriority());
+    task->m_urlBackup = m_urlBackup;
+    task->m_userAgent = m_userAgent;
+    task->m_retries = m_retries;
+    task->m_scheduler = m_scheduler;
+    task->m_downloadPriority = m_downloadPriority;
+    task->m_attempt = m_attempt;
+    task->m_httpCache = m_httpCache;
+    task->m_cacheEntry = m_cacheEntry;
+    task->m_revalidating = m_revalidating;
+    return task;
+}
+
+bool DownloadTask::getAttemptUrl(unsigned int attempt, std::string& url) const
+{
+    const std::string* urls[] = { &m_url, &m_urlBackup };
+    for (size_t item = 0; item < sizeof(urls) / sizeof(std::string*); ++item)
     {
         if (urls[item]->empty())
         {
             continue;
         }
-        for (int idx = 0; idx < DEFAULT_RETRIES; idx++)
+        if (attempt < DEFAULT_RETRIES)
         {
-            if (downloadFile(*urls[item]))
+            url = *urls[item];
+            return true;
+        }
+        attempt -= DEFAULT_RETRIES;
+        if (startsWith(*urls[item], "http://"))
+        {
+            if (attempt == 0)
             {
+                url = *urls[item];
+                url.replace(0, 7, "https://");
                 return true;
             }
+            --attempt;
         }
-        
-        if (startsWith(*urls[item], "http://"))
+    }
+    return false;
+}
+
+bool DownloadTask::run()
+{
+    m_retrying = false;
+    if (m_attempt == 0)
+    {
+        m_revalidating = false;
+        if (NULL != m_httpCache && m_httpCache->find(m_url, m_cacheEntry))
         {
-            std::string url = *urls[item];
-            url.replace(0, 7, "https://");
-            if (downloadFile(url))
+            if (m_httpCache->isRevalidating() && m_cacheEntry.hasValidators())
+            {
+                m_revalidating = true;
+            }
+            else if (m_httpCache->copyTo(m_cacheEntry, m_output, m_mtime))
             {
+                m_httpCache->addHit(false);
                 return true;
             }
         }
     }
     
+    std::string url;
+    while (getAttemptUrl(m_attempt, url))
+    {
+        ++m_attempt;
+        if (downloadFile(url))
+        {
+            return true;
+        }
+        // The scheduler delays the next attempt without holding the thread or the slot of the host
+        if (NULL != m_scheduler && getAttemptUrl(m_attempt, url))
+        {
+            m_retrying = true;
+            return false;
+        }
+    }
+    
     if (!m_default.empty())
     {
         if (copyFile(m_default, m_output))
@@ -201,6 +894,7 @@ bool DownloadTask::downloadFile(const std::string& url)
     
     m_outputTmp = m_output + ".tmp";
     deleteFile(m_outputTmp);
+    m_writer.open(m_outputTmp);
 
     CURLcode res = CURLE_OK;
     CURL *curl = NULL;
@@ -219,16 +913,42 @@ bool DownloadTask::downloadFile(const std::string& url)
     
 #ifndef FAKE_DOWNLOAD
     // User-Agent: WeChat/7.0.15.33 CFNetwork/978.0.7 Darwin/18.6.0
-    curl = curl_easy_init();
+    curl = t_curlHandle.acquire();
+    if (NULL == curl)
+    {
+        m_error = "Failed " + m_name + "\r\nFailed to initialize curl";
+#ifndef NDEBUG
+        if (NULL != logFile)
+        {
+            fclose(logFile);
+        }
+#endif
+        return false;
+    }
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgent.c_str());
-    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);
+    setCommonHttpOptions(curl);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &::writeTaskHttpData);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+    m_etag.clear();
+    m_lastModified.clear();
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &::writeTaskHttpHeader);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+    struct curl_slist *headers = NULL;
+    // The validators belong to the cached response of m_url, not to the backup or https one
+    bool conditional = m_revalidating && url == m_url;
+    if (conditional)
+    {
+        if (!m_cacheEntry.etag.empty())
+        {
+            headers = curl_slist_append(headers, ("If-None-Match: " + m_cacheEntry.etag).c_str());
+        }
+        if (!m_cacheEntry.lastModified.empty())
+        {
+            headers = curl_slist_append(headers, ("If-Modified-Since: " + m_cacheEntry.lastModified).c_str());
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
 #ifndef NDEBUG
     curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
     curl_easy_setopt(curl, CURLOPT_STDERR, logFile);
@@ -260,7 +980,27 @@ bool DownloadTask::downloadFile(const std::string& url)
         }
 #endif
     }
-    curl_easy_cleanup(curl);
+#ifndef NDEBUG
+    // The handle is reused, don't keep the log file in it
+    curl_easy_setopt(curl, CURLOPT_STDERR, stderr);
+#endif
+    if (NULL != headers)
+    {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+        curl_slist_free_all(headers);
+    }
+    if (NULL != m_scheduler)
+    {
+        // Time to the first byte is the latency of the host, the size of file doesn't matter
+        // Transfer errors, throttling and server errors count against the host
+        double startTransferTime = 0;
+        if (res == CURLE_OK)
+        {
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &startTransferTime);
+        }
+        bool failed = (res != CURLE_OK && res != CURLE_WRITE_ERROR) || httpStatus == 429 || httpStatus >= 500;
+        m_scheduler->report(m_host, static_cast<unsigned int>(startTransferTime * 1000), failed);
+    }
 #endif // no FAKE_DOWNLOAD
 
 #ifndef NDEBUG
@@ -270,12 +1010,38 @@ bool DownloadTask::downloadFile(const std::string& url)
     }
 #endif
     
+    if (res == CURLE_OK && httpStatus == 304 && conditional)
+    {
+        // Not modified, serve the cached one
+        m_writer.close();
+        ::deleteFile(m_outputTmp);
+        if (m_httpCache->copyTo(m_cacheEntry, m_output, m_mtime))
+        {
+            m_httpCache->addHit(true);
+#ifndef NDEBUG
+            ::deleteFile(logPath);
+#endif
+            return true;
+        }
+        // The cached file is gone, request it without validators next time
+        m_revalidating = false;
+        m_error = "Failed " + m_name + "\r\nFailed to copy cached file: " + m_cacheEntry.hash;
+        return false;
+    }
     if (res == CURLE_OK && httpStatus == 200)
     {
+        // mtime is set on the handle and kept by the rename
+        if (!m_writer.close(m_mtime > 0 ? m_mtime : 0))
+        {
+            m_error = "Failed " + m_name + "\r\nFailed to write " + m_outputTmp;
+            ::deleteFile(m_outputTmp);
+            return false;
+        }
         ::moveFile(m_outputTmp, m_output);
-        if (m_mtime > 0)
+        if (NULL != m_httpCache)
         {
-            updateFileTime(m_output, m_mtime);
+            // Cached under the url which was actually fetched, with its own validators
+            m_httpCache->put(url, m_output, m_etag, m_lastModified);
         }
 #ifndef NDEBUG
         ::deleteFile(logPath);
@@ -283,6 +1049,8 @@ bool DownloadTask::downloadFile(const std::string& url)
         return true;
     }
 
+    m_writer.close();
+    ::deleteFile(m_outputTmp);
     if (m_error.empty())
     {
         m_error = "HTTP Status:" + std::to_string(httpStatus);
@@ -293,20 +1061,55 @@ bool DownloadTask::downloadFile(const std::string& url)
 size_t DownloadTask::writeData(void *buffer, size_t size, size_t nmemb)
 {
     size_t bytesToWrite = size * nmemb;
-    if (appendFile(m_outputTmp, reinterpret_cast<const unsigned char *>(buffer), bytesToWrite))
+    if (m_writer.write(buffer, bytesToWrite))
     {
         return bytesToWrite;
     }
     return 0;
 }
 
-CopyTask::CopyTask(const std::string &src, const std::string& dest, const std::string& name) : m_src(src), m_dest(dest), m_name(name)
+size_t DownloadTask::writeHeader(const char *buffer, size_t length)
+{
+    std::string header(buffer, length);
+    if (startsWith(header, "HTTP/"))
+    {
+        // Status line of a new response (redirected)
+        m_etag.clear();
+        m_lastModified.clear();
+        return length;
+    }
+    
+    std::string::size_type pos = header.find(':');
+    if (pos == std::string::npos)
+    {
+        return length;
+    }
+    std::string name = header.substr(0, pos);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    std::string::size_type valueStart = header.find_first_not_of(" \t", pos + 1);
+    std::string::size_type valueEnd = header.find_last_not_of(" \t\r\n");
+    if (valueStart == std::string::npos || valueEnd == std::string::npos || valueEnd < valueStart)
+    {
+        return length;
+    }
+    if (name == "etag")
+    {
+        m_etag = header.substr(valueStart, valueEnd - valueStart + 1);
+    }
+    else if (name == "last-modified")
+    {
+        m_lastModified = header.substr(valueStart, valueEnd - valueStart + 1);
+    }
+    return length;
+}
+
+CopyTask::CopyTask(const std::string &src, const std::string& dest, const std::string& name, time_t mtime/* = 0*/, int flags/* = 0*/) : m_src(src), m_dest(dest), m_name(name), m_mtime(mtime), m_flags(flags)
 {
 }
 
 bool CopyTask::run()
 {
-    if (::copyFile(m_src, m_dest))
+    if (::copyFile(m_src, m_dest, m_mtime, m_flags))
     {
         return true;
     }
@@ -331,31 +1134,16 @@ Mp3Task::Mp3Task(const std::string &pcm, const std::string& mp3, unsigned int mt
 {
 }
 
-void Mp3Task::swapBuffer(std::vector<unsigned char>& buffer)
-{
-    m_pcmData.swap(buffer);
-}
-
 bool Mp3Task::run()
 {
-    std::vector<unsigned char> pcmData;
-    if (silkToPcm(m_pcm, pcmData) && !pcmData.empty())
+    if (silkToMp3(m_pcm, m_mp3))
     {
-        if (pcmToMp3(pcmData, m_mp3))
-        {
-            updateFileTime(m_mp3, m_mtime);
-            // std::this_thread::sleep_for(std::chrono::milliseconds(192));
-            return true;
-        }
-        else
-        {
-            m_error = "Failed pcmToMp3: " + m_pcm + " => " + m_mp3;
-        }
-    }
-    else
-    {
-        m_error = "Failed silkTpPcm: " + m_pcm;
+        updateFileTime(m_mp3, m_mtime);
+        // std::this_thread::sleep_for(std::chrono::milliseconds(192));
+        return true;
     }
+    
+    m_error = "Failed silkToMp3: " + m_pcm + " => " + m_mp3;
     return false;
 }
 
@@ -10,14 +10,177 @@
 #define AsyncTask_h
 
 #include <stdio.h>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <queue>
+#include <chrono>
+#include <random>
 #include "AsyncExecutor.h"
 #include "PdfConverter.h"
+#include "FileSystem.h"
 
 #define TASK_TYPE_DOWNLOAD  1
 #define TASK_TYPE_COPY      2
 #define TASK_TYPE_AUDIO     3
 #define TASK_TYPE_PDF       4
 
+// Lower value is dispatched first, avatars are shown on every page so they go ahead of emojis
+#define DOWNLOAD_PRIORITY_AVATAR    0
+#define DOWNLOAD_PRIORITY_DEFAULT   1
+#define DOWNLOAD_PRIORITY_EMOJI     2
+#define NUMBER_OF_DOWNLOAD_PRIORITIES   3
+
+class DownloadTask;
+
+struct HTTP_CACHE_ENTRY
+{
+    std::string etag;
+    std::string lastModified;
+    std::string hash;   // md5 of the content, name of the stored file
+    uint64_t size;
+    uint32_t accessTime;
+    
+    HTTP_CACHE_ENTRY() : size(0), accessTime(0)
+    {
+    }
+    
+    bool hasValidators() const
+    {
+        return !etag.empty() || !lastModified.empty();
+    }
+};
+
+// Downloaded media kept across exportings, keyed by url and bounded by size (least recently used ones are evicted on saving)
+// Contents are stored by their hash, so the same file from different urls is stored once
+class HttpCache
+{
+public:
+    HttpCache(const std::string& dir, uint64_t maxBytes);
+    
+    // Revalidating: cached urls are requested with If-None-Match/If-Modified-Since instead of being served directly
+    void setRevalidating(bool revalidating)
+    {
+        m_revalidating = revalidating;
+    }
+    
+    bool isRevalidating() const
+    {
+        return m_revalidating;
+    }
+    
+    bool load();
+    bool save();
+    
+    bool find(const std::string& url, HTTP_CACHE_ENTRY& entry);
+    bool copyTo(const HTTP_CACHE_ENTRY& entry, const std::string& output, time_t mtime);
+    bool put(const std::string& url, const std::string& path, const std::string& etag, const std::string& lastModified);
+    
+    void addHit(bool revalidated)
+    {
+        ++(revalidated ? m_numberOfRevalidated : m_numberOfHits);
+    }
+    
+    uint32_t getNumberOfHits() const
+    {
+        return m_numberOfHits;
+    }
+    
+    uint32_t getNumberOfRevalidated() const
+    {
+        return m_numberOfRevalidated;
+    }
+    
+    uint32_t getNumberOfStored() const
+    {
+        return m_numberOfStored;
+    }
+    
+private:
+    std::string getContentPath(const std::string& hash) const;
+    
+private:
+    std::string m_dir;
+    uint64_t m_maxBytes;
+    bool m_revalidating;
+    
+    mutable std::mutex m_mutex;
+    std::map<std::string, HTTP_CACHE_ENTRY> m_entries;
+    std::set<std::string> m_replacedHashes;
+    
+    std::atomic<uint32_t> m_numberOfHits;
+    std::atomic<uint32_t> m_numberOfRevalidated;
+    std::atomic<uint32_t> m_numberOfStored;
+};
+
+// Dispatches downloads by host: the in-flight requests of a host are limited by a window tuned with AIMD,
+// which grows by 1 per window while the latency stays close to the best one observed and shrinks on latency inflation or errors.
+// Retries are delayed exponentially with jitter, and a host failing repeatedly is backed off as a whole.
+// Delayed tasks wait here without holding a slot or a thread, a timer thread hands them to the executor when they are due
+class DownloadScheduler
+{
+public:
+    DownloadScheduler(AsyncExecutor *executor, unsigned int maxConcurrency, unsigned int maxConcurrencyPerHost);
+    ~DownloadScheduler();
+    
+    // readyTasks: tasks which can be run now
+    void enqueue(DownloadTask *task, int priority, std::vector<AsyncExecutor::Task *>& readyTasks);
+    void release(const std::string& host, std::vector<AsyncExecutor::Task *>& readyTasks);
+    // Releases the slot of the failed attempt and queues the next one after its backoff
+    void retry(DownloadTask *task, std::vector<AsyncExecutor::Task *>& readyTasks);
+    
+    void report(const std::string& host, unsigned int latency, bool failed);
+    
+    size_t getNumberOfPending() const;
+    // No task is pending or in flight
+    bool isIdle() const;
+    void cancel();
+    std::string getStats() const;
+    
+private:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    
+    struct HOST_STATE
+    {
+        std::queue<DownloadTask *> pendingTasks[NUMBER_OF_DOWNLOAD_PRIORITIES];
+        std::multimap<TimePoint, DownloadTask *> delayedTasks;   // Retries by the time they are due
+        unsigned int numberOfInFlight;
+        double window;
+        unsigned int minLatency;    // ms
+        unsigned int avgLatency;    // ms
+        unsigned int consecutiveErrors;
+        uint32_t numberOfRequests;
+        uint32_t numberOfErrors;
+        TimePoint backoffUntil;
+        TimePoint nextDecrease;
+        
+        HOST_STATE() : numberOfInFlight(0), window(2.0), minLatency(0), avgLatency(0), consecutiveErrors(0), numberOfRequests(0), numberOfErrors(0)
+        {
+        }
+    };
+    
+    void dispatch(std::vector<AsyncExecutor::Task *>& readyTasks);
+    bool getNextWakeup(TimePoint& wakeup) const;
+    unsigned int getBackoffDelay(unsigned int attempt);
+    void releaseSlot(const std::string& host);
+    void timerFunc();
+    
+private:
+    AsyncExecutor *m_executor;
+    unsigned int m_maxConcurrency;
+    unsigned int m_maxConcurrencyPerHost;
+    
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, HOST_STATE> m_hosts;
+    unsigned int m_numberOfInFlight;
+    size_t m_numberOfPending;
+    bool m_cancelled;
+    std::minstd_rand m_random;
+    std::thread m_timer;    // Started by the first delayed task
+};
+
 class DownloadTask : public AsyncExecutor::Task
 {
 private:
@@ -26,12 +189,24 @@ private:
     std::string m_output;
     std::string m_default;
     std::string m_outputTmp;
+    FileWriter m_writer;
     std::string m_error;
     std::string m_userAgent;
     time_t m_mtime;
     unsigned int m_retries;
     
     std::string m_name;
+    std::string m_host;
+    
+    DownloadScheduler *m_scheduler;
+    int m_downloadPriority;
+    unsigned int m_attempt;     // Index in the urls to try: each url DEFAULT_RETRIES times, then over https if it is http
+    bool m_retrying;
+    HttpCache *m_httpCache;
+    HTTP_CACHE_ENTRY m_cacheEntry;
+    bool m_revalidating;
+    std::string m_etag;
+    std::string m_lastModified;
     
 public:
     static const unsigned int DEFAULT_RETRIES = 3;
@@ -54,6 +229,40 @@ public:
         m_userAgent = userAgent;
     }
     
+    void setHttpCache(HttpCache *httpCache)
+    {
+        m_httpCache = httpCache;
+    }
+    
+    void setScheduler(DownloadScheduler *scheduler)
+    {
+        m_scheduler = scheduler;
+    }
+    
+    void setDownloadPriority(int priority)
+    {
+        m_downloadPriority = priority;
+    }
+    
+    int getDownloadPriority() const
+    {
+        return m_downloadPriority;
+    }
+    
+    // With a scheduler each run makes one attempt, true if it failed and the next attempt should be queued
+    bool isRetrying() const
+    {
+        return m_retrying;
+    }
+    
+    // The executor deletes the task after it runs, the next attempt continues in a new one
+    DownloadTask* createRetryTask() const;
+    
+    inline std::string getHost() const
+    {
+        return m_host;
+    }
+    
     inline std::string getUrl() const
     {
         return m_url;
@@ -78,19 +287,21 @@ public:
     static bool httpGet(const std::string& url, const std::vector<std::pair<std::string, std::string>>& headers, long& httpStatus, std::vector<unsigned char>& body);
     
     size_t writeData(void *buffer, size_t size, size_t nmemb);
+    size_t writeHeader(const char *buffer, size_t length);
     
     unsigned int getRetries() const;
     
     bool run();
     
 protected:
+    bool getAttemptUrl(unsigned int attempt, std::string& url) const;
     bool downloadFile(const std::string& url);
 };
 
 class CopyTask : public AsyncExecutor::Task
 {
 public:
-    CopyTask(const std::string &src, const std::string& dest, const std::string& name);
+    CopyTask(const std::string &src, const std::string& dest, const std::string& name, time_t mtime = 0, int flags = 0);
     virtual ~CopyTask() {}
     
     virtual int getType() const
@@ -109,6 +320,22 @@ public:
     {
         return m_error;
     }
+    inline std::string getSource() const
+    {
+        return m_src;
+    }
+    inline std::string getDest() const
+    {
+        return m_dest;
+    }
+    inline time_t getMtime() const
+    {
+        return m_mtime;
+    }
+    inline int getFlags() const
+    {
+        return m_flags;
+    }
     
     bool run();
     
@@ -117,6 +344,8 @@ private:
     std::string m_dest;
     std::string m_name;
     std::string m_error;
+    time_t m_mtime;
+    int m_flags;
 };
 
 class Mp3Task : public AsyncExecutor::Task
@@ -142,8 +371,6 @@ public:
         return m_error;
     }
     
-    void swapBuffer(std::vector<unsigned char>& buffer);
-
     bool run();
     
 private:
@@ -151,8 +378,6 @@ private:
     std::string m_mp3;
     unsigned int m_mtime;
     std::string m_error;
-    
-    std::vector<unsigned char> m_pcmData;
 };
 
 class PdfTask : public AsyncExecutor::Task
@@ -9,12 +9,15 @@
 #ifndef ExportContext_h
 #define ExportContext_h
 
+#include <mutex>
+
 class ExportContext
 {
 private:
     int m_options;
     std::time_t m_exportTime;
     std::map<std::string, int64_t> m_maxIdForSessions;
+    mutable std::mutex m_mutex;   // Sessions are exported concurrently
     
 public:
     ExportContext()
@@ -46,11 +49,13 @@ public:
     
     size_t getNumberOfSessions() const
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
         return m_maxIdForSessions.size();
     }
     
     bool getMaxId(const std::string& usrName, int64_t& maxId) const
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
         std::map<std::string, int64_t>::const_iterator it = m_maxIdForSessions.find(usrName);
         if (it != m_maxIdForSessions.cend())
         {
@@ -62,6 +67,7 @@ public:
     
     void setMaxId(const std::string& usrName, int64_t maxId)
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_maxIdForSessions[usrName] = maxId;
     }
     
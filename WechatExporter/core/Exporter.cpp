@@ -16,12 +16,423 @@
 #include "TaskManager.h"
 #include "WechatParser.h"
 #include "ExportContext.h"
+#include <libxml/parser.h>
 #ifdef _WIN32
 #include <winsock.h>
 #endif
 
 #define WXEXP_DATA_FOLDER   ".wxexp"
 #define WXEXP_DATA_FILE   "wxexp.dat"
+#define WXEXP_SNAPSHOT_MAGIC    0x53535857  // WXSS
+#define WXEXP_SNAPSHOT_VERSION  1
+
+#define WXEXP_MSGLOG_MAGIC      0x4C4D5857  // WXML
+#define WXEXP_MSGLOG_VERSION    1
+
+// Writes the rendered messages of a session in the display order:
+// the first page into the frame and the following pages into Data/msg-N.js,
+// so only one page is kept in memory
+class SessionWriter
+{
+private:
+    size_t m_pageSize;  // 0: no paging, all messages are written into frame
+    
+    std::ofstream m_frameStream;
+    std::string m_frameSuffix;
+    
+    std::string m_dataPath;
+    std::string m_scripts;
+    std::vector<std::string> m_firstPage;
+    std::vector<std::string> m_page;
+    size_t m_numberOfPages;
+    size_t m_numberOfMessagesInPages;
+    
+public:
+    SessionWriter(size_t pageSize) : m_pageSize(pageSize), m_numberOfPages(0), m_numberOfMessagesInPages(0)
+    {
+        if (m_pageSize > 0)
+        {
+            m_firstPage.reserve(m_pageSize);
+            m_page.reserve(m_pageSize);
+        }
+    }
+    
+    ~SessionWriter()
+    {
+        close();
+    }
+    
+    bool openFrameFile(const std::string& fileName, const std::string& prefix, const std::string& suffix)
+    {
+        if (!openOutputFile(m_frameStream, fileName))
+        {
+            return false;
+        }
+        m_frameStream.write(prefix.c_str(), prefix.size());
+        m_frameSuffix = suffix;
+        return true;
+    }
+    
+    void setPagePath(const std::string& dataPath, const std::string& scripts)
+    {
+        m_dataPath = dataPath;
+        m_scripts = scripts;
+    }
+    
+    void write(const std::string& message)
+    {
+        if (m_pageSize == 0)
+        {
+            if (m_frameStream.is_open())
+            {
+                m_frameStream.write(message.c_str(), message.size());
+            }
+        }
+        else if (m_firstPage.size() < m_pageSize)
+        {
+            m_firstPage.push_back(message);
+        }
+        else
+        {
+            m_page.push_back(message);
+            if (m_page.size() >= m_pageSize)
+            {
+                flushPage();
+            }
+        }
+    }
+    
+    // Keeps the next page file written by the previous exporting, false if it has to be written again
+    bool skipPage()
+    {
+        if (m_pageSize == 0 || m_firstPage.size() < m_pageSize || !m_page.empty())
+        {
+            return false;
+        }
+        if (!existsFile(getPageFileName(m_numberOfPages + 1)))
+        {
+            return false;
+        }
+        m_numberOfMessagesInPages += m_pageSize;
+        ++m_numberOfPages;
+        return true;
+    }
+    
+    void close()
+    {
+        if (!m_page.empty())
+        {
+            flushPage();
+        }
+        if (m_frameStream.is_open())
+        {
+            m_frameStream.write(m_frameSuffix.c_str(), m_frameSuffix.size());
+            m_frameStream.close();
+        }
+    }
+    
+    const std::vector<std::string>& getFirstPage() const
+    {
+        return m_firstPage;
+    }
+    
+    size_t getNumberOfPages() const
+    {
+        return m_numberOfPages;
+    }
+    
+    size_t getNumberOfMessagesInPages() const
+    {
+        return m_numberOfMessagesInPages;
+    }
+    
+private:
+    std::string getPageFileName(size_t page) const
+    {
+        return combinePath(m_dataPath, "msg-" + std::to_string(page) + ".js");
+    }
+    
+    void flushPage()
+    {
+        if (m_numberOfPages == 0)
+        {
+            makeDirectory(m_dataPath);
+        }
+        
+        Json::Value jsonMsgs(Json::arrayValue);
+        for (std::vector<std::string>::const_iterator it = m_page.cbegin(); it != m_page.cend(); ++it)
+        {
+            jsonMsgs.append(*it);
+        }
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";  // assume default for comments is None
+#ifndef NDEBUG
+        builder["emitUTF8"] = true;
+#endif
+        std::string scripts = m_scripts;
+        replaceAll(scripts, "%%JSON_DATA%%", Json::writeString(builder, jsonMsgs));
+        
+        m_numberOfMessagesInPages += m_page.size();
+        ++m_numberOfPages;
+        writeFile(getPageFileName(m_numberOfPages), scripts);
+        
+        m_page.clear();
+    }
+};
+
+// Append-only store of the rendered messages of a session, so incremental exporting only appends the new ones
+// .dat: records of big-endian length + content, in the order they are rendered
+// .idx: magic, version, page size, count, max MesLocalID and the offsets of the records in chronological order
+class MessageLog
+{
+private:
+    std::string m_dataFileName;
+    std::string m_indexFileName;
+    
+    uint32_t m_pageSize;
+    int64_t m_maxId;    // -1: unknown, converted from the .dat of the previous versions
+    std::vector<uint64_t> m_offsets;
+    size_t m_numberOfPrevious;
+    
+    std::ofstream m_dataStream;
+    uint64_t m_dataSize;
+    std::ifstream m_readStream;
+    uint64_t m_readPos;
+    
+public:
+    MessageLog(const std::string& fileName) : m_dataFileName(fileName + ".dat"), m_indexFileName(fileName + ".idx"), m_pageSize(0), m_maxId(0), m_numberOfPrevious(0), m_dataSize(0), m_readPos(0)
+    {
+    }
+    
+    // Loads the index of the previous exporting
+    bool open(bool desc)
+    {
+        if (!existsFile(m_dataFileName))
+        {
+            return false;
+        }
+        return existsFile(m_indexFileName) ? loadIndex() : loadLegacyData(desc);
+    }
+    
+    // Drops the messages of the previous exporting
+    void reset()
+    {
+        if (m_dataStream.is_open())
+        {
+            m_dataStream.close();
+        }
+        if (m_readStream.is_open())
+        {
+            m_readStream.close();
+        }
+        m_offsets.clear();
+        m_numberOfPrevious = 0;
+        m_maxId = 0;
+        m_pageSize = 0;
+        deleteFile(m_indexFileName);
+        writeFile(m_dataFileName, "");
+    }
+    
+    int64_t getMaxId() const
+    {
+        return m_maxId;
+    }
+    
+    uint32_t getPageSize() const
+    {
+        return m_pageSize;
+    }
+    
+    size_t getNumberOfMessages() const
+    {
+        return m_offsets.size();
+    }
+    
+    size_t getNumberOfPreviousMessages() const
+    {
+        return m_numberOfPrevious;
+    }
+    
+    bool append(const std::string& message)
+    {
+        if (!m_dataStream.is_open())
+        {
+            // Records after the indexed ones are left by an interrupted exporting and just ignored
+            size_t size = getFileSize(m_dataFileName);
+            m_dataSize = (size == static_cast<size_t>(-1)) ? 0 : size;
+            if (!openOutputFile(m_dataStream, m_dataFileName, true))
+            {
+                return false;
+            }
+        }
+        
+        uint32_t size = htonl(static_cast<uint32_t>(message.size()));
+        m_dataStream.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        m_dataStream.write(message.c_str(), message.size());
+        m_offsets.push_back(m_dataSize);
+        m_dataSize += sizeof(size) + message.size();
+        return true;
+    }
+    
+    // The new messages come in the display order, which is reversed for desc
+    bool commit(bool desc, int64_t maxId, size_t pageSize)
+    {
+        if (m_dataStream.is_open())
+        {
+            m_dataStream.close();
+        }
+        if (desc)
+        {
+            std::reverse(m_offsets.begin() + m_numberOfPrevious, m_offsets.end());
+        }
+        m_maxId = maxId;
+        m_pageSize = static_cast<uint32_t>(pageSize);
+        
+        std::string buffer;
+        serializeUInt32(buffer, WXEXP_MSGLOG_MAGIC);
+        serializeUInt32(buffer, WXEXP_MSGLOG_VERSION);
+        serializeUInt32(buffer, m_pageSize);
+        serializeUInt32(buffer, static_cast<uint32_t>(m_offsets.size()));
+        buffer.append(reinterpret_cast<const char *>(&m_maxId), sizeof(m_maxId));
+        if (!m_offsets.empty())
+        {
+            buffer.append(reinterpret_cast<const char *>(&m_offsets[0]), m_offsets.size() * sizeof(uint64_t));
+        }
+        
+        std::string tmpFileName = m_indexFileName + ".tmp";
+        return writeFile(tmpFileName, buffer) && moveFile(tmpFileName, m_indexFileName);
+    }
+    
+    // index is in chronological order
+    bool read(size_t index, std::string& message)
+    {
+        if (index >= m_offsets.size())
+        {
+            return false;
+        }
+        if (!m_readStream.is_open())
+        {
+            if (!openInputFile(m_readStream, m_dataFileName))
+            {
+                return false;
+            }
+            m_readPos = 0;
+        }
+        
+        uint64_t offset = m_offsets[index];
+        if (offset != m_readPos)
+        {
+            m_readStream.clear();
+            m_readStream.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+        }
+        uint32_t size = 0;
+        if (!m_readStream.read(reinterpret_cast<char *>(&size), sizeof(size)))
+        {
+            return false;
+        }
+        size = ntohl(size);
+        message.resize(size);
+        if (size > 0 && !m_readStream.read(&message[0], size))
+        {
+            return false;
+        }
+        m_readPos = offset + sizeof(size) + size;
+        return true;
+    }
+    
+private:
+    bool loadIndex()
+    {
+        std::vector<unsigned char> buffer;
+        if (!readFile(m_indexFileName, buffer) || buffer.empty())
+        {
+            return false;
+        }
+        const char* data = reinterpret_cast<const char *>(&buffer[0]);
+        const char* end = data + buffer.size();
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t count = 0;
+        if (!unserializeUInt32(data, end, magic) || magic != WXEXP_MSGLOG_MAGIC || !unserializeUInt32(data, end, version) || version != WXEXP_MSGLOG_VERSION
+            || !unserializeUInt32(data, end, m_pageSize) || !unserializeUInt32(data, end, count))
+        {
+            return false;
+        }
+        if (static_cast<size_t>(end - data) != sizeof(m_maxId) + static_cast<size_t>(count) * sizeof(uint64_t))
+        {
+            return false;
+        }
+        std::memcpy(&m_maxId, data, sizeof(m_maxId));
+        data += sizeof(m_maxId);
+        m_offsets.resize(count);
+        if (count > 0)
+        {
+            std::memcpy(&m_offsets[0], data, count * sizeof(uint64_t));
+        }
+        m_numberOfPrevious = m_offsets.size();
+        return true;
+    }
+    
+    // The .dat written by the previous versions: number of records followed by records in the display order
+    bool loadLegacyData(bool desc)
+    {
+        std::ifstream ifs;
+        if (!openInputFile(ifs, m_dataFileName))
+        {
+            return false;
+        }
+        uint32_t count = 0;
+        if (!ifs.read(reinterpret_cast<char *>(&count), sizeof(count)))
+        {
+            return false;
+        }
+        count = ntohl(count);
+        
+        uint64_t offset = sizeof(count);
+        uint32_t size = 0;
+        m_offsets.reserve(count);
+        for (uint32_t idx = 0; idx < count; ++idx)
+        {
+            if (!ifs.read(reinterpret_cast<char *>(&size), sizeof(size)))
+            {
+                return false;
+            }
+            size = ntohl(size);
+            m_offsets.push_back(offset);
+            offset += sizeof(size) + size;
+            ifs.seekg(size, std::ios::cur);
+        }
+        if (desc)
+        {
+            std::reverse(m_offsets.begin(), m_offsets.end());
+        }
+        m_numberOfPrevious = m_offsets.size();
+        m_maxId = -1;
+        m_pageSize = 0;     // Pages are always written again
+        return true;
+    }
+};
+
+struct SESSION_EXPORT_CONTEXT
+{
+    const Friend& myself;
+    Friends& friends;
+    TaskManager& taskManager;
+    PortraitManager* portraitManager;
+    std::string userBase;
+    std::string outputBase;
+    std::function<std::string(const std::string&)> localeFunction;
+    
+    std::vector<Session*> sessions;
+    std::vector<size_t> sessionIndexes;     // Index in all sessions of the user, only for logs
+    size_t numberOfAllSessions;
+    std::vector<std::string> userItems;     // listitem of each session
+    std::atomic_size_t nextSession;
+    
+    SESSION_EXPORT_CONTEXT(const Friend& m, Friends& f, TaskManager& tm, const std::string& ub, const std::string& ob, const std::function<std::string(const std::string&)>& lf) : myself(m), friends(f), taskManager(tm), portraitManager(NULL), userBase(ub), outputBase(ob), localeFunction(lf), numberOfAllSessions(0), nextSession(0)
+    {
+    }
+};
 
 Exporter::Exporter(const std::string& workDir, const std::string& backup, const std::string& output, Logger* logger, PdfConverter* pdfConverter)
 {
@@ -40,6 +451,12 @@ Exporter::Exporter(const std::string& workDir, const std::string& backup, const
     m_extName = "html";
     m_templatesName = "templates";
     m_exportContext = NULL;
+    m_numberOfSessionWorkers = 1;
+    m_numberOfAudioWorkers = 0;
+    m_mediaStore = NULL;
+    m_httpCache = NULL;
+    m_httpCacheSize = 0;   // Off unless it is asked for
+    m_revalidatingHttpCache = false;
 }
 
 Exporter::~Exporter()
@@ -49,6 +466,16 @@ Exporter::~Exporter()
         delete m_exportContext;
         m_exportContext = NULL;
     }
+    if (NULL != m_mediaStore)
+    {
+        delete m_mediaStore;
+        m_mediaStore = NULL;
+    }
+    if (NULL != m_httpCache)
+    {
+        delete m_httpCache;
+        m_httpCache = NULL;
+    }
     releaseITunes();
     m_logger = NULL;
     m_notifier = NULL;
@@ -56,6 +483,8 @@ Exporter::~Exporter()
 
 void Exporter::initializeExporter()
 {
+    // Sessions are parsed in multiple threads
+    xmlInitParser();
 #ifdef USING_DOWNLOADER
     Downloader::initialize();
 #else
@@ -192,6 +621,22 @@ void Exporter::setIncrementalExporting(bool incrementalExporting)
         m_options &= ~SPO_INCREMENTAL_EXP;
 }
 
+void Exporter::setHardLinkingFiles(bool hardLinkingFiles)
+{
+    if (hardLinkingFiles)
+        m_options |= SPO_HARD_LINK_FILES;
+    else
+        m_options &= ~SPO_HARD_LINK_FILES;
+}
+
+void Exporter::setDeduplicatingFiles(bool deduplicatingFiles)
+{
+    if (deduplicatingFiles)
+        m_options |= SPO_DEDUP_FILES;
+    else
+        m_options &= ~SPO_DEDUP_FILES;
+}
+
 void Exporter::supportsFilter(bool supportsFilter/* = true*/)
 {
     if (supportsFilter)
@@ -226,6 +671,27 @@ void Exporter::setTemplatesName(const std::string& templatesName)
     m_templatesName = templatesName;
 }
 
+void Exporter::setNumberOfSessionWorkers(unsigned int numberOfSessionWorkers)
+{
+    m_numberOfSessionWorkers = numberOfSessionWorkers;
+}
+
+void Exporter::setNumberOfAudioWorkers(unsigned int numberOfAudioWorkers)
+{
+    m_numberOfAudioWorkers = numberOfAudioWorkers;
+}
+
+void Exporter::setCacheDirectory(const std::string& cacheDir)
+{
+    m_cacheDir = cacheDir;
+}
+
+void Exporter::setHttpCache(uint64_t maxBytes, bool revalidating/* = false*/)
+{
+    m_httpCacheSize = maxBytes;
+    m_revalidatingHttpCache = revalidating;
+}
+
 void Exporter::setLanguageCode(const std::string& languageCode)
 {
     m_languageCode = languageCode;
@@ -265,6 +731,22 @@ bool Exporter::loadUsersAndSessions()
     
     loadStrings();
     
+    // The sessions list only changes with the backup, reuse the snapshot of last loading if the backup is untouched
+    std::string snapshotFileName;
+    std::string fingerprint;
+    std::string cacheDir = getCacheDirectory();
+    if (!cacheDir.empty())
+    {
+        snapshotFileName = combinePath(cacheDir, "sessions_" + md5(m_backup) + ".dat");
+        fingerprint = buildBackupFingerprint();
+        if (loadSessionsSnapshot(snapshotFileName, fingerprint))
+        {
+            m_logger->write(formatString(getLocaleString("iTunes Version: %s, iOS Version: %s, Wechat Version: %s"), m_iTunesVersion.c_str(), m_iOSVersion.c_str(), m_wechatInfo.getShortVersion().c_str()));
+            m_logger->debug("Sessions snapshot loaded.");
+            return true;
+        }
+    }
+    
     if (!loadITunes(false))
     {
         m_logger->write(formatString(getLocaleString("Failed to parse the backup data of iTunes in the directory: %s"), m_backup.c_str()));
@@ -301,6 +783,11 @@ bool Exporter::loadUsersAndSessions()
         Friends friends;
         loadUserFriendsAndSessions(it2->first, friends, it2->second, false);
     }
+    
+    if (!snapshotFileName.empty())
+    {
+        saveSessionsSnapshot(snapshotFileName, fingerprint);
+    }
 
     return true;
 }
@@ -383,6 +870,19 @@ bool Exporter::runImpl()
         // If there is no export context, save current options
         m_exportContext->setOptions(m_options);
     }
+    m_iTunesDb->setHardLinkingFiles((m_options & SPO_HARD_LINK_FILES) == SPO_HARD_LINK_FILES);
+    m_iTunesDbShare->setHardLinkingFiles((m_options & SPO_HARD_LINK_FILES) == SPO_HARD_LINK_FILES);
+    if ((m_options & SPO_DEDUP_FILES) == SPO_DEDUP_FILES)
+    {
+        m_mediaStore = new MediaStore();
+    }
+    // Media are only kept in a cache directory set by the app, never in the output
+    if (m_httpCacheSize > 0 && !m_cacheDir.empty())
+    {
+        m_httpCache = new HttpCache(combinePath(m_cacheDir, "http"), m_httpCacheSize);
+        m_httpCache->setRevalidating(m_revalidatingHttpCache);
+        m_httpCache->load();
+    }
     
     std::string htmlBody;
 
@@ -446,6 +946,20 @@ bool Exporter::runImpl()
     delete m_exportContext;
     m_exportContext = NULL;
     
+    if (NULL != m_mediaStore)
+    {
+        m_logger->write(formatString(getLocaleString("Deduplicated media: %d references, %.1f MB saved."), static_cast<int>(m_mediaStore->getNumberOfReferences()), m_mediaStore->getSavedBytes() / (1024.0 * 1024.0)));
+        delete m_mediaStore;
+        m_mediaStore = NULL;
+    }
+    if (NULL != m_httpCache)
+    {
+        m_httpCache->save();
+        m_logger->write(formatString(getLocaleString("Media cache: %d hits, %d revalidated, %d stored."), static_cast<int>(m_httpCache->getNumberOfHits()), static_cast<int>(m_httpCache->getNumberOfRevalidated()), static_cast<int>(m_httpCache->getNumberOfStored())));
+        delete m_httpCache;
+        m_httpCache = NULL;
+    }
+    
     time_t endTime = 0;
     std::time(&endTime);
     int seconds = static_cast<int>(difftime(endTime, startTime));
@@ -525,8 +1039,6 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
         myself = &user;
     }
     
-    std::string userBody;
-    
     std::map<std::string, std::map<std::string, void *>>::const_iterator itUser = m_usersAndSessionsFilter.cend();
     if (!m_usersAndSessionsFilter.empty())
     {
@@ -542,7 +1054,7 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
 #ifdef USING_DOWNLOADER
     Downloader downloader(m_logger);
 #else
-    TaskManager taskManager(m_logger);
+    TaskManager taskManager(m_logger, m_numberOfAudioWorkers);
 #endif
 #ifndef NDEBUG
     m_logger->debug("UA: " + m_wechatInfo.buildUserAgent());
@@ -552,10 +1064,15 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
     downloader.setUserAgent(m_wechatInfo.buildUserAgent());
 #else
     taskManager.setUserAgent(m_wechatInfo.buildUserAgent());
+    taskManager.setMediaStore(m_mediaStore);
+    taskManager.setHttpCache(m_httpCache);
 #endif
     
     std::function<std::string(const std::string&)> localeFunction = std::bind(&Exporter::getLocaleString, this, std::placeholders::_1);
     MessageParser msgParser(*m_iTunesDb, *m_iTunesDbShare, taskManager, friends, *myself, m_options, m_workDir, outputBase, localeFunction);
+    // Each portrait is resolved once in the export of the user
+    PortraitManager portraitManager;
+    msgParser.setPortraitManager(&portraitManager);
     
     if ((m_options & SPO_IGNORE_AVATAR) == 0)
     {
@@ -566,6 +1083,10 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
         // downloader.addTask(user.getPortrait(), combinePath(outputBase, "Portrait", user.getLocalPortrait()), 0);
     }
 
+    SESSION_EXPORT_CONTEXT context(*myself, friends, taskManager, userBase, outputBase, localeFunction);
+    context.portraitManager = &portraitManager;
+    context.numberOfAllSessions = sessions.size();
+    
     std::set<std::string> sessionFileNames;
     for (std::vector<Session>::iterator it = sessions.begin(); it != sessions.end(); ++it)
     {
@@ -584,65 +1105,79 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
             
             it->setData(itSession->second);
         }
-
-		notifySessionStart(it->getUsrName(), it->getData(), it->getRecordCount());
         
+        // File names must be unique in the user folder, so they are built before exporting sessions concurrently
         if (!buildFileNameForUser(*it, sessionFileNames))
         {
+            notifySessionStart(it->getUsrName(), it->getData(), it->getRecordCount());
             m_logger->write(formatString(getLocaleString("Can't build directory name for chat: %s. Skip it."), it->getDisplayName().c_str()));
-			notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
+            notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
             continue;
         }
-        
-        std::string sessionDisplayName = it->getDisplayName();
-#ifndef NDEBUG
-        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (std::distance(sessions.begin(), it) + 1), sessions.size(), sessionDisplayName.c_str()) + " uid:" + it->getUsrName());
-#else
-        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (std::distance(sessions.begin(), it) + 1), sessions.size(), sessionDisplayName.c_str()));
-#endif
         if (it->isSubscription())
         {
-            m_logger->write(formatString(getLocaleString("Skip subscription: %s"), sessionDisplayName.c_str()));
-			notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
+            notifySessionStart(it->getUsrName(), it->getData(), it->getRecordCount());
+            m_logger->write(formatString(getLocaleString("Skip subscription: %s"), it->getDisplayName().c_str()));
+            notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
             continue;
         }
-        if ((m_options & SPO_IGNORE_AVATAR) == 0)
+        
+        context.sessions.push_back(&(*it));
+        context.sessionIndexes.push_back(std::distance(sessions.begin(), it));
+    }
+    context.userItems.resize(context.sessions.size());
+    
+    unsigned int numberOfWorkers = m_numberOfSessionWorkers;
+    if (numberOfWorkers == 0)
+    {
+        numberOfWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (numberOfWorkers > context.sessions.size())
+    {
+        numberOfWorkers = static_cast<unsigned int>(context.sessions.size());
+    }
+    
+    if (numberOfWorkers <= 1)
+    {
+        exportSessions(&context);
+    }
+    else
+    {
+        std::vector<std::thread> workers;
+        workers.reserve(numberOfWorkers);
+        for (unsigned int idx = 0; idx < numberOfWorkers; ++idx)
         {
-            // Download avatar for session
-            msgParser.copyPortraitIcon(&(*it), *it, combinePath(outputBase, "Portrait"));
+            workers.push_back(std::thread(&Exporter::exportSessions, this, &context));
         }
-        int count = exportSession(*myself, msgParser, *it, userBase, outputBase);
-        
-        m_logger->write(formatString(getLocaleString("Succeeded handling %d messages."), count));
-
-        if (count > 0)
+        for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it)
         {
-            std::string userItem = getTemplate("listitem");
-            replaceAll(userItem, "%%ITEMPICPATH%%", "Portrait/" + it->getLocalPortrait());
-            if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
-            {
-                replaceAll(userItem, "%%ITEMLINK%%", encodeUrl(it->getOutputFileName()) + "." + m_extName);
-                replaceAll(userItem, "%%ITEMTEXT%%", safeHTML(sessionDisplayName));
-            }
-            else
-            {
-                replaceAll(userItem, "%%ITEMLINK%%", it->getOutputFileName() + "." + m_extName);
-                replaceAll(userItem, "%%ITEMTEXT%%", sessionDisplayName);
-            }
-            
-            userBody += userItem;
+            it->join();
         }
-
-		notifySessionComplete(it->getUsrName(), it->getData(), m_cancelled);
-        
-        if (pdfOutput)
+    }
+    
+    // Merge the items in the order of sessions, so the index is the same as the serial exporting
+    std::string userBody;
+    for (std::vector<std::string>::const_iterator it = context.userItems.cbegin(); it != context.userItems.cend(); ++it)
+    {
+        userBody += *it;
+    }
+    
+    if (pdfOutput)
+    {
+#ifndef USING_DOWNLOADER
+        taskManager.waitForCopyCompletion();
+#endif
+        for (std::vector<Session*>::const_iterator it = context.sessions.cbegin(); it != context.sessions.cend(); ++it)
         {
-            // std::string 
-            std::string htmlFileName = combinePath(outputBase, it->getOutputFileName() + "." + m_extName);
+            if (m_cancelled)
+            {
+                break;
+            }
+            std::string htmlFileName = combinePath(outputBase, (*it)->getOutputFileName() + "." + m_extName);
             if (existsFile(htmlFileName))
             {
-                std::string pdfFileName = combinePath(m_output, "pdf", userOutputPath, it->getOutputFileName() + ".pdf");
-                // taskManager.convertPdf(&(*it), htmlFileName, pdfFileName, m_pdfConverter);
+                std::string pdfFileName = combinePath(m_output, "pdf", userOutputPath, (*it)->getOutputFileName() + ".pdf");
+                // taskManager.convertPdf(*it, htmlFileName, pdfFileName, m_pdfConverter);
                 m_pdfConverter->convert(htmlFileName, pdfFileName);
             }
         }
@@ -731,6 +1266,68 @@ bool Exporter::exportUser(Friend& user, std::string& userOutputPath)
     return true;
 }
 
+void Exporter::exportSessions(SESSION_EXPORT_CONTEXT* context)
+{
+    // MessageParser reuses its XmlExtractors and the sender table of the session across messages, so each worker has its own parser
+    MessageParser msgParser(*m_iTunesDb, *m_iTunesDbShare, context->taskManager, context->friends, context->myself, m_options, m_workDir, context->outputBase, context->localeFunction);
+    msgParser.setPortraitManager(context->portraitManager);
+    
+    while (!m_cancelled)
+    {
+        size_t idx = context->nextSession++;
+        if (idx >= context->sessions.size())
+        {
+            break;
+        }
+        
+        Session& session = *(context->sessions[idx]);
+        // Member names missing in the chat are decoded from the chatroom contact only when the chat is exported
+        const Friend* chatroom = context->friends.getFriend(session.getHash());
+        if (NULL != chatroom)
+        {
+            FriendsParser::parseMembers(*chatroom, session);
+        }
+        notifySessionStart(session.getUsrName(), session.getData(), session.getRecordCount());
+        
+        std::string sessionDisplayName = session.getDisplayName();
+#ifndef NDEBUG
+        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (int)(context->sessionIndexes[idx] + 1), (int)(context->numberOfAllSessions), sessionDisplayName.c_str()) + " uid:" + session.getUsrName());
+#else
+        m_logger->write(formatString(getLocaleString("%d/%d: Handling the chat with %s"), (int)(context->sessionIndexes[idx] + 1), (int)(context->numberOfAllSessions), sessionDisplayName.c_str()));
+#endif
+        if ((m_options & SPO_IGNORE_AVATAR) == 0)
+        {
+            // Download avatar for session
+            msgParser.copyPortraitIcon(&session, session, combinePath(context->outputBase, "Portrait"));
+        }
+        int count = exportSession(context->myself, msgParser, session, context->userBase, context->outputBase);
+        if (count >= 0)
+        {
+            m_logger->write(formatString(getLocaleString("Succeeded handling %d messages."), count));
+        }
+
+        if (count > 0)
+        {
+            std::string userItem = getTemplate("listitem");
+            replaceAll(userItem, "%%ITEMPICPATH%%", "Portrait/" + session.getLocalPortrait());
+            if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
+            {
+                replaceAll(userItem, "%%ITEMLINK%%", encodeUrl(session.getOutputFileName()) + "." + m_extName);
+                replaceAll(userItem, "%%ITEMTEXT%%", safeHTML(sessionDisplayName));
+            }
+            else
+            {
+                replaceAll(userItem, "%%ITEMLINK%%", session.getOutputFileName() + "." + m_extName);
+                replaceAll(userItem, "%%ITEMTEXT%%", sessionDisplayName);
+            }
+            
+            context->userItems[idx].swap(userItem);
+        }
+
+        notifySessionComplete(session.getUsrName(), session.getData(), m_cancelled);
+    }
+}
+
 bool Exporter::loadUserFriendsAndSessions(const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo/* = true*/) const
 {
     std::string uidMd5 = user.getHash();
@@ -749,6 +1346,11 @@ bool Exporter::loadUserFriendsAndSessions(const Friend& user, Friends& friends,
     }
 
     SessionsParser sessionsParser(m_iTunesDb, m_iTunesDbShare, m_wechatInfo.getCellDataVersion(), detailedInfo);
+    std::string cacheDir = getCacheDirectory();
+    if (!cacheDir.empty())
+    {
+        sessionsParser.setCacheDirectory(combinePath(cacheDir, user.getUsrName()));
+    }
     
     sessionsParser.parse(user, friends, sessions);
  
@@ -778,21 +1380,67 @@ int Exporter::exportSession(const Friend& user, const MessageParser& msgParser,
         makeDirectory(combinePath(sessionBasePath, "Emoji"));
     }
 
-    std::vector<std::string> messages;
-    if (session.getRecordCount() > 0)
-    {
-        messages.reserve(session.getRecordCount());
-    }
+#ifndef NDEBUG
+    const size_t pageSize = 500;
+#else
+    const size_t pageSize = 1000;
+#endif
+    // No page for text mode
+    bool paging = (m_options & (SPO_TEXT_MODE | SPO_SYNC_LOADING)) == 0;
+    bool desc = (m_options & SPO_DESC) != 0;
+    bool incremental = (m_options & SPO_INCREMENTAL_EXP) != 0;
     
     int64_t maxMsgId = 0;
     m_exportContext->getMaxId(session.getUsrName(), maxMsgId);
     
-    int numberOfMsgs = 0;
+    // Messages of the previous exporting are kept only if the log matches the context, otherwise all are exported again
+    MessageLog msgLog(combinePath(m_output, WXEXP_DATA_FOLDER, session.getOwner()->getUsrName(), session.getUsrName()));
+    if (!incremental || !msgLog.open(desc) || (msgLog.getMaxId() != -1 && msgLog.getMaxId() != maxMsgId))
+    {
+        msgLog.reset();
+        incremental = false;
+        maxMsgId = 0;
+    }
+    const size_t previousPageSize = msgLog.getPageSize();
+    
     SessionParser sessionParser(m_options);
     std::unique_ptr<SessionParser::MessageEnumerator> enumerator(sessionParser.buildMsgEnumerator(session, maxMsgId));
-    std::vector<TemplateValues> tvs;
     WXMSG msg;
-    while (enumerator->nextMessage(msg))
+    if (!enumerator->nextMessage(msg))
+    {
+        // No new messages, keep the previous output
+        if (!incremental)
+        {
+            msgLog.commit(desc, maxMsgId, pageSize);
+        }
+        return 0;
+    }
+    
+    msgParser.prefetchPortraits(session);
+    
+    std::string fileName = combinePath(outputBase, session.getOutputFileName() + "." + m_extName);
+    SessionWriter writer(paging ? pageSize : 0);
+    if (paging)
+    {
+        writer.setPagePath(combinePath(sessionBasePath, "Data"), getTemplate("scripts"));
+    }
+    else
+    {
+        std::string html = buildSessionFrame(user, session, pageSize, 0, 0);
+        std::string::size_type pos = html.find("%%BODY%%");
+        if (pos == std::string::npos)
+        {
+            pos = html.size();
+        }
+        writer.openFrameFile(fileName, html.substr(0, pos), (pos < html.size()) ? html.substr(pos + 8) : "");
+    }
+    
+    // A full exporting writes the pages as the messages are rendered and keeps the log for the next incremental one.
+    // An incremental exporting only appends the new messages to the log and writes the pages from it later
+    int numberOfMsgs = 0;
+    std::vector<TemplateValues> tvs;
+    std::string content;
+    do
     {
         if (msg.msgIdValue > maxMsgId)
         {
@@ -801,7 +1449,17 @@ int Exporter::exportSession(const Friend& user, const MessageParser& msgParser,
         
         tvs.clear();
         msgParser.parse(msg, session, tvs);
-        exportMessage(session, tvs, messages);
+        exportMessage(session, tvs, content);
+        if (!msgLog.append(content))
+        {
+            m_logger->write(formatString(getLocaleString("Failed to write the message log of the chat: %s"), session.getDisplayName().c_str()));
+            msgLog.reset();
+            return -1;
+        }
+        if (!incremental)
+        {
+            writer.write(content);
+        }
         ++numberOfMsgs;
         
         notifySessionProgress(session.getUsrName(), session.getData(), numberOfMsgs, session.getRecordCount());
@@ -809,177 +1467,91 @@ int Exporter::exportSession(const Friend& user, const MessageParser& msgParser,
         {
             break;
         }
-    }
+    } while (enumerator->nextMessage(msg));
     
+    if (!msgLog.commit(desc, maxMsgId, pageSize))
+    {
+        m_logger->write(formatString(getLocaleString("Failed to write the message log of the chat: %s"), session.getDisplayName().c_str()));
+        msgLog.reset();
+        return -1;
+    }
     if (maxMsgId > 0)
     {
         m_exportContext->setMaxId(session.getUsrName(), maxMsgId);
     }
     
-    std::string rawMsgFileName = combinePath(m_output, WXEXP_DATA_FOLDER, session.getOwner()->getUsrName(), session.getUsrName() + ".dat");
-    if (m_options & SPO_INCREMENTAL_EXP)
-    {
-        mergeMessages(rawMsgFileName, messages);
-    }
-    serializeMessages(rawMsgFileName, messages);
-
-    if (numberOfMsgs > 0 && !messages.empty())
+    if (incremental)
     {
-#ifndef NDEBUG
-        const size_t pageSize = 500;
-#else
-        const size_t pageSize = 1000;
-#endif
-        auto b = messages.cbegin();
-        // No page for text mode
-        auto e = (((m_options & (SPO_TEXT_MODE | SPO_SYNC_LOADING)) != 0) || (messages.size() <= pageSize)) ? messages.cend() : (b + pageSize);
-        
-        const size_t numberOfMessages = std::distance(e, messages.cend());
-        const size_t numberOfPages = (numberOfMessages + pageSize - 1) / pageSize;
-        
-        std::string html = getTemplate("frame");
-#ifndef NDEBUG
-        replaceAll(html, "%%USRNAME%%", user.getUsrName() + " - " + user.getHash());
-        replaceAll(html, "%%SESSION_USRNAME%%", session.getUsrName() + " - " + session.getHash());
-#else
-        replaceAll(html, "%%USRNAME%%", "");
-        replaceAll(html, "%%SESSION_USRNAME%%", "");
-#endif
-        replaceAll(html, "%%DISPLAYNAME%%", session.getDisplayName());
-        replaceAll(html, "%%WX_CHAT_HISTORY%%", getLocaleString("Wechat Chat History"));
-        replaceAll(html, "%%ASYNC_LOADING_TYPE%%", m_loadingDataOnScroll ? "onscroll" : "initial");
-        
-        replaceAll(html, "%%SIZE_OF_PAGE%%", std::to_string(pageSize));
-        replaceAll(html, "%%NUMBER_OF_MSGS%%", std::to_string(numberOfMessages));
-        replaceAll(html, "%%NUMBER_OF_PAGES%%", std::to_string(numberOfPages));
-        
-        replaceAll(html, "%%DATA_PATH%%", encodeUrl(session.getOutputFileName() + "_files") + "/Data");
-        
-        replaceAll(html, "%%BODY%%", join(b, e, ""));
-        replaceAll(html, "%%HEADER_FILTER%%", (m_options & SPO_SUPPORT_FILTER) ? getTemplate("filter") : "");
-        
-        std::string fileName = combinePath(outputBase, session.getOutputFileName() + "." + m_extName);
-        writeFile(fileName, html);
-        
-        if ((m_options & SPO_SYNC_LOADING) == 0 && numberOfPages > 0)
+        // In asc order the new messages only touch the last pages, the full pages of the previous exporting are kept
+        bool skippingPages = paging && !desc && previousPageSize == pageSize;
+        size_t numberOfPrevious = msgLog.getNumberOfPreviousMessages();
+        size_t numberOfMessages = msgLog.getNumberOfMessages();
+        size_t idx = 0;
+        while (idx < numberOfMessages)
         {
-            std::string dataPath = combinePath(outputBase, session.getOutputFileName() + "_files", "Data");
-            makeDirectory(dataPath);
-
-            for (size_t page = 0; page < numberOfPages; ++page)
+            if (skippingPages && idx >= pageSize && (idx % pageSize) == 0 && idx + pageSize <= numberOfPrevious && writer.skipPage())
             {
-                b = e;
-                std::string scripts = getTemplate("scripts");
-                e = (page == (numberOfPages - 1)) ? messages.cend() : (b + pageSize);
-                Json::Value jsonMsgs(Json::arrayValue);
-                for (auto it = b; it != e; ++it)
-                {
-                    jsonMsgs.append(*it);
-                }
-                Json::StreamWriterBuilder builder;
-                builder["indentation"] = "";  // assume default for comments is None
-#ifndef NDEBUG
-                builder["emitUTF8"] = true;
-#endif
-                std::string moreMsgs = Json::writeString(builder, jsonMsgs);
-
-                replaceAll(scripts, "%%JSON_DATA%%", moreMsgs);
-                
-                fileName = combinePath(dataPath, "msg-" + std::to_string(page + 1) + ".js");
-                writeFile(fileName, scripts);
+                idx += pageSize;
+                continue;
             }
+            if (!msgLog.read(desc ? (numberOfMessages - 1 - idx) : idx, content))
+            {
+                m_logger->write(formatString(getLocaleString("Failed to read the message log of the chat: %s"), session.getDisplayName().c_str()));
+                // Export the chat again next time
+                msgLog.reset();
+                m_exportContext->setMaxId(session.getUsrName(), 0);
+                return -1;
+            }
+            writer.write(content);
+            ++idx;
         }
-        
-        
     }
     
-    return numberOfMsgs;
-}
+    writer.close();
 
-bool Exporter::exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::vector<std::string>& messages)
-{
-    std::string content;
-    for (std::vector<TemplateValues>::const_iterator it = tvs.cbegin(); it != tvs.cend(); ++it)
+    if (paging)
     {
-        content.append(buildContentFromTemplateValues(*it));
+        std::string html = buildSessionFrame(user, session, pageSize, writer.getNumberOfMessagesInPages(), writer.getNumberOfPages());
+        replaceAll(html, "%%BODY%%", join(writer.getFirstPage(), ""));
+        writeFile(fileName, html);
     }
     
-    messages.push_back(content);
-    return m_cancelled;
-}
-
-void Exporter::serializeMessages(const std::string& fileName, const std::vector<std::string>& messages)
-{
-    uint32_t size = htonl(static_cast<uint32_t>(messages.size()));
-    writeFile(fileName, "");
-    appendFile(fileName, reinterpret_cast<const unsigned char *>(&size), sizeof(size));
-    
-    for (std::vector<std::string>::const_iterator it = messages.cbegin(); it != messages.cend(); ++it)
-    {
-        size = htonl(static_cast<uint32_t>(it->size()));
-        appendFile(fileName, reinterpret_cast<const unsigned char *>(&size), sizeof(size));
-        appendFile(fileName, *it);
-    }
+    return numberOfMsgs;
 }
 
-void Exporter::unserializeMessages(const std::string& fileName, std::vector<std::string>& messages)
+std::string Exporter::buildSessionFrame(const Friend& user, const Session& session, size_t pageSize, size_t numberOfMessages, size_t numberOfPages) const
 {
-    std::vector<unsigned char> data;
-    if (!readFile(fileName, data))
-    {
-        messages.clear();
-        return;
-    }
-    
-    size_t dataSize = data.size();
-    if (dataSize < sizeof(uint32_t))
-    {
-        return;
-    }
+    std::string html = getTemplate("frame");
+#ifndef NDEBUG
+    replaceAll(html, "%%USRNAME%%", user.getUsrName() + " - " + user.getHash());
+    replaceAll(html, "%%SESSION_USRNAME%%", session.getUsrName() + " - " + session.getHash());
+#else
+    replaceAll(html, "%%USRNAME%%", "");
+    replaceAll(html, "%%SESSION_USRNAME%%", "");
+#endif
+    replaceAll(html, "%%DISPLAYNAME%%", session.getDisplayName());
+    replaceAll(html, "%%WX_CHAT_HISTORY%%", getLocaleString("Wechat Chat History"));
+    replaceAll(html, "%%ASYNC_LOADING_TYPE%%", m_loadingDataOnScroll ? "onscroll" : "initial");
     
-    size_t offset = 0;
-    uint32_t itemSize = 0;
-    memcpy(&itemSize, &data[offset], sizeof(uint32_t));
-    offset += sizeof(uint32_t);
-    itemSize = ntohl(itemSize);
+    replaceAll(html, "%%SIZE_OF_PAGE%%", std::to_string(pageSize));
+    replaceAll(html, "%%NUMBER_OF_MSGS%%", std::to_string(numberOfMessages));
+    replaceAll(html, "%%NUMBER_OF_PAGES%%", std::to_string(numberOfPages));
     
-    messages.clear();
-    messages.reserve(itemSize);
+    replaceAll(html, "%%DATA_PATH%%", encodeUrl(session.getOutputFileName() + "_files") + "/Data");
+    replaceAll(html, "%%HEADER_FILTER%%", (m_options & SPO_SUPPORT_FILTER) ? getTemplate("filter") : "");
     
-    uint32_t sizeOfString = 0;
-    for (uint32_t idx = 0; idx < itemSize; ++idx)
-    {
-        if (offset + sizeof(uint32_t) > dataSize)
-        {
-            break;
-        }
-        memcpy(&sizeOfString, &data[offset], sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        sizeOfString = ntohl(sizeOfString);
-        
-        if (offset + sizeOfString > dataSize)
-        {
-            break;
-        }
-        
-        messages.emplace_back(reinterpret_cast<const char *>(&data[offset]), sizeOfString);
-        offset += sizeOfString;
-    }
+    return html;
 }
 
-void Exporter::mergeMessages(const std::string& fileName, std::vector<std::string>& messages)
+bool Exporter::exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::string& content)
 {
-    std::vector<std::string> orgMessages;
-    unserializeMessages(fileName, orgMessages);
-    
-    std::string contents = readFile(fileName);
-    if ((m_options & SPO_DESC) == 0)
+    content.clear();
+    for (std::vector<TemplateValues>::const_iterator it = tvs.cbegin(); it != tvs.cend(); ++it)
     {
-        messages.swap(orgMessages);
+        buildContentFromTemplateValues(*it, content);
     }
     
-    messages.reserve(messages.size() + orgMessages.size());
-    messages.insert(messages.cend(), orgMessages.cbegin(), orgMessages.cend());
+    return m_cancelled;
 }
 
 bool Exporter::buildFileNameForUser(Friend& user, std::set<std::string>& existingFileNames)
@@ -1067,14 +1639,148 @@ bool Exporter::loadITunes(bool detailedInfo/* = true*/)
     return true;
 }
 
+std::string Exporter::getCacheDirectory() const
+{
+    if (!m_cacheDir.empty())
+    {
+        return m_cacheDir;
+    }
+    return m_output.empty() ? "" : combinePath(m_output, WXEXP_DATA_FOLDER);
+}
+
+std::string Exporter::buildBackupFingerprint() const
+{
+    // Size and mtime of the manifest db plus its sqlite header, which carries the file change counter
+    std::string fingerprint;
+    const char* manifestNames[] = {"Manifest.db", "Manifest.mbdb", "Info.plist"};
+    for (size_t idx = 0; idx < sizeof(manifestNames) / sizeof(const char*); ++idx)
+    {
+        std::string path = combinePath(m_backup, manifestNames[idx]);
+        time_t mtime = getFileModifiedTime(path);
+        fingerprint += std::string(manifestNames[idx]) + ":" + (mtime == 0 ? "-" : (std::to_string(getFileSize(path)) + ":" + std::to_string(mtime))) + ";";
+    }
+    
+    std::ifstream ifs;
+    if (openInputFile(ifs, combinePath(m_backup, "Manifest.db")))
+    {
+        char header[4096];
+        ifs.read(header, sizeof(header));
+        std::streamsize length = ifs.gcount();
+        if (length > 0)
+        {
+            unsigned char digest[SHA1_DIGEST_SIZE];
+            sha1(header, static_cast<size_t>(length), digest);
+            fingerprint += hexEncode(digest, SHA1_DIGEST_SIZE);
+        }
+    }
+    return fingerprint;
+}
+
+bool Exporter::loadSessionsSnapshot(const std::string& fileName, const std::string& fingerprint)
+{
+    std::vector<unsigned char> buffer;
+    if (!existsFile(fileName) || !readFile(fileName, buffer) || buffer.empty())
+    {
+        return false;
+    }
+    
+    const char* data = reinterpret_cast<const char *>(&buffer[0]);
+    const char* end = data + buffer.size();
+    
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    std::string value;
+    if (!unserializeUInt32(data, end, magic) || magic != WXEXP_SNAPSHOT_MAGIC || !unserializeUInt32(data, end, version) || version != WXEXP_SNAPSHOT_VERSION)
+    {
+        return false;
+    }
+    if (!unserializeString(data, end, value) || value != fingerprint)
+    {
+        return false;
+    }
+    
+    std::string iTunesVersion;
+    std::string iOSVersion;
+    WechatInfo wechatInfo;
+    uint32_t numberOfUsers = 0;
+    if (!unserializeString(data, end, iTunesVersion) || !unserializeString(data, end, iOSVersion) || !wechatInfo.unserialize(data, end) || !unserializeUInt32(data, end, numberOfUsers))
+    {
+        return false;
+    }
+    
+    std::vector<std::pair<Friend, std::vector<Session>>> usersAndSessions;
+    usersAndSessions.reserve(numberOfUsers); // Sessions keep the pointer of the owner
+    for (uint32_t idx = 0; idx < numberOfUsers; ++idx)
+    {
+        std::vector<std::pair<Friend, std::vector<Session>>>::iterator it = usersAndSessions.emplace(usersAndSessions.cend(), std::pair<Friend, std::vector<Session>>(Friend(), std::vector<Session>()));
+        uint32_t numberOfSessions = 0;
+        if (!it->first.unserialize(data, end) || !unserializeUInt32(data, end, numberOfSessions))
+        {
+            return false;
+        }
+        it->second.reserve(numberOfSessions);
+        for (uint32_t sessionIdx = 0; sessionIdx < numberOfSessions; ++sessionIdx)
+        {
+            std::vector<Session>::iterator itSession = it->second.emplace(it->second.cend(), &(it->first));
+            if (!itSession->unserialize(data, end))
+            {
+                return false;
+            }
+        }
+    }
+    if (data != end)
+    {
+        return false;
+    }
+    
+    m_iTunesVersion.swap(iTunesVersion);
+    m_iOSVersion.swap(iOSVersion);
+    m_wechatInfo = wechatInfo;
+    m_usersAndSessions.swap(usersAndSessions);
+    return true;
+}
+
+void Exporter::saveSessionsSnapshot(const std::string& fileName, const std::string& fingerprint) const
+{
+    std::string buffer;
+    serializeUInt32(buffer, WXEXP_SNAPSHOT_MAGIC);
+    serializeUInt32(buffer, WXEXP_SNAPSHOT_VERSION);
+    serializeString(buffer, fingerprint);
+    serializeString(buffer, getITunesVersion());
+    serializeString(buffer, getIOSVersion());
+    m_wechatInfo.serialize(buffer);
+    serializeUInt32(buffer, static_cast<uint32_t>(m_usersAndSessions.size()));
+    for (std::vector<std::pair<Friend, std::vector<Session>>>::const_iterator it = m_usersAndSessions.cbegin(); it != m_usersAndSessions.cend(); ++it)
+    {
+        it->first.serialize(buffer);
+        serializeUInt32(buffer, static_cast<uint32_t>(it->second.size()));
+        for (std::vector<Session>::const_iterator itSession = it->second.cbegin(); itSession != it->second.cend(); ++itSession)
+        {
+            itSession->serialize(buffer);
+        }
+    }
+    
+    std::string cacheDir = getCacheDirectory();
+    if (!existsDirectory(cacheDir))
+    {
+        makeDirectory(cacheDir);
+    }
+    // Write into a temporary file first so a partial snapshot is never picked up
+    std::string tmpFileName = fileName + ".tmp";
+    if (writeFile(tmpFileName, buffer))
+    {
+        moveFile(tmpFileName, fileName);
+    }
+}
+
 std::string Exporter::getITunesVersion() const
 {
-    return NULL != m_iTunesDb ? m_iTunesDb->getVersion() : "";
+    return NULL != m_iTunesDb ? m_iTunesDb->getVersion() : m_iTunesVersion;
 }
 
 std::string Exporter::getIOSVersion() const
 {
-    return NULL != m_iTunesDb ? m_iTunesDb->getIOSVersion() : "";
+    return NULL != m_iTunesDb ? m_iTunesDb->getIOSVersion() : m_iOSVersion;
 }
 
 std::string Exporter::getWechatVersion() const
@@ -1091,6 +1797,14 @@ bool Exporter::loadTemplates()
         std::string path = combinePath(m_workDir, "res", m_templatesName, name + ".html");
         m_templates[name] = readFile(path);
     }
+    
+    // Templates of messages are rendered for every message, compile them once
+    const char* msgNames[] = {"msg", "video", "notice", "system", "audio", "image", "card", "emoji", "plainshare", "share", "thumb", "refermsg", "channels"};
+    m_compiledTemplates.clear();
+    for (int idx = 0; idx < sizeof(msgNames) / sizeof(const char*); idx++)
+    {
+        m_compiledTemplates[msgNames[idx]].compile(m_templates[msgNames[idx]]);
+    }
     return true;
 }
 
@@ -1137,45 +1851,22 @@ std::string Exporter::getLocaleString(const std::string& key) const
     return it == m_localeStrings.cend() ? key : it->second;
 }
 
-std::string Exporter::buildContentFromTemplateValues(const TemplateValues& tv) const
+void Exporter::buildContentFromTemplateValues(const TemplateValues& tv, std::string& content) const
 {
-#if !defined(NDEBUG) && defined(SAMPLING_TMPL)
-    std::string alignment = "";
-#endif
-    std::string content = getTemplate(tv.getName());
-    for (TemplateValues::const_iterator it = tv.cbegin(); it != tv.cend(); ++it)
+    std::map<std::string, CompiledTemplate>::const_iterator it = m_compiledTemplates.find(tv.getName());
+    if (it == m_compiledTemplates.cend())
     {
-        if (startsWith(it->first, "%"))
-        {
-            replaceAll(content, it->first, it->second);
-        }
+        return;
+    }
 #if !defined(NDEBUG) && defined(SAMPLING_TMPL)
-        if (it->first == "%%ALIGNMENT%%")
-        {
-            alignment = it->second;
-        }
+    std::string::size_type pos = content.size();
 #endif
-    }
-    
-    std::string::size_type pos = 0;
-
-    while ((pos = content.find("%%", pos)) != std::string::npos)
-    {
-        std::string::size_type posEnd = content.find("%%", pos + 2);
-        if (posEnd == std::string::npos)
-        {
-            break;
-        }
-        
-        content.erase(pos, posEnd + 2 - pos);
-    }
+    it->second.render(tv, content);
     
 #if !defined(NDEBUG) && defined(SAMPLING_TMPL)
-    std::string fileName = "sample_" + tv.getName() + alignment + ".html";
-    writeFile(combinePath(m_output, "dbg", fileName), content);
+    std::string fileName = "sample_" + tv.getName() + tv.getValue(TPH_ALIGNMENT) + ".html";
+    writeFile(combinePath(m_output, "dbg", fileName), content.substr(pos));
 #endif
-    
-    return content;
 }
 
 void Exporter::notifyStart()
@@ -24,7 +24,11 @@
 
 class MessageParser;
 class TemplateValues;
+class CompiledTemplate;
 class ExportContext;
+struct SESSION_EXPORT_CONTEXT;
+class MediaStore;
+class HttpCache;
 
 class Exporter
 {
@@ -38,13 +42,17 @@ protected:
     WechatInfo m_wechatInfo;
     std::string m_backup;
     std::string m_output;
+    std::string m_cacheDir;
     Logger* m_logger;
     PdfConverter* m_pdfConverter;
     
     ITunesDb *m_iTunesDb;
     ITunesDb *m_iTunesDbShare;
+    std::string m_iTunesVersion;    // From the sessions snapshot when iTunes db is not loaded
+    std::string m_iOSVersion;
     
     std::map<std::string, std::string> m_templates;
+    std::map<std::string, CompiledTemplate> m_compiledTemplates;   // Templates of messages
     std::map<std::string, std::string> m_localeStrings;
 
     ExportNotifier* m_notifier;
@@ -62,6 +70,14 @@ protected:
     ExportContext*  m_exportContext;
     
     std::string m_languageCode;
+    
+    unsigned int m_numberOfSessionWorkers;
+    unsigned int m_numberOfAudioWorkers;
+    
+    MediaStore* m_mediaStore;
+    HttpCache* m_httpCache;
+    uint64_t m_httpCacheSize;
+    bool m_revalidatingHttpCache;
 
 public:
     Exporter(const std::string& workDir, const std::string& backup, const std::string& output, Logger* logger, PdfConverter* pdfConverter);
@@ -85,13 +101,25 @@ public:
     void setSyncLoading(bool syncLoading = true);
     void setLoadingDataOnScroll(bool loadingDataOnScroll = true);
     void setIncrementalExporting(bool incrementalExporting);
+    void setHardLinkingFiles(bool hardLinkingFiles);
+    void setDeduplicatingFiles(bool deduplicatingFiles);
     void supportsFilter(bool supportsFilter = true);
     void useRemoteEmoji(bool useEmojiUrl);
     void outputDebugLogs(bool outputDebugLogs);
     void setExtName(const std::string& extName);
     void setTemplatesName(const std::string& templatesName);
+    // Number of sessions exported concurrently, 0 for the number of cores
+    void setNumberOfSessionWorkers(unsigned int numberOfSessionWorkers);
+    // Number of voices converted into mp3 concurrently, 0 for the number of cores
+    void setNumberOfAudioWorkers(unsigned int numberOfAudioWorkers);
     
     void setLanguageCode(const std::string& languageCode);
+    // Directory for the local caches(snapshot of sessions list, stats of message dbs), output/.wxexp is used if it is not set
+    void setCacheDirectory(const std::string& cacheDir);
+    // Downloaded avatars and emojis are kept in the cache directory up to maxBytes for the later exportings,
+    // it is off by default(maxBytes = 0) and without a directory from setCacheDirectory.
+    // revalidating: send conditional requests for the cached ones instead of using them directly
+    void setHttpCache(uint64_t maxBytes, bool revalidating = false);
     
     std::string getITunesVersion() const;
     std::string getIOSVersion() const;
@@ -107,13 +135,19 @@ protected:
     bool exportUser(Friend& user, std::string& userOutputPath);
     // bool loadUserSessions(Friend& user, std::vector<Session>& sessions) const;
     bool loadUserFriendsAndSessions(const Friend& user, Friends& friends, std::vector<Session>& sessions, bool detailedInfo = true) const;
+    void exportSessions(SESSION_EXPORT_CONTEXT* context);
     int exportSession(const Friend& user, const MessageParser& msgParser, const Session& session, const std::string& userBase, const std::string& outputBase);
     
-    bool exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::vector<std::string>& messages);
+    std::string buildSessionFrame(const Friend& user, const Session& session, size_t pageSize, size_t numberOfMessages, size_t numberOfPages) const;
+    bool exportMessage(const Session& session, const std::vector<TemplateValues>& tvs, std::string& content);
 
     bool fillSession(Session& session, const Friends& friends) const;
     void releaseITunes();
     bool loadITunes(bool detailedInfo = true);
+    std::string getCacheDirectory() const;
+    std::string buildBackupFingerprint() const;
+    bool loadSessionsSnapshot(const std::string& fileName, const std::string& fingerprint);
+    void saveSessionsSnapshot(const std::string& fileName, const std::string& fingerprint) const;
     bool loadTemplates();
     bool loadStrings();
     std::string getTemplate(const std::string& key) const;
@@ -129,14 +163,10 @@ protected:
     void notifyTasksComplete(const std::string& usrName, bool cancelled = false);
     void notifyTasksProgress(const std::string& usrName, uint32_t numberOfCompletedTasks, uint32_t numberOfTotalTasks);
     bool buildFileNameForUser(Friend& user, std::set<std::string>& existingFileNames);
-    std::string buildContentFromTemplateValues(const TemplateValues& values) const;
+    void buildContentFromTemplateValues(const TemplateValues& values, std::string& content) const;
     
     bool filterITunesFile(const char * file, int flags) const;
     
-    void serializeMessages(const std::string& fileName, const std::vector<std::string>& messages);
-    void unserializeMessages(const std::string& fileName, std::vector<std::string>& messages);
-    void mergeMessages(const std::string& fileName, std::vector<std::string>& messages);
-    
     static bool loadExportContext(const std::string& contextFile, ExportContext *context);
     
     
@@ -26,6 +26,17 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fts.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#ifdef __APPLE__
+#include <copyfile.h>
+#endif
 #endif //  _WIN32
 
 size_t getFileSize(const std::string& path)
@@ -357,6 +368,157 @@ bool copyFile(const std::string& src, const std::string& dest, bool overwrite)
 #endif
 }
 
+#ifndef _WIN32
+static bool copyFileContent(int srcFd, int destFd, off_t size)
+{
+#ifdef __linux__
+#ifdef FICLONE
+    // Reflink on btrfs/xfs etc.
+    if (ioctl(destFd, FICLONE, srcFd) == 0)
+    {
+        return true;
+    }
+#endif
+    off_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t bytes = copy_file_range(srcFd, NULL, destFd, NULL, static_cast<size_t>(size - copied), 0);
+        if (bytes <= 0)
+        {
+            break;
+        }
+        copied += bytes;
+    }
+    if (copied == size)
+    {
+        return true;
+    }
+    // copy_file_range is not supported (old kernel or cross-filesystem), try sendfile from where it stopped
+    while (copied < size)
+    {
+        off_t offset = copied;
+        ssize_t bytes = sendfile(destFd, srcFd, &offset, static_cast<size_t>(size - copied));
+        if (bytes <= 0)
+        {
+            break;
+        }
+        copied += bytes;
+    }
+    if (copied == size)
+    {
+        return true;
+    }
+    if (lseek(srcFd, copied, SEEK_SET) != copied || lseek(destFd, copied, SEEK_SET) != copied)
+    {
+        return false;
+    }
+#elif defined(__APPLE__)
+    if (fcopyfile(srcFd, destFd, NULL, COPYFILE_DATA) == 0)
+    {
+        return true;
+    }
+    if (lseek(srcFd, 0, SEEK_SET) != 0 || lseek(destFd, 0, SEEK_SET) != 0)
+    {
+        return false;
+    }
+#endif
+    char buffer[64 * 1024];
+    ssize_t bytesRead = 0;
+    while ((bytesRead = read(srcFd, buffer, sizeof(buffer))) > 0)
+    {
+        char* ptr = buffer;
+        while (bytesRead > 0)
+        {
+            ssize_t bytesWritten = write(destFd, ptr, static_cast<size_t>(bytesRead));
+            if (bytesWritten <= 0)
+            {
+                return false;
+            }
+            ptr += bytesWritten;
+            bytesRead -= bytesWritten;
+        }
+    }
+    return bytesRead == 0;
+}
+#endif
+
+bool copyFile(const std::string& src, const std::string& dest, time_t mtime, int flags)
+{
+#ifdef _WIN32
+    CW2T pszSrc(CA2W(src.c_str(), CP_UTF8));
+    CW2T pszDest(CA2W(dest.c_str(), CP_UTF8));
+    // dest may be a hard link to src left by an earlier export, writing through it would truncate the backup
+    ::DeleteFile((LPCTSTR)pszDest);
+    if ((flags & COPY_FLAG_HARD_LINK) == COPY_FLAG_HARD_LINK)
+    {
+        if (::CreateHardLink((LPCTSTR)pszDest, (LPCTSTR)pszSrc, NULL))
+        {
+            return true;
+        }
+    }
+    if (!::CopyFile((LPCTSTR)pszSrc, (LPCTSTR)pszDest, FALSE))
+    {
+        return false;
+    }
+    if (mtime != 0)
+    {
+        updateFileTime(dest, mtime);
+    }
+    return true;
+#else
+    int srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (srcFd == -1)
+    {
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(srcFd, &st) != 0)
+    {
+        close(srcFd);
+        return false;
+    }
+    
+    // dest may be a hard link to src left by an earlier export, writing through it would truncate the backup
+    unlink(dest.c_str());
+    if ((flags & COPY_FLAG_HARD_LINK) == COPY_FLAG_HARD_LINK)
+    {
+        if (link(src.c_str(), dest.c_str()) == 0)
+        {
+            close(srcFd);
+            return true;
+        }
+        // EXDEV etc.: copy it
+    }
+    
+    int destFd = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (destFd == -1)
+    {
+        close(srcFd);
+        return false;
+    }
+    
+    bool result = copyFileContent(srcFd, destFd, st.st_size);
+    if (result && mtime != 0)
+    {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;  // keep atime unchanged
+        times[1].tv_sec = mtime;
+        times[1].tv_nsec = 0;
+        futimens(destFd, times);
+    }
+    
+    close(destFd);
+    close(srcFd);
+    if (!result)
+    {
+        unlink(dest.c_str());
+    }
+    return result;
+#endif
+}
+
 bool moveFile(const std::string& src, const std::string& dest, bool overwrite/* = true*/)
 {
 #ifndef NDEBUG
@@ -660,6 +822,190 @@ bool appendFile(const std::string& path, const unsigned char* data, size_t dataL
 #endif
 }
 
+bool openInputFile(std::ifstream& ifs, const std::string& path)
+{
+#ifdef _WIN32
+    CA2W pszW(path.c_str(), CP_UTF8);
+    ifs.open(pszW, std::ios::in | std::ios::binary);
+#else
+    ifs.open(path, std::ios::in | std::ios::binary);
+#endif
+    return ifs.is_open();
+}
+
+bool openOutputFile(std::ofstream& ofs, const std::string& path, bool append/* = false*/)
+{
+    std::ios_base::openmode mode = std::ios::out | std::ios::binary | (append ? std::ios::app : std::ios::trunc);
+#ifdef _WIN32
+    CA2W pszW(path.c_str(), CP_UTF8);
+    ofs.open(pszW, mode);
+#else
+    ofs.open(path, mode);
+#endif
+    return ofs.is_open();
+}
+
+FileWriter::FileWriter(size_t bufferSize/* = DEFAULT_BUFFER_SIZE*/) : m_bufferSize(bufferSize), m_failed(false)
+#ifdef _WIN32
+    , m_handle(INVALID_HANDLE_VALUE)
+#else
+    , m_fd(-1)
+#endif
+{
+}
+
+FileWriter::~FileWriter()
+{
+    closeHandle();
+}
+
+void FileWriter::open(const std::string& path)
+{
+    closeHandle();
+    m_path = path;
+    m_buffer.clear();
+    m_failed = false;
+}
+
+bool FileWriter::write(const void *data, size_t length)
+{
+    if (m_failed || m_path.empty())
+    {
+        return false;
+    }
+    const unsigned char *ptr = reinterpret_cast<const unsigned char *>(data);
+    if (m_buffer.size() + length <= m_bufferSize)
+    {
+        if (m_buffer.capacity() < m_bufferSize)
+        {
+            m_buffer.reserve(m_bufferSize);
+        }
+        m_buffer.insert(m_buffer.end(), ptr, ptr + length);
+        return true;
+    }
+    
+    if (!m_buffer.empty())
+    {
+        if (!writeHandle(&m_buffer[0], m_buffer.size()))
+        {
+            return false;
+        }
+        m_buffer.clear();
+    }
+    // Large chunks go to the handle directly
+    if (length >= m_bufferSize)
+    {
+        return writeHandle(ptr, length);
+    }
+    m_buffer.insert(m_buffer.end(), ptr, ptr + length);
+    return true;
+}
+
+bool FileWriter::close(time_t mtime/* = 0*/)
+{
+    if (m_path.empty())
+    {
+        return false;
+    }
+    bool result = !m_failed && openHandle();
+    if (result && !m_buffer.empty())
+    {
+        result = writeHandle(&m_buffer[0], m_buffer.size());
+    }
+    m_buffer.clear();
+    if (result && mtime != 0)
+    {
+#ifdef _WIN32
+        FILETIME ft;
+        LONGLONG ll = static_cast<LONGLONG>(mtime) * 10000000 + 116444736000000000LL;  // 100ns since 1601
+        ft.dwLowDateTime = static_cast<DWORD>(ll);
+        ft.dwHighDateTime = static_cast<DWORD>(ll >> 32);
+        ::SetFileTime(m_handle, NULL, NULL, &ft);
+#else
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;  // keep atime unchanged
+        times[1].tv_sec = mtime;
+        times[1].tv_nsec = 0;
+        futimens(m_fd, times);
+#endif
+    }
+    closeHandle();
+    m_path.clear();
+    return result;
+}
+
+bool FileWriter::openHandle()
+{
+#ifdef _WIN32
+    if (m_handle != INVALID_HANDLE_VALUE)
+    {
+        return true;
+    }
+    CW2T pszT(CA2W(m_path.c_str(), CP_UTF8));
+    m_handle = ::CreateFile((LPCTSTR)pszT, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    m_failed = (m_handle == INVALID_HANDLE_VALUE);
+#else
+    if (m_fd != -1)
+    {
+        return true;
+    }
+    m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    m_failed = (m_fd == -1);
+#endif
+    return !m_failed;
+}
+
+bool FileWriter::writeHandle(const unsigned char *data, size_t length)
+{
+    if (!openHandle())
+    {
+        return false;
+    }
+    while (length > 0)
+    {
+#ifdef _WIN32
+        DWORD bytesWritten = 0;
+        if (!::WriteFile(m_handle, data, static_cast<DWORD>(length), &bytesWritten, NULL) || bytesWritten == 0)
+        {
+            m_failed = true;
+            return false;
+        }
+#else
+        ssize_t bytesWritten = ::write(m_fd, data, length);
+        if (bytesWritten <= 0)
+        {
+            if (bytesWritten == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            m_failed = true;
+            return false;
+        }
+#endif
+        data += bytesWritten;
+        length -= static_cast<size_t>(bytesWritten);
+    }
+    return true;
+}
+
+void FileWriter::closeHandle()
+{
+#ifdef _WIN32
+    if (m_handle != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_fd != -1)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+#endif
+}
+
 std::string combinePath(const std::string& p1, const std::string& p2)
 {
     if (p1.empty() && p2.empty())
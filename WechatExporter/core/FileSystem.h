@@ -11,6 +11,8 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
+#include <ctime>
 
 #ifdef _WIN32
 #define DIR_SEP '\\'
@@ -30,6 +32,9 @@ bool deleteDirectory(const std::string& path);
 bool existsFile(const std::string& path);
 bool listSubDirectories(const std::string& path, std::vector<std::string>& subDirectories);
 bool copyFile(const std::string& src, const std::string& dest, bool overwrite = true);
+#define COPY_FLAG_HARD_LINK     1   // Hard link the file when src and dest are on the same volume, mtime is left untouched for links
+// Overwrites dest with the fastest way the platform provides (reflink/copy_file_range/sendfile) and sets mtime (0 to skip) on it
+bool copyFile(const std::string& src, const std::string& dest, time_t mtime, int flags);
 bool moveFile(const std::string& src, const std::string& dest, bool overwrite = true);
 // ref: https://blackbeltreview.wordpress.com/2015/01/27/illegal-filename-characters-on-windows-vs-mac-os/
 bool isValidFileName(const std::string& fileName);
@@ -42,6 +47,44 @@ bool writeFile(const std::string& path, const std::string& data);
 bool writeFile(const std::string& path, const unsigned char* data, size_t dataLength);
 bool appendFile(const std::string& path, const std::string& data);
 bool appendFile(const std::string& path, const unsigned char* data, size_t dataLength);
+// Open streams with utf8 path
+bool openInputFile(std::ifstream& ifs, const std::string& path);
+bool openOutputFile(std::ofstream& ofs, const std::string& path, bool append = false);
+
+// Writes a file through one handle kept open until close, small writes are gathered in the buffer.
+// The file is not created until the buffer is full or close is called, so a small file costs a single write
+class FileWriter
+{
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+    
+    FileWriter(size_t bufferSize = DEFAULT_BUFFER_SIZE);
+    ~FileWriter();
+    
+    void open(const std::string& path);
+    bool write(const void *data, size_t length);
+    // Flushes the buffer and sets mtime (0 to skip) on the handle before closing it
+    bool close(time_t mtime = 0);
+    
+private:
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+    
+    bool openHandle();
+    bool writeHandle(const unsigned char *data, size_t length);
+    void closeHandle();
+    
+private:
+    std::string m_path;
+    std::vector<unsigned char> m_buffer;
+    size_t m_bufferSize;
+    bool m_failed;
+#ifdef _WIN32
+    void *m_handle;
+#else
+    int m_fd;
+#endif
+};
 
 
 
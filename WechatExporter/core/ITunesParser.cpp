@@ -12,6 +12,8 @@
 #include <sys/types.h>
 #include <sqlite3.h>
 #include <algorithm>
+#include <thread>
+#include <atomic>
 #include <plist/plist.h>
 #include <libxml/tree.h>
 #include <libxml/parser.h>
@@ -52,10 +54,198 @@ struct __string_less
     // _LIBCPP_INLINE_VISIBILITY _LIBCPP_CONSTEXPR_AFTER_CXX11
     bool operator()(const std::string& __x, const std::string& __y) const {return __x < __y;}
     bool operator()(const std::pair<std::string, std::string>& __x, const std::string& __y) const {return __x.first < __y;}
-    bool operator()(const ITunesFile* __x, const std::string& __y) const {return __x->relativePath < __y;}
-    bool operator()(const ITunesFile* __x, const ITunesFile* __y) const {return __x->relativePath < __y->relativePath;}
+    bool operator()(const ITunesFile& __x, const ITunesFile& __y) const {return __x.compare(__y.relativePath, __y.relativePathLength) < 0;}
 };
 
+static const uint32_t INVALID_FILE_INDEX = 0xFFFFFFFF;
+
+// FNV-1a, backslashes are hashed as slashes so the query path doesn't have to be rewritten
+inline uint32_t hashPath(const char *path, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        hash ^= static_cast<unsigned char>(path[idx] == '\\' ? '/' : path[idx]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline bool equalsPath(const ITunesFile& file, const char *path, size_t length)
+{
+    if (file.relativePathLength != length)
+    {
+        return false;
+    }
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        if (file.relativePath[idx] != (path[idx] == '\\' ? '/' : path[idx]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline int hexValue(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static bool parseFileId(const char *hex, size_t length, unsigned char *fileId)
+{
+    if (NULL == hex || length != 40)
+    {
+        return false;
+    }
+    for (size_t idx = 0; idx < 20; ++idx)
+    {
+        int high = hexValue(hex[idx * 2]);
+        int low = hexValue(hex[idx * 2 + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        fileId[idx] = static_cast<unsigned char>((high << 4) | low);
+    }
+    return true;
+}
+
+std::string ITunesFile::getFileId() const
+{
+    return hexEncode(fileId, SHA1_DIGEST_SIZE);
+}
+
+struct FILE_BLOB
+{
+    size_t fileIndex;
+    size_t offset;
+    size_t length;
+};
+
+// Decode the blobs on all cores, the plist parsing dominates the loading of big manifests
+static void parseFileBlobs(const std::vector<FILE_BLOB>& blobs, const std::vector<unsigned char>& data, std::vector<ITunesFile>& files)
+{
+    if (blobs.empty())
+    {
+        return;
+    }
+    
+    size_t numberOfWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    // Not worth a thread for small domains
+    numberOfWorkers = std::min(numberOfWorkers, (blobs.size() + 1023) / 1024);
+    
+    std::atomic<size_t> next(0);
+    auto worker = [&blobs, &data, &files, &next]()
+    {
+        const size_t batchSize = 256;
+        size_t begin = 0;
+        while ((begin = next.fetch_add(batchSize)) < blobs.size())
+        {
+            size_t end = std::min(begin + batchSize, blobs.size());
+            for (size_t idx = begin; idx < end; ++idx)
+            {
+                const FILE_BLOB& blob = blobs[idx];
+                ITunesDb::parseFileInfo(&data[blob.offset], blob.length, files[blob.fileIndex]);
+            }
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    for (size_t idx = 1; idx < numberOfWorkers; ++idx)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+}
+
+struct MBDB_ENTRY
+{
+    size_t offset;      // Offset of the record in Manifest.mbdb
+    const char *path;   // Points into the mapped file
+    size_t pathLength;
+    int flags;          // 1: file, 2: directory, 0: skipped
+    unsigned int modifiedTime;
+    uint64_t size;
+    unsigned char fileId[SHA1_DIGEST_SIZE];
+};
+
+// Second pass over the records found by the first scan, the filter and sha1 of domain-path are run on all cores
+static void parseMbdbEntries(const MbdbReader& reader, bool onlyFile, const std::function<bool(const char *, int)>& loadingFilter, std::vector<MBDB_ENTRY>& entries)
+{
+    if (entries.empty())
+    {
+        return;
+    }
+    
+    size_t numberOfWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    numberOfWorkers = std::min(numberOfWorkers, (entries.size() + 4095) / 4096);
+    bool hasFilter = (bool)loadingFilter;
+    
+    std::atomic<size_t> next(0);
+    auto worker = [&reader, onlyFile, hasFilter, &loadingFilter, &entries, &next]()
+    {
+        const size_t batchSize = 1024;
+        std::string fileKey;    // domain-path, the path part is also the NUL-terminated string for the filter
+        MBDB_RECORD record;
+        size_t begin = 0;
+        while ((begin = next.fetch_add(batchSize)) < entries.size())
+        {
+            size_t end = std::min(begin + batchSize, entries.size());
+            for (size_t idx = begin; idx < end; ++idx)
+            {
+                MBDB_ENTRY& entry = entries[idx];
+                entry.flags = 0;
+                if (!reader.readRecordAt(entry.offset, record))
+                {
+                    continue;
+                }
+                
+                bool isDir = S_ISDIR(record.getMode());
+                if (onlyFile && isDir)
+                {
+                    continue;
+                }
+                
+                fileKey.assign(record.domain.data, record.domain.length);
+                fileKey.push_back('-');
+                fileKey.append(record.path.data, record.path.length);
+                if (hasFilter && !loadingFilter(fileKey.c_str() + record.domain.length + 1, (isDir ? 2 : 1)))
+                {
+                    continue;
+                }
+                
+                sha1(fileKey.c_str(), fileKey.size(), entry.fileId);
+                entry.path = record.path.data;
+                entry.pathLength = record.path.length;
+                entry.flags = isDir ? 2 : 1;
+                unsigned int aTime = record.getUInt32(18);
+                unsigned int bTime = record.getUInt32(22);
+                entry.modifiedTime = aTime != 0 ? aTime : bTime;
+                entry.size = isDir ? 0 : record.getFileLength();
+            }
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    for (size_t idx = 1; idx < numberOfWorkers; ++idx)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+}
+
 struct PlistDictionary
 {
     PlistDictionary(const std::vector<std::string>& tags, const std::vector<std::string>& nodeNames) : m_tags(tags)
@@ -140,7 +330,7 @@ inline std::string PlistDictionary::toString(const xmlChar* ch, int len)
     return std::string(p, p + len);
 }
 
-ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileName) : m_isMbdb(false), m_rootPath(rootPath), m_manifestFileName(manifestFileName)
+ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileName) : m_isMbdb(false), m_copyFlags(0), m_rootPath(rootPath), m_manifestFileName(manifestFileName)
 {
     std::replace(m_rootPath.begin(), m_rootPath.end(), ALT_DIR_SEP, DIR_SEP);
     
@@ -152,11 +342,55 @@ ITunesDb::ITunesDb(const std::string& rootPath, const std::string& manifestFileN
 
 ITunesDb::~ITunesDb()
 {
-    for (std::vector<ITunesFile *>::iterator it = m_files.begin(); it != m_files.end(); ++it)
+    clearFiles();
+}
+
+void ITunesDb::clearFiles()
+{
+    m_files.clear();
+    m_stringPool.clear();
+    m_pathIndex.clear();
+}
+
+void ITunesDb::addFile(const char *relativePath, size_t length, std::vector<size_t>& pathOffsets)
+{
+    // Paths are appended to one pool and the pointers are fixed up in buildIndex once the pool stops growing
+    pathOffsets.push_back(m_stringPool.size());
+    if (length > 0)
     {
-        delete *it;
+        m_stringPool.insert(m_stringPool.end(), relativePath, relativePath + length);
+    }
+    m_stringPool.push_back('\0');
+    
+    m_files.push_back(ITunesFile());
+    m_files.back().relativePathLength = static_cast<uint32_t>(length);
+}
+
+void ITunesDb::buildIndex(const std::vector<size_t>& pathOffsets)
+{
+    for (size_t idx = 0; idx < m_files.size(); ++idx)
+    {
+        m_files[idx].relativePath = &m_stringPool[pathOffsets[idx]];
+    }
+    
+    std::sort(m_files.begin(), m_files.end(), __string_less());
+    
+    size_t capacity = 16;
+    while (capacity < m_files.size() * 2)
+    {
+        capacity <<= 1;
+    }
+    m_pathIndex.assign(capacity, INVALID_FILE_INDEX);
+    const size_t mask = capacity - 1;
+    for (size_t idx = 0; idx < m_files.size(); ++idx)
+    {
+        size_t pos = hashPath(m_files[idx].relativePath, m_files[idx].relativePathLength) & mask;
+        while (m_pathIndex[pos] != INVALID_FILE_INDEX)
+        {
+            pos = (pos + 1) & mask;
+        }
+        m_pathIndex[pos] = static_cast<uint32_t>(idx);
     }
-    m_files.clear();
 }
 
 bool ITunesDb::load()
@@ -172,6 +406,7 @@ bool ITunesDb::load(const std::string& domain)
 bool ITunesDb::load(const std::string& domain, bool onlyFile)
 {
     m_version.clear();
+    clearFiles();
     BackupManifest manifest;
     if (ManifestParser::parseInfoPlist(m_rootPath, manifest))
     {
@@ -237,7 +472,13 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
     
     bool hasFilter = (bool)m_loadingFilter;
     
+    // Blobs are only kept until LastModified and Size are decoded, in one buffer to save the allocations
+    std::vector<FILE_BLOB> blobs;
+    std::vector<unsigned char> blobData;
+    std::vector<size_t> pathOffsets;
+    
     m_files.reserve(2048);
+    pathOffsets.reserve(2048);
     while (sqlite3_step(stmt) == SQLITE_ROW)
     {
         int flags = sqlite3_column_int(stmt, 2);
@@ -254,18 +495,18 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
             continue;
         }
         
-        ITunesFile *file = new ITunesFile();
-        const char *fileId = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        if (NULL != fileId)
+        // The path in the backup comes from the id, an entry without a valid one can't be read
+        const char *fileIdHex = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        unsigned char fileId[SHA1_DIGEST_SIZE];
+        if (!parseFileId(fileIdHex, NULL == fileIdHex ? 0 : static_cast<size_t>(sqlite3_column_bytes(stmt, 0)), fileId))
         {
-            file->fileId = fileId;
+            continue;
         }
         
-        if (NULL != relativePath)
-        {
-            file->relativePath = relativePath;
-        }
-        file->flags = static_cast<unsigned int>(flags);
+        addFile(relativePath, NULL == relativePath ? 0 : static_cast<size_t>(sqlite3_column_bytes(stmt, 1)), pathOffsets);
+        ITunesFile& file = m_files.back();
+        std::memcpy(file.fileId, fileId, SHA1_DIGEST_SIZE);
+        file.flags = static_cast<unsigned int>(flags);
         if (flags == 1)
         {
             // Files
@@ -273,12 +514,11 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
             const unsigned char *blob = reinterpret_cast<const unsigned char*>(sqlite3_column_blob(stmt, 3));
             if (blobBytes > 0 && NULL != blob)
             {
-                std::vector<unsigned char> blobVector(blob, blob + blobBytes);
-                file->blob.swap(blobVector);
+                FILE_BLOB fileBlob = { m_files.size() - 1, blobData.size(), static_cast<size_t>(blobBytes) };
+                blobData.insert(blobData.end(), blob, blob + blobBytes);
+                blobs.push_back(fileBlob);
             }
         }
-        
-        m_files.push_back(file);
     }
     
     sqlite3_finalize(stmt);
@@ -288,7 +528,13 @@ bool ITunesDb::load(const std::string& domain, bool onlyFile)
     printf("PERF: end.....%s, size=%lu\r\n", getTimestampString(false, true).c_str(), m_files.size());
 #endif
     
-    std::sort(m_files.begin(), m_files.end(), __string_less());
+    parseFileBlobs(blobs, blobData, m_files);
+    
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    printf("PERF: after parsing blobs.....%s, blobs=%lu\r\n", getTimestampString(false, true).c_str(), blobs.size());
+#endif
+    
+    buildIndex(pathOffsets);
     
 #if !defined(NDEBUG) || defined(DBG_PERF)
     printf("PERF: after sort.....%s\r\n", getTimestampString(false, true).c_str());
@@ -304,155 +550,86 @@ bool ITunesDb::loadMbdb(const std::string& domain, bool onlyFile)
         return false;
     }
     
-    // unsigned char mdbxBuffer[26];           // buffer for .mbdx record
-    unsigned char fixedData[40] = { 0 };    // buffer for the fixed part of .mbdb record
-    // SHA1CryptoServiceProvider hasher = new SHA1CryptoServiceProvider();
-
-    // System.DateTime unixEpoch = new System.DateTime(1970, 1, 1, 0, 0, 0, 0, DateTimeKind.Utc);
-
-    std::string domainInFile;
-    std::string path;
-    std::string linkTarget;
-    std::string dataHash;
-    std::string alwaysNull;
-    unsigned short fileMode = 0;
-    bool isDir = false;
-    bool skipped = false;
-    
-    bool hasFilter = (bool)m_loadingFilter;
-
+    // First pass: only the lengths are read to find the records of the domain
+    std::vector<MBDB_ENTRY> entries;
+    MBDB_STRING domainInFile;
     while (reader.hasMoreData())
     {
-        if (!reader.read(domainInFile))
+        size_t offset = reader.getPosition();
+        if (!reader.nextRecord(domainInFile))
         {
             break;
         }
         
-        skipped = false;
-        if (!domain.empty() && domain != domainInFile)
+        if (domain.empty() || domainInFile.equals(domain))
         {
-            skipped = true;
+            entries.push_back(MBDB_ENTRY());
+            entries.back().offset = offset;
         }
-        
-        if (skipped)
-        {
-            // will skip it
-            reader.skipString();    // path
-            reader.skipString();    // linkTarget
-            reader.skipString();    // dataHash
-            reader.skipString();    // alwaysNull;
-            
-            reader.read(fixedData, 40);
-            int propertyCount = fixedData[39];
-
-            for (int j = 0; j < propertyCount; ++j)
-            {
-                reader.skipString();
-                reader.skipString();
-            }
-        }
-        else
+    }
+    
+#if !defined(NDEBUG) || defined(DBG_PERF)
+    printf("PERF: mbdb scanned.....%s, records=%lu\r\n", getTimestampString(false, true).c_str(), entries.size());
+#endif
+    
+    parseMbdbEntries(reader, onlyFile, m_loadingFilter, entries);
+    
+    std::vector<size_t> pathOffsets;
+    pathOffsets.reserve(entries.size());
+    m_files.reserve(entries.size());
+    for (std::vector<MBDB_ENTRY>::const_iterator it = entries.cbegin(); it != entries.cend(); ++it)
+    {
+        if (it->flags == 0)
         {
-            reader.read(path);
-            reader.read(linkTarget);
-            reader.readD(dataHash);
-            reader.readD(alwaysNull);
-            
-            reader.read(fixedData, 40);
-
-            fileMode = (fixedData[0] << 8) | fixedData[1];
-            
-            isDir = S_ISDIR(fileMode);
-            
-            // unsigned char flags = fixedData[38];
-            
-            if (onlyFile && isDir)
-            {
-                skipped = true;
-            }
-            
-            if (hasFilter && !m_loadingFilter(path.c_str(), (isDir ? 2 : 1)))
-            {
-                skipped = true;
-            }
-            
-            unsigned int aTime = GetBigEndianInteger(fixedData, 18);
-            unsigned int bTime = GetBigEndianInteger(fixedData, 22);
-            // unsigned int cTime = GetBigEndianInteger(fixedData, 26);
-            
-            int propertyCount = fixedData[39];
-            
-            // rec.Properties = new MBFileRecord.Property[rec.PropertyCount];
-            for (int j = 0; j < propertyCount; ++j)
-            {
-                if (skipped)
-                {
-                    reader.skipString(); // name
-                    reader.skipString(); // value
-                }
-                else
-                {
-                    std::string name;
-                    std::string value;
-                    
-                    reader.read(name);
-                    reader.read(value);
-                }
-                
-            }
-            /*
-            StringBuilder fileName = new StringBuilder();
-            byte[] fb = hasher.ComputeHash(ASCIIEncoding.UTF8.GetBytes(rec.Domain + "-" + rec.Path));
-            for (int k = 0; k < fb.Length; k++)
-            {
-                fileName.Append(fb[k].ToString("x2"));
-            }
-
-            rec.key = fileName.ToString();
-             */
-            
-            if (!skipped)
-            {
-                ITunesFile *file = new ITunesFile();
-                file->relativePath = path;
-                file->fileId = sha1(domain + "-" + path);
-                file->flags = isDir ? 2 : 1;
-                file->modifiedTime = aTime != 0 ? aTime : bTime;
-                
-                m_files.push_back(file);
-            }
-            
+            continue;
         }
-        
-        
+        addFile(it->path, it->pathLength, pathOffsets);
+        ITunesFile& file = m_files.back();
+        std::memcpy(file.fileId, it->fileId, SHA1_DIGEST_SIZE);
+        file.flags = it->flags;
+        file.modifiedTime = it->modifiedTime;
+        file.size = it->size;
     }
     
-    std::sort(m_files.begin(), m_files.end(), __string_less());
+    buildIndex(pathOffsets);
 
     return true;
 }
 
-unsigned int ITunesDb::parseModifiedTime(const std::vector<unsigned char>& data)
+bool ITunesDb::parseFileInfo(const unsigned char *data, size_t length, ITunesFile& file)
 {
-    if (data.empty())
+    if (NULL == data || 0 == length)
     {
-        return 0;
+        return false;
     }
-    uint64_t val = 0;
     plist_t node = NULL;
-    plist_from_memory(reinterpret_cast<const char *>(&data[0]), static_cast<uint32_t>(data.size()), &node);
-    if (NULL != node)
+    plist_from_memory(reinterpret_cast<const char *>(data), static_cast<uint32_t>(length), &node);
+    if (NULL == node)
     {
-        plist_t lastModified = plist_access_path(node, 3, "$objects", 1, "LastModified");
-        if (NULL != lastModified)
+        return false;
+    }
+    
+    plist_t fileNode = plist_access_path(node, 2, "$objects", 1);
+    if (NULL != fileNode)
+    {
+        uint64_t val = 0;
+        plist_t valNode = plist_dict_get_item(fileNode, "LastModified");
+        if (NULL != valNode)
         {
-            plist_get_uint_val(lastModified, &val);
+            plist_get_uint_val(valNode, &val);
+            file.modifiedTime = static_cast<unsigned int>(val);
+        }
+        val = 0;
+        valNode = plist_dict_get_item(fileNode, "Size");
+        if (NULL != valNode)
+        {
+            plist_get_uint_val(valNode, &val);
+            file.size = val;
         }
-        
-        plist_free(node);
     }
-
-    return static_cast<unsigned int>(val);
+    
+    plist_free(node);
+    return NULL != fileNode;
 }
 
 std::string ITunesDb::findFileId(const std::string& relativePath) const
@@ -463,21 +640,28 @@ std::string ITunesDb::findFileId(const std::string& relativePath) const
     {
         return std::string();
     }
-    return file->fileId;
+    return file->getFileId();
 }
 
 const ITunesFile* ITunesDb::findITunesFile(const std::string& relativePath) const
 {
-    std::string formatedPath = relativePath;
-    std::replace(formatedPath.begin(), formatedPath.end(), '\\', '/');
-
-    typename std::vector<ITunesFile *>::iterator it = std::lower_bound(m_files.begin(), m_files.end(), formatedPath, __string_less());
-    
-    if (it == m_files.end() || (*it)->relativePath != formatedPath)
+    if (m_pathIndex.empty())
     {
         return NULL;
     }
-    return *it;
+    
+    const size_t mask = m_pathIndex.size() - 1;
+    size_t pos = hashPath(relativePath.c_str(), relativePath.size()) & mask;
+    while (m_pathIndex[pos] != INVALID_FILE_INDEX)
+    {
+        const ITunesFile& file = m_files[m_pathIndex[pos]];
+        if (equalsPath(file, relativePath.c_str(), relativePath.size()))
+        {
+            return &file;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
 }
 
 std::string ITunesDb::fileIdToRealPath(const std::string& fileId) const
@@ -490,6 +674,22 @@ std::string ITunesDb::fileIdToRealPath(const std::string& fileId) const
     return std::string();
 }
 
+std::string ITunesDb::fileIdToRealPath(const unsigned char *fileId) const
+{
+    // root/ab/ab...
+    std::string realPath = m_rootPath;
+    size_t pos = realPath.size();
+    if (!m_isMbdb)
+    {
+        realPath.append(3, DIR_SEP);
+        hexEncode(fileId, 1, &realPath[pos]);
+        pos += 3;
+    }
+    realPath.append(SHA1_DIGEST_SIZE * 2, '0');
+    hexEncode(fileId, SHA1_DIGEST_SIZE, &realPath[pos]);
+    return realPath;
+}
+
 std::string ITunesDb::getRealPath(const ITunesFile& file) const
 {
     return fileIdToRealPath(file.fileId);
@@ -515,22 +715,7 @@ bool ITunesDb::copyFile(const std::string& vpath, const std::string& dest, bool
     }
     
     const ITunesFile* file = findITunesFile(vpath);
-    if (NULL != file)
-    {
-        std::string srcPath = getRealPath(*file);
-        if (!srcPath.empty())
-        {
-            normalizePath(srcPath);
-            bool result = ::copyFile(srcPath, destPath, true);
-            if (result)
-            {
-                updateFileTime(dest, ITunesDb::parseModifiedTime(file->blob));
-            }
-            return result;
-        }
-    }
-    
-    return false;
+    return NULL != file && copyFile(file, destPath);
 }
 
 bool ITunesDb::copyFile(const std::string& vpath, const std::string& destPath, const std::string& destFileName, bool overwrite/* = false*/) const
@@ -544,33 +729,34 @@ bool ITunesDb::copyFile(const std::string& vpath, const std::string& destPath, c
     const ITunesFile* file = findITunesFile(vpath);
     if (NULL != file)
     {
-        std::string srcPath = getRealPath(*file);
-        if (!srcPath.empty())
+        if (!existsDirectory(destPath))
         {
-            normalizePath(srcPath);
-            if (!existsDirectory(destPath))
-            {
-                makeDirectory(destPath);
-            }
-            bool result = ::copyFile(srcPath, destFullPath, true);
-            if (result)
-            {
-                if (file->modifiedTime != 0)
-                {
-                    updateFileTime(destFullPath, static_cast<time_t>(file->modifiedTime));
-                }
-                else if (!file->blob.empty())
-                {
-                    updateFileTime(destFullPath, ITunesDb::parseModifiedTime(file->blob));
-                }
-            }
-            return result;
+            makeDirectory(destPath);
         }
+        return copyFile(file, destFullPath);
     }
     
     return false;
 }
 
+bool ITunesDb::copyFile(const ITunesFile* file, const std::string& destFullPath) const
+{
+    std::string srcPath = getRealPath(*file);
+    if (srcPath.empty())
+    {
+        return false;
+    }
+    normalizePath(srcPath);
+    
+    // The time is applied on the open file descriptor, no extra path lookup
+    return ::copyFile(srcPath, destFullPath, getModifiedTime(*file), m_copyFlags);
+}
+
+time_t ITunesDb::getModifiedTime(const ITunesFile& file)
+{
+    return static_cast<time_t>(file.modifiedTime);
+}
+
 ManifestParser::ManifestParser(const std::string& manifestPath) : m_manifestPath(manifestPath)
 {
 }
@@ -13,33 +13,72 @@
 #include <sstream>
 #include <iomanip>
 #include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include "Utils.h"
+#include "FileSystem.h"
 
 #ifndef ITunesParser_h
 #define ITunesParser_h
 
+// Fixed-size record, the path lives in the string pool of ITunesDb and fileId is the binary sha1
 struct ITunesFile
 {
-    std::string fileId;
-    std::string relativePath;
+    const char *relativePath;
+    uint64_t size;
+    uint32_t relativePathLength;
     unsigned int flags;
     unsigned int modifiedTime;
-    std::vector<unsigned char> blob;
+    unsigned char fileId[20];
     
-    ITunesFile() : flags(0), modifiedTime(0)
+    ITunesFile() : relativePath(""), size(0), relativePathLength(0), flags(0), modifiedTime(0)
     {
+        std::memset(fileId, 0, sizeof(fileId));
     }
     
     bool isDir() const
     {
         return flags == 2;
     }
+    
+    std::string getRelativePath() const
+    {
+        return std::string(relativePath, relativePathLength);
+    }
+    
+    std::string getFileId() const;
+    
+    int compare(const char *path, size_t length) const
+    {
+        int result = std::memcmp(relativePath, path, std::min(static_cast<size_t>(relativePathLength), length));
+        if (result != 0)
+        {
+            return result;
+        }
+        return relativePathLength < length ? -1 : (relativePathLength > length ? 1 : 0);
+    }
+    
+    int compare(const std::string& path) const
+    {
+        return compare(path.c_str(), path.size());
+    }
+    
+    bool startsWith(const std::string& prefix) const
+    {
+        return relativePathLength >= prefix.size() && std::memcmp(relativePath, prefix.c_str(), prefix.size()) == 0;
+    }
+    
+    bool endsWith(const std::string& suffix) const
+    {
+        return relativePathLength >= suffix.size() && std::memcmp(relativePath + relativePathLength - suffix.size(), suffix.c_str(), suffix.size()) == 0;
+    }
 };
 
 using ITunesFileVector = std::vector<ITunesFile *>;
-using ITunesFilesIterator = typename ITunesFileVector::iterator;
 using ITunesFilesConstIterator = typename ITunesFileVector::const_iterator;
-using ITunesFileRange = std::pair<ITunesFilesConstIterator, ITunesFilesConstIterator>;
+using ITunesFilesIterator = typename std::vector<ITunesFile>::iterator;
+using ITunesFileRange = std::pair<ITunesFilesIterator, ITunesFilesIterator>;
 
 class BackupManifest
 {
@@ -168,6 +207,17 @@ public:
         m_loadingFilter = std::move(loadingFilter);
     }
     
+    // Hard link the files into the output instead of copying when they are on the same volume
+    void setHardLinkingFiles(bool hardLinking)
+    {
+        m_copyFlags = hardLinking ? (m_copyFlags | COPY_FLAG_HARD_LINK) : (m_copyFlags & ~COPY_FLAG_HARD_LINK);
+    }
+    
+    int getCopyFlags() const
+    {
+        return m_copyFlags;
+    }
+    
     bool load();
     bool load(const std::string& domain);
     bool load(const std::string& domain, bool onlyFile);
@@ -184,17 +234,29 @@ public:
     std::string getRealPath(const ITunesFile& file) const;
     std::string getRealPath(const ITunesFile* file) const;
     
-    static unsigned int parseModifiedTime(const std::vector<unsigned char>& data);
+    // Decode LastModified and Size from the NSKeyedArchiver blob in the `file` column of Manifest.db
+    static bool parseFileInfo(const unsigned char *data, size_t length, ITunesFile& file);
+    static time_t getModifiedTime(const ITunesFile& file);
     bool copyFile(const std::string& vpath, const std::string& dest, bool overwrite = false) const;
     bool copyFile(const std::string& vpath, const std::string& destPath, const std::string& destFileName, bool overwrite = false) const;
     
 protected:
     bool loadMbdb(const std::string& domain, bool onlyFile);
+    void clearFiles();
+    void addFile(const char *relativePath, size_t length, std::vector<size_t>& pathOffsets);
+    void buildIndex(const std::vector<size_t>& pathOffsets);
     std::string fileIdToRealPath(const std::string& fileId) const;
+    std::string fileIdToRealPath(const unsigned char *fileId) const;
+    bool copyFile(const ITunesFile* file, const std::string& destFullPath) const;
     
 protected:
     bool m_isMbdb;
-    mutable std::vector<ITunesFile *> m_files;
+    int m_copyFlags;
+    // Records sorted by relativePath for the prefix ranges of filter()
+    mutable std::vector<ITunesFile> m_files;
+    std::vector<char> m_stringPool;
+    // Open addressing table of record indexes for exact path lookups
+    std::vector<uint32_t> m_pathIndex;
     std::string m_rootPath;
     std::string m_manifestFileName;
     std::string m_version;
@@ -206,14 +268,14 @@ template<class TFilter>
 ITunesFileVector ITunesDb::filter(TFilter f) const
 {
     ITunesFileVector files;
-    ITunesFileRange range = std::equal_range(m_files.cbegin(), m_files.cend(), f, f);
+    ITunesFileRange range = std::equal_range(m_files.begin(), m_files.end(), f, f);
     if (range.first != range.second)
     {
-        for (ITunesFilesConstIterator it = range.first; it != range.second; ++it)
+        for (ITunesFilesIterator it = range.first; it != range.second; ++it)
         {
-            if (f == *it)
+            if (f == &(*it))
             {
-                files.push_back(*it);
+                files.push_back(&(*it));
             }
         }
     }
@@ -224,9 +286,9 @@ ITunesFileVector ITunesDb::filter(TFilter f) const
 template<class THandler>
 void ITunesDb::enumFiles(THandler handler) const
 {
-    for (ITunesFilesConstIterator it = m_files.cbegin(); it != m_files.cend(); ++it)
+    for (std::vector<ITunesFile>::const_iterator it = m_files.cbegin(); it != m_files.cend(); ++it)
     {
-        if (!handler(*it))
+        if (!handler(&(*it)))
         {
             break;
         }
@@ -6,7 +6,17 @@
 //  Copyright © 2021 Matthew. All rights reserved.
 //
 
-#include <fstream>
+#include <string>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#include <atlstr.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifndef MbdbReader_h
 #define MbdbReader_h
@@ -35,153 +45,268 @@
     // string name
     // string value can be a string or a binary content
 
-class MbdbReader {
+#define MBDB_SIGNATURE_SIZE     6
+#define MBDB_FIXED_DATA_SIZE    40
+
+// Points into the mapped file, not NUL-terminated
+struct MBDB_STRING
+{
+    const char *data;
+    size_t length;
+    
+    bool equals(const std::string& str) const
+    {
+        return length == str.size() && (length == 0 || std::memcmp(data, str.c_str(), length) == 0);
+    }
+};
+
+struct MBDB_RECORD
+{
+    MBDB_STRING domain;
+    MBDB_STRING path;
+    MBDB_STRING linkTarget;
+    MBDB_STRING dataHash;
+    const unsigned char *fixedData;
     
-    std::ifstream m_ifs;
-    std::vector<char> m_buffer;
+    unsigned short getMode() const
+    {
+        return static_cast<unsigned short>((fixedData[0] << 8) | fixedData[1]);
+    }
     
-#ifndef NDEBUG
-    std::ifstream::streampos m_pos;
+    unsigned int getUInt32(size_t offset) const
+    {
+        return (static_cast<unsigned int>(fixedData[offset]) << 24) | (static_cast<unsigned int>(fixedData[offset + 1]) << 16) | (static_cast<unsigned int>(fixedData[offset + 2]) << 8) | fixedData[offset + 3];
+    }
+    
+    uint64_t getFileLength() const
+    {
+        return (static_cast<uint64_t>(getUInt32(30)) << 32) | getUInt32(34);
+    }
+};
+
+// Maps the whole Manifest.mbdb and walks the records in place, nothing is copied
+class MbdbReader {
+
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
 #endif
+
 public:
+
+    MbdbReader() : m_data(NULL), m_size(0), m_pos(0)
+#ifdef _WIN32
+        , m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#endif
+    {
+    }
     
     ~MbdbReader()
     {
-        if (m_ifs.is_open())
-        {
-            m_ifs.close();
-        }
+        close();
     }
     
     bool open(const std::string& fileName)
     {
-        m_ifs.open(fileName, std::ios_base::in | std::ios_base::binary);
-        if (!m_ifs.is_open())
+        close();
+#ifdef _WIN32
+        CW2T pszT(CA2W(fileName.c_str(), CP_UTF8));
+        m_file = CreateFile((LPCTSTR)pszT, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_file == INVALID_HANDLE_VALUE)
         {
             return false;
         }
-        
-        char signature[7] = { 0 };
-        m_ifs.read(&signature[0], 6);
-        if (strcmp(signature, "mbdb\5\0") != 0)
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart <= MBDB_SIGNATURE_SIZE)
         {
-            m_ifs.close();
+            close();
             return false;
         }
+        m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_mapping == NULL)
+        {
+            close();
+            return false;
+        }
+        m_data = reinterpret_cast<const char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (m_data == NULL)
+        {
+            close();
+            return false;
+        }
+        m_size = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= MBDB_SIGNATURE_SIZE)
+        {
+            ::close(fd);
+            return false;
+        }
+        void *data = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);    // The mapping keeps the file referenced
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+        madvise(data, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        m_data = reinterpret_cast<const char *>(data);
+        m_size = static_cast<size_t>(st.st_size);
+#endif
+
+        if (std::memcmp(m_data, "mbdb\5\0", MBDB_SIGNATURE_SIZE) != 0)
+        {
+            close();
+            return false;
+        }
+        m_pos = MBDB_SIGNATURE_SIZE;
         
         return true;
     }
     
-    bool hasMoreData()
+    void close()
     {
-        return !m_ifs.eof();
+#ifdef _WIN32
+        if (m_data != NULL)
+        {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping != NULL)
+        {
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+            m_file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_data != NULL)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+#endif
+        m_data = NULL;
+        m_size = 0;
+        m_pos = 0;
     }
     
-    bool read(unsigned char *buffer, size_t length)
+    bool hasMoreData() const
     {
-        m_ifs.read(reinterpret_cast<char *>(buffer), length);
-
-        return true;
+        return m_pos < m_size;
     }
     
-    bool read(std::string& str)
+    // Offset of the next record, can be passed to readRecordAt later
+    size_t getPosition() const
     {
-        int b0 = m_ifs.get();
-        int b1 = m_ifs.get();
-        
-        if ((b0 == 255 && b1 == 255) || (b0 == 0 && b1 == 0))
-        {
-            str.clear();
-            return true;
-        }
-        
-        if (b0 == std::ifstream::traits_type::eof() || b1 == std::ifstream::traits_type::eof())
+        return m_pos;
+    }
+    
+    // Reads the domain and jumps over the rest of the record
+    bool nextRecord(MBDB_STRING& domain)
+    {
+        size_t pos = m_pos;
+        if (!readString(pos, domain) || !skipRecordBody(pos))
         {
             return false;
         }
-        
-        int lengthOfString = b0 * 256 + b1;
-        m_buffer.resize(lengthOfString);
-        m_ifs.read(&m_buffer[0], lengthOfString);
-
-        str.clear();
-        std::copy(m_buffer.begin(), m_buffer.end(), std::back_inserter(str));
-        
+        m_pos = pos;
         return true;
     }
     
-    bool readD(std::string& str)
+    bool nextRecord(MBDB_RECORD& record)
     {
-        if (!read(str))
+        size_t pos = m_pos;
+        if (!readRecord(pos, record))
         {
             return false;
         }
-        
-        // If only ASCII printable characters, return the string
-        size_t i = 0, length = str.size();
-        for (; i < length; ++i)
-        {
-            if (str[i] < 32 || str[i] >= 128)
-            {
-                break;
-            }
-        }
-        if (i == length)
-        {
-            return true;
-        }
-
-        // otherwise the hexadecimal dump
-        std::string result;
-        for (i = 0; i < length; ++i)
-        {
-            result.push_back(toHex(str[i] >> 4));
-            result.push_back(toHex(str[i] & 15));
-        }
-
-        str.swap(result);
+        m_pos = pos;
         return true;
     }
+    
+    // Random access for the second pass, safe to call from multiple threads
+    bool readRecordAt(size_t offset, MBDB_RECORD& record) const
+    {
+        return readRecord(offset, record);
+    }
 
-    bool skipString()
+protected:
+    bool readString(size_t& pos, MBDB_STRING& str) const
     {
-        int b0 = m_ifs.get();
-        int b1 = m_ifs.get();
+        if (m_size - pos < 2)
+        {
+            return false;
+        }
         
+        unsigned char b0 = static_cast<unsigned char>(m_data[pos]);
+        unsigned char b1 = static_cast<unsigned char>(m_data[pos + 1]);
+        pos += 2;
+        str.data = m_data + pos;
+        str.length = 0;
         if ((b0 == 255 && b1 == 255) || (b0 == 0 && b1 == 0))
         {
             return true;
         }
         
-        if (b0 == std::ifstream::traits_type::eof() || b1 == std::ifstream::traits_type::eof())
+        size_t lengthOfString = b0 * 256 + b1;
+        if (m_size - pos < lengthOfString)
         {
             return false;
         }
-        
-        int lengthOfString = b0 * 256 + b1;
-        m_ifs.seekg(lengthOfString, std::ios_base::cur);
-
+        str.length = lengthOfString;
+        pos += lengthOfString;
         return true;
     }
-    // static size_t skipString(const unsigned char *data, size_t length);
     
-    bool skip(size_t length)
+    bool skipString(size_t& pos) const
     {
-        m_ifs.seekg(length, std::ios_base::cur);
-        return true;
+        MBDB_STRING str;
+        return readString(pos, str);
     }
     
-protected:
-    char toHex(int value)
+    bool readRecord(size_t& pos, MBDB_RECORD& record) const
     {
-        value &= 0xF;
-        return (value >= 0 && value <= 9) ? (char)('0' + value) : (char)('A' + (value - 10));
+        if (!readString(pos, record.domain) || !readString(pos, record.path) || !readString(pos, record.linkTarget) || !readString(pos, record.dataHash)
+            || !skipString(pos))    // unknown, always N/A
+        {
+            return false;
+        }
+        record.fixedData = reinterpret_cast<const unsigned char *>(m_data + pos);
+        return skipFixedData(pos);
     }
-
-    char toHexLow(int value)
+    
+    // Everything after the domain
+    bool skipRecordBody(size_t& pos) const
     {
-        value &= 0xF;
-        return (value >= 0 && value <= 9) ? (char)('0' + value) : (char)('a' + (value - 10));
+        return skipString(pos) && skipString(pos) && skipString(pos) && skipString(pos) && skipFixedData(pos);
+    }
+    
+    // The fixed part and the properties following it
+    bool skipFixedData(size_t& pos) const
+    {
+        if (m_size - pos < MBDB_FIXED_DATA_SIZE)
+        {
+            return false;
+        }
+        int propertyCount = static_cast<unsigned char>(m_data[pos + MBDB_FIXED_DATA_SIZE - 1]);
+        pos += MBDB_FIXED_DATA_SIZE;
+        for (int j = 0; j < propertyCount; ++j)
+        {
+            if (!skipString(pos) || !skipString(pos))
+            {
+                return false;
+            }
+        }
+        return true;
     }
 };
 
@@ -7,6 +7,8 @@
 //
 
 #include "MessageParser.h"
+#include <atomic>
+#include <cstring>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
@@ -14,10 +16,163 @@
 #include <plist/plist.h>
 #include "XmlParser.h"
 
-MessageParser::MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, std::function<std::string(const std::string&)>& localeFunc) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_taskManager(taskManager), m_friends(friends), m_myself(myself), m_options(options), m_resPath(resPath), m_outputPath(outputPath)
+// Slots of the XmlExtractors in MessageParser
+enum { PUSHMAIL_SUBJECT = 0, PUSHMAIL_DIGEST };
+enum { VIDEO_FROMUSERNAME = 0, VIDEO_THUMBWIDTH, VIDEO_THUMBHEIGHT };
+enum { EMOJI_CDNURL = 0, EMOJI_THUMBURL };
+enum { LOCATION_X = 0, LOCATION_Y, LOCATION_LABEL, LOCATION_POINAME };
+enum { APPMSG_FROMUSERNAME = 0, APPMSG_TYPE, APPMSG_APPID, APPMSG_APPNAME, APPMSG_TITLE, APPMSG_DES, APPMSG_URL, APPMSG_THUMBURL, APPMSG_FILEEXT, APPMSG_RECORDITEM, APPMSG_LAST_TITLE, APPMSG_LAST_DES, APPMSG_LAST_URL, APPMSG_LAST_THUMBURL };
+enum { SYSMSG_TYPE = 0, SYSMSG_TEMPLATE_TYPE, SYSMSG_TEMPLATE_PLAIN, SYSMSG_PLAIN, SYSMSG_TEXT };
+
+static const char* TEMPLATE_PLACEHOLDER_NAMES[TPH_MAX] = {
+    "%%ALIGNMENT%%",
+    "%%APPICONPATH%%",
+    "%%APPNAME%%",
+    "%%AUDIOPATH%%",
+    "%%AVATAR%%",
+    "%%CARDIMGPATH%%",
+    "%%CARDNAME%%",
+    "%%CARDTYPE%%",
+    "%%CHANNELS%%",
+    "%%CHANNELTHUMBPATH%%",
+    "%%CHANNELURL%%",
+    "%%EMOJIPATH%%",
+    "%%EXTRA_CLS%%",
+    "%%IMGPATH%%",
+    "%%IMGTHUMBPATH%%",
+    "%%MESSAGE%%",
+    "%%MSGID%%",
+    "%%MSGTYPE%%",
+    "%%NAME%%",
+    "%%RAWEMOJIPATH%%",
+    "%%REFERMSG%%",
+    "%%REFERNAME%%",
+    "%%SHARINGIMGPATH%%",
+    "%%SHARINGTITLE%%",
+    "%%SHARINGURL%%",
+    "%%THUMBPATH%%",
+    "%%TIME%%",
+    "%%VIDEOHEIGHT%%",
+    "%%VIDEOPATH%%",
+    "%%VIDEOWIDTH%%"
+};
+
+const char* getTemplatePlaceholderName(int placeholder)
+{
+    return (placeholder >= 0 && placeholder < TPH_MAX) ? TEMPLATE_PLACEHOLDER_NAMES[placeholder] : "";
+}
+
+int findTemplatePlaceholder(const char* name, size_t length)
+{
+    for (int idx = 0; idx < TPH_MAX; ++idx)
+    {
+        if (strlen(TEMPLATE_PLACEHOLDER_NAMES[idx]) == length && strncmp(TEMPLATE_PLACEHOLDER_NAMES[idx], name, length) == 0)
+        {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+void CompiledTemplate::compile(const std::string& text)
+{
+    m_text = text;
+    m_tokens.clear();
+    m_literalLength = 0;
+    
+    std::string::size_type start = 0;
+    std::string::size_type pos = 0;
+    while ((pos = m_text.find("%%", start)) != std::string::npos)
+    {
+        std::string::size_type posEnd = m_text.find("%%", pos + 2);
+        if (posEnd == std::string::npos)
+        {
+            break;
+        }
+        
+        if (pos > start)
+        {
+            Token literal = {start, pos - start, -1};
+            m_tokens.push_back(literal);
+            m_literalLength += literal.length;
+        }
+        int placeholder = findTemplatePlaceholder(m_text.c_str() + pos, posEnd + 2 - pos);
+        if (placeholder != -1)
+        {
+            Token slot = {pos, posEnd + 2 - pos, placeholder};
+            m_tokens.push_back(slot);
+        }
+        start = posEnd + 2;
+    }
+    
+    if (start < m_text.size())
+    {
+        Token literal = {start, m_text.size() - start, -1};
+        m_tokens.push_back(literal);
+        m_literalLength += literal.length;
+    }
+}
+
+void CompiledTemplate::render(const TemplateValues& tv, std::string& output) const
+{
+    output.reserve(output.size() + m_literalLength);
+    for (std::vector<Token>::const_iterator it = m_tokens.cbegin(); it != m_tokens.cend(); ++it)
+    {
+        if (it->placeholder == -1)
+        {
+            output.append(m_text, it->offset, it->length);
+        }
+        else
+        {
+            output.append(tv.getValue(it->placeholder));
+        }
+    }
+}
+
+MessageParser::MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, std::function<std::string(const std::string&)>& localeFunc) : m_iTunesDb(iTunesDb), m_iTunesDbShare(iTunesDbShare), m_taskManager(taskManager), m_friends(friends), m_myself(myself), m_options(options), m_resPath(resPath), m_outputPath(outputPath), m_portraitManager(NULL), m_senderSession(NULL)
 {
     m_userBase = "Documents/" + m_myself.getHash();
     m_localFunction = std::move(localeFunc);
+    
+    // Slots are registered in the order of the enums above
+    m_voiceExtractor.addAttribute("/msg/voicemsg", "voicelength");
+    
+    m_pushMailExtractor.addNode("/msg/pushmail/content/subject");
+    m_pushMailExtractor.addNode("/msg/pushmail/content/digest");
+    
+    m_videoExtractor.addAttribute("/msg/videomsg", "fromusername");
+    m_videoExtractor.addAttribute("/msg/videomsg", "cdnthumbwidth");
+    m_videoExtractor.addAttribute("/msg/videomsg", "cdnthumbheight");
+    
+    m_emojiExtractor.addAttribute("/msg/emoji", "cdnurl");
+    m_emojiExtractor.addAttribute("/msg/emoji", "thumburl");
+    
+    m_locationExtractor.addAttribute("/msg/location", "x");
+    m_locationExtractor.addAttribute("/msg/location", "y");
+    m_locationExtractor.addAttribute("/msg/location", "label");
+    m_locationExtractor.addAttribute("/msg/location", "poiname");
+    
+    m_appMsgExtractor.addNode("/msg/fromusername");
+    m_appMsgExtractor.addNode("/msg/appmsg/type");
+    m_appMsgExtractor.addAttribute("/msg/appmsg", "appid");
+    m_appMsgExtractor.addNode("/msg/appinfo/appname");
+    m_appMsgExtractor.addNode("/msg/appmsg/title");
+    m_appMsgExtractor.addNode("/msg/appmsg/des");
+    m_appMsgExtractor.addNode("/msg/appmsg/url");
+    m_appMsgExtractor.addNode("/msg/appmsg/thumburl");
+    m_appMsgExtractor.addNode("/msg/appmsg/appattach/fileext");
+    m_appMsgExtractor.addNode("/msg/appmsg/recorditem");
+    // parseAppMsgDefault takes the last of the duplicated nodes, as it did with all the children of /msg/appmsg
+    m_appMsgExtractor.addNode("/msg/appmsg/title", true);
+    m_appMsgExtractor.addNode("/msg/appmsg/des", true);
+    m_appMsgExtractor.addNode("/msg/appmsg/url", true);
+    m_appMsgExtractor.addNode("/msg/appmsg/thumburl", true);
+    
+    m_sysMsgExtractor.addAttribute("/sysmsg", "type");
+    m_sysMsgExtractor.addAttribute("/sysmsg/sysmsgtemplate/content_template", "type");
+    m_sysMsgExtractor.addNode("/sysmsg/sysmsgtemplate/content_template/plain");
+    m_sysMsgExtractor.addNode("/sysmsg/@type/plain");
+    m_sysMsgExtractor.addNode("/sysmsg/@type/text");
 }
 
 bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<TemplateValues>& tvs) const
@@ -26,11 +181,11 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
 
     std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
     
-    tv["%%MSGID%%"] = msg.msgId;
-    tv["%%NAME%%"] = "";
-    tv["%%TIME%%"] = fromUnixTime(msg.createTime);
-    tv["%%MSGTYPE%%"] = std::to_string(msg.type);
-    tv["%%MESSAGE%%"] = "";
+    tv[TPH_MSGID] = msg.msgId;
+    tv[TPH_NAME] = "";
+    tv[TPH_TIME] = fromUnixTime(msg.createTime);
+    tv[TPH_MSGTYPE] = std::to_string(msg.type);
+    tv[TPH_MESSAGE] = "";
     
     std::string forwardedMsg;
     std::string forwardedMsgTitle;
@@ -118,19 +273,20 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
             break;
     }
     
-    std::string portraitPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
+    std::string portraitPath = getPortraitPath(session);
     // std::string emojiPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Emoji/" : "Emoji/";
     
     std::string localPortrait;
 
     const Friend* protraitUser = NULL;
+    bool nameEscaped = false;
     if (session.isChatroom())
     {
-        tv["%%ALIGNMENT%%"] = (msg.des == 0) ? "right" : "left";
+        tv[TPH_ALIGNMENT] = (msg.des == 0) ? "right" : "left";
         if (msg.des == 0)
         {
-            tv["%%NAME%%"] = m_myself.getDisplayName();    // CSS will prevent showing the name for self
-            tv["%%AVATAR%%"] = portraitPath + m_myself.getLocalPortrait();
+            tv[TPH_NAME] = m_myself.getDisplayName();    // CSS will prevent showing the name for self
+            tv[TPH_AVATAR] = portraitPath + m_myself.getLocalPortrait();
             // remotePortrait = m_myself.getPortrait();
             protraitUser = &m_myself;
         }
@@ -138,28 +294,21 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
         {
             if (!senderId.empty())
             {
-                std::string senderHash = md5(senderId);
-                std::string senderDisplayName = session.getMemberName(senderHash);
-                const Friend *f = m_friends.getFriend(senderHash);
-                if (senderDisplayName.empty() && NULL != f)
-                {
-                    senderDisplayName = f->getDisplayName();
-                }
-                tv["%%NAME%%"] = senderDisplayName.empty() ? senderId : senderDisplayName;
-                if (NULL != f)
-                {
-                    protraitUser = f;
-                }
-                if (NULL == f)
+                WXSENDER& sender = resolveSender(session, senderId, portraitPath);
+                tv[TPH_NAME] = sender.displayName;
+                tv[TPH_AVATAR] = sender.avatar;
+                nameEscaped = true;
+                if (!sender.portraitCopied)
                 {
-                    ensureDefaultPortraitIconExisted(portraitPath);
+                    // Only the first message of the sender copies or downloads the portrait
+                    protraitUser = sender.user;
+                    sender.portraitCopied = true;
                 }
-                tv["%%AVATAR%%"] = portraitPath + ((NULL != f) ? f->getLocalPortrait() : "DefaultProfileHead@2x.png");
             }
             else
             {
-                tv["%%NAME%%"] = senderId;
-                tv["%%AVATAR%%"] = "";
+                tv[TPH_NAME] = senderId;
+                tv[TPH_AVATAR] = "";
             }
         }
     }
@@ -167,36 +316,36 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
     {
         if (msg.des == 0 || session.getUsrName() == m_myself.getUsrName())
         {
-            tv["%%ALIGNMENT%%"] = "right";
-            tv["%%NAME%%"] = m_myself.getDisplayName();
-            tv["%%AVATAR%%"] = portraitPath + m_myself.getLocalPortrait();
+            tv[TPH_ALIGNMENT] = "right";
+            tv[TPH_NAME] = m_myself.getDisplayName();
+            tv[TPH_AVATAR] = portraitPath + m_myself.getLocalPortrait();
             
             protraitUser = &m_myself;
         }
         else
         {
-            tv["%%ALIGNMENT%%"] = "left";
+            tv[TPH_ALIGNMENT] = "left";
 
             const Friend *f = m_friends.getFriend(session.getHash());
             if (NULL == f)
             {
-                tv["%%NAME%%"] = session.getDisplayName();
+                tv[TPH_NAME] = session.getDisplayName();
                 if (session.isPortraitEmpty())
                 {
                     ensureDefaultPortraitIconExisted(portraitPath);
                 }
                 localPortrait = portraitPath + (session.isPortraitEmpty() ? "DefaultProfileHead@2x.png" : session.getLocalPortrait());
                 // remotePortrait = session.getPortrait();
-                tv["%%AVATAR%%"] = localPortrait;
+                tv[TPH_AVATAR] = localPortrait;
                 
                 protraitUser = &session;
             }
             else
             {
-                tv["%%NAME%%"] = f->getDisplayName();
+                tv[TPH_NAME] = f->getDisplayName();
                 localPortrait = portraitPath + f->getLocalPortrait();
                 // remotePortrait = f->getPortrait();
-                tv["%%AVATAR%%"] = localPortrait;
+                tv[TPH_AVATAR] = localPortrait;
                 
                 protraitUser = f;
             }
@@ -212,9 +361,9 @@ bool MessageParser::parse(WXMSG& msg, const Session& session, std::vector<Templa
         }
     }
     
-    if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
+    if ((m_options & SPO_IGNORE_HTML_ENC) == 0 && !nameEscaped)
     {
-        tv["%%NAME%%"] = safeHTML(tv["%%NAME%%"]);
+        tv[TPH_NAME] = safeHTML(tv[TPH_NAME]);
     }
 
     if (!forwardedMsg.empty())
@@ -230,24 +379,80 @@ void MessageParser::parsePortrait(const WXMSG& msg, const Session& session, cons
     
 }
 
+void MessageParser::prefetchPortraits(const Session& session) const
+{
+    if ((m_options & SPO_IGNORE_AVATAR) != 0 || !session.isChatroom())
+    {
+        return;
+    }
+    
+    std::string destPath = combinePath(m_outputPath, getPortraitPath(session));
+    const std::map<std::string, std::pair<std::string, std::string>>& members = session.getMembers();
+    for (std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = members.cbegin(); it != members.cend(); ++it)
+    {
+        if (it->second.first.empty() || it->second.first == m_myself.getUsrName())
+        {
+            continue;
+        }
+        copyPortraitIcon(&session, it->second.first, it->first, "", "", destPath);
+    }
+}
+
+WXSENDER& MessageParser::resolveSender(const Session& session, const std::string& senderId, const std::string& portraitPath) const
+{
+    if (m_senderSession != &session)
+    {
+        m_senders.clear();
+        m_senderSession = &session;
+    }
+    
+    std::map<std::string, WXSENDER>::iterator it = m_senders.find(senderId);
+    if (it != m_senders.end())
+    {
+        return it->second;
+    }
+    
+    WXSENDER& sender = m_senders[senderId];
+    std::string senderHash = md5(senderId);
+    std::string displayName = session.getMemberName(senderHash);
+    const Friend *f = m_friends.getFriend(senderHash);
+    if (displayName.empty() && NULL != f)
+    {
+        displayName = f->getDisplayName();
+    }
+    if (displayName.empty())
+    {
+        displayName = senderId;
+    }
+    sender.displayName = ((m_options & SPO_IGNORE_HTML_ENC) == 0) ? safeHTML(displayName) : displayName;
+    sender.user = f;
+    if (NULL == f)
+    {
+        ensureDefaultPortraitIconExisted(portraitPath);
+    }
+    sender.avatar = portraitPath + ((NULL != f) ? f->getLocalPortrait() : "DefaultProfileHead@2x.png");
+    
+    return sender;
+}
+
 /////////////////////////////////////
 
 void MessageParser::parseText(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
     if ((m_options & SPO_IGNORE_HTML_ENC) == 0)
     {
-        tv["%%MESSAGE%%"] = safeHTML(msg.content);
+        tv[TPH_MESSAGE] = safeHTML(msg.content);
     }
     else
     {
-        tv["%%MESSAGE%%"] = msg.content;
+        tv[TPH_MESSAGE] = msg.content;
     }
 }
 
 void MessageParser::parseImage(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
     std::string vFile = combinePath(m_userBase, "Img", session.getHash(), msg.msgId);
-    parseImage(m_outputPath, session.getOutputFileName() + "_files", vFile + ".pic", "", msg.msgId + ".jpg", vFile + ".pic_thum", msg.msgId + "_thumb.jpg", tv);
+    parseImage(session, m_outputPath, session.getOutputFileName() + "_files", vFile + ".pic", "", msg.msgId + ".jpg", vFile + ".pic_thum", msg.msgId + "_thumb.jpg", tv);
 }
 
 void MessageParser::parseVoice(const WXMSG& msg, const Session& session, TemplateValues& tv) const
@@ -257,11 +462,9 @@ void MessageParser::parseVoice(const WXMSG& msg, const Session& session, Templat
     const ITunesFile* audioSrcFile = NULL;
     if ((m_options & SPO_IGNORE_AUDIO) == 0)
     {
-        std::string vLenStr;
-        XmlParser xmlParser(msg.content);
-        if (xmlParser.parseAttributeValue("/msg/voicemsg", "voicelength", vLenStr) && !vLenStr.empty())
+        if (m_voiceExtractor.extract(msg.content) && !m_voiceExtractor.getValue(0).empty())
         {
-            voiceLen = std::stoi(vLenStr);
+            voiceLen = std::stoi(m_voiceExtractor.getValue(0));
         }
         
         audioSrcFile = m_iTunesDb.findITunesFile(combinePath(m_userBase, "Audio", session.getHash(), msg.msgId + ".aud"));
@@ -278,25 +481,21 @@ void MessageParser::parseVoice(const WXMSG& msg, const Session& session, Templat
         std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
         ensureDirectoryExisted(assetsDir);
         std::string mp3Path = combinePath(assetsDir, msg.msgId + ".mp3");
-        m_taskManager.convertAudio(&session, audioSrc, mp3Path, ITunesDb::parseModifiedTime(audioSrcFile->blob));
+        m_taskManager.convertAudio(&session, audioSrc, mp3Path, ITunesDb::getModifiedTime(*audioSrcFile));
         
         tv.setName("audio");
-        tv["%%AUDIOPATH%%"] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
+        tv[TPH_AUDIOPATH] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
         result = true;
 #else
-        m_pcmData.clear();
-        if (silkToPcm(audioSrc, m_pcmData) && !m_pcmData.empty())
+        std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
+        std::string mp3Path = combinePath(assetsDir, msg.msgId + ".mp3");
+        ensureDirectoryExisted(assetsDir);
+        if (silkToMp3(audioSrc, mp3Path))
         {
-            std::string assetsDir = combinePath(m_outputPath, session.getOutputFileName() + "_files");
-            std::string mp3Path = combinePath(assetsDir, msg.msgId + ".mp3");
-            ensureDirectoryExisted(assetsDir);
-            if (pcmToMp3(m_pcmData, mp3Path))
-            {
-                updateFileTime(mp3Path, ITunesDb::parseModifiedTime(audioSrcFile->blob));
-                tv.setName("audio");
-                tv["%%AUDIOPATH%%"] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
-                result = true;
-            }
+            updateFileTime(mp3Path, ITunesDb::getModifiedTime(*audioSrcFile));
+            tv.setName("audio");
+            tv[TPH_AUDIOPATH] = session.getOutputFileName() + "_files/" + msg.msgId + ".mp3";
+            result = true;
         }
 #endif
     }
@@ -304,40 +503,32 @@ void MessageParser::parseVoice(const WXMSG& msg, const Session& session, Templat
     if (!result)
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = voiceLen == -1 ? getLocaleString("[Audio]") : formatString(getLocaleString("[Audio %s]"), getDisplayTime(voiceLen).c_str());
+        tv[TPH_MESSAGE] = voiceLen == -1 ? getLocaleString("[Audio]") : formatString(getLocaleString("[Audio %s]"), getDisplayTime(voiceLen).c_str());
     }
 }
 
 void MessageParser::parsePushMail(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
-    std::string subject;
-    std::string digest;
-    XmlParser xmlParser(msg.content);
-    xmlParser.parseNodeValue("/msg/pushmail/content/subject", subject);
-    xmlParser.parseNodeValue("/msg/pushmail/content/digest", digest);
+    m_pushMailExtractor.extract(msg.content);
     
     tv.setName("plainshare");
 
-    tv["%%SHARINGURL%%"] = "##";
-    tv["%%SHARINGTITLE%%"] = subject;
-    tv["%%MESSAGE%%"] = digest;
+    tv[TPH_SHARINGURL] = "##";
+    tv[TPH_SHARINGTITLE] = m_pushMailExtractor.getValue(PUSHMAIL_SUBJECT);
+    tv[TPH_MESSAGE] = m_pushMailExtractor.getValue(PUSHMAIL_DIGEST);
 }
 
 void MessageParser::parseVideo(const WXMSG& msg, const Session& session, std::string& senderId, TemplateValues& tv) const
 {
-    std::map<std::string, std::string> attrs = { {"fromusername", ""}, {"cdnthumbwidth", ""}, {"cdnthumbheight", ""} };
-    XmlParser xmlParser(msg.content);
-    if (xmlParser.parseAttributesValue("/msg/videomsg", attrs))
-    {
-    }
+    m_videoExtractor.extract(msg.content);
     
     if (senderId.empty())
     {
-        senderId = attrs["fromusername"];
+        senderId = m_videoExtractor.getValue(VIDEO_FROMUSERNAME);
     }
     
     std::string vfile = combinePath(m_userBase, "Video", session.getHash(), msg.msgId);
-    parseVideo(m_outputPath, session.getOutputFileName() + "_files", vfile + ".mp4", msg.msgId + ".mp4", vfile + ".video_thum", msg.msgId + "_thum.jpg", attrs["cdnthumbwidth"], attrs["cdnthumbheight"], tv);
+    parseVideo(session, m_outputPath, session.getOutputFileName() + "_files", vfile + ".mp4", msg.msgId + ".mp4", vfile + ".video_thum", msg.msgId + "_thum.jpg", m_videoExtractor.getValue(VIDEO_THUMBWIDTH), m_videoExtractor.getValue(VIDEO_THUMBHEIGHT), tv);
 }
 
 void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, TemplateValues& tv) const
@@ -345,19 +536,12 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
     std::string url;
     if ((m_options & SPO_IGNORE_EMOJI) == 0)
     {
-        XmlParser xmlParser(msg.content);
-        if (!xmlParser.parseAttributeValue("/msg/emoji", "cdnurl", url))
-        {
-            url.clear();
-        }
-        else
+        if (m_emojiExtractor.extract(msg.content) && m_emojiExtractor.hasValue(EMOJI_CDNURL))
         {
+            url = m_emojiExtractor.getValue(EMOJI_CDNURL);
             if (!startsWith(url, "http") && startsWith(url, "https"))
             {
-                if (!xmlParser.parseAttributeValue("/msg/emoji", "thumburl", url))
-                {
-                    url.clear();
-                }
+                url = m_emojiExtractor.getValue(EMOJI_THUMBURL);
             }
         }
     }
@@ -377,7 +561,7 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
             }
             else
             {
-                static int uniqueFileName = 1000000000;
+                static std::atomic<int> uniqueFileName(1000000000);
                 emojiFile = std::to_string(uniqueFileName++);
             }
             
@@ -393,39 +577,40 @@ void MessageParser::parseEmotion(const WXMSG& msg, const Session& session, Templ
             m_taskManager.download(&session, url, "", combinePath(m_outputPath, localEmojiFile), msg.createTime, "", "emoji");
 #endif
             
-            tv["%%EMOJIPATH%%"] = emojiFile;
-            tv["%%RAWEMOJIPATH%%"] = url;
+            tv[TPH_EMOJIPATH] = emojiFile;
+            tv[TPH_RAWEMOJIPATH] = url;
         }
         else
         {
-            tv["%%EMOJIPATH%%"] = url;
-            tv["%%RAWEMOJIPATH%%"] = url;
+            tv[TPH_EMOJIPATH] = url;
+            tv[TPH_RAWEMOJIPATH] = url;
         }
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Emoji]");
+        tv[TPH_MESSAGE] = getLocaleString("[Emoji]");
     }
 }
 
 void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::string& senderId, std::string& forwardedMsg, std::string& forwardedMsgTitle, TemplateValues& tv) const
 {
     WXAPPMSG appMsg = {&msg, 0};
-    XmlParser xmlParser(msg.content, true);
+    const XmlExtractor& extractor = m_appMsgExtractor;
+    m_appMsgExtractor.extract(msg.content, true);
     if (senderId.empty())
     {
-        xmlParser.parseNodeValue("/msg/fromusername", senderId);
+        extractor.getValue(APPMSG_FROMUSERNAME, senderId);
     }
     
     std::string appMsgTypeStr;
-    if (!xmlParser.parseNodeValue("/msg/appmsg/type", appMsgTypeStr))
+    if (!extractor.getValue(APPMSG_TYPE, appMsgTypeStr))
     {
         // Failed to parse APPMSG type
 #ifndef NDEBUG
         writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(msg.type) + "_app_invld_" + msg.msgId + ".txt"), msg.content);
 #endif
-        tv["%%MESSAGE%%"] = getLocaleString("[Link]");
+        tv[TPH_MESSAGE] = getLocaleString("[Link]");
         return;
     }
 
@@ -434,93 +619,102 @@ void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::s
     writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(msg.type) + "_app_" + appMsgTypeStr + ".txt"), msg.content);
 #endif
     appMsg.appMsgType = std::atoi(appMsgTypeStr.c_str());
-    xmlParser.parseAttributeValue("/msg/appmsg", "appid", appMsg.appId);
+    extractor.getValue(APPMSG_APPID, appMsg.appId);
     if (!appMsg.appId.empty())
     {
-        xmlParser.parseNodeValue("/msg/appinfo/appname", appMsg.appName);
-        tv["%%APPNAME%%"] = appMsg.appName;
+        extractor.getValue(APPMSG_APPNAME, appMsg.appName);
+        tv[TPH_APPNAME] = appMsg.appName;
         std::string vFile = combinePath(m_userBase, "appicon", appMsg.appId + ".png");
         std::string portraitDir = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait" : "Portrait";
 
         if (m_iTunesDb.copyFile(vFile, combinePath(m_outputPath, portraitDir), "appicon_" + appMsg.appId + ".png"))
         {
             appMsg.localAppIcon = portraitDir + "/appicon_" + appMsg.appId + ".png";
-            tv["%%APPICONPATH%%"] = appMsg.localAppIcon;
+            tv[TPH_APPICONPATH] = appMsg.localAppIcon;
         }
     }
 
     switch (appMsg.appMsgType)
     {
         case APPMSGTYPE_TEXT: // 1
-            parseAppMsgText(appMsg, xmlParser, session, tv);
+            parseAppMsgText(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_IMG: // 2
-            parseAppMsgImage(appMsg, xmlParser, session, tv);
+            parseAppMsgImage(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_AUDIO: // 3
-            parseAppMsgAudio(appMsg, xmlParser, session, tv);
+            parseAppMsgAudio(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_VIDEO: // 4
-            parseAppMsgVideo(appMsg, xmlParser, session, tv);
+            parseAppMsgVideo(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_URL: // 5
-            parseAppMsgUrl(appMsg, xmlParser, session, tv);
+            parseAppMsgUrl(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_ATTACH: // 6
-            parseAppMsgAttachment(appMsg, xmlParser, session, tv);
+            parseAppMsgAttachment(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_OPEN: // 7
-            parseAppMsgOpen(appMsg, xmlParser, session, tv);
+            parseAppMsgOpen(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_EMOJI: // 8
-            parseAppMsgEmoji(appMsg, xmlParser, session, tv);
+            parseAppMsgEmoji(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_VOICE_REMIND: // 9
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
 
         case APPMSGTYPE_SCAN_GOOD: // 10
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
             
         case APPMSGTYPE_GOOD: // 13
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
 
         case APPMSGTYPE_EMOTION: // 15
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
 
         case APPMSGTYPE_CARD_TICKET: // 16
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
 
         case APPMSGTYPE_REALTIME_LOCATION: // 17
-            parseAppMsgRtLocation(appMsg, xmlParser, session, tv);
+            parseAppMsgRtLocation(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_FWD_MSG: // 19
-            parseAppMsgFwdMsg(appMsg, xmlParser, session, forwardedMsg, forwardedMsgTitle, tv);
+            parseAppMsgFwdMsg(appMsg, extractor, session, forwardedMsg, forwardedMsgTitle, tv);
             break;
         case APPMSGTYPE_CHANNEL_CARD:   // 50
-            parseAppMsgChannelCard(appMsg, xmlParser, session, tv);
+            {
+                XmlParser xmlParser(msg.content, true);
+                parseAppMsgChannelCard(appMsg, xmlParser, session, tv);
+            }
             break;
         case APPMSGTYPE_CHANNELS:   // 51
-            parseAppMsgChannels(appMsg, xmlParser, session, tv);
+            {
+                XmlParser xmlParser(msg.content, true);
+                parseAppMsgChannels(appMsg, xmlParser, session, tv);
+            }
             break;
         case APPMSGTYPE_REFER:  // 57
-            parseAppMsgRefer(appMsg, xmlParser, session, tv);
+            {
+                XmlParser xmlParser(msg.content, true);
+                parseAppMsgRefer(appMsg, xmlParser, session, tv);
+            }
             break;
         case APPMSGTYPE_TRANSFERS: // 2000
-            parseAppMsgTransfer(appMsg, xmlParser, session, tv);
+            parseAppMsgTransfer(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_RED_ENVELOPES: // 2001
-            parseAppMsgRedPacket(appMsg, xmlParser, session, tv);
+            parseAppMsgRedPacket(appMsg, extractor, session, tv);
             break;
         case APPMSGTYPE_READER_TYPE: // 100001
-            parseAppMsgReaderType(appMsg, xmlParser, session, tv);
+            parseAppMsgReaderType(appMsg, extractor, session, tv);
             break;
         default:
-            parseAppMsgUnknownType(appMsg, xmlParser, session, tv);
+            parseAppMsgUnknownType(appMsg, extractor, session, tv);
             break;
     }
     
@@ -542,24 +736,23 @@ void MessageParser::parseAppMsg(const WXMSG& msg, const Session& session, std::s
 void MessageParser::parseCall(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
     tv.setName("msg");
-    tv["%%MESSAGE%%"] = getLocaleString("[Video/Audio Call]");
+    tv[TPH_MESSAGE] = getLocaleString("[Video/Audio Call]");
 }
 
 void MessageParser::parseLocation(const WXMSG& msg, const Session& session, TemplateValues& tv) const
 {
-    std::map<std::string, std::string> attrs = { {"x", ""}, {"y", ""}, {"label", ""}, {"poiname", ""} };
-    
-    XmlParser xmlParser(msg.content);
-    xmlParser.parseAttributesValue("/msg/location", attrs);
+    m_locationExtractor.extract(msg.content);
+    const std::string& label = m_locationExtractor.getValue(LOCATION_LABEL);
+    const std::string& poiName = m_locationExtractor.getValue(LOCATION_POINAME);
     
-    std::string location = (!attrs["poiname"].empty() && !attrs["label"].empty()) ? (attrs["poiname"] + " - " + attrs["label"]) : (attrs["poiname"] + attrs["label"]);
+    std::string location = (!poiName.empty() && !label.empty()) ? (poiName + " - " + label) : (poiName + label);
     if (!location.empty())
     {
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), attrs["x"].c_str(), attrs["y"].c_str());
+        tv[TPH_MESSAGE] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), m_locationExtractor.getValue(LOCATION_X).c_str(), m_locationExtractor.getValue(LOCATION_Y).c_str());
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Location]");
+        tv[TPH_MESSAGE] = getLocaleString("[Location]");
     }
     tv.setName("msg");
 }
@@ -605,7 +798,7 @@ void MessageParser::parseNotice(const WXMSG& msg, const Session& session, Templa
     Json::Value root;
     if (reader.parse(msg.content, root))
     {
-        tv["%%MESSAGE%%"] = root["msgContent"].asString();
+        tv[TPH_MESSAGE] = root["msgContent"].asString();
     }
 }
 
@@ -617,7 +810,7 @@ void MessageParser::parseSysNotice(const WXMSG& msg, const Session& session, Tem
     tv.setName("notice");
     std::string sysMsg = msg.content;
     removeHtmlTags(sysMsg);
-    tv["%%MESSAGE%%"] = sysMsg;
+    tv[TPH_MESSAGE] = sysMsg;
 }
 
 void MessageParser::parseSystem(const WXMSG& msg, const Session& session, TemplateValues& tv) const
@@ -625,15 +818,12 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
     tv.setName("notice");
     if (startsWith(msg.content, "<sysmsg"))
     {
-        XmlParser xmlParser(msg.content, true);
-        std::string sysMsgType;
-        xmlParser.parseAttributeValue("/sysmsg", "type", sysMsgType);
+        const XmlExtractor& extractor = m_sysMsgExtractor;
+        m_sysMsgExtractor.extract(msg.content, true);
+        const std::string& sysMsgType = extractor.getValue(SYSMSG_TYPE);
         if (sysMsgType == "sysmsgtemplate")
         {
-            std::string plainText;
-            std::string templateContent;
-            std::string templateType;
-            xmlParser.parseAttributeValue("/sysmsg/sysmsgtemplate/content_template", "type", templateType);
+            const std::string& templateType = extractor.getValue(SYSMSG_TEMPLATE_TYPE);
 #ifndef NDEBUG
             writeFile(combinePath(m_outputPath, "../dbg", "msg_" + std::to_string(msg.type) + "_" + sysMsgType + ".txt"), msg.content);
 #endif
@@ -642,19 +832,21 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
                 // tmpl_type_profilewithrevokeqrcode
                 // tmpl_type_profilewithrevoke
                 // tmpl_type_profile
-                xmlParser.parseNodeValue("/sysmsg/sysmsgtemplate/content_template/plain", plainText);
-                if (plainText.empty())
+                if (extractor.getValue(SYSMSG_TEMPLATE_PLAIN).empty())
                 {
+                    // The links have to be resolved with DOM
+                    XmlParser xmlParser(msg.content, true);
+                    std::string templateContent;
                     xmlParser.parseNodeValue("/sysmsg/sysmsgtemplate/content_template/template", templateContent);
                     WechatTemplateHandler handler(xmlParser, templateContent);
                     if (xmlParser.parseWithHandler("/sysmsg/sysmsgtemplate/content_template/link_list/link", handler))
                     {
-                        tv["%%MESSAGE%%"] = handler.getText();
+                        tv[TPH_MESSAGE] = handler.getText();
                     }
                 }
                 else
                 {
-                    tv["%%MESSAGE%%"] = msg.content;
+                    tv[TPH_MESSAGE] = msg.content;
                 }
             }
             else
@@ -667,17 +859,15 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
         }
         else if (sysMsgType == "editrevokecontent")
         {
-            std::string content;
-            xmlParser.parseNodeValue("/sysmsg/" + sysMsgType + "/text", content);
-            tv["%%MESSAGE%%"] = content;
+            tv[TPH_MESSAGE] = extractor.getValue(SYSMSG_TEXT);
         }
         else
         {
             // Try to find plain first
-            std::string plainText;
-            if (xmlParser.parseNodeValue("/sysmsg/" + sysMsgType + "/plain", plainText) && !plainText.empty())
+            const std::string& plainText = extractor.getValue(SYSMSG_PLAIN);
+            if (!plainText.empty())
             {
-                tv["%%MESSAGE%%"] = plainText;
+                tv[TPH_MESSAGE] = plainText;
             }
             else
             {
@@ -700,49 +890,41 @@ void MessageParser::parseSystem(const WXMSG& msg, const Session& session, Templa
         // Plain Text
         std::string sysMsg = msg.content;
         removeHtmlTags(sysMsg);
-        tv["%%MESSAGE%%"] = sysMsg;
+        tv[TPH_MESSAGE] = sysMsg;
     }
 }
 
 ////////////////////////////////
 
-void MessageParser::parseAppMsgText(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgText(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    std::string title;
-    xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    tv["%%MESSAGE%%"] = title.empty() ? getLocaleString("[Link]") : title;
+    const std::string& title = extractor.getValue(APPMSG_TITLE);
+    tv[TPH_MESSAGE] = title.empty() ? getLocaleString("[Link]") : title;
 }
 
-void MessageParser::parseAppMsgImage(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgImage(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgAudio(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgAudio(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgVideo(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgVideo(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgEmotion(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgEmotion(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    std::string title;
-    std::string desc;
-    std::string url;
     std::string thumbUrl;
-    xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    xmlParser.parseNodeValue("/msg/appmsg/des", desc);
-    xmlParser.parseNodeValue("/msg/appmsg/url", url);
     
     // Check Local File
     std::string vThumbFile = m_userBase + "/OpenData/" + session.getHash() + "/" + appMsg.msg->msgId + ".pic_thum";
@@ -753,7 +935,7 @@ void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlP
     }
     else
     {
-        xmlParser.parseNodeValue("/msg/appmsg/thumburl", thumbUrl);
+        extractor.getValue(APPMSG_THUMBURL, thumbUrl);
         if (thumbUrl.empty())
         {
             thumbUrl = appMsg.localAppIcon;
@@ -761,21 +943,19 @@ void MessageParser::parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlP
     }
     
     tv.setName(thumbUrl.empty() ? "plainshare" : "share");
-    tv["%%SHARINGIMGPATH%%"] = thumbUrl;
-    tv["%%SHARINGTITLE%%"] = title;
-    tv["%%SHARINGURL%%"] = url;
-    tv["%%MESSAGE%%"] = desc;
+    tv[TPH_SHARINGIMGPATH] = thumbUrl;
+    tv[TPH_SHARINGTITLE] = extractor.getValue(APPMSG_TITLE);
+    tv[TPH_SHARINGURL] = extractor.getValue(APPMSG_URL);
+    tv[TPH_MESSAGE] = extractor.getValue(APPMSG_DES);
 }
 
-void MessageParser::parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
 #ifndef NDEBUG
     writeFile(combinePath(m_outputPath, "../dbg", "msg_" + std::to_string(appMsg.msg->type) + "_attach_" + appMsg.msg->msgId + ".txt"), appMsg.msg->content);
 #endif
-    std::string title;
-    std::string attachFileExtName;
-    xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    xmlParser.parseNodeValue("/msg/appmsg/appattach/fileext", attachFileExtName);
+    const std::string& title = extractor.getValue(APPMSG_TITLE);
+    const std::string& attachFileExtName = extractor.getValue(APPMSG_FILEEXT);
     
     std::string attachFileName = m_userBase + "/OpenData/" + session.getHash() + "/" + appMsg.msg->msgId;
     std::string attachOutputFileName = appMsg.msg->msgId;
@@ -784,42 +964,41 @@ void MessageParser::parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlParse
         attachFileName += "." + attachFileExtName;
         attachOutputFileName += "." + attachFileExtName;
     }
-    parseFile(m_outputPath, session.getOutputFileName() + "_files", attachFileName, attachOutputFileName, title, tv);
+    parseFile(session, m_outputPath, session.getOutputFileName() + "_files", attachFileName, attachOutputFileName, title, tv);
 }
 
-void MessageParser::parseAppMsgOpen(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgOpen(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgEmoji(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgEmoji(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
     // Can't parse the detail info of emoji as the url is encrypted
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgRtLocation(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgRtLocation(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Real-time Location]");
+    tv[TPH_MESSAGE] = getLocaleString("[Real-time Location]");
 }
 
-void MessageParser::parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, std::string& forwardedMsg, std::string& forwardedMsgTitle, TemplateValues& tv) const
+void MessageParser::parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, std::string& forwardedMsg, std::string& forwardedMsgTitle, TemplateValues& tv) const
 {
-    std::string title;
-    xmlParser.parseNodeValue("/msg/appmsg/title", title);
-    xmlParser.parseNodeValue("/msg/appmsg/recorditem", forwardedMsg);
+    const std::string& title = extractor.getValue(APPMSG_TITLE);
+    extractor.getValue(APPMSG_RECORDITEM, forwardedMsg);
 #ifndef NDEBUG
     writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(appMsg.msg->type) + "_app_19.txt"), forwardedMsg);
 #endif
     tv.setName("msg");
-    tv["%%MESSAGE%%"] = title;
+    tv[TPH_MESSAGE] = title;
 
     forwardedMsgTitle = title;
 }
 
-void MessageParser::parseAppMsgCard(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgCard(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
 void MessageParser::parseAppMsgChannelCard(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
@@ -854,19 +1033,19 @@ void MessageParser::parseAppMsgRefer(const WXAPPMSG& appMsg, const XmlParser& xm
         writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(appMsg.msg->type) + "_app_" + std::to_string(APPMSGTYPE_REFER) + "_ref_" + nodes["type"] + " .txt"), nodes["content"]);
 #endif
         tv.setName("refermsg");
-        tv["%%MESSAGE%%"] = title;
-        tv["%%REFERNAME%%"] = nodes["displayname"];
+        tv[TPH_MESSAGE] = title;
+        tv[TPH_REFERNAME] = nodes["displayname"];
         if (nodes["type"] == "43")
         {
-            tv["%%REFERMSG%%"] = getLocaleString("[Video]");
+            tv[TPH_REFERMSG] = getLocaleString("[Video]");
         }
         else if (nodes["type"] == "1")
         {
-            tv["%%REFERMSG%%"] = nodes["content"];
+            tv[TPH_REFERMSG] = nodes["content"];
         }
         else if (nodes["type"] == "3")
         {
-            tv["%%REFERMSG%%"] = getLocaleString("[Photo]");
+            tv[TPH_REFERMSG] = getLocaleString("[Photo]");
         }
         else if (nodes["type"] == "49")
         {
@@ -874,64 +1053,65 @@ void MessageParser::parseAppMsgRefer(const WXAPPMSG& appMsg, const XmlParser& xm
             XmlParser subAppMsgXmlParser(nodes["content"], true);
             std::string subAppMsgTitle;
             subAppMsgXmlParser.parseNodeValue("/msg/appmsg/title", subAppMsgTitle);
-            tv["%%REFERMSG%%"] = subAppMsgTitle;
+            tv[TPH_REFERMSG] = subAppMsgTitle;
         }
         else
         {
-            tv["%%REFERMSG%%"] = nodes["content"];
+            tv[TPH_REFERMSG] = nodes["content"];
         }
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = title;
+        tv[TPH_MESSAGE] = title;
     }
 }
 
-void MessageParser::parseAppMsgTransfer(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgTransfer(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Transfer]");
+    tv[TPH_MESSAGE] = getLocaleString("[Transfer]");
 }
 
-void MessageParser::parseAppMsgRedPacket(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgRedPacket(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    tv["%%MESSAGE%%"] = getLocaleString("[Red Packet]");
+    tv[TPH_MESSAGE] = getLocaleString("[Red Packet]");
 }
 
-void MessageParser::parseAppMsgReaderType(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgReaderType(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgUnknownType(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgUnknownType(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
 #if !defined(NDEBUG) || defined(DBG_PERF)
     writeFile(combinePath(m_outputPath, "../dbg", "msg" + std::to_string(appMsg.msg->type) + "_app_unknwn_" + std::to_string(appMsg.appMsgType) + ".txt"), appMsg.msg->content);
 #endif
-    parseAppMsgDefault(appMsg, xmlParser, session, tv);
+    parseAppMsgDefault(appMsg, extractor, session, tv);
 }
 
-void MessageParser::parseAppMsgDefault(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const
+void MessageParser::parseAppMsgDefault(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const
 {
-    std::map<std::string, std::string> nodes = { {"title", ""}, {"type", ""}, {"des", ""}, {"url", ""}, {"thumburl", ""}, {"recorditem", ""} };
-    xmlParser.parseNodesValue("/msg/appmsg/*", nodes);
+    const std::string& title = extractor.getValue(APPMSG_LAST_TITLE);
+    const std::string& url = extractor.getValue(APPMSG_LAST_URL);
+    const std::string& thumbUrl = extractor.getValue(APPMSG_LAST_THUMBURL);
     
-    if (!nodes["title"].empty() && !nodes["url"].empty())
+    if (!title.empty() && !url.empty())
     {
-        tv.setName(nodes["thumburl"].empty() ? "plainshare" : "share");
+        tv.setName(thumbUrl.empty() ? "plainshare" : "share");
 
-        tv["%%SHARINGIMGPATH%%"] = nodes["thumburl"];
-        tv["%%SHARINGURL%%"] = nodes["url"];
-        tv["%%SHARINGTITLE%%"] = nodes["title"];
-        tv["%%MESSAGE%%"] = nodes["des"];
+        tv[TPH_SHARINGIMGPATH] = thumbUrl;
+        tv[TPH_SHARINGURL] = url;
+        tv[TPH_SHARINGTITLE] = title;
+        tv[TPH_MESSAGE] = extractor.getValue(APPMSG_LAST_DES);
     }
-    else if (!nodes["title"].empty())
+    else if (!title.empty())
     {
-        tv["%%MESSAGE%%"] = nodes["title"];
+        tv[TPH_MESSAGE] = title;
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Link]");
+        tv[TPH_MESSAGE] = getLocaleString("[Link]");
     }
 }
 
@@ -943,21 +1123,21 @@ void MessageParser::parseFwdMsgText(const WXFWDMSG& fwdMsg, const XmlParser& xml
     xmlParser.getChildNodeContent(itemNode, "datadesc", message);
     static std::vector<std::pair<std::string, std::string>> replaces = { {"\r\n", "<br />"}, {"\r", "<br />"}, {"\n", "<br />"}};
     replaceAll(message, replaces);
-    tv["%%MESSAGE%%"] = message;
+    tv[TPH_MESSAGE] = message;
 }
 
 void MessageParser::parseFwdMsgImage(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNode *itemNode, const Session& session, TemplateValues& tv) const
 {
     std::string fileExtName = fwdMsg.dataFormat.empty() ? "" : ("." + fwdMsg.dataFormat);
     std::string vfile = m_userBase + "/OpenData/" + session.getHash() + "/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId;
-    parseImage(m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, vfile + fileExtName + "_pre3", fwdMsg.dataId + ".jpg", vfile + ".record_thumb", fwdMsg.dataId + "_thumb.jpg", tv);
+    parseImage(session, m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, vfile + fileExtName + "_pre3", fwdMsg.dataId + ".jpg", vfile + ".record_thumb", fwdMsg.dataId + "_thumb.jpg", tv);
 }
 
 void MessageParser::parseFwdMsgVideo(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
 {
     std::string fileExtName = fwdMsg.dataFormat.empty() ? "" : ("." + fwdMsg.dataFormat);
     std::string vfile = m_userBase + "/OpenData/" + session.getHash() + "/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId;
-    parseVideo(m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, fwdMsg.dataId + fileExtName, vfile + ".record_thumb", fwdMsg.dataId + "_thumb.jpg", "", "", tv);
+    parseVideo(session, m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, fwdMsg.dataId + fileExtName, vfile + ".record_thumb", fwdMsg.dataId + "_thumb.jpg", "", "", tv);
                     
 }
 
@@ -987,14 +1167,14 @@ void MessageParser::parseFwdMsgLink(const WXFWDMSG& fwdMsg, const XmlParser& xml
     {
         tv.setName(hasThumb ? "share" : "plainshare");
 
-        tv["%%SHARINGIMGPATH%%"] = session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId + "_thumb.jpg";
-        tv["%%SHARINGURL%%"] = link;
-        tv["%%SHARINGTITLE%%"] = title;
-        tv["%%MESSAGE%%"] = message;
+        tv[TPH_SHARINGIMGPATH] = session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId + "_thumb.jpg";
+        tv[TPH_SHARINGURL] = link;
+        tv[TPH_SHARINGTITLE] = title;
+        tv[TPH_MESSAGE] = message;
     }
     else
     {
-        tv["%%MESSAGE%%"] = title;
+        tv[TPH_MESSAGE] = title;
     }
 }
 
@@ -1016,11 +1196,11 @@ void MessageParser::parseFwdMsgLocation(const WXFWDMSG& fwdMsg, const XmlParser&
     std::string location = (!message.empty() && !label.empty()) ? (message + " - " + label) : (message + label);
     if (!location.empty())
     {
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), lat.c_str(), lng.c_str());
+        tv[TPH_MESSAGE] = formatString(getLocaleString("[Location] %s (%s,%s)"), location.c_str(), lat.c_str(), lng.c_str());
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Location]");
+        tv[TPH_MESSAGE] = getLocaleString("[Location]");
     }
     tv.setName("msg");
 }
@@ -1032,7 +1212,7 @@ void MessageParser::parseFwdMsgAttach(const WXFWDMSG& fwdMsg, const XmlParser& x
     
     std::string fileExtName = fwdMsg.dataFormat.empty() ? "" : ("." + fwdMsg.dataFormat);
     std::string vfile = m_userBase + "/OpenData/" + session.getHash() + "/" + fwdMsg.msg->msgId + "/" + fwdMsg.dataId;
-    parseFile(m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, fwdMsg.dataId + fileExtName, message, tv);
+    parseFile(session, m_outputPath, session.getOutputFileName() + "_files/" + fwdMsg.msg->msgId, vfile + fileExtName, fwdMsg.dataId + fileExtName, message, tv);
 }
 
 void MessageParser::parseFwdMsgCard(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
@@ -1053,14 +1233,14 @@ void MessageParser::MessageParser::parseFwdMsgNestedFwdMsg(const WXFWDMSG& fwdMs
         nestedFwdMsg = XmlParser::getNodeOuterXml(nodeRecordInfo);
     }
     
-    tv["%%MESSAGE%%"] = nestedFwdMsgTitle;
+    tv[TPH_MESSAGE] = nestedFwdMsgTitle;
 }
 
 void MessageParser::MessageParser::parseFwdMsgMiniProgram(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
 {
     std::string title;
     xmlParser.getChildNodeContent(itemNode, "datatitle", title);
-    tv["%%MESSAGE%%"] = title;
+    tv[TPH_MESSAGE] = title;
 }
 
 void MessageParser::MessageParser::parseFwdMsgChannels(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const
@@ -1088,7 +1268,7 @@ void MessageParser::MessageParser::parseFwdMsgChannelCard(const WXFWDMSG& fwdMsg
 ///////////////////////////////
 // Implementation
 
-void MessageParser::parseVideo(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& srcVideo, const std::string& destVideo, const std::string& srcThumb, const std::string& destThumb, const std::string& width, const std::string& height, TemplateValues& tv) const
+void MessageParser::parseVideo(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& srcVideo, const std::string& destVideo, const std::string& srcThumb, const std::string& destThumb, const std::string& width, const std::string& height, TemplateValues& tv) const
 {
     bool hasThumb = false;
     bool hasVideo = false;
@@ -1096,95 +1276,94 @@ void MessageParser::parseVideo(const std::string& sessionPath, const std::string
     if ((m_options & SPO_IGNORE_VIDEO) == 0)
     {
         std::string fullAssertsPath = combinePath(sessionPath, sessionAssertsPath);
-        ensureDirectoryExisted(fullAssertsPath);
-        hasThumb = m_iTunesDb.copyFile(srcThumb, combinePath(fullAssertsPath, destThumb));
-        hasVideo = m_iTunesDb.copyFile(srcVideo, combinePath(fullAssertsPath, destVideo));
+        hasThumb = copyFileAsync(session, srcThumb, fullAssertsPath, destThumb);
+        hasVideo = copyFileAsync(session, srcVideo, fullAssertsPath, destVideo);
     }
 
     if (hasVideo)
     {
         tv.setName("video");
-        tv["%%THUMBPATH%%"] = hasThumb ? (sessionAssertsPath + "/" + destThumb) : "";
-        tv["%%VIDEOPATH%%"] = sessionAssertsPath + "/" + destVideo;
-        tv["%%MSGTYPE%%"] = "video";
+        tv[TPH_THUMBPATH] = hasThumb ? (sessionAssertsPath + "/" + destThumb) : "";
+        tv[TPH_VIDEOPATH] = sessionAssertsPath + "/" + destVideo;
+        tv[TPH_MSGTYPE] = "video";
     }
     else if (hasThumb)
     {
         tv.setName("thumb");
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + destThumb;
-        tv["%%MESSAGE%%"] = getLocaleString("(Video Missed)");
+        tv[TPH_IMGTHUMBPATH] = sessionAssertsPath + "/" + destThumb;
+        tv[TPH_MESSAGE] = getLocaleString("(Video Missed)");
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Video]");
+        tv[TPH_MESSAGE] = getLocaleString("[Video]");
     }
     
-    tv["%%VIDEOWIDTH%%"] = width;
-    tv["%%VIDEOHEIGHT%%"] = height;
+    tv[TPH_VIDEOWIDTH] = width;
+    tv[TPH_VIDEOHEIGHT] = height;
 }
 
-void MessageParser::parseImage(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& srcPre, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, TemplateValues& tv) const
+void MessageParser::parseImage(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& srcPre, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, TemplateValues& tv) const
 {
     bool hasThumb = false;
     bool hasImage = false;
     if ((m_options & SPO_IGNORE_IMAGE) == 0)
     {
         std::string fullAssertsPath = combinePath(sessionPath, sessionAssertsPath);
-        hasThumb = m_iTunesDb.copyFile(srcThumb, fullAssertsPath, destThumb);
+        hasThumb = copyFileAsync(session, srcThumb, fullAssertsPath, destThumb);
         if (!srcPre.empty())
         {
-            hasImage = m_iTunesDb.copyFile(srcPre, fullAssertsPath, dest);
+            hasImage = copyFileAsync(session, srcPre, fullAssertsPath, dest);
         }
         if (!hasImage)
         {
-            hasImage = m_iTunesDb.copyFile(src, fullAssertsPath, dest);
+            hasImage = copyFileAsync(session, src, fullAssertsPath, dest);
         }
     }
 
     if (hasImage)
     {
         tv.setName("image");
-        tv["%%IMGPATH%%"] = sessionAssertsPath + "/" + dest;
+        tv[TPH_IMGPATH] = sessionAssertsPath + "/" + dest;
         // If it is PDF mode, use the raw image directly for print quaility
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + (((!hasThumb) || (m_options & SPO_PDF_MODE)) ? dest : destThumb);
-        tv["%%MSGTYPE%%"] = "image";
-        tv["%%EXTRA_CLS%%"] = "raw-img";
+        tv[TPH_IMGTHUMBPATH] = sessionAssertsPath + "/" + (((!hasThumb) || (m_options & SPO_PDF_MODE)) ? dest : destThumb);
+        tv[TPH_MSGTYPE] = "image";
+        tv[TPH_EXTRA_CLS] = "raw-img";
     }
     else if (hasThumb)
     {
         tv.setName("thumb");
-        tv["%%IMGTHUMBPATH%%"] = sessionAssertsPath + "/" + destThumb;
-        tv["%%MESSAGE%%"] = "";
-        tv["%%MSGTYPE%%"] = "image";
+        tv[TPH_IMGTHUMBPATH] = sessionAssertsPath + "/" + destThumb;
+        tv[TPH_MESSAGE] = "";
+        tv[TPH_MSGTYPE] = "image";
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = getLocaleString("[Photo]");
+        tv[TPH_MESSAGE] = getLocaleString("[Photo]");
     }
 }
 
-void MessageParser::parseFile(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& fileName, TemplateValues& tv) const
+void MessageParser::parseFile(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& fileName, TemplateValues& tv) const
 {
     bool hasFile = false;
     if ((m_options & SPO_IGNORE_FILE) == 0)
     {
-        hasFile = m_iTunesDb.copyFile(src, combinePath(sessionPath, sessionAssertsPath), dest);
+        hasFile = copyFileAsync(session, src, combinePath(sessionPath, sessionAssertsPath), dest);
     }
 
     if (hasFile)
     {
         tv.setName("plainshare");
-        tv["%%SHARINGURL%%"] = sessionAssertsPath + "/" + dest;
-        tv["%%SHARINGTITLE%%"] = fileName;
-        tv["%%MESSAGE%%"] = "";
-        tv["%%MSGTYPE%%"] = "file";
+        tv[TPH_SHARINGURL] = sessionAssertsPath + "/" + dest;
+        tv[TPH_SHARINGTITLE] = fileName;
+        tv[TPH_MESSAGE] = "";
+        tv[TPH_MSGTYPE] = "file";
     }
     else
     {
         tv.setName("msg");
-        tv["%%MESSAGE%%"] = formatString(getLocaleString("[File: %s]"), fileName.c_str());
+        tv[TPH_MESSAGE] = formatString(getLocaleString("[File: %s]"), fileName.c_str());
     }
 }
 
@@ -1202,7 +1381,7 @@ void MessageParser::parseCard(const Session& session, const std::string& session
         attrs = { {"nickname", ""}, {"username", ""} };
     }
 
-    tv["%%CARDTYPE%%"] = getLocaleString("[Contact Card]");
+    tv[TPH_CARDTYPE] = getLocaleString("[Contact Card]");
     XmlParser xmlParser(cardMessage, true);
     if (xmlParser.parseAttributesValue("/msg", attrs) && !attrs["nickname"].empty())
     {
@@ -1213,8 +1392,8 @@ void MessageParser::parseCard(const Session& session, const std::string& session
             tv.setName("card");
             // Some username is too long to be created on windows, have to use its md5 string
 			std::string imgFileName = startsWith(attrs["username"], "wxid_") ? attrs["username"] : md5(attrs["username"]);
-            tv["%%CARDNAME%%"] = attrs["nickname"];
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + imgFileName + ".jpg";
+            tv[TPH_CARDNAME] = attrs["nickname"];
+            tv[TPH_CARDIMGPATH] = portraitDir + "/" + imgFileName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, imgFileName + ".jpg");
             ensureDirectoryExisted(combinePath(sessionPath, localPortraitDir));
@@ -1227,18 +1406,18 @@ void MessageParser::parseCard(const Session& session, const std::string& session
         }
         else if (!attrs["nickname"].empty())
         {
-            tv["%%MESSAGE%%"] = formatString(getLocaleString("[Contact Card] %s"), attrs["nickname"].c_str());
+            tv[TPH_MESSAGE] = formatString(getLocaleString("[Contact Card] %s"), attrs["nickname"].c_str());
         }
         else
         {
-            tv["%%MESSAGE%%"] = getLocaleString("[Contact Card]");
+            tv[TPH_MESSAGE] = getLocaleString("[Contact Card]");
         }
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Contact Card]");
+        tv[TPH_MESSAGE] = getLocaleString("[Contact Card]");
     }
-    tv["%%EXTRA_CLS%%"] = "contact-card";
+    tv[TPH_EXTRA_CLS] = "contact-card";
 }
 
 void MessageParser::parseChannelCard(const Session& session, const std::string& portraitDir, const std::string& usrName, const std::string& avatar, const std::string& avatarLD, const std::string& name, TemplateValues& tv) const
@@ -1248,14 +1427,14 @@ void MessageParser::parseChannelCard(const Session& session, const std::string&
     {
         hasImg = (!usrName.empty() && !avatar.empty());
     }
-    tv["%%CARDTYPE%%"] = getLocaleString("[Channel Card]");
+    tv[TPH_CARDTYPE] = getLocaleString("[Channel Card]");
     if (!name.empty())
     {
         if (hasImg)
         {
             tv.setName("card");
-            tv["%%CARDNAME%%"] = name;
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + usrName + ".jpg";
+            tv[TPH_CARDNAME] = name;
+            tv[TPH_CARDIMGPATH] = portraitDir + "/" + usrName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, usrName + ".jpg");
             ensureDirectoryExisted(combinePath(m_outputPath, localPortraitDir));
@@ -1268,14 +1447,14 @@ void MessageParser::parseChannelCard(const Session& session, const std::string&
         else
         {
             tv.setName("msg");
-            tv["%%MESSAGE%%"] = formatString(getLocaleString("[Channel Card] %s"), name.c_str());
+            tv[TPH_MESSAGE] = formatString(getLocaleString("[Channel Card] %s"), name.c_str());
         }
     }
     else
     {
-        tv["%%MESSAGE%%"] = getLocaleString("[Channel Card]");
+        tv[TPH_MESSAGE] = getLocaleString("[Channel Card]");
     }
-    tv["%%EXTRA_CLS%%"] = "channel-card";
+    tv[TPH_EXTRA_CLS] = "channel-card";
 }
 
 void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xmlParser, xmlNodePtr parentNode, const std::string& finderFeedXPath, const Session& session, TemplateValues& tv) const
@@ -1305,18 +1484,18 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
     
     const std::string portraitDir = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait" : "Portrait";
     
-    tv["%%CARDNAME%%"] = nodes["nickname"];
-    tv["%%CHANNELS%%"] = getLocaleString("Channels");
-    tv["%%MESSAGE%%"] = nodes["desc"];
-    tv["%%EXTRA_CLS%%"] = "channels";
+    tv[TPH_CARDNAME] = nodes["nickname"];
+    tv[TPH_CHANNELS] = getLocaleString("Channels");
+    tv[TPH_MESSAGE] = nodes["desc"];
+    tv[TPH_EXTRA_CLS] = "channels";
     
     if (!thumbUrl.empty())
     {
         tv.setName("channels");
-        tv["%%MSGTYPE%%"] = "channels";
+        tv[TPH_MSGTYPE] = "channels";
         std::string thumbFile = session.getOutputFileName() + "_files/" + msgId + ".jpg";
 		std::string localThumbFile = session.getOutputFileName() + "_files" + DIR_SEP + msgId + ".jpg";
-        tv["%%CHANNELTHUMBPATH%%"] = thumbFile;
+        tv[TPH_CHANNELTHUMBPATH] = thumbFile;
         ensureDirectoryExisted(combinePath(m_outputPath, session.getOutputFileName() + "_files"));
 
 #ifdef USING_DOWNLOADER
@@ -1328,7 +1507,7 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
         if (!nodes["avatar"].empty())
         {
             std::string fileName = nodes["username"].empty() ? nodes["objectId"] : nodes["username"];
-            tv["%%CARDIMGPATH%%"] = portraitDir + "/" + fileName + ".jpg";
+            tv[TPH_CARDIMGPATH] = portraitDir + "/" + fileName + ".jpg";
 			std::string localPortraitDir = normalizePath(portraitDir);
             std::string localFile = combinePath(localPortraitDir, fileName + ".jpg");
             ensureDirectoryExisted(combinePath(m_outputPath, localPortraitDir));
@@ -1339,18 +1518,18 @@ void MessageParser::parseChannels(const std::string& msgId, const XmlParser& xml
 #endif
         }
 
-        tv["%%CHANNELURL%%"] = videoNodes["url"];
+        tv[TPH_CHANNELURL] = videoNodes["url"];
     }
 }
 
 bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg, const std::string& title, const std::string& message, std::vector<TemplateValues>& tvs) const
 {
-    std::string portraitPath = ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
+    std::string portraitPath = getPortraitPath(session);
     
     tvs.push_back(TemplateValues("notice"));
     TemplateValues& beginTv = tvs.back();
-    beginTv["%%MESSAGE%%"] = formatString(getLocaleString("<< %s"), title.c_str());
-    beginTv["%%EXTRA_CLS%%"] = "fmsgtag";   // tag for forwarded msg
+    beginTv[TPH_MESSAGE] = formatString(getLocaleString("<< %s"), title.c_str());
+    beginTv[TPH_EXTRA_CLS] = "fmsgtag";   // tag for forwarded msg
     
     XmlParser xmlParser(message);
     XmlParser::XPathEnumerator enumerator(xmlParser, "/recordinfo/datalist/dataitem");
@@ -1383,8 +1562,8 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
             writeFile(combinePath(m_outputPath, "../dbg", "fwdmsg_" + fmsg.dataType + ".txt"), fmsg.rawMessage);
 #endif
             TemplateValues& tv = *(tvs.emplace(tvs.end(), "msg"));
-            tv["%%ALIGNMENT%%"] = "left";
-            tv["%%EXTRA_CLS%%"] = "fmsg";   // forwarded msg
+            tv[TPH_ALIGNMENT] = "left";
+            tv[TPH_EXTRA_CLS] = "fmsg";   // forwarded msg
             
             std::string nestedFwdMsgTitle;
             std::string nestedFwdMsg;
@@ -1432,21 +1611,21 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
                     break;
             }
             
-            tv["%%NAME%%"] = fmsg.displayName;
-            tv["%%MSGID%%"] = msg.msgId + "_" + fmsg.dataId;
-            tv["%%TIME%%"] = fmsg.srcMsgTime.empty() ? fmsg.msgTime : fromUnixTime(static_cast<unsigned int>(std::atoi(fmsg.srcMsgTime.c_str())));
+            tv[TPH_NAME] = fmsg.displayName;
+            tv[TPH_MSGID] = msg.msgId + "_" + fmsg.dataId;
+            tv[TPH_TIME] = fmsg.srcMsgTime.empty() ? fmsg.msgTime : fromUnixTime(static_cast<unsigned int>(std::atoi(fmsg.srcMsgTime.c_str())));
 
             // std::string localPortrait;
             // bool hasPortrait = false;
             // localPortrait = combinePath(portraitPath, fmsg.usrName + ".jpg");
             if (copyPortraitIcon(&session, fmsg.usrName, fmsg.portrait, fmsg.portraitLD, combinePath(m_outputPath, portraitPath)))
             {
-                tv["%%AVATAR%%"] = portraitPath + "/" + fmsg.usrName + ".jpg";
+                tv[TPH_AVATAR] = portraitPath + "/" + fmsg.usrName + ".jpg";
             }
             else
             {
                 ensureDefaultPortraitIconExisted(portraitPath);
-                tv["%%AVATAR%%"] = portraitPath + "DefaultProfileHead@2x.png";
+                tv[TPH_AVATAR] = portraitPath + "DefaultProfileHead@2x.png";
             }
 
             if ((dataType == FWDMSG_DATATYPE_NESTED_FWD_MSG) && !nestedFwdMsg.empty())
@@ -1458,8 +1637,8 @@ bool MessageParser::parseForwardedMsgs(const Session& session, const WXMSG& msg,
     
     tvs.push_back(TemplateValues("notice"));
     TemplateValues& endTv = tvs.back();
-    endTv["%%MESSAGE%%"] = formatString(getLocaleString("%s Ends >>"), title.c_str());
-    endTv["%%EXTRA_CLS%%"] = "fmsgtag";   // tag for forwarded msg
+    endTv[TPH_MESSAGE] = formatString(getLocaleString("%s Ends >>"), title.c_str());
+    endTv[TPH_EXTRA_CLS] = "fmsgtag";   // tag for forwarded msg
     
     return true;
 }
@@ -1488,8 +1667,20 @@ bool MessageParser::copyPortraitIcon(const Session* session, const Friend& f, co
 bool MessageParser::copyPortraitIcon(const Session* session, const std::string& usrName, const std::string& usrNameHash, const std::string& portraitUrl, const std::string& portraitUrlLD, const std::string& destPath) const
 {
     std::string destFileName = usrName + ".jpg";
+    std::string portraitFile;
+    bool hasPortrait = false;
+    bool urlTried = !portraitUrl.empty() || !portraitUrlLD.empty();
+    if (NULL != m_portraitManager)
+    {
+        portraitFile = combinePath(destPath, destFileName);
+        if (!m_portraitManager->claim(portraitFile, urlTried, hasPortrait))
+        {
+            return hasPortrait;
+        }
+    }
+    
     std::string avatarPath = "share/" + m_myself.getHash() + "/session/headImg/" + usrNameHash + ".pic";
-    bool hasPortrait = m_iTunesDbShare.copyFile(avatarPath, destPath, destFileName);
+    hasPortrait = m_iTunesDbShare.copyFile(avatarPath, destPath, destFileName);
     if (!hasPortrait)
     {
         if (portraitUrl.empty() && portraitUrlLD.empty())
@@ -1501,6 +1692,7 @@ bool MessageParser::copyPortraitIcon(const Session* session, const std::string&
                 std::string urlLD = f->getSecondaryPortrait();
                 if (!url.empty() || !urlLD.empty())
                 {
+                    urlTried = true;
 					std::string localDestPath = normalizePath(destPath);
 #ifdef USING_DOWNLOADER
                     m_downloader.addTask(url, combinePath(localDestPath, destFileName), 0, "avatar");
@@ -1523,12 +1715,20 @@ bool MessageParser::copyPortraitIcon(const Session* session, const std::string&
         }
     }
     
+    if (NULL != m_portraitManager)
+    {
+        m_portraitManager->add(portraitFile, hasPortrait, urlTried);
+    }
     return hasPortrait;
 }
 
 void MessageParser::ensureDefaultPortraitIconExisted(const std::string& portraitPath) const
 {
     std::string dest = combinePath(m_outputPath, portraitPath);
+    if (NULL != m_portraitManager && !m_portraitManager->addDefaultIcon(dest))
+    {
+        return;
+    }
     ensureDirectoryExisted(dest);
     dest = combinePath(dest, "DefaultProfileHead@2x.png");
     if (!existsFile(dest))
@@ -1536,3 +1736,29 @@ void MessageParser::ensureDefaultPortraitIconExisted(const std::string& portrait
         copyFile(combinePath(m_resPath, "res", "DefaultProfileHead@2x.png"), dest, false);
     }
 }
+
+bool MessageParser::copyFileAsync(const Session& session, const std::string& vpath, const std::string& destPath, const std::string& destFileName) const
+{
+    std::string destFullPath = normalizePath(combinePath(destPath, destFileName));
+    if (existsFile(destFullPath))
+    {
+        return true;
+    }
+    
+    const ITunesFile* file = m_iTunesDb.findITunesFile(vpath);
+    if (NULL == file)
+    {
+        return false;
+    }
+    std::string srcPath = m_iTunesDb.getRealPath(*file);
+    if (srcPath.empty())
+    {
+        return false;
+    }
+    normalizePath(srcPath);
+    
+    // The template is decided by the presence in backup, the copy overlaps with parsing
+    ensureDirectoryExisted(destPath);
+    m_taskManager.copyFile(&session, srcPath, destFullPath, ITunesDb::getModifiedTime(*file), m_iTunesDb.getCopyFlags());
+    return true;
+}
@@ -10,6 +10,9 @@
 #define MessageParser_h
 
 #include <string>
+#include <mutex>
+#include <condition_variable>
+#include <set>
 #ifndef NDEBUG
 #include <cassert>
 #endif
@@ -40,6 +43,8 @@ enum SessionParsingOption
     SPO_ICON_IN_SESSION = 1 << 21,     // Put Head Icon and Emoji files in the folder of session
     SPO_SYNC_LOADING = 1 << 22,
     SPO_SUPPORT_FILTER = 1 << 23,
+    SPO_HARD_LINK_FILES = 1 << 24,     // Hard link the media files of the backup instead of copying them if possible
+    SPO_DEDUP_FILES = 1 << 25,         // Materialize the same media once in the export and link the other references to it
     
     SPO_OUTPUT_DBG_LOGS = 1 << 29,
     SPO_INCREMENTAL_EXP = 1 << 30,
@@ -84,20 +89,123 @@ struct WXFWDMSG
 #endif
 };
 
+// Portraits written into the portrait directories of an export, shared by the session workers
+class PortraitManager
+{
+public:
+    // True if the caller should copy the portrait and then call add(), otherwise hasPortrait is the earlier result.
+    // A miss without any url is not final: a later caller with urls claims the portrait again
+    bool claim(const std::string& portraitFile, bool hasUrl, bool& hasPortrait)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::map<std::string, PortraitState>::iterator it = m_portraits.find(portraitFile);
+        while (it != m_portraits.end() && it->second == PORTRAIT_PENDING)
+        {
+            m_cond.wait(lock);
+            it = m_portraits.find(portraitFile);
+        }
+        if (it != m_portraits.end() && (it->second != PORTRAIT_NO_URL || !hasUrl))
+        {
+            hasPortrait = (it->second == PORTRAIT_COPIED);
+            return false;
+        }
+        m_portraits[portraitFile] = PORTRAIT_PENDING;
+        return true;
+    }
+    
+    void add(const std::string& portraitFile, bool hasPortrait, bool urlTried)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_portraits[portraitFile] = hasPortrait ? PORTRAIT_COPIED : (urlTried ? PORTRAIT_MISSING : PORTRAIT_NO_URL);
+        m_cond.notify_all();
+    }
+    
+    // True only for the first caller of the directory, which copies the default icon
+    bool addDefaultIcon(const std::string& portraitDir)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_defaultIcons.insert(portraitDir).second;
+    }
+    
+private:
+    enum PortraitState
+    {
+        PORTRAIT_PENDING = 0,
+        PORTRAIT_COPIED,
+        PORTRAIT_NO_URL,
+        PORTRAIT_MISSING,
+    };
+    
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::map<std::string, PortraitState> m_portraits;
+    std::set<std::string> m_defaultIcons;
+};
+
+// Sender of chatroom messages, resolved once per session
+struct WXSENDER
+{
+    std::string displayName;    // Escaped unless SPO_IGNORE_HTML_ENC
+    const Friend *user;
+    std::string avatar;
+    bool portraitCopied;
+    
+    WXSENDER() : user(NULL), portraitCopied(false)
+    {
+    }
+};
+
+// Placeholders (%%NAME%%) in the templates of messages, used as the slot index in TemplateValues
+enum TemplatePlaceholder
+{
+    TPH_ALIGNMENT = 0,
+    TPH_APPICONPATH,
+    TPH_APPNAME,
+    TPH_AUDIOPATH,
+    TPH_AVATAR,
+    TPH_CARDIMGPATH,
+    TPH_CARDNAME,
+    TPH_CARDTYPE,
+    TPH_CHANNELS,
+    TPH_CHANNELTHUMBPATH,
+    TPH_CHANNELURL,
+    TPH_EMOJIPATH,
+    TPH_EXTRA_CLS,
+    TPH_IMGPATH,
+    TPH_IMGTHUMBPATH,
+    TPH_MESSAGE,
+    TPH_MSGID,
+    TPH_MSGTYPE,
+    TPH_NAME,
+    TPH_RAWEMOJIPATH,
+    TPH_REFERMSG,
+    TPH_REFERNAME,
+    TPH_SHARINGIMGPATH,
+    TPH_SHARINGTITLE,
+    TPH_SHARINGURL,
+    TPH_THUMBPATH,
+    TPH_TIME,
+    TPH_VIDEOHEIGHT,
+    TPH_VIDEOPATH,
+    TPH_VIDEOWIDTH,
+    TPH_MAX
+};
+
+const char* getTemplatePlaceholderName(int placeholder);
+int findTemplatePlaceholder(const char* name, size_t length);
+
 class TemplateValues
 {
 private:
     std::string m_name;
-    std::map<std::string, std::string> m_values;
+    std::string m_values[TPH_MAX];
+    uint64_t m_mask;    // Bits of assigned slots
     
 public:
-    using const_iterator = std::map<std::string, std::string>::const_iterator;
-
-public:
-    TemplateValues()
+    TemplateValues() : m_mask(0)
     {
     }
-    TemplateValues(const std::string& name) : m_name(name)
+    TemplateValues(const std::string& name) : m_name(name), m_mask(0)
     {
     }
     std::string getName() const
@@ -108,28 +216,30 @@ public:
     {
         m_name = name;
     }
-    std::string& operator[](const std::string& k)
+    std::string& operator[](TemplatePlaceholder k)
     {
+        m_mask |= (1ull << k);
         return m_values[k];
     }
-    bool hasValue(const std::string& key) const
-    {
-        return m_values.find(key) != m_values.cend();
-    }
-    
-    const_iterator cbegin() const
+    bool hasValue(TemplatePlaceholder k) const
     {
-        return m_values.cbegin();
+        return (m_mask & (1ull << k)) != 0;
     }
-    
-    const_iterator cend() const
+    const std::string& getValue(int k) const
     {
-        return m_values.cend();
+        return m_values[k];
     }
     
     void clear()
     {
-        m_values.clear();
+        for (int idx = 0; idx < TPH_MAX; ++idx)
+        {
+            if (m_mask & (1ull << idx))
+            {
+                m_values[idx].clear();
+            }
+        }
+        m_mask = 0;
     }
     
     void clearName()
@@ -138,6 +248,32 @@ public:
     }
 };
 
+// Template compiled into literal spans and placeholder slots once, so a message is rendered in one pass.
+// Unknown placeholders are dropped, which is the same as erasing the unreplaced %%NAME%% from the output
+class CompiledTemplate
+{
+private:
+    struct Token
+    {
+        size_t offset;
+        size_t length;
+        int placeholder;    // -1 for literal
+    };
+    
+    std::string m_text;
+    std::vector<Token> m_tokens;
+    size_t m_literalLength;
+    
+public:
+    CompiledTemplate() : m_literalLength(0)
+    {
+    }
+    
+    void compile(const std::string& text);
+    // Append the content into output
+    void render(const TemplateValues& tv, std::string& output) const;
+};
+
 struct WechatTemplateHandler
 {
     XmlParser& m_xmlParser;
@@ -298,7 +434,14 @@ public:
     
     MessageParser(const ITunesDb& iTunesDb, const ITunesDb& iTunesDbShare, TaskManager& taskManager, Friends& friends, Friend myself, int options, const std::string& resPath, const std::string& outputPath, std::function<std::string(const std::string&)>& localeFunc);
     
+    void setPortraitManager(PortraitManager* portraitManager)
+    {
+        m_portraitManager = portraitManager;
+    }
+    
     bool parse(WXMSG& msg, const Session& session, std::vector<TemplateValues>& tvs) const;
+    // Materialize the portraits of all members of the chatroom before its messages are parsed
+    void prefetchPortraits(const Session& session) const;
     
     bool copyPortraitIcon(const Session* session, const std::string& usrName, const std::string& portraitUrl, const std::string& portraitUrlLD, const std::string& destPath) const;
     bool copyPortraitIcon(const Session* session, const std::string& usrName, const std::string& usrNameHash, const std::string& portraitUrl, const std::string& portraitUrlLD, const std::string& destPath) const;
@@ -326,26 +469,26 @@ protected:
     void parseSystem(const WXMSG& msg, const Session& session, TemplateValues& tv) const;
     
     // APP MSG
-    void parseAppMsgText(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgImage(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgAudio(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgVideo(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgEmotion(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgOpen(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgEmoji(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgRtLocation(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, std::string& fwdMsg, std::string& fwdMsgTitle, TemplateValues& tv) const;
-    void parseAppMsgCard(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgText(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgImage(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgAudio(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgVideo(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgEmotion(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgUrl(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgAttachment(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgOpen(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgEmoji(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgRtLocation(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgFwdMsg(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, std::string& fwdMsg, std::string& fwdMsgTitle, TemplateValues& tv) const;
+    void parseAppMsgCard(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
     void parseAppMsgChannelCard(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
     void parseAppMsgChannels(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
     void parseAppMsgRefer(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgTransfer(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgRedPacket(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgReaderType(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgUnknownType(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
-    void parseAppMsgDefault(const WXAPPMSG& appMsg, const XmlParser& xmlParser, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgTransfer(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgRedPacket(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgReaderType(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgUnknownType(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
+    void parseAppMsgDefault(const WXAPPMSG& appMsg, const XmlExtractor& extractor, const Session& session, TemplateValues& tv) const;
 
     // FORWARDEWD MSG
     void parseFwdMsgText(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const;
@@ -361,9 +504,9 @@ protected:
     void parseFwdMsgChannelCard(const WXFWDMSG& fwdMsg, const XmlParser& xmlParser, xmlNodePtr itemNode, const Session& session, TemplateValues& tv) const;
     
     // Implementation
-    void parseImage(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& srcPre, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, TemplateValues& tv) const;
-    void parseVideo(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, const std::string& width, const std::string& height, TemplateValues& tv) const;
-    void parseFile(const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& fileName, TemplateValues& tv) const;
+    void parseImage(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& srcPre, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, TemplateValues& tv) const;
+    void parseVideo(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& srcThumb, const std::string& destThumb, const std::string& width, const std::string& height, TemplateValues& tv) const;
+    void parseFile(const Session& session, const std::string& sessionPath, const std::string& sessionAssertsPath, const std::string& src, const std::string& dest, const std::string& fileName, TemplateValues& tv) const;
     void parseCard(const Session& session, const std::string& sessionPath, const std::string& portraitDir, const std::string& cardMessage, TemplateValues& tv) const;
     void parseChannelCard(const Session& session, const std::string& portraitDir, const std::string& usrName, const std::string& avatar, const std::string& avatarLD, const std::string& name, TemplateValues& tv) const;
     void parseChannels(const std::string& msgId, const XmlParser& xmlParser, xmlNodePtr parentNode, const std::string& finderFeedXPath, const Session& session, TemplateValues& tv) const;
@@ -383,7 +526,14 @@ protected:
         }
     }
     
+    std::string getPortraitPath(const Session& session) const
+    {
+        return ((m_options & SPO_ICON_IN_SESSION) == SPO_ICON_IN_SESSION) ? session.getOutputFileName() + "_files/Portrait/" : "Portrait/";
+    }
     void ensureDefaultPortraitIconExisted(const std::string& portraitPath) const;
+    WXSENDER& resolveSender(const Session& session, const std::string& senderId, const std::string& portraitPath) const;
+    // Queue the copy into TaskManager, true if the file exists in backup
+    bool copyFileAsync(const Session& session, const std::string& vpath, const std::string& destPath, const std::string& destFileName) const;
 protected:
     const ITunesDb& m_iTunesDb;
     const ITunesDb& m_iTunesDbShare;
@@ -399,11 +549,21 @@ protected:
     std::string m_userBase;
 
     std::function<std::string(const std::string&)> m_localFunction;
+    PortraitManager* m_portraitManager;
     
 protected:
-#ifndef USING_ASYNC_TASK_FOR_MP3
-    mutable std::vector<unsigned char> m_pcmData;  // buffer
-#endif
+    // Single pass extractors of the common message types, the DOM is only built for the complex ones
+    mutable XmlExtractor m_voiceExtractor;
+    mutable XmlExtractor m_pushMailExtractor;
+    mutable XmlExtractor m_videoExtractor;
+    mutable XmlExtractor m_emojiExtractor;
+    mutable XmlExtractor m_locationExtractor;
+    mutable XmlExtractor m_appMsgExtractor;
+    mutable XmlExtractor m_sysMsgExtractor;
+    
+    // Senders of the session being parsed, keyed by the raw sender id
+    mutable const Session* m_senderSession;
+    mutable std::map<std::string, WXSENDER> m_senders;
 };
 
 #endif /* MessageParser_h */
@@ -7,134 +7,87 @@
 //
 
 #include "RawMessage.h"
-#ifdef _WIN32
-#include <atlstr.h>
+#include <fstream>
+#ifdef _WIN32
+#include <atlstr.h>
 #endif
 
-bool convertUnknownField(const UnknownField &uf, std::string& value)
+RawFieldPath::RawFieldPath(const char *fields) : m_depth(0)
 {
-    if (uf.type() == UnknownField::TYPE_LENGTH_DELIMITED)
+    unsigned int fieldNumber = 0;
+    bool hasDigit = false;
+    for (const char *p = fields; ; ++p)
     {
-        value.assign(uf.length_delimited().c_str(), uf.GetLengthDelimitedSize());
-        return true;
-    }
-    else if (uf.type() == UnknownField::TYPE_VARINT)
-    {
-        value = std::to_string(uf.varint());
-        return true;
-    }
-    else if (uf.type() == UnknownField::TYPE_FIXED32)
-    {
-        value = std::to_string(uf.fixed32());
-        return true;
-    }
-    else if (uf.type() == UnknownField::TYPE_FIXED64)
-    {
-        value = std::to_string(uf.fixed64());
-        return true;
+        if (*p >= '0' && *p <= '9')
+        {
+            fieldNumber = fieldNumber * 10 + (*p - '0');
+            hasDigit = true;
+            continue;
+        }
+        if ((*p != '.' && *p != '\0') || !hasDigit || fieldNumber == 0 || m_depth >= RAW_FIELD_PATH_MAX_DEPTH)
+        {
+            m_depth = 0;
+            return;
+        }
+        m_fields[m_depth++] = fieldNumber;
+        if (*p == '\0')
+        {
+            break;
+        }
+        fieldNumber = 0;
+        hasDigit = false;
     }
-    
-    return false;
 }
 
-bool convertUnknownField(const UnknownField &uf, int& value)
+static uint64_t readLittleEndian(const char *p, int size)
 {
-    if (uf.type() == UnknownField::TYPE_VARINT)
-    {
-        value = static_cast<int>(uf.varint());
-        return true;
-    }
-    else if (uf.type() == UnknownField::TYPE_FIXED32)
-    {
-        value = static_cast<int>(uf.fixed32());
-        return true;
-    }
-    else if (uf.type() == UnknownField::TYPE_FIXED64)
+    uint64_t value = 0;
+    for (int idx = size - 1; idx >= 0; --idx)
     {
-        value = static_cast<int>(uf.fixed64());
-        return true;
+        value = (value << 8) | static_cast<unsigned char>(p[idx]);
     }
-    
-    return false;
-}
-
-std::string RawMessage::toUtf8String(const std::string& str)
-{
-    return UnescapeCEscapeString(str);
+    return value;
 }
 
-RawMessage::RawMessage() : m_pool(NULL), m_factory(NULL), m_message(NULL)
+RawMessage::RawMessage() : m_data(NULL), m_length(0)
 {
 }
 
 RawMessage::~RawMessage()
 {
-    release();
-}
-
-void RawMessage::release()
-{
-    if (NULL != m_message)
-    {
-        delete m_message;
-        m_message = NULL;
-    }
-    if (NULL != m_factory)
-    {
-        delete m_factory;
-        m_factory = NULL;
-    }
-    if (NULL != m_pool)
-    {
-        delete m_pool;
-        m_pool = NULL;
-    }
 }
 
 bool RawMessage::merge(const char *data, int length)
 {
-    release();
-    
-    m_pool = new DescriptorPool();
-    FileDescriptorProto file;
-    file.set_name("empty_message.proto");
-    file.add_message_type()->set_name("EmptyMessage");
-    GOOGLE_CHECK(m_pool->BuildFile(file) != NULL);
-
-    const Descriptor *descriptor = m_pool->FindMessageTypeByName("EmptyMessage");
-    if (NULL == descriptor)
-    {
-        // FormatError(outputString, lengthOfOutputString, ERROR_NO_MESSAGE_TYPE, src->messageTypeName);
-        return false;
-    }
-
-    m_factory = new DynamicMessageFactory(m_pool);
-    const Message *message = m_factory->GetPrototype(descriptor);
-    if (NULL == message)
+    m_data = NULL;
+    m_length = 0;
+    if (length < 0 || (NULL == data && length > 0))
     {
         return false;
     }
     
-    m_message = message->New();
-    if (NULL == m_message)
+    // Only the top level is checked, nested messages are checked when they are walked into
+    const char *p = data;
+    const char *limit = data + length;
+    unsigned int fieldNumber = 0;
+    RAW_FIELD field;
+    while (p < limit)
     {
-        return false;
+        if (!readField(p, limit, fieldNumber, field) || field.wireType == WIRETYPE_END_GROUP)
+        {
+            return false;
+        }
     }
     
-    if (!m_message->ParseFromArray(reinterpret_cast<const void *>(data), length))
-    {
-        delete m_message;
-        m_message = NULL;
-        return false;
-    }
-
+    m_data = data;
+    m_length = static_cast<size_t>(length);
     return true;
 }
 
 bool RawMessage::mergeFile(const std::string& path)
 {
-    release();
-    
+    m_buffer.clear();
+
 #ifdef _WIN32
     CA2W pszW(path.c_str(), CP_UTF8);
     std::ifstream file(pszW, std::ios::in|std::ios::binary|std::ios::ate);
@@ -144,113 +97,190 @@ bool RawMessage::mergeFile(const std::string& path)
     if (file.is_open())
     {
         std::streampos size = file.tellg();
-        std::vector<char> buffer;
-        buffer.resize(size);
+        if (size <= 0)
+        {
+            return merge(NULL, 0);
+        }
+        m_buffer.resize(static_cast<size_t>(size));
         
         file.seekg (0, std::ios::beg);
-        file.read((char *)(&buffer[0]), size);
+        file.read(&m_buffer[0], size);
         file.close();
-
-        return merge(&buffer[0], static_cast<int>(size));
+        
+        return merge(&m_buffer[0], static_cast<int>(size));
     }
     
     return false;
 }
 
-/*
-bool RawMessage::parse(int fieldNumber, std::string& value)
+bool RawMessage::readField(const char*& p, const char* limit, unsigned int& fieldNumber, RAW_FIELD& field, int depth)
 {
-    if (NULL == m_message)
+    // Tags take 5 bytes at most and keep the low 32 bits, as protobuf reads them
+    uint32_t tag = 0;
+    p = calcVarint32Ptr(p, limit, &tag);
+    if (NULL == p || (tag >> 3) == 0)
     {
         return false;
     }
+    fieldNumber = tag >> 3;
+    field.wireType = static_cast<int>(tag & 7);
+    field.value = 0;
+    field.data = NULL;
+    field.length = 0;
     
-    const Reflection* reflection = m_message->GetReflection();
-    const UnknownFieldSet& ufs = reflection->GetUnknownFields(*m_message);
-    
-    for (int fieldIdx = 0; fieldIdx < ufs.field_count(); ++fieldIdx)
+    switch (field.wireType)
     {
-        const UnknownField uf = ufs.field(fieldIdx);
-        if (uf.number() == fieldNumber)
+        case WIRETYPE_VARINT:
+            p = GetVarint64Ptr(p, limit, &field.value);
+            return NULL != p;
+        case WIRETYPE_FIXED64:
+        case WIRETYPE_FIXED32:
+        {
+            int size = (field.wireType == WIRETYPE_FIXED64) ? 8 : 4;
+            if (limit - p < size)
+            {
+                return false;
+            }
+            field.value = readLittleEndian(p, size);
+            p += size;
+            return true;
+        }
+        case WIRETYPE_LENGTH_DELIMITED:
         {
-            value = uf.length_delimited();
+            uint64_t length = 0;
+            p = GetVarint64Ptr(p, limit, &length);
+            if (NULL == p || length > static_cast<uint64_t>(limit - p))
+            {
+                return false;
+            }
+            field.data = p;
+            field.length = static_cast<size_t>(length);
+            p += length;
             return true;
         }
+        case WIRETYPE_START_GROUP:
+        {
+            if (depth >= RAW_GROUP_MAX_DEPTH)
+            {
+                return false;
+            }
+            // The group covers the fields before the matching END_GROUP
+            field.data = p;
+            unsigned int innerFieldNumber = 0;
+            RAW_FIELD innerField;
+            const char *end = p;
+            while (readField(p, limit, innerFieldNumber, innerField, depth + 1))
+            {
+                if (innerField.wireType == WIRETYPE_END_GROUP)
+                {
+                    field.length = static_cast<size_t>(end - field.data);
+                    return innerFieldNumber == fieldNumber;
+                }
+                end = p;
+            }
+            return false;
+        }
+        case WIRETYPE_END_GROUP:
+            return depth > 0;
+        default:
+            break;
     }
-
+    
     return false;
 }
 
-bool RawMessage::parseFile(const std::string& path, std::string& fields, std::string& value)
+bool RawMessage::find(const RawFieldPath& path, RAW_FIELD& field) const
 {
-    std::string data = readFile(path);
-    return parse(data, fields, value);
-}
-
-bool RawMessage::parse(const std::string& data, std::string& fields, std::string& value)
-{
-    std::queue<int> fieldNumbers;
+    if (NULL == m_data || path.getDepth() == 0)
+    {
+        return false;
+    }
     
-    std::string::size_type start = 0;
-    std::string::size_type end = fields.find('.');
-    while (end != std::string::npos)
+    const char *p = m_data;
+    const char *limit = m_data + m_length;
+    for (int idx = 0; idx < path.getDepth(); ++idx)
     {
-        std::string field = fields.substr(start, end - start);
-        if (field.empty())
+        // The first field with the number wins
+        unsigned int fieldNumber = 0;
+        bool found = false;
+        while (p < limit)
+        {
+            if (!readField(p, limit, fieldNumber, field) || field.wireType == WIRETYPE_END_GROUP)
+            {
+                return false;
+            }
+            if (fieldNumber == path.getField(idx))
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
         {
             return false;
         }
         
-        int fieldNumber = std::stoi(field);
-        fieldNumbers.push(fieldNumber);
-        start = end + 1;
-        end = fields.find('.', start);
+        if (idx < path.getDepth() - 1)
+        {
+            if (field.wireType != WIRETYPE_LENGTH_DELIMITED && field.wireType != WIRETYPE_START_GROUP)
+            {
+                return false;
+            }
+            p = field.data;
+            limit = field.data + field.length;
+        }
+    }
+    
+    return true;
+}
+
+bool RawMessage::parse(const RawFieldPath& path, const char*& data, size_t& length) const
+{
+    RAW_FIELD field;
+    if (!find(path, field) || field.wireType != WIRETYPE_LENGTH_DELIMITED)
+    {
+        return false;
     }
-    std::string field = fields.substr(start, end);
-    if (field.empty())
+    data = field.data;
+    length = field.length;
+    return true;
+}
+
+bool RawMessage::parse(const RawFieldPath& path, std::string& value) const
+{
+    RAW_FIELD field;
+    if (!find(path, field))
     {
         return false;
     }
-    int fieldNumber = std::stoi(field);
-    fieldNumbers.push(fieldNumber);
     
-    return parse(data, fieldNumbers, value);
+    if (field.wireType == WIRETYPE_LENGTH_DELIMITED)
+    {
+        value.assign(field.data, field.length);
+        return true;
+    }
+    else if (field.wireType == WIRETYPE_VARINT || field.wireType == WIRETYPE_FIXED32 || field.wireType == WIRETYPE_FIXED64)
+    {
+        value = std::to_string(field.value);
+        return true;
+    }
+    
+    return false;
 }
 
-bool RawMessage::parse(const std::string& data, std::queue<int>& fieldNumbers, std::string& value)
+bool RawMessage::parse(const RawFieldPath& path, int& value) const
 {
-    if (fieldNumbers.empty())
+    RAW_FIELD field;
+    if (!find(path, field))
     {
         return false;
     }
-
-    UnknownFieldSet unknownFields;
-    if (unknownFields.ParseFromString(data))
+    
+    if (field.wireType == WIRETYPE_VARINT || field.wireType == WIRETYPE_FIXED32 || field.wireType == WIRETYPE_FIXED64)
     {
-        int fieldNumber = fieldNumbers.front();
-        fieldNumbers.pop();
-        
-        for (int fieldIdx = 0; fieldIdx < unknownFields.field_count(); ++fieldIdx)
-        {
-            const UnknownField uf = unknownFields.field(fieldIdx);
-            if (uf.number() == fieldNumber)
-            {
-                if (fieldNumbers.empty())
-                {
-                    value = uf.length_delimited();
-                    return true;
-                }
-                else
-                {
-                    std::string embeded_data = uf.length_delimited();
-                    return parse(embeded_data, fieldNumbers, value);
-                }
-
-                break;
-            }
-        }
+        value = static_cast<int>(field.value);
+        return true;
     }
-
+    
     return false;
 }
-*/
@@ -7,147 +7,78 @@
 //
 
 #include <string>
-#include <queue>
-#include <iostream>
-#include <fstream>
-#include <iomanip>
-
-#include <google/protobuf/descriptor.h>
-#include <google/protobuf/descriptor.pb.h>
-#include <google/protobuf/descriptor_database.h>
-#include <google/protobuf/dynamic_message.h>
-#include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl.h>
-#include <google/protobuf/io/tokenizer.h>
-#include <google/protobuf/compiler/parser.h>
-// #include <google/protobuf/compiler/importer.h>
-#include <google/protobuf/stubs/strutil.h>
-#include <google/protobuf/text_format.h>
+#include <vector>
+#include <cstdint>
 
 #include "Utils.h"
 
-
-using namespace google::protobuf;
-using namespace google::protobuf::io;
-using namespace google::protobuf::compiler;
-
 #ifndef RawMessage_h
 #define RawMessage_h
 
-bool convertUnknownField(const UnknownField &uf, std::string& value);
-bool convertUnknownField(const UnknownField &uf, int& value);
+#define RAW_FIELD_PATH_MAX_DEPTH        8
+#define RAW_GROUP_MAX_DEPTH             64
 
-class RawMessage
+#define WIRETYPE_VARINT                 0
+#define WIRETYPE_FIXED64                1
+#define WIRETYPE_LENGTH_DELIMITED       2
+#define WIRETYPE_START_GROUP            3
+#define WIRETYPE_END_GROUP              4
+#define WIRETYPE_FIXED32                5
+
+// Field numbers separated by dots, such as "1.1.6", parsed once and reusable for any message
+class RawFieldPath
 {
 public:
-    RawMessage();
-    ~RawMessage();
-    
-    bool merge(const char *data, int length);
-    bool mergeFile(const std::string& path);
-    // bool parse(int fieldNumber, std::string& value);
+    RawFieldPath(const char *fields);
     
-    template<class T>
-    bool parse(const std::string& fields, T& value);
-    
-    // static bool parse(const std::string& data, std::string& fields, std::string& value);
-    // static bool parse(const std::string& data, std::string& fields, int& value);
-    // static bool parseFile(const std::string& path, std::string& fields, std::string& value);
-    
-    static std::string toUtf8String(const std::string& str);
+    int getDepth() const
+    {
+        return m_depth;
+    }
     
+    unsigned int getField(int index) const
+    {
+        return m_fields[index];
+    }
+
 private:
-    
-    void release();
-    // static bool parse(const std::string& data, std::queue<int>& fieldNumbers, std::string& value);
+    unsigned int m_fields[RAW_FIELD_PATH_MAX_DEPTH];
+    int m_depth;    // 0 if the path is invalid
+};
 
-    google::protobuf::DescriptorPool* m_pool;
-    google::protobuf::DynamicMessageFactory* m_factory;
-    google::protobuf::Message* m_message;
+// A field in the wire data, data points into the buffer of the message
+struct RAW_FIELD
+{
+    int wireType;
+    uint64_t value;     // Varint, fixed32 and fixed64
+    const char *data;   // Length-delimited and group
+    size_t length;
 };
 
-template<class T>
-inline bool RawMessage::parse(const std::string& fields, T& value)
+// Walks the protobuf wire format in place: only the fields along the path are visited and nothing is copied
+class RawMessage
 {
-    if (NULL == m_message)
-    {
-        return false;
-    }
-    
-    std::vector<unsigned int> fieldNumbers;
-    
-    std::string::size_type start = 0;
-    std::string::size_type end = fields.find('.');
-    while (end != std::string::npos)
-    {
-        std::string field = fields.substr(start, end - start);
-        if (field.empty())
-        {
-            return false;
-        }
-        
-        int fieldNumber = std::stoi(field);
-        fieldNumbers.push_back(fieldNumber);
-        start = end + 1;
-        end = fields.find('.', start);
-    }
-    std::string field = fields.substr(start, end);
-    if (field.empty())
-    {
-        return false;
-    }
-    int fieldNumber = std::stoi(field);
-    fieldNumbers.push_back(fieldNumber);
+public:
+    RawMessage();
+    ~RawMessage();
     
-    const Reflection* reflection = m_message->GetReflection();
-    const UnknownFieldSet& ufs = reflection->GetUnknownFields(*m_message);
+    // data is not copied, it should outlive the message
+    bool merge(const char *data, int length);
+    bool mergeFile(const std::string& path);
     
-    const UnknownFieldSet* pUfs = &ufs;
+    bool find(const RawFieldPath& path, RAW_FIELD& field) const;
+    // Span of a length-delimited field in the buffer
+    bool parse(const RawFieldPath& path, const char*& data, size_t& length) const;
+    bool parse(const RawFieldPath& path, std::string& value) const;
+    bool parse(const RawFieldPath& path, int& value) const;
     
-    std::vector<std::unique_ptr<UnknownFieldSet>> ufsList;
+    // Reads the field at p and moves p to the next one. An END_GROUP field is only valid inside a group
+    static bool readField(const char*& p, const char* limit, unsigned int& fieldNumber, RAW_FIELD& field, int depth = 0);
 
-    for (int idx = 0; idx < fieldNumbers.size(); ++idx)
-    {
-        bool found = false;
-        for (int fieldIdx = 0; fieldIdx < pUfs->field_count(); ++fieldIdx)
-        {
-            const UnknownField &uf = pUfs->field(fieldIdx);
-            if (uf.number() == fieldNumbers[idx])
-            {
-                found = true;
-                if (idx == fieldNumbers.size() - 1)
-                {
-                    return convertUnknownField(uf, value);
-                }
-                else
-                {
-                    if (uf.type() == UnknownField::TYPE_GROUP)
-                    {
-                        pUfs = &(uf.group());
-                    }
-                    else if (uf.type() == UnknownField::TYPE_LENGTH_DELIMITED)
-                    {
-                        std::unique_ptr<UnknownFieldSet> ufs(new UnknownFieldSet());
-                        
-                        if (ufs->ParseFromString(uf.length_delimited()))
-                        {
-                            pUfs = ufs.get();
-                        }
-                        
-                        ufsList.push_back(std::move(ufs));
-                    }
-                }
-                break;
-            }
-        }
-        
-        if (!found || NULL == pUfs)
-        {
-            break;
-        }
-    }
-    
-    return false;
-}
+private:
+    const char *m_data;
+    size_t m_length;
+    std::vector<char> m_buffer;     // Contents of the file from mergeFile
+};
 
 #endif /* RawMessage_h */
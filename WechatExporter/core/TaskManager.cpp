@@ -9,20 +9,33 @@
 #include "TaskManager.h"
 #include "AsyncTask.h"
 #include "FileSystem.h"
+#include <algorithm>
 
-TaskManager::TaskManager(Logger* logger) : m_logger(logger), m_downloadExecutor(NULL)
+TaskManager::TaskManager(Logger* logger, unsigned int numberOfAudioWorkers/* = 1*/) : m_logger(logger), m_downloadExecutor(NULL), m_downloadScheduler(NULL), m_copyExecutor(NULL)
 #ifdef USING_ASYNC_TASK_FOR_MP3
     , m_audioExecutor(NULL)
 #endif
+    , m_mediaStore(NULL), m_httpCache(NULL)
 {
-    m_downloadExecutor = new AsyncExecutor(2, 4, this);
+    // Concurrency of downloads is controlled by the scheduler, the executor only needs enough threads for it.
+    // Retries wait in the scheduler, so the threads are only taken by the requests.
+    // Idle workers are kept for the connections of their curl handles
+    m_downloadExecutor = new AsyncExecutor(8, 8, this);
+    m_downloadScheduler = new DownloadScheduler(m_downloadExecutor, 8, 6);
+    m_copyExecutor = new AsyncExecutor(1, 2, this);
 #ifdef USING_ASYNC_TASK_FOR_MP3
-    m_audioExecutor = new AsyncExecutor(1, 1, this);
+    if (numberOfAudioWorkers == 0)
+    {
+        numberOfAudioWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    // Workers are kept alive for their codec states
+    m_audioExecutor = new AsyncExecutor(numberOfAudioWorkers, numberOfAudioWorkers, this);
 #endif
     // m_audioExecutor = m_downloadExecutor;
     
 #if !defined(NDEBUG) || defined(DBG_PERF)
     m_downloadExecutor->setTag("dl");
+    m_copyExecutor->setTag("cp");
 #ifdef USING_ASYNC_TASK_FOR_MP3
     if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
     {
@@ -34,7 +47,23 @@ TaskManager::TaskManager(Logger* logger) : m_logger(logger), m_downloadExecutor(
 
 TaskManager::~TaskManager()
 {
+    // The timer of the scheduler adds tasks to the executor, stop it first
+    if (NULL != m_downloadScheduler)
+    {
+        m_downloadScheduler->cancel();
+    }
     shutdownExecutors();
+#ifndef NDEBUG
+    if (NULL != m_logger && NULL != m_downloadScheduler)
+    {
+        m_logger->debug(m_downloadScheduler->getStats());
+    }
+#endif
+    if (NULL != m_downloadScheduler)
+    {
+        delete m_downloadScheduler;
+        m_downloadScheduler = NULL;
+    }
     m_logger = NULL;
 }
 
@@ -46,6 +75,10 @@ void TaskManager::shutdown()
         m_audioExecutor->shutdown();
     }
 #endif
+    if (NULL != m_copyExecutor)
+    {
+        m_copyExecutor->shutdown();
+    }
     if (NULL != m_downloadExecutor)
     {
         m_downloadExecutor->shutdown();
@@ -61,6 +94,11 @@ void TaskManager::shutdownExecutors()
         m_audioExecutor = NULL;
     }
 #endif
+    if (NULL != m_copyExecutor)
+    {
+        delete m_copyExecutor;
+        m_copyExecutor = NULL;
+    }
     if (NULL != m_downloadExecutor)
     {
         delete m_downloadExecutor;
@@ -93,10 +131,21 @@ bool TaskManager::waitForCompltion(unsigned int ms)
     }
      */
     
+    if (!m_copyExecutor->waitForCompltion(ms))
+    {
+        return false;
+    }
     if (!m_downloadExecutor->waitForCompltion(ms))
     {
         return false;
     }
+    // Retries waiting for their backoff are neither queued nor running in the executor.
+    // A task is in flight from its dispatching until it completes, so it is seen either here or by the executor
+    if (!m_downloadScheduler->isIdle())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms > 0 ? ms : 100));
+        return false;
+    }
 #ifdef USING_ASYNC_TASK_FOR_MP3
     if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
     {
@@ -110,6 +159,15 @@ bool TaskManager::waitForCompltion(unsigned int ms)
     return true;
 }
 
+void TaskManager::waitForCopyCompletion()
+{
+    // No more copy tasks after all sessions are parsed
+    m_copyExecutor->shutdown();
+    while (!m_copyExecutor->waitForCompltion(512))
+    {
+    }
+}
+
 void TaskManager::cancel()
 {
     std::map<uint32_t, std::set<AsyncExecutor::Task *>> copyTaskQueue;
@@ -119,6 +177,8 @@ void TaskManager::cancel()
         copyTaskQueue.swap(m_copyTaskQueue);
     }
     
+    m_downloadScheduler->cancel();
+    m_copyExecutor->cancel();
     m_downloadExecutor->cancel();
 #ifdef USING_ASYNC_TASK_FOR_MP3
     if (NULL != m_audioExecutor && m_audioExecutor != m_downloadExecutor)
@@ -140,7 +200,8 @@ void TaskManager::cancel()
 
 size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
 {
-    size_t numberOfDownloads = m_downloadExecutor->getNumberOfQueue();
+    size_t numberOfDownloads = m_downloadExecutor->getNumberOfQueue() + m_downloadScheduler->getNumberOfPending();
+    size_t numberOfCopies = m_copyExecutor->getNumberOfQueue();
 #ifdef USING_ASYNC_TASK_FOR_MP3
     size_t numberOfAudio = 0;
     if (m_audioExecutor != m_downloadExecutor)
@@ -159,6 +220,14 @@ size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
     {
         queueDesc += std::to_string(numberOfDownloads) + " downloads";
     }
+    if (numberOfCopies > 0)
+    {
+        if (!queueDesc.empty())
+        {
+            queueDesc += ", ";
+        }
+        queueDesc += std::to_string(numberOfCopies) + " copies";
+    }
 #ifdef USING_ASYNC_TASK_FOR_MP3
     if (numberOfAudio > 0)
     {
@@ -170,7 +239,7 @@ size_t TaskManager::getNumberOfQueue(std::string& queueDesc) const
     }
 #endif
 
-    return numberOfDownloads
+    return numberOfDownloads + numberOfCopies
 #ifdef USING_ASYNC_TASK_FOR_MP3
 		+ numberOfAudio
 #endif
@@ -182,6 +251,25 @@ void TaskManager::setUserAgent(const std::string& userAgent)
     m_userAgent = userAgent;
 }
 
+void TaskManager::setMediaStore(MediaStore* mediaStore)
+{
+    m_mediaStore = mediaStore;
+}
+
+void TaskManager::setHttpCache(HttpCache* httpCache)
+{
+    m_httpCache = httpCache;
+}
+
+void TaskManager::addMediaReference(const std::string& path)
+{
+    if (NULL != m_mediaStore)
+    {
+        size_t size = getFileSize(path);
+        m_mediaStore->addReference(size == static_cast<size_t>(-1) ? 0 : size);
+    }
+}
+
 void TaskManager::onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task)
 {
     if (NULL != m_logger && task->getType() != TASK_TYPE_AUDIO)
@@ -195,6 +283,15 @@ void TaskManager::onTaskStart(const AsyncExecutor* executor, const AsyncExecutor
 
 void TaskManager::onTaskComplete(const AsyncExecutor* executor, const AsyncExecutor::Task *task, bool succeeded)
 {
+    if (task->getType() == TASK_TYPE_DOWNLOAD && dynamic_cast<const DownloadTask *>(task)->isRetrying())
+    {
+        // The next attempt waits in the scheduler, the download is still running for the copies of its output
+        std::vector<AsyncExecutor::Task *> readyTasks;
+        m_downloadScheduler->retry(dynamic_cast<const DownloadTask *>(task)->createRetryTask(), readyTasks);
+        addDownloadTasks(readyTasks);
+        return;
+    }
+    
     if (NULL != m_logger)
     {
         if (!succeeded || task->hasError())
@@ -230,24 +327,81 @@ void TaskManager::onTaskComplete(const AsyncExecutor* executor, const AsyncExecu
         {
             m_downloadingTasks.erase(it);
         }
+        if (succeeded && NULL != m_mediaStore)
+        {
+            m_mediaStore->add("url:" + downloadTask->getUrl(), downloadTask->getOutput());
+        }
         
         std::set<AsyncExecutor::Task *> copyTasks = dequeueCopyTasks(task->getTaskId());
         lock.unlock();
         
+        std::vector<AsyncExecutor::Task *> readyTasks;
+        m_downloadScheduler->release(downloadTask->getHost(), readyTasks);
+        addDownloadTasks(readyTasks);
+        
 #ifndef NDEBUG
         if (succeeded)
         {
             assert(existsFile(downloadTask->getOutput()));
         }
 #endif
+        // Copies of the downloaded file are local and quick, run them ahead of other downloads
         for (std::set<AsyncExecutor::Task *>::iterator it = copyTasks.begin(); it != copyTasks.end(); ++it)
         {
-            m_downloadExecutor->addTask(*it);
+            (*it)->setPriority(AsyncExecutor::PRIORITY_HIGH);
         }
+        m_downloadExecutor->addTasks(copyTasks.begin(), copyTasks.end());
     }
-    else if ((task->getType() == TASK_TYPE_COPY) || (task->getType() == TASK_TYPE_AUDIO))
+    else if (task->getType() == TASK_TYPE_COPY)
     {
-        // check copy task
+        const CopyTask* copyTask = dynamic_cast<const CopyTask *>(task);
+        
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Only the links actually made are counted as saved
+        std::map<uint32_t, int>::iterator itReference = m_mediaReferences.find(task->getTaskId());
+        if (itReference != m_mediaReferences.end())
+        {
+            m_mediaReferences.erase(itReference);
+            lock.unlock();
+            if (succeeded)
+            {
+                addMediaReference(copyTask->getDest());
+            }
+            return;
+        }
+        std::map<std::string, std::pair<uint32_t, std::string>>::iterator it = m_copyingTasks.find(copyTask->getSource());
+        if (it == m_copyingTasks.end() || it->second.first != task->getTaskId())
+        {
+            return;
+        }
+        if (succeeded)
+        {
+            m_mediaStore->add(copyTask->getSource(), copyTask->getDest());
+        }
+        m_copyingTasks.erase(it);
+        std::set<AsyncExecutor::Task *> linkTasks = dequeueCopyTasks(task->getTaskId());
+        std::vector<AsyncExecutor::Task *> readyTasks;
+        readyTasks.reserve(linkTasks.size());
+        for (std::set<AsyncExecutor::Task *>::iterator it = linkTasks.begin(); it != linkTasks.end(); ++it)
+        {
+            AsyncExecutor::Task *linkTask = *it;
+            if (!succeeded)
+            {
+                // Nothing to link to, copy it from backup as the caller asked, it is not a reference any more
+                const CopyTask* failedTask = dynamic_cast<const CopyTask *>(linkTask);
+                int flags = m_mediaReferences[linkTask->getTaskId()];
+                m_mediaReferences.erase(linkTask->getTaskId());
+                CopyTask* newTask = new CopyTask(copyTask->getSource(), failedTask->getDest(), "CP: " + copyTask->getSource() + " => " + failedTask->getDest(), failedTask->getMtime(), flags);
+                newTask->setTaskId(linkTask->getTaskId());
+                newTask->setUserData(linkTask->getUserData());
+                delete linkTask;
+                linkTask = newTask;
+            }
+            readyTasks.push_back(linkTask);
+        }
+        lock.unlock();
+        
+        m_copyExecutor->addTasks(readyTasks);
     }
 }
 
@@ -264,15 +418,14 @@ void TaskManager::download(const Session* session, const std::string &url, const
 	}
 #endif
     
+    // Sessions may be exported concurrently
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::set<std::string>::iterator itFile = m_downloadedFiles.find(output);
+    if (itFile != m_downloadedFiles.end())
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        std::set<std::string>::iterator it = m_downloadedFiles.find(output);
-        if (it != m_downloadedFiles.end())
-        {
-            return;
-        }
-        m_downloadedFiles.insert(output);
+        return;
     }
+    m_downloadedFiles.insert(output);
     
     std::map<std::string, std::string>::iterator it = m_downloadTasks.find(url);
     if (it != m_downloadTasks.end() && it->second == output)
@@ -284,15 +437,28 @@ void TaskManager::download(const Session* session, const std::string &url, const
     bool downloadFile = false;
     uint32_t taskId = AsyncExecutor::genNextTaskId();
     AsyncExecutor::Task *task = NULL;
+    std::string storedPath;
     if (it != m_downloadTasks.end())
     {
         // Existed and different output path, copy it
-        task = new CopyTask(it->second, output, "CP: " + url + " => " + output + " <= " + it->second);
+        task = new CopyTask(it->second, output, "CP: " + url + " => " + output + " <= " + it->second, 0, NULL != m_mediaStore ? COPY_FLAG_HARD_LINK : 0);
+        if (NULL != m_mediaStore)
+        {
+            m_mediaReferences[taskId] = 0;
+        }
+    }
+    else if (NULL != m_mediaStore && m_mediaStore->find("url:" + url, storedPath))
+    {
+        // Downloaded for the previous account
+        task = new CopyTask(storedPath, output, "CP: " + url + " => " + output + " <= " + storedPath, 0, COPY_FLAG_HARD_LINK);
+        m_mediaReferences[taskId] = 0;
     }
     else
     {
         DownloadTask* downloadTask = new DownloadTask(url, output, defaultFile, mtime, "DL: " + url + " => " + output);
         downloadTask->setUserAgent(m_userAgent);
+        downloadTask->setHttpCache(m_httpCache);
+        downloadTask->setScheduler(m_downloadScheduler);
         task = downloadTask;
         downloadFile = true;
         m_downloadTasks.insert(std::pair<std::string, std::string>(url, output));
@@ -300,7 +466,6 @@ void TaskManager::download(const Session* session, const std::string &url, const
     task->setTaskId(taskId);
     task->setUserData(reinterpret_cast<const void *>(session));
     
-    std::unique_lock<std::mutex> lock(m_mutex);
     if (downloadFile)
     {
         m_downloadingTasks.insert(std::pair<std::string, uint32_t>(url, taskId));
@@ -324,8 +489,76 @@ void TaskManager::download(const Session* session, const std::string &url, const
     lock.unlock();
     if (NULL != task)
     {
-        m_downloadExecutor->addTask(task);
+        if (downloadFile)
+        {
+            int priority = DOWNLOAD_PRIORITY_DEFAULT;
+            if (type == "avatar")
+            {
+                priority = DOWNLOAD_PRIORITY_AVATAR;
+            }
+            else if (type == "emoji")
+            {
+                priority = DOWNLOAD_PRIORITY_EMOJI;
+            }
+            std::vector<AsyncExecutor::Task *> readyTasks;
+            m_downloadScheduler->enqueue(dynamic_cast<DownloadTask *>(task), priority, readyTasks);
+            addDownloadTasks(readyTasks);
+        }
+        else
+        {
+            m_downloadExecutor->addTask(task);
+        }
+    }
+}
+
+void TaskManager::addDownloadTasks(const std::vector<AsyncExecutor::Task *>& tasks)
+{
+    m_downloadExecutor->addTasks(tasks);
+}
+
+void TaskManager::copyFile(const Session* session, const std::string& src, const std::string& dest, time_t mtime, int flags)
+{
+    // Sessions may be exported concurrently and share the same output, e.g.: app icons
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_copiedFiles.insert(dest).second)
+    {
+        return;
+    }
+    
+    uint32_t taskId = AsyncExecutor::genNextTaskId();
+    CopyTask *task = NULL;
+    std::string storedPath;
+    if (NULL == m_mediaStore)
+    {
+        task = new CopyTask(src, dest, "CP: " + src + " => " + dest, mtime, flags);
+    }
+    else if (m_mediaStore->find(src, storedPath))
+    {
+        task = new CopyTask(storedPath, dest, "CP: " + src + " => " + dest + " <= " + storedPath, mtime, flags | COPY_FLAG_HARD_LINK);
+        m_mediaReferences[taskId] = flags;
+    }
+    else
+    {
+        std::map<std::string, std::pair<uint32_t, std::string>>::iterator it = m_copyingTasks.find(src);
+        if (it != m_copyingTasks.end())
+        {
+            // Link it after the first copy is done
+            task = new CopyTask(it->second.second, dest, "CP: " + src + " => " + dest + " <= " + it->second.second, mtime, flags | COPY_FLAG_HARD_LINK);
+            task->setTaskId(taskId);
+            task->setUserData(reinterpret_cast<const void *>(session));
+            m_copyTaskQueue[it->second.first].insert(task);
+            m_mediaReferences[taskId] = flags;
+            return;
+        }
+        
+        task = new CopyTask(src, dest, "CP: " + src + " => " + dest, mtime, flags);
+        m_copyingTasks.insert(std::pair<std::string, std::pair<uint32_t, std::string>>(src, std::pair<uint32_t, std::string>(taskId, dest)));
     }
+    task->setTaskId(taskId);
+    task->setUserData(reinterpret_cast<const void *>(session));
+    lock.unlock();
+    
+    m_copyExecutor->addTask(task);
 }
 
 #ifdef USING_ASYNC_TASK_FOR_MP3
@@ -12,17 +12,73 @@
 #include <stdio.h>
 #include <map>
 #include <set>
+#include <atomic>
 #include "WechatObjects.h"
 #include "AsyncExecutor.h"
 #include "PdfConverter.h"
 #include "Logger.h"
 
+class HttpCache;
+class DownloadScheduler;
+
+// Export-wide store of the materialized media files, keyed by the file in backup or url
+// Further references to the same content are hard linked (reflinked or copied if not possible) from the first one
+class MediaStore
+{
+public:
+    MediaStore() : m_numberOfReferences(0), m_savedBytes(0)
+    {
+    }
+    
+    bool find(const std::string& key, std::string& path) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, std::string>::const_iterator it = m_files.find(key);
+        if (it == m_files.cend())
+        {
+            return false;
+        }
+        path = it->second;
+        return true;
+    }
+    
+    void add(const std::string& key, const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_files.insert(std::pair<std::string, std::string>(key, path));
+    }
+    
+    void addReference(size_t bytes)
+    {
+        ++m_numberOfReferences;
+        m_savedBytes += bytes;
+    }
+    
+    uint64_t getNumberOfReferences() const
+    {
+        return m_numberOfReferences;
+    }
+    
+    uint64_t getSavedBytes() const
+    {
+        return m_savedBytes;
+    }
+    
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, std::string> m_files;
+    std::atomic<uint64_t> m_numberOfReferences;
+    std::atomic<uint64_t> m_savedBytes;
+};
+
 class TaskManager : public AsyncExecutor::Callback
 {
 private:
     Logger* m_logger;
     
     AsyncExecutor   *m_downloadExecutor;
+    DownloadScheduler   *m_downloadScheduler;   // Downloads wait in it until their hosts have room
+    AsyncExecutor   *m_copyExecutor;    // Local files in backup, sized for disk I/O
 #ifdef USING_ASYNC_TASK_FOR_MP3
     AsyncExecutor   *m_audioExecutor;
 #endif
@@ -33,30 +89,38 @@ private:
     mutable std::mutex m_mutex;
     std::set<std::string> m_downloadedFiles;
     std::map<std::string, uint32_t> m_downloadingTasks;
+    std::set<std::string> m_copiedFiles;
+    std::map<std::string, std::pair<uint32_t, std::string>> m_copyingTasks;    // src => (taskId, dest)
+    std::map<uint32_t, int> m_mediaReferences;  // taskId of the links to stored files => flags asked by the caller
     
-    std::map<uint32_t, std::set<AsyncExecutor::Task *>> m_copyTaskQueue;
+    MediaStore* m_mediaStore;
+    HttpCache* m_httpCache;
     
-#ifdef USING_ASYNC_TASK_FOR_MP3
-    std::queue<std::vector<unsigned char>> m_Buffers;
-#endif
+    std::map<uint32_t, std::set<AsyncExecutor::Task *>> m_copyTaskQueue;
     
 public:
     
-    TaskManager(Logger* logger);
+    // numberOfAudioWorkers: 0 for the number of cores
+    TaskManager(Logger* logger, unsigned int numberOfAudioWorkers = 1);
     ~TaskManager();
     
     virtual void onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task);
     virtual void onTaskComplete(const AsyncExecutor* executor, const AsyncExecutor::Task *task, bool succeeded);
     
     void setUserAgent(const std::string& userAgent);
+    void setMediaStore(MediaStore* mediaStore);
+    void setHttpCache(HttpCache* httpCache);
     
     size_t getNumberOfQueue(std::string& queueDesc) const;
     void cancel();
     void shutdown();
     // true: completed, false: timeout
     bool waitForCompltion(unsigned int ms);
+    // Local copies must be done before html files are converted into pdf
+    void waitForCopyCompletion();
 
     void download(const Session* session, const std::string &url, const std::string &backupUrl, const std::string& output, time_t mtime, const std::string& defaultFile = "", std::string type = "");
+    void copyFile(const Session* session, const std::string& src, const std::string& dest, time_t mtime, int flags);
 #ifdef USING_ASYNC_TASK_FOR_MP3
     void convertAudio(const Session* session, const std::string& pcmPath, const std::string& mp3Path, unsigned int mtime);
 #endif
@@ -64,6 +128,8 @@ public:
 private:
     
     void shutdownExecutors();
+    void addDownloadTasks(const std::vector<AsyncExecutor::Task *>& tasks);
+    void addMediaReference(const std::string& path);
     
     inline std::set<AsyncExecutor::Task *> dequeueCopyTasks(uint32_t taskId)
     {
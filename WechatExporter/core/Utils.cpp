@@ -324,6 +324,18 @@ void updateFileTime(const std::string& path, time_t mtime)
 #endif
 }
 
+time_t getFileModifiedTime(const std::string& path)
+{
+#ifdef _WIN32
+    CW2T pszT(CA2W(path.c_str(), CP_UTF8));
+    struct _stat st;
+    return _tstat((LPCTSTR)pszT, &st) == 0 ? st.st_mtime : 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+#endif
+}
+
 /*
 bool deleteFile(const std::string& fileName)
 {
@@ -11,6 +11,8 @@
 #include <map>
 #include <thread>
 #include <locale>
+#include <functional>
+#include <cstdint>
 
 #ifdef _WIN32
 #include <io.h>
@@ -49,8 +51,28 @@ std::string formatString(const std::string& format, Args && ...args)
 // bool existsFile(const std::string &path);
 // int makePath(const std::string& path, mode_t mode);
 
+#define MD5_DIGEST_SIZE 16
+#define SHA1_DIGEST_SIZE 20
+
 std::string md5(const std::string& s);
 std::string sha1(const std::string& s);
+void md5(const void *data, size_t length, unsigned char *digest);
+void sha1(const void *data, size_t length, unsigned char *digest);
+// Incremental md5 of data coming in pieces, e.g.: a file read in chunks
+struct MD5_CONTEXT
+{
+    uint32_t state[4];
+    unsigned char buffer[64];
+    uint64_t length;
+};
+void md5Init(MD5_CONTEXT& context);
+void md5Update(MD5_CONTEXT& context, const void *data, size_t length);
+void md5Final(MD5_CONTEXT& context, unsigned char *digest);
+// Batch hashing of short ids, digests holds MD5_DIGEST_SIZE bytes for each input
+void md5(const std::string *inputs, size_t count, unsigned char *digests);
+void md5(const std::vector<std::string>& inputs, std::vector<std::string>& hashes);
+void hexEncode(const unsigned char *data, size_t length, char *output);
+std::string hexEncode(const unsigned char *data, size_t length);
 
 std::string safeHTML(const std::string& s);
 void removeHtmlTags(std::string& html);
@@ -62,6 +84,7 @@ uint32_t getUnixTimeStamp();
 
 const char* calcVarint32Ptr(const char* p, const char* limit, uint32_t* value);
 const unsigned char* calcVarint32Ptr(const unsigned char* p, const unsigned char* limit, uint32_t* value);
+const char* GetVarint64Ptr(const char* p, const char* limit, uint64_t* value);
 
 // bool moveFile(const std::string& src, const std::string& dest, bool overwrite = true);
 // bool copyFile(const std::string& src, const std::string& dest);
@@ -72,6 +95,8 @@ std::string utf8ToLocalAnsi(const std::string& utf8Str);
 #define utf8ToLocalAnsi(utf8Str) utf8Str
 #endif
 void updateFileTime(const std::string& path, time_t mtime);
+// 0 if the file doesn't exist
+time_t getFileModifiedTime(const std::string& path);
 // bool deleteFile(const std::string& fileName);
 
 int GetBigEndianInteger(const unsigned char* data, int startIndex = 0);
@@ -85,11 +110,15 @@ std::string encodeUrl(const std::string& url);
 std::string utcToLocal(const std::string& utcTime);
 std::string getTimestampString(bool includingYMD = false, bool includingMs = false);
 
+// Decodes silk into 24kHz mono samples and hands them over frame by frame, the handler returns false to stop
+bool silkDecode(const std::string& silkPath, const std::function<bool(const short *samples, size_t numberOfSamples)>& handler);
 bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData);
 bool silkToPcm(const std::string& silkPath, const std::string& pcmPath);
 
 bool pcmToMp3(const std::string& pcmPath, const std::string& mp3Path);
 bool pcmToMp3(const std::vector<unsigned char>& pcmData, const std::string& mp3Path);
+// Each decoded frame is encoded right away, no pcm of the whole voice is kept
+bool silkToMp3(const std::string& silkPath, const std::string& mp3Path);
 
 void setThreadName(const char* threadName);
 bool isNumber(const std::string &s);
@@ -11,6 +11,7 @@ extern "C"
 {
 #include <lame/lame.h>
 }
+#include <algorithm>
 #include "Utils.h"
 #include "FileSystem.h"
 #ifdef _WIN32
@@ -31,55 +32,88 @@ bool pcmToMp3(const std::string& pcmPath, const std::string& mp3Path)
     return pcmToMp3(pcmData, mp3Path);
 }
 
+#ifdef ENABLE_AUDIO_CONVERTION
+// lame_init_params builds the psychoacoustic tables, so every worker thread keeps one encoder
+// and only resets the bitstream between files
+class LameEncoder
+{
+public:
+    LameEncoder() : m_gfp(NULL), m_used(false)
+    {
+    }
+    
+    ~LameEncoder()
+    {
+        if (NULL != m_gfp)
+        {
+            lame_close(m_gfp);
+        }
+    }
+    
+    lame_global_flags* acquire()
+    {
+        if (NULL == m_gfp)
+        {
+            m_gfp = lame_init();
+            if (NULL == m_gfp)
+            {
+                return NULL;
+            }
+            
+            lame_set_in_samplerate(m_gfp, 24000);
+            lame_set_preset(m_gfp, 56);
+            lame_set_mode(m_gfp, MONO);
+            // RG is enabled by default
+            lame_set_findReplayGain(m_gfp, 1);
+            // lame_set_quality(m_gfp, 7);
+            lame_set_num_channels(m_gfp, 1);
+            lame_set_out_samplerate(m_gfp, 24000);
+            
+            if (lame_init_params(m_gfp) == -1)
+            {
+                //lame initialization failed
+                lame_close(m_gfp);
+                m_gfp = NULL;
+                return NULL;
+            }
+        }
+        else if (m_used)
+        {
+            // The previous file is flushed with lame_encode_flush_nogap
+            lame_init_bitstream(m_gfp);
+        }
+        m_used = true;
+        return m_gfp;
+    }
+    
+private:
+    lame_global_flags *m_gfp;
+    bool m_used;
+};
+
+static thread_local LameEncoder t_lameEncoder;
+#endif // ENABLE_AUDIO_CONVERTION
+
 bool pcmToMp3(const std::vector<unsigned char>& pcmData, const std::string& mp3Path)
 {
 #ifndef NDEBUG
     assert(!pcmData.empty());
 #endif
 #ifdef ENABLE_AUDIO_CONVERTION
-    const int MP3_SIZE = 4096;
-    const int num_of_channels = 1;
+    const int SAMPLES_PER_BLOCK = 4608;     // 8 frames of 576 samples
+    const int MP3_SIZE = SAMPLES_PER_BLOCK * 5 / 4 + 7200;  // Worst case from lame.h
 
-    lame_global_flags *gfp = NULL;
-    gfp = lame_init();
+    lame_global_flags *gfp = t_lameEncoder.acquire();
     if (NULL == gfp)
     {
         return false;
     }
-
-    lame_set_in_samplerate(gfp, 24000);
-    lame_set_preset(gfp, 56);
-    lame_set_mode(gfp, MONO);
-    // RG is enabled by default
-    lame_set_findReplayGain(gfp, 1);
-    // lame_set_quality(gfp, 7);
-    //Setting Channels
-    lame_set_num_channels(gfp, num_of_channels);
-
-    unsigned long fsize = (unsigned long) (pcmData.size() / (2 * num_of_channels));
-    lame_set_num_samples(gfp, fsize);
-    
-    int samples_to_read = lame_get_framesize(gfp);
-    int samples_of_channel = 576;
-    samples_to_read = samples_of_channel * num_of_channels;    //
-    // int framesize = samples_to_read;
-    // std::assert(framesize <= 1152);
-    // int bytes_per_sample = sizeof(short int);
-    
-    lame_set_out_samplerate(gfp, 24000);
-
-    if(lame_init_params(gfp) == -1)
-    {
-        //lame initialization failed
-        lame_close(gfp);
-        return false;
-    }
     
-    std::vector<short int> pcm_buffer;
-    pcm_buffer.resize(samples_to_read, 0);
-    int bytesOfPcmBuffer = static_cast<int>(pcm_buffer.size() * sizeof(short int));
+    // Mono 16-bit samples, encoded straight from the pcm buffer
+    const short int *samples = reinterpret_cast<const short int *>(pcmData.empty() ? NULL : &pcmData[0]);
+    size_t numberOfSamples = pcmData.size() / sizeof(short int);
+    lame_set_num_samples(gfp, static_cast<unsigned long>(numberOfSamples));
     unsigned char mp3_buffer[MP3_SIZE];
-    int count = static_cast<int>((pcmData.size() + bytesOfPcmBuffer - 1) / bytesOfPcmBuffer);
     
 #ifdef _WIN32
 	CA2W pszW(mp3Path.c_str(), CP_UTF8);
@@ -92,26 +126,82 @@ bool pcmToMp3(const std::vector<unsigned char>& pcmData, const std::string& mp3P
     
     if(mp3 == NULL)
     {
-        lame_close(gfp);
+        // Drain the encoder so the next file starts clean
+        lame_encode_flush_nogap(gfp, mp3_buffer, MP3_SIZE);
         return false;
     }
-    for (int idx = 0; idx < count; ++idx)
+    for (size_t offset = 0; offset < numberOfSamples; offset += SAMPLES_PER_BLOCK)
     {
-        if (idx == (count - 1) && (pcmData.size() % bytesOfPcmBuffer) != 0)
+        int samples_to_read = static_cast<int>(std::min(numberOfSamples - offset, static_cast<size_t>(SAMPLES_PER_BLOCK)));
+        int write = lame_encode_buffer(gfp, samples + offset, NULL, samples_to_read, mp3_buffer, MP3_SIZE);
+        if (write > 0)
         {
-            pcm_buffer.assign(pcm_buffer.size(), 0);
-            samples_to_read = ((pcmData.size() % bytesOfPcmBuffer) + sizeof(short int) - 1) / sizeof(short int);
+            fwrite(mp3_buffer, write, sizeof(char), mp3);
         }
-        memcpy(reinterpret_cast<void *>(&(pcm_buffer[0])), reinterpret_cast<const void *>(&(pcmData[idx * bytesOfPcmBuffer])), samples_to_read * sizeof(short int));
-        
-        int write = lame_encode_buffer(gfp, &pcm_buffer[0], NULL, samples_of_channel, mp3_buffer, MP3_SIZE);
+    }
+    int write = lame_encode_flush_nogap(gfp, mp3_buffer, MP3_SIZE);
+    if (write > 0)
+    {
         fwrite(mp3_buffer, write, sizeof(char), mp3);
     }
 
     fclose(mp3);
-    lame_close(gfp);
 
 #endif // ENABLE_AUDIO_CONVERTION
     
     return true;
 }
+
+bool silkToMp3(const std::string& silkPath, const std::string& mp3Path)
+{
+#ifdef ENABLE_AUDIO_CONVERTION
+    const int MAX_FRAME_SAMPLES = ((20 * 48) << 1) * 5;     // Size of the output buffer of the silk decoder
+    const int MP3_SIZE = MAX_FRAME_SAMPLES * 5 / 4 + 7200;
+    
+    lame_global_flags *gfp = t_lameEncoder.acquire();
+    if (NULL == gfp)
+    {
+        return false;
+    }
+    
+    unsigned char mp3_buffer[MP3_SIZE];
+#ifdef _WIN32
+    CA2W pszW(mp3Path.c_str(), CP_UTF8);
+    FILE *mp3 = _wfopen((LPCWSTR)pszW, L"wb" );
+#else
+    FILE *mp3 = fopen(mp3Path.c_str(), "wb");
+#endif
+    if (mp3 == NULL)
+    {
+        return false;
+    }
+    
+    size_t totalSamples = 0;
+    bool result = silkDecode(silkPath, [gfp, mp3, &mp3_buffer, &totalSamples](const short *samples, size_t numberOfSamples)
+    {
+        int write = lame_encode_buffer(gfp, samples, NULL, static_cast<int>(numberOfSamples), mp3_buffer, MP3_SIZE);
+        if (write < 0)
+        {
+            return false;
+        }
+        totalSamples += numberOfSamples;
+        return write == 0 || fwrite(mp3_buffer, write, sizeof(char), mp3) == sizeof(char);
+    });
+    
+    // Flush anyway, so the next voice on this thread starts clean
+    int write = lame_encode_flush_nogap(gfp, mp3_buffer, MP3_SIZE);
+    if (result && write > 0)
+    {
+        result = fwrite(mp3_buffer, write, sizeof(char), mp3) == sizeof(char);
+    }
+    fclose(mp3);
+    
+    if (!result || totalSamples == 0)
+    {
+        deleteFile(mp3Path);
+        return false;
+    }
+#endif // ENABLE_AUDIO_CONVERTION
+    
+    return true;
+}
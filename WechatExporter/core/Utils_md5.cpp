@@ -7,114 +7,423 @@
 //
 
 #include <string>
-#include <sstream>
-#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 
-#if defined(_WIN32)
-#include <windows.h>
-#include <wincrypt.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MD5_SSE2_LANES 4
+#endif
 
-#define MD5_DIGEST_LENGTH 16
-#define SHA_DIGEST_LENGTH 20
+#include "Utils.h"
 
-#elif defined(__APPLE__)
-#import <CommonCrypto/CommonDigest.h>
-#else
+static const char HEX_DIGITS[] = "0123456789abcdef";
 
-#endif
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
 
-std::string md5(const std::string& s)
+static const int MD5_S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+// Index of the message word used by each MD5 step
+static const int MD5_G[64] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9
+};
+
+static const uint32_t MD5_INIT[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+static const uint32_t SHA1_INIT[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+inline uint32_t rotateLeft(uint32_t x, int c)
+{
+    return (x << c) | (x >> (32 - c));
+}
+
+inline uint32_t readLittleEndian(const unsigned char *p)
 {
-    std::stringstream stream;
-    stream << std::setfill ('0') << std::hex;
-    
-#if defined(_WIN32)
-    
-    HCRYPTPROV hCryptProv = NULL;
-    HCRYPTHASH hHash = NULL;
-    BYTE bHash[0x7f] = {0};
-    DWORD dwHashLen= MD5_DIGEST_LENGTH; // The MD5 algorithm always returns 16 bytes.
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint32_t readBigEndian(const unsigned char *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static void md5Block(uint32_t state[4], const unsigned char *block)
+{
+    uint32_t m[16];
+    for (int idx = 0; idx < 16; ++idx)
+    {
+        m[idx] = readLittleEndian(block + idx * 4);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int idx = 0; idx < 64; ++idx)
+    {
+        uint32_t f = 0;
+        if (idx < 16)
+        {
+            f = (b & c) | (~b & d);
+        }
+        else if (idx < 32)
+        {
+            f = (d & b) | (~d & c);
+        }
+        else if (idx < 48)
+        {
+            f = b ^ c ^ d;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+        }
+        f += a + MD5_K[idx] + m[MD5_G[idx]];
+        a = d;
+        d = c;
+        c = b;
+        b += rotateLeft(f, MD5_S[idx]);
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void sha1Block(uint32_t state[5], const unsigned char *block)
+{
+    uint32_t w[80];
+    for (int idx = 0; idx < 16; ++idx)
+    {
+        w[idx] = readBigEndian(block + idx * 4);
+    }
+    for (int idx = 16; idx < 80; ++idx)
+    {
+        w[idx] = rotateLeft(w[idx - 3] ^ w[idx - 8] ^ w[idx - 14] ^ w[idx - 16], 1);
+    }
 
-    if(CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_MACHINE_KEYSET))
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int idx = 0; idx < 80; ++idx)
     {
-        if(CryptCreateHash(hCryptProv, CALG_MD5, 0, 0, &hHash))
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (idx < 20)
         {
-            if(CryptHashData(hHash, reinterpret_cast<const BYTE*>(s.c_str()), static_cast<DWORD>(s.size()), 0))
-            {
-                if(CryptGetHashParam(hHash, HP_HASHVAL, bHash, &dwHashLen, 0))
-                {
-                    // Make a string version of the numeric digest value
-                    for (int idx = 0; idx < 16; idx++)
-                    {
-                        stream << std::setw(2) << ((unsigned int) bHash[idx]);
-                    }
-                }
-            }
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
         }
+        else if (idx < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        }
+        else if (idx < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t temp = rotateLeft(a, 5) + f + e + k + w[idx];
+        e = d;
+        d = c;
+        c = rotateLeft(b, 30);
+        b = a;
+        a = temp;
     }
 
-    CryptDestroyHash(hHash);
-    CryptReleaseContext(hCryptProv, 0);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
 
-#elif defined(__APPLE__)
-    unsigned char digest[CC_MD5_DIGEST_LENGTH] = {0};
-    CC_MD5(s.c_str(), (CC_LONG)s.size(), digest); // This is the md5 call
+// Pads the tail (less than a block) into at most two blocks on the stack, the length is stored little endian for md5 and big endian for sha1
+template<class TBlock, class TState>
+void hashTail(TState *state, const unsigned char *data, size_t tailLength, uint64_t length, bool bigEndian, TBlock blockFunc)
+{
+    unsigned char tail[128] = { 0 };
+    if (tailLength > 0)
+    {
+        std::memcpy(tail, data, tailLength);
+    }
+    tail[tailLength] = 0x80;
+    size_t tailBlocks = tailLength < 56 ? 1 : 2;
+    uint64_t bits = length * 8;
+    unsigned char *lengthPtr = tail + tailBlocks * 64 - 8;
+    for (int idx = 0; idx < 8; ++idx)
+    {
+        lengthPtr[bigEndian ? (7 - idx) : idx] = static_cast<unsigned char>(bits >> (idx * 8));
+    }
 
-    for (int idx = 0; idx < CC_MD5_DIGEST_LENGTH; idx++)
+    blockFunc(state, tail);
+    if (tailBlocks > 1)
     {
-        stream << std::setw(2) << ((unsigned int) digest[idx]);
+        blockFunc(state, tail + 64);
     }
-#else
-#error "Md5 Not implemented."
-#endif
+}
 
-    return stream.str();
+template<class TBlock, class TState>
+void hashData(TState *state, const unsigned char *data, size_t length, bool bigEndian, TBlock blockFunc)
+{
+    size_t pos = 0;
+    for (; pos + 64 <= length; pos += 64)
+    {
+        blockFunc(state, data + pos);
+    }
+    hashTail(state, data + pos, length - pos, static_cast<uint64_t>(length), bigEndian, blockFunc);
 }
 
-std::string sha1(const std::string& s)
+static void md5Digest(const uint32_t state[4], unsigned char *digest)
+{
+    for (int idx = 0; idx < 4; ++idx)
+    {
+        digest[idx * 4] = static_cast<unsigned char>(state[idx]);
+        digest[idx * 4 + 1] = static_cast<unsigned char>(state[idx] >> 8);
+        digest[idx * 4 + 2] = static_cast<unsigned char>(state[idx] >> 16);
+        digest[idx * 4 + 3] = static_cast<unsigned char>(state[idx] >> 24);
+    }
+}
+
+void md5(const void *data, size_t length, unsigned char *digest)
+{
+    uint32_t state[4] = { MD5_INIT[0], MD5_INIT[1], MD5_INIT[2], MD5_INIT[3] };
+    hashData(state, reinterpret_cast<const unsigned char *>(data), length, false, md5Block);
+    md5Digest(state, digest);
+}
+
+void md5Init(MD5_CONTEXT& context)
+{
+    std::memcpy(context.state, MD5_INIT, sizeof(context.state));
+    context.length = 0;
+}
+
+void md5Update(MD5_CONTEXT& context, const void *data, size_t length)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    size_t buffered = static_cast<size_t>(context.length % 64);
+    context.length += length;
+    if (buffered > 0)
+    {
+        size_t size = std::min(length, 64 - buffered);
+        std::memcpy(context.buffer + buffered, p, size);
+        p += size;
+        length -= size;
+        if (buffered + size < 64)
+        {
+            return;
+        }
+        md5Block(context.state, context.buffer);
+    }
+    for (; length >= 64; p += 64, length -= 64)
+    {
+        md5Block(context.state, p);
+    }
+    if (length > 0)
+    {
+        std::memcpy(context.buffer, p, length);
+    }
+}
+
+void md5Final(MD5_CONTEXT& context, unsigned char *digest)
+{
+    hashTail(context.state, context.buffer, static_cast<size_t>(context.length % 64), context.length, false, md5Block);
+    md5Digest(context.state, digest);
+}
+
+void sha1(const void *data, size_t length, unsigned char *digest)
 {
-    std::stringstream stream;
-    stream << std::setfill ('0') << std::hex;
-    
-#if defined(_WIN32)
-    
-    HCRYPTPROV hCryptProv = NULL;
-    HCRYPTHASH hHash = NULL;
-    BYTE bHash[0x7f] = {0};
-    DWORD dwHashLen= SHA_DIGEST_LENGTH ; // The SHA1 algorithm always returns 20 bytes.
+    uint32_t state[5] = { SHA1_INIT[0], SHA1_INIT[1], SHA1_INIT[2], SHA1_INIT[3], SHA1_INIT[4] };
+    hashData(state, reinterpret_cast<const unsigned char *>(data), length, true, sha1Block);
+    for (int idx = 0; idx < 5; ++idx)
+    {
+        digest[idx * 4] = static_cast<unsigned char>(state[idx] >> 24);
+        digest[idx * 4 + 1] = static_cast<unsigned char>(state[idx] >> 16);
+        digest[idx * 4 + 2] = static_cast<unsigned char>(state[idx] >> 8);
+        digest[idx * 4 + 3] = static_cast<unsigned char>(state[idx]);
+    }
+}
 
-    if(CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_MACHINE_KEYSET))
+#ifdef MD5_SSE2_LANES
+inline __m128i rotateLeft(__m128i x, int c)
+{
+    return _mm_or_si128(_mm_sll_epi32(x, _mm_cvtsi32_si128(c)), _mm_srl_epi32(x, _mm_cvtsi32_si128(32 - c)));
+}
+
+// Single-block messages (up to 55 bytes, which covers usernames and chatroom ids) of 4 inputs in the lanes of SSE2 registers
+static void md5Lanes(const std::string * const *inputs, unsigned char * const *digests)
+{
+    unsigned char blocks[MD5_SSE2_LANES][64];
+    std::memset(blocks, 0, sizeof(blocks));
+    for (int lane = 0; lane < MD5_SSE2_LANES; ++lane)
     {
-        if(CryptCreateHash(hCryptProv, CALG_SHA1, 0, 0, &hHash))
+        size_t length = inputs[lane]->size();
+        std::memcpy(blocks[lane], inputs[lane]->c_str(), length);
+        blocks[lane][length] = 0x80;
+        uint64_t bits = static_cast<uint64_t>(length) * 8;
+        for (int idx = 0; idx < 8; ++idx)
         {
-            if(CryptHashData(hHash, reinterpret_cast<const BYTE*>(s.c_str()), static_cast<DWORD>(s.size()), 0))
-            {
-                if(CryptGetHashParam(hHash, HP_HASHVAL, bHash, &dwHashLen, 0))
-                {
-                    // Make a string version of the numeric digest value
-                    for (int idx = 0; idx < dwHashLen; idx++)
-                    {
-                        stream << std::setw(2) << ((unsigned int) bHash[idx]);
-                    }
-                }
-            }
+            blocks[lane][56 + idx] = static_cast<unsigned char>(bits >> (idx * 8));
         }
     }
 
-    CryptDestroyHash(hHash);
-    CryptReleaseContext(hCryptProv, 0);
+    __m128i m[16];
+    for (int idx = 0; idx < 16; ++idx)
+    {
+        m[idx] = _mm_set_epi32(static_cast<int>(readLittleEndian(blocks[3] + idx * 4)), static_cast<int>(readLittleEndian(blocks[2] + idx * 4)), static_cast<int>(readLittleEndian(blocks[1] + idx * 4)), static_cast<int>(readLittleEndian(blocks[0] + idx * 4)));
+    }
 
-#elif defined(__APPLE__)
-    unsigned char digest[CC_SHA1_DIGEST_LENGTH] = {0};
-    CC_SHA1(s.c_str(), (CC_LONG)s.size(), digest); // This is the md5 call
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i initA = _mm_set1_epi32(static_cast<int>(MD5_INIT[0]));
+    const __m128i initB = _mm_set1_epi32(static_cast<int>(MD5_INIT[1]));
+    const __m128i initC = _mm_set1_epi32(static_cast<int>(MD5_INIT[2]));
+    const __m128i initD = _mm_set1_epi32(static_cast<int>(MD5_INIT[3]));
+    __m128i a = initA, b = initB, c = initC, d = initD;
+    for (int idx = 0; idx < 64; ++idx)
+    {
+        __m128i f;
+        if (idx < 16)
+        {
+            f = _mm_or_si128(_mm_and_si128(b, c), _mm_andnot_si128(b, d));
+        }
+        else if (idx < 32)
+        {
+            f = _mm_or_si128(_mm_and_si128(d, b), _mm_andnot_si128(d, c));
+        }
+        else if (idx < 48)
+        {
+            f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+        }
+        else
+        {
+            f = _mm_xor_si128(c, _mm_or_si128(b, _mm_xor_si128(d, ones)));
+        }
+        f = _mm_add_epi32(_mm_add_epi32(f, a), _mm_add_epi32(_mm_set1_epi32(static_cast<int>(MD5_K[idx])), m[MD5_G[idx]]));
+        a = d;
+        d = c;
+        c = b;
+        b = _mm_add_epi32(b, rotateLeft(f, MD5_S[idx]));
+    }
+
+    uint32_t state[4][MD5_SSE2_LANES];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state[0]), _mm_add_epi32(a, initA));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state[1]), _mm_add_epi32(b, initB));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state[2]), _mm_add_epi32(c, initC));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state[3]), _mm_add_epi32(d, initD));
+    for (int lane = 0; lane < MD5_SSE2_LANES; ++lane)
+    {
+        unsigned char *digest = digests[lane];
+        for (int idx = 0; idx < 4; ++idx)
+        {
+            uint32_t value = state[idx][lane];
+            digest[idx * 4] = static_cast<unsigned char>(value);
+            digest[idx * 4 + 1] = static_cast<unsigned char>(value >> 8);
+            digest[idx * 4 + 2] = static_cast<unsigned char>(value >> 16);
+            digest[idx * 4 + 3] = static_cast<unsigned char>(value >> 24);
+        }
+    }
+}
+#endif
 
-    for (int idx = 0; idx < CC_SHA1_DIGEST_LENGTH; idx++)
+void md5(const std::string *inputs, size_t count, unsigned char *digests)
+{
+    size_t idx = 0;
+#ifdef MD5_SSE2_LANES
+    // Gather the short inputs into groups for the lanes, the long ones go through the scalar path
+    const std::string *lanes[MD5_SSE2_LANES];
+    unsigned char *laneDigests[MD5_SSE2_LANES];
+    int numberOfLanes = 0;
+    for (; idx < count; ++idx)
+    {
+        if (inputs[idx].size() > 55)
+        {
+            md5(inputs[idx].c_str(), inputs[idx].size(), digests + idx * MD5_DIGEST_SIZE);
+            continue;
+        }
+        lanes[numberOfLanes] = &inputs[idx];
+        laneDigests[numberOfLanes] = digests + idx * MD5_DIGEST_SIZE;
+        if (++numberOfLanes == MD5_SSE2_LANES)
+        {
+            md5Lanes(lanes, laneDigests);
+            numberOfLanes = 0;
+        }
+    }
+    for (int lane = 0; lane < numberOfLanes; ++lane)
     {
-        stream << std::setw(2) << ((unsigned int) digest[idx]);
+        md5(lanes[lane]->c_str(), lanes[lane]->size(), laneDigests[lane]);
     }
 #else
-#error "SHA1 Not implemented."
+    for (; idx < count; ++idx)
+    {
+        md5(inputs[idx].c_str(), inputs[idx].size(), digests + idx * MD5_DIGEST_SIZE);
+    }
 #endif
+}
 
-    return stream.str();
+void md5(const std::vector<std::string>& inputs, std::vector<std::string>& hashes)
+{
+    hashes.resize(inputs.size());
+    if (inputs.empty())
+    {
+        return;
+    }
+    std::vector<unsigned char> digests(inputs.size() * MD5_DIGEST_SIZE);
+    md5(&inputs[0], inputs.size(), &digests[0]);
+    for (size_t idx = 0; idx < inputs.size(); ++idx)
+    {
+        hashes[idx] = hexEncode(&digests[idx * MD5_DIGEST_SIZE], MD5_DIGEST_SIZE);
+    }
+}
+
+void hexEncode(const unsigned char *data, size_t length, char *output)
+{
+    for (size_t idx = 0; idx < length; ++idx)
+    {
+        output[idx * 2] = HEX_DIGITS[data[idx] >> 4];
+        output[idx * 2 + 1] = HEX_DIGITS[data[idx] & 0x0F];
+    }
+}
+
+std::string hexEncode(const unsigned char *data, size_t length)
+{
+    std::string value(length * 2, '0');
+    if (length > 0)
+    {
+        hexEncode(data, length, &value[0]);
+    }
+    return value;
+}
+
+std::string md5(const std::string& s)
+{
+    unsigned char digest[MD5_DIGEST_SIZE];
+    md5(s.c_str(), s.size(), digest);
+    return hexEncode(digest, MD5_DIGEST_SIZE);
+}
+
+std::string sha1(const std::string& s)
+{
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    sha1(s.c_str(), s.size(), digest);
+    return hexEncode(digest, SHA1_DIGEST_SIZE);
 }
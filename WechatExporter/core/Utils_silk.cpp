@@ -73,12 +73,13 @@ unsigned long GetHighResolutionTime() /* O: time in usec*/
 #endif // _WIN32
 
 /* Seed for the random number generator, which is used for simulating packet loss */
-static SKP_int32 rand_seed = 1;
+static thread_local SKP_int32 rand_seed = 1;
 
-bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
+/* Decoder state of the worker thread, reset by SKP_Silk_SDK_InitDecoder for each file */
+static thread_local std::vector<unsigned char> t_decoderState;
+
+bool silkDecode(const std::string& silkPath, const std::function<bool(const short *samples, size_t numberOfSamples)>& handler)
 {
-    pcmData.clear();
-    
 #ifdef ENABLE_AUDIO_CONVERTION
     unsigned long tottime, starttime;
     size_t    counter;
@@ -159,10 +160,12 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
     if( ret ) {
         // printf( "\nSKP_Silk_SDK_Get_Decoder_Size returned %d", ret );
     }
-    std::vector<unsigned char> bufferDec;
-    bufferDec.resize(decSizeBytes, 0);
+    if (t_decoderState.size() < static_cast<size_t>(decSizeBytes))
+    {
+        t_decoderState.resize(decSizeBytes, 0);
+    }
     // psDec = malloc( decSizeBytes );
-    psDec = reinterpret_cast<void *>(&(bufferDec[0]));
+    psDec = reinterpret_cast<void *>(&(t_decoderState[0]));
 
     /* Reset decoder */
     ret = SKP_Silk_SDK_InitDecoder( psDec );
@@ -291,8 +294,10 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
         swap_endian( out, tot_len );
 #endif
         // fwrite( out, sizeof( SKP_int16 ), tot_len, speechOutFile );
-        unsigned char *p = reinterpret_cast<unsigned char *>(out);
-        std::copy(p, p + sizeof( SKP_int16 ) * tot_len, std::back_inserter(pcmData));
+        if (tot_len > 0 && !handler(out, tot_len))
+        {
+            return false;
+        }
 
         /* Update buffer */
         totBytes = 0;
@@ -388,8 +393,10 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
         swap_endian( out, tot_len );
 #endif
         // fwrite( out, sizeof( SKP_int16 ), tot_len, speechOutFile );
-        unsigned char *p = reinterpret_cast<unsigned char *>(out);
-        std::copy(p, p + sizeof( SKP_int16 ) * tot_len, std::back_inserter(pcmData));
+        if (tot_len > 0 && !handler(out, tot_len))
+        {
+            return false;
+        }
 
         /* Update Buffer */
         totBytes = 0;
@@ -422,6 +429,17 @@ bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
     return true;
 }
 
+bool silkToPcm(const std::string& silkPath, std::vector<unsigned char>& pcmData)
+{
+    pcmData.clear();
+    return silkDecode(silkPath, [&pcmData](const short *samples, size_t numberOfSamples)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(samples);
+        pcmData.insert(pcmData.end(), p, p + sizeof(short) * numberOfSamples);
+        return true;
+    });
+}
+
 bool silkToPcm(const std::string& silkPath, const std::string& pcmPath)
 {
     std::vector<unsigned char> pcmData;
@@ -12,6 +12,8 @@
 #include <map>
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #ifndef NDEBUG
 #include <cassert>
 #endif
@@ -64,6 +66,41 @@
 // CFNetwork - Darwin
 // https://user-agents.net/applications/cfnetwork
 
+// Length-prefixed binary records for the local snapshots, native byte order
+inline void serializeUInt32(std::string& buffer, uint32_t value)
+{
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void serializeString(std::string& buffer, const std::string& value)
+{
+    serializeUInt32(buffer, static_cast<uint32_t>(value.size()));
+    buffer.append(value);
+}
+
+inline bool unserializeUInt32(const char*& data, const char* end, uint32_t& value)
+{
+    if (end - data < static_cast<ptrdiff_t>(sizeof(value)))
+    {
+        return false;
+    }
+    std::memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return true;
+}
+
+inline bool unserializeString(const char*& data, const char* end, std::string& value)
+{
+    uint32_t length = 0;
+    if (!unserializeUInt32(data, end, length) || static_cast<size_t>(end - data) < length)
+    {
+        return false;
+    }
+    value.assign(data, length);
+    data += length;
+    return true;
+}
+
 class WechatInfo
 {
 private:
@@ -123,6 +160,24 @@ public:
         return m_cellDataVersion;
     }
     
+    void serialize(std::string& buffer) const
+    {
+        serializeString(buffer, m_version);
+        serializeString(buffer, m_osVersion);
+        serializeString(buffer, m_cellDataVersion);
+    }
+    
+    bool unserialize(const char*& data, const char* end)
+    {
+        std::string version;
+        if (!unserializeString(data, end, version) || !unserializeString(data, end, m_osVersion) || !unserializeString(data, end, m_cellDataVersion))
+        {
+            return false;
+        }
+        setVersion(version);
+        return true;
+    }
+    
     std::string buildUserAgent() const
     {
         std::vector<std::pair<int, std::string>> versionMapping = {
@@ -221,14 +276,15 @@ protected:
     std::string m_outputFileName; // Use displayName first and then usrName
     
     std::map<std::string, std::pair<std::string, std::string>> m_members; // uidHash => <uid,NickName>
+    std::string m_membersXml; // RoomData of the chatroom contact, decoded only when a chat needs the names
     
 public:
     
-    Friend() : m_isChatroom(false), m_deleted(false)
+    Friend() : m_userType(0), m_isChatroom(false), m_deleted(false)
     {
     }
     
-    Friend(const std::string& uid, const std::string& hash) : m_usrName(uid), m_uidHash(hash), m_isChatroom(false), m_deleted(false)
+    Friend(const std::string& uid, const std::string& hash) : m_usrName(uid), m_uidHash(hash), m_userType(0), m_isChatroom(false), m_deleted(false)
     {
         m_isChatroom = isChatroom(uid);
     }
@@ -271,12 +327,60 @@ public:
         return it != m_members.cend();
     }
     
+    const std::map<std::string, std::pair<std::string, std::string>>& getMembers() const
+    {
+        return m_members;
+    }
+    
     std::string getMemberName(const std::string& uidHash) const
     {
         std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = m_members.find(uidHash);
         return it != m_members.cend() ? it->second.second : "";
     }
 
+    inline bool isMembersXmlEmpty() const
+    {
+        return m_membersXml.empty();
+    }
+    
+    inline const std::string& getMembersXml() const
+    {
+        return m_membersXml;
+    }
+    
+    inline void setMembersXml(const char *xml, size_t length)
+    {
+        m_membersXml.assign(xml, length);
+    }
+    
+    bool hasEmptyMemberName() const
+    {
+        for (std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = m_members.cbegin(); it != m_members.cend(); ++it)
+        {
+            if (it->second.second.empty())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Takes the display names of f for the members without one
+    void updateMemberNames(const Friend& f)
+    {
+        for (std::map<std::string, std::pair<std::string, std::string>>::iterator it = m_members.begin(); it != m_members.end(); ++it)
+        {
+            if (it->second.second.empty())
+            {
+                std::map<std::string, std::pair<std::string, std::string>>::const_iterator it2 = f.m_members.find(it->first);
+                if (it2 != f.m_members.cend())
+                {
+                    it->second.second = it2->second.second;
+                }
+            }
+        }
+    }
+
     void addMember(const std::string& uidHash, const std::pair<std::string, std::string>& uidAndDisplayName)
     {
         typename std::map<std::string, std::pair<std::string, std::string>>::iterator it = m_members.find(uidHash);
@@ -366,6 +470,55 @@ public:
         return m_usrName + ".jpg";
     }
     
+    void serialize(std::string& buffer) const
+    {
+        serializeString(buffer, m_usrName);
+        serializeString(buffer, m_uidHash);
+        serializeString(buffer, m_displayName);
+        serializeUInt32(buffer, static_cast<uint32_t>(m_userType));
+        serializeUInt32(buffer, (m_isChatroom ? 1 : 0) | (m_deleted ? 2 : 0));
+        serializeString(buffer, m_portrait);
+        serializeString(buffer, m_portraitHD);
+        serializeString(buffer, m_outputFileName);
+        serializeUInt32(buffer, static_cast<uint32_t>(m_members.size()));
+        for (std::map<std::string, std::pair<std::string, std::string>>::const_iterator it = m_members.cbegin(); it != m_members.cend(); ++it)
+        {
+            serializeString(buffer, it->first);
+            serializeString(buffer, it->second.first);
+            serializeString(buffer, it->second.second);
+        }
+    }
+    
+    bool unserialize(const char*& data, const char* end)
+    {
+        uint32_t userType = 0;
+        uint32_t flags = 0;
+        uint32_t numberOfMembers = 0;
+        if (!unserializeString(data, end, m_usrName) || !unserializeString(data, end, m_uidHash) || !unserializeString(data, end, m_displayName)
+            || !unserializeUInt32(data, end, userType) || !unserializeUInt32(data, end, flags)
+            || !unserializeString(data, end, m_portrait) || !unserializeString(data, end, m_portraitHD) || !unserializeString(data, end, m_outputFileName)
+            || !unserializeUInt32(data, end, numberOfMembers))
+        {
+            return false;
+        }
+        m_userType = static_cast<int>(userType);
+        m_isChatroom = (flags & 1) != 0;
+        m_deleted = (flags & 2) != 0;
+        
+        m_members.clear();
+        std::string uidHash;
+        std::pair<std::string, std::string> member;
+        for (uint32_t idx = 0; idx < numberOfMembers; ++idx)
+        {
+            if (!unserializeString(data, end, uidHash) || !unserializeString(data, end, member.first) || !unserializeString(data, end, member.second))
+            {
+                return false;
+            }
+            m_members.emplace_hint(m_members.cend(), uidHash, member);
+        }
+        return true;
+    }
+    
 protected:
     bool update(const Friend& f)
     {
@@ -390,17 +543,7 @@ protected:
         {
             m_portraitHD = f.m_portraitHD;
         }
-        for (std::map<std::string, std::pair<std::string, std::string>>::iterator it = m_members.begin(); it != m_members.end(); ++it)
-        {
-            if (it->second.second.empty())
-            {
-                std::map<std::string, std::pair<std::string, std::string>>::const_iterator it2 = f.m_members.find(it->first);
-                if (it2 != f.m_members.cend())
-                {
-                    it->second.second = it2->second.second;
-                }
-            }
-        }
+        updateMemberNames(f);
         
         return true;
     }
@@ -646,6 +789,34 @@ public:
         return m_owner;
     }
     
+    // m_data and m_owner belong to the running process and are not serialized
+    void serialize(std::string& buffer) const
+    {
+        Friend::serialize(buffer);
+        serializeUInt32(buffer, static_cast<uint32_t>(m_unreadCount));
+        serializeUInt32(buffer, static_cast<uint32_t>(m_recordCount));
+        serializeUInt32(buffer, m_createTime);
+        serializeUInt32(buffer, m_lastMessageTime);
+        serializeString(buffer, m_extFileName);
+        serializeString(buffer, m_dbFile);
+        serializeString(buffer, m_memberIds);
+    }
+    
+    bool unserialize(const char*& data, const char* end)
+    {
+        uint32_t unreadCount = 0;
+        uint32_t recordCount = 0;
+        if (!Friend::unserialize(data, end) || !unserializeUInt32(data, end, unreadCount) || !unserializeUInt32(data, end, recordCount)
+            || !unserializeUInt32(data, end, m_createTime) || !unserializeUInt32(data, end, m_lastMessageTime)
+            || !unserializeString(data, end, m_extFileName) || !unserializeString(data, end, m_dbFile) || !unserializeString(data, end, m_memberIds))
+        {
+            return false;
+        }
+        m_unreadCount = static_cast<int>(unreadCount);
+        m_recordCount = static_cast<int>(recordCount);
+        return true;
+    }
+    
     
 };
 
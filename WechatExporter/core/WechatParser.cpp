@@ -12,6 +12,7 @@
 #include <fstream>
 #include <cmath>
 #include <algorithm>
+#include <set>
 #include <cstdio>
 #include <cstring>
 #include <sqlite3.h>
@@ -51,6 +52,10 @@ bool parseMembers(const std::string& xml, T& f)
     xpathNodes = xpathObj->nodesetval; //从xpath object中得到node set
     if ((xpathNodes) && (xpathNodes->nodeNr > 0))
     {
+        std::vector<std::string> uids;
+        std::vector<std::string> displayNames;
+        uids.reserve(xpathNodes->nodeNr);
+        displayNames.reserve(xpathNodes->nodeNr);
         for (int i = 0; i < xpathNodes->nodeNr; i++)
         {
             xmlNode *cur = xpathNodes->nodeTab[i];
@@ -81,8 +86,16 @@ bool parseMembers(const std::string& xml, T& f)
                 cur = cur->next;
             }
         
-            std::string uidHash = md5(uid);
-            f.addMember(uidHash, std::make_pair(uid, displayName));
+            uids.push_back(uid);
+            displayNames.push_back(displayName);
+        }
+        
+        // Hash the members of the chatroom in one batch
+        std::vector<std::string> uidHashes;
+        md5(uids, uidHashes);
+        for (size_t idx = 0; idx < uids.size(); ++idx)
+        {
+            f.addMember(uidHashes[idx], std::make_pair(uids[idx], displayNames[idx]));
         }
     }
     
@@ -145,7 +158,7 @@ bool LoginInfo2Parser::parse(std::vector<Friend>& users)
     for (ITunesFilesConstIterator it = mmsettings.cbegin(); it != mmsettings.cend(); ++it)
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
-        m_logger->debug("mmsetting: " + (*it)->relativePath  + " => " + (*it)->fileId);
+        m_logger->debug("mmsetting: " + (*it)->getRelativePath()  + " => " + (*it)->getFileId());
 #endif
         std::string fileName = filter.parse((*it));
         fileName = fileName.substr(filter.getPrefix().size());
@@ -259,6 +272,8 @@ bool LoginInfo2Parser::parse(std::vector<Friend>& users)
 
 bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Friend>& users)
 {
+    static const RawFieldPath FIELD_USERS("1");
+    
     RawMessage msg;
     if (!msg.mergeFile(loginInfo2Path))
     {
@@ -268,8 +283,9 @@ bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Frie
         return false;
     }
     
-    std::string value1;
-    if (!msg.parse("1", value1))
+    const char *value1 = NULL;
+    size_t length = 0;
+    if (!msg.parse(FIELD_USERS, value1, length))
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug("Failed to parse field 1 in Documents/LoginInfo2.dat.");
@@ -278,8 +294,7 @@ bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Frie
     }
     
     users.clear();
-    int offset = 0;
-    std::string::size_type length = value1.size();
+    size_t offset = 0;
 #if !defined(NDEBUG) || defined(DBG_PERF)
     m_logger->debug("Length of field 1 in Documents/LoginInfo2.dat = " + std::to_string(length));
 #endif
@@ -288,7 +303,7 @@ bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Frie
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug("Offset of field 1 in Documents/LoginInfo2.dat = " + std::to_string(offset) + "/" + std::to_string(length));
 #endif
-        int res = parseUser(value1.c_str() + offset, static_cast<int>(length - offset), users);
+        int res = parseUser(value1 + offset, static_cast<int>(length - offset), users);
         if (res < 0)
         {
             break;
@@ -309,6 +324,13 @@ bool LoginInfo2Parser::parse(const std::string& loginInfo2Path, std::vector<Frie
 
 int LoginInfo2Parser::parseUser(const char* data, int length, std::vector<Friend>& users)
 {
+    static const RawFieldPath FIELD_USRNAME("1");
+    static const RawFieldPath FIELD_DISPLAYNAME("3");
+#ifndef NDEBUG
+    static const RawFieldPath FIELD_10_1_2("10.1.2");
+    static const RawFieldPath FIELD_10_2_2_2("10.2.2.2");
+#endif
+    
     uint32_t userBufferLen = 0;
     
     const char* p = calcVarint32Ptr(data, data + length, &userBufferLen);
@@ -325,14 +347,14 @@ int LoginInfo2Parser::parseUser(const char* data, int length, std::vector<Friend
     Friend user;
     
     std::string value;
-    if (msg.parse("1", value))
+    if (msg.parse(FIELD_USRNAME, value))
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug("UsrName from Documents/LoginInfo2.dat = " + value);
 #endif
         user.setUsrName(value);
     }
-    if (msg.parse("3", value))
+    if (msg.parse(FIELD_DISPLAYNAME, value))
     {
 #if !defined(NDEBUG) || defined(DBG_PERF)
         m_logger->debug("DisplayName from Documents/LoginInfo2.dat = " + value);
@@ -340,10 +362,10 @@ int LoginInfo2Parser::parseUser(const char* data, int length, std::vector<Friend
         user.setDisplayName(value);
     }
 #ifndef NDEBUG
-    if (msg.parse("10.1.2", value))
+    if (msg.parse(FIELD_10_1_2, value))
     {
     }
-    if (msg.parse("10.2.2.2", value))
+    if (msg.parse(FIELD_10_2_2_2, value))
     {
     }
 #endif
@@ -740,6 +762,16 @@ void FriendsParser::setOutputPath(const std::string& outputPath)
 }
 #endif
 
+// Rows of Friend table in [firstRowId, lastRowId] and the contacts decoded from them by one worker
+struct FRIENDS_ROWID_RANGE
+{
+    sqlite3_int64 firstRowId;
+    sqlite3_int64 lastRowId;
+    std::vector<Friend> friends;
+};
+
+#define FRIENDS_ROWS_PER_RANGE  1024
+
 bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
 {
     sqlite3 *db = NULL;
@@ -750,7 +782,7 @@ bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
         return false;
     }
     
-    std::string sql = "SELECT userName,dbContactRemark,dbContactChatRoom,dbContactHeadImage,type FROM Friend";
+    std::string sql = "SELECT MIN(rowid),MAX(rowid),COUNT(*) FROM Friend";
     sqlite3_stmt* stmt = NULL;
     rc = sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL);
     if (rc != SQLITE_OK)
@@ -759,41 +791,131 @@ bool FriendsParser::parseWcdb(const std::string& mmPath, Friends& friends)
         sqlite3_close(db);
         return false;
     }
-
-    while (sqlite3_step(stmt) == SQLITE_ROW)
+    
+    sqlite3_int64 minRowId = 0;
+    sqlite3_int64 maxRowId = -1;
+    sqlite3_int64 numberOfRows = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+    {
+        minRowId = sqlite3_column_int64(stmt, 0);
+        maxRowId = sqlite3_column_int64(stmt, 1);
+        numberOfRows = sqlite3_column_int64(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    
+    // Split rowids evenly, rows of a range keep the order of the table
+    std::vector<FRIENDS_ROWID_RANGE> ranges(static_cast<size_t>(std::max(numberOfRows / FRIENDS_ROWS_PER_RANGE, static_cast<sqlite3_int64>(1))));
+    sqlite3_int64 rowIdsPerRange = (maxRowId - minRowId) / static_cast<sqlite3_int64>(ranges.size()) + 1;
+    for (size_t idx = 0; idx < ranges.size(); ++idx)
+    {
+        ranges[idx].firstRowId = minRowId + rowIdsPerRange * static_cast<sqlite3_int64>(idx);
+        ranges[idx].lastRowId = (idx == ranges.size() - 1) ? maxRowId : (ranges[idx].firstRowId + rowIdsPerRange - 1);
+    }
+    
+    // Each worker has its own connection and decodes into the contacts of the ranges it takes
+    std::atomic_size_t nextRange(0);
+    std::atomic_bool failed(false);
+    auto worker = [this, &mmPath, &ranges, &nextRange, &failed]()
     {
-        int userType = sqlite3_column_int(stmt, 4);
-        const char* val = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        if (NULL == val)
+        sqlite3 *db = NULL;
+        sqlite3_stmt* stmt = NULL;
+        std::string sql = "SELECT userName,dbContactRemark,dbContactChatRoom,dbContactHeadImage,type FROM Friend WHERE rowid>=? AND rowid<=?";
+        if (openSqlite3ReadOnly(mmPath, &db) != SQLITE_OK || sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
         {
-            continue;
+            sqlite3_close(db);
+            failed = true;
+            return;
         }
-        std::string uid = val;
         
-        if (Friend::isSubscription(uid))
+        size_t idx = 0;
+        while ((idx = nextRange++) < ranges.size())
         {
-            continue;
+            FRIENDS_ROWID_RANGE& range = ranges[idx];
+            sqlite3_bind_int64(stmt, 1, range.firstRowId);
+            sqlite3_bind_int64(stmt, 2, range.lastRowId);
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                int userType = sqlite3_column_int(stmt, 4);
+                const char* val = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+                if (NULL == val)
+                {
+                    continue;
+                }
+                std::string uid = val;
+                
+                if (Friend::isSubscription(uid))
+                {
+                    continue;
+                }
+                
+                range.friends.push_back(Friend(uid, md5(uid)));
+                Friend& f = range.friends.back();
+                f.setUserType(userType);
+                
+                parseRemark(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), f);
+                if (m_detailedInfo)
+                {
+                    parseAvatar(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3), f);
+                    parseChatroom(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2), f);
+                }
+            }
+            sqlite3_reset(stmt);
         }
         
-        Friend& f = friends.addFriend(uid);
-        f.setUserType(userType);
-        
-        parseRemark(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), f);
-        if (m_detailedInfo)
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+    };
+    size_t numberOfWorkers = std::min(static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1u)), ranges.size());
+    std::vector<std::thread> threads;
+    for (size_t idx = 1; idx < numberOfWorkers; ++idx)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+    if (failed)
+    {
+        return false;
+    }
+    
+    // Merged in the order of rowids, so a later row of the same contact still wins
+    for (std::vector<FRIENDS_ROWID_RANGE>::iterator itRange = ranges.begin(); itRange != ranges.end(); ++itRange)
+    {
+        for (std::vector<Friend>::iterator it = itRange->friends.begin(); it != itRange->friends.end(); ++it)
         {
-            parseAvatar(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3), f);
-            parseChatroom(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2), f);
+            friends.hashes.emplace(it->getUsrName(), it->getHash());
+            friends.friends[it->getHash()] = std::move(*it);
         }
     }
     
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    return true;
+}
+
+bool FriendsParser::parseMembers(const Friend& chatroom, Session& session)
+{
+    if (chatroom.isMembersXmlEmpty() || !session.hasEmptyMemberName())
+    {
+        return false;
+    }
     
+    Friend members;
+    if (!::parseMembers(chatroom.getMembersXml(), members))
+    {
+        return false;
+    }
+    session.updateMemberNames(members);
     return true;
 }
 
 bool FriendsParser::parseRemark(const void *data, int length, Friend& f)
 {
+    static const RawFieldPath FIELD_NICKNAME("1");
+    static const RawFieldPath FIELD_REMARK("3");
+    
     RawMessage msg;
     if (!msg.merge(reinterpret_cast<const char *>(data), length))
     {
@@ -802,11 +924,11 @@ bool FriendsParser::parseRemark(const void *data, int length, Friend& f)
     
     std::string value;
     // Remark Name
-    if (msg.parse("3", value))
+    if (msg.parse(FIELD_REMARK, value))
     {
         f.setDisplayName(value);
     }
-    if (f.isDisplayNameEmpty() && msg.parse("1", value))
+    if (f.isDisplayNameEmpty() && msg.parse(FIELD_NICKNAME, value))
     {
         f.setDisplayName(value);
     }
@@ -822,6 +944,8 @@ bool FriendsParser::parseRemark(const void *data, int length, Friend& f)
 
 bool FriendsParser::parseAvatar(const void *data, int length, Friend& f)
 {
+    static const RawFieldPath FIELD_PORTRAIT("2");
+    static const RawFieldPath FIELD_PORTRAIT_HD("3");
 
     RawMessage msg;
     if (!msg.merge(reinterpret_cast<const char *>(data), length))
@@ -830,14 +954,14 @@ bool FriendsParser::parseAvatar(const void *data, int length, Friend& f)
     }
     
     std::string value;
-    if (msg.parse("2", value))
+    if (msg.parse(FIELD_PORTRAIT, value))
     {
         if (!Friend::isInvalidPortrait(value))
         {
             f.setPortrait(value);
         }
     }
-    if (msg.parse("3", value))
+    if (msg.parse(FIELD_PORTRAIT_HD, value))
     {
         if (!Friend::isInvalidPortrait(value))
         {
@@ -850,16 +974,20 @@ bool FriendsParser::parseAvatar(const void *data, int length, Friend& f)
 
 bool FriendsParser::parseChatroom(const void *data, int length, Friend& f)
 {
+    static const RawFieldPath FIELD_MEMBERS_XML("6");
+    
     RawMessage msg;
     if (!msg.merge(reinterpret_cast<const char *>(data), length))
     {
         return false;
     }
     
-    std::string value;
-    if (msg.parse("6", value))
+    // Only kept here, most chatrooms are never exported
+    const char *xml = NULL;
+    size_t xmlLength = 0;
+    if (msg.parse(FIELD_MEMBERS_XML, xml, xmlLength))
     {
-        parseMembers(value, f);
+        f.setMembersXml(xml, xmlLength);
     }
 
     return true;
@@ -998,7 +1126,7 @@ bool SessionsParser::parse(const Friend& user, const Friends& friends, std::vect
             const ITunesFile* file = m_iTunesDb->findITunesFile(relativePath);
             if (NULL != file)
             {
-                session.setExtFileName(file->relativePath.substr(userRoot.size())); // file->relativePath is formatted
+                session.setExtFileName(file->getRelativePath().substr(userRoot.size())); // file->relativePath is formatted
             }
             
         }
@@ -1162,7 +1290,7 @@ bool SessionsParser::parseUniversalSessions(const Friend& user, const std::strin
                 const ITunesFile* file = m_iTunesDb->findITunesFile(relativePath);
                 if (NULL != file)
                 {
-                    session.setExtFileName(file->relativePath.substr(userRoot.size())); // file->relativePath is formatted
+                    session.setExtFileName(file->getRelativePath().substr(userRoot.size())); // file->relativePath is formatted
                 }
                 session.setDeleted(true);
                 
@@ -1182,68 +1310,64 @@ bool SessionsParser::parseUniversalSessions(const Friend& user, const std::strin
     return true;
 }
 
-bool SessionsParser::parseMessageDbs(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions)
+struct MSGDB_TABLE_STAT
 {
-    SessionHashCompare comp;
-    std::sort(sessions.begin(), sessions.end(), comp);
+    std::string chatId;
+    int recordCount;
+    bool hasLastCreateTime; // Only taken for the chats without session
+    uint32_t lastCreateTime;
+};
 
-    MessageDbFilter filter(userRoot);
-    ITunesFileVector dbs = m_iTunesDb->filter(filter);
-    const ITunesFile* file = m_iTunesDb->findITunesFile(combinePath(userRoot, "DB", "MM.sqlite"));
-    if (NULL != file)
-    {
-        dbs.push_back(const_cast<ITunesFile *>(file));
-    }
+struct MSGDB_STATS
+{
+    std::string mmPath;
+    std::string fileId;
+    unsigned int modifiedTime;
+    uint64_t size;
+    bool cached;
+    bool loaded;    // All tables are counted, only then the stats are written into the cache
+    std::vector<MSGDB_TABLE_STAT> tables;
+};
 
-    std::vector<Session> deletedSessions;
-    std::vector<std::pair<std::string, int>> sessionIds;
-    for (ITunesFilesConstIterator it = dbs.cbegin(); it != dbs.cend(); ++it)
+static bool queryInteger(sqlite3 *db, const std::string& sql, int64_t& value)
+{
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) != SQLITE_OK)
     {
-        std::string mmPath = m_iTunesDb->getRealPath(*it);
-        parseMessageDb(user, mmPath, sessions, deletedSessions);
+        return false;
     }
-    
-    // Append deletedSessions at last as parseMessageDb needs SORTED sessions
-    for (std::vector<Session>::iterator it = deletedSessions.begin(); it != deletedSessions.end(); ++it)
+    // No row leaves the value as it is
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW)
     {
-        // /session/data/c3/2488b928e0bf604ec1cb02b53f18a7
-        std::string relativePath = combinePath(userRoot, "/session/data/", it->getHash().substr(0, 2), it->getHash().substr(2));
-        const ITunesFile* file = m_iTunesDb->findITunesFile(relativePath);
-        if (NULL != file)
-        {
-            it->setExtFileName(file->relativePath); // it->relativePath is formatted
-        }
-        
-        it->setDeleted(true);
-        sessions.push_back(*it);
+        value = sqlite3_column_int64(stmt, 0);
     }
-
-    return true;
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE;
 }
 
-bool SessionsParser::parseMessageDb(const Friend& user, const std::string& mmPath, std::vector<Session>& sessions, std::vector<Session>& deletedSessions)
+static bool loadMessageDbStats(MSGDB_STATS& stats)
 {
     sqlite3 *db = NULL;
-    int rc = openSqlite3ReadOnly(mmPath, &db);
+    int rc = openSqlite3ReadOnly(stats.mmPath, &db);
     if (rc != SQLITE_OK)
     {
         sqlite3_close(db);
         return false;
     }
     
-    std::string sql = "SELECT name FROM sqlite_master WHERE type='table' ORDER BY name";
+    std::string sql = "SELECT name FROM sqlite_master WHERE type='table' AND name LIKE 'Chat\\_%' ESCAPE '\\' ORDER BY name";
 
     sqlite3_stmt* stmt = NULL;
     rc = sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL);
     if (rc != SQLITE_OK)
     {
-        std::string error = sqlite3_errmsg(db);
         sqlite3_close(db);
         return false;
     }
     
-    SessionHashCompare comp;
-    while (sqlite3_step(stmt) == SQLITE_ROW)
+    bool result = true;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
     {
         const unsigned char* pName = sqlite3_column_text(stmt, 0);
         if (pName == NULL)
@@ -1252,62 +1376,310 @@ bool SessionsParser::parseMessageDb(const Friend& user, const std::string& mmPat
         }
         std::string name = reinterpret_cast<const char*>(pName);
         // "^Chat_([0-9a-f]{32})$"
-        if (startsWith(name, "Chat_"))
-        {
-            std::string chatId = name.substr(5);
-            int recordCount = 0;
-            std::string sql2 = "SELECT COUNT(*) AS rc FROM " + name;
-            sqlite3_stmt* stmt2 = NULL;
-            rc = sqlite3_prepare_v2(db, sql2.c_str(), (int)(sql2.size()), &stmt2, NULL);
-            if (rc == SQLITE_OK)
-            {
-                if (sqlite3_step(stmt2) == SQLITE_ROW)
-                {
-                    recordCount = sqlite3_column_int(stmt2, 0);
-                }
-                
-                sqlite3_finalize(stmt2);
-                
-                std::vector<Session>::iterator it = std::lower_bound(sessions.begin(), sessions.end(), chatId, comp);
-                if (it != sessions.end() && it->getHash() == chatId)
-                {
-                    it->setDbFile(mmPath);
-                    it->setRecordCount(recordCount);
-                }
-                else
-                {
-                    uint32_t lastCreateTime = 0;
-                    std::string sql3 = "SELECT MAX(CreateTime) AS lct FROM " + name;
-                    sqlite3_stmt* stmt3 = NULL;
-                    rc = sqlite3_prepare_v2(db, sql3.c_str(), (int)(sql3.size()), &stmt3, NULL);
-                    if (rc == SQLITE_OK)
-                    {
-                        if (sqlite3_step(stmt3) == SQLITE_ROW)
-                        {
-                            lastCreateTime = sqlite3_column_int(stmt3, 0);
-                        }
-                        sqlite3_finalize(stmt3);
-                    }
+        if (!startsWith(name, "Chat_"))
+        {
+            continue;
+        }
+        // A bare COUNT(*) takes the fast path of sqlite, the last time is only taken for the chats which need it
+        int64_t count = 0;
+        if (!queryInteger(db, "SELECT COUNT(*) FROM " + name, count))
+        {
+            result = false;
+            continue;
+        }
+        
+        MSGDB_TABLE_STAT tableStat;
+        tableStat.chatId = name.substr(5);
+        tableStat.recordCount = static_cast<int>(count);
+        tableStat.hasLastCreateTime = false;
+        tableStat.lastCreateTime = 0;
+        stats.tables.push_back(tableStat);
+    }
+    if (rc != SQLITE_DONE)
+    {
+        result = false;
+    }
+    
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    
+    return result;
+}
 
-                    it = deletedSessions.emplace(deletedSessions.cend(), "", chatId, &user);
-                    it->setDbFile(mmPath);
-                    it->setLastMessageTime(lastCreateTime);
-                    it->setRecordCount(recordCount);
-                }
+// The time of the last message of the chats without session, which are exported as deleted sessions
+// sessions should be sorted by hash. Returns true if any time is taken
+static bool loadLastCreateTimes(MSGDB_STATS& stats, const std::vector<Session>& sessions)
+{
+    SessionHashCompare comp;
+    std::vector<MSGDB_TABLE_STAT *> tables;
+    for (std::vector<MSGDB_TABLE_STAT>::iterator it = stats.tables.begin(); it != stats.tables.end(); ++it)
+    {
+        if (it->hasLastCreateTime)
+        {
+            continue;
+        }
+        std::vector<Session>::const_iterator itSession = std::lower_bound(sessions.cbegin(), sessions.cend(), it->chatId, comp);
+        if (itSession == sessions.cend() || itSession->getHash() != it->chatId)
+        {
+            tables.push_back(&(*it));
+        }
+    }
+    if (tables.empty())
+    {
+        return false;
+    }
+    
+    sqlite3 *db = NULL;
+    int rc = openSqlite3ReadOnly(stats.mmPath, &db);
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_close(db);
+        return false;
+    }
+    
+    // Tables with an index led by CreateTime, the last row is read from the index instead of scanning the table
+    std::set<std::string> indexedTables;
+    std::string sql = "SELECT m.tbl_name FROM sqlite_master AS m, pragma_index_info(m.name) AS i WHERE m.type='index' AND m.tbl_name LIKE 'Chat\\_%' ESCAPE '\\' AND i.seqno=0 AND i.name='CreateTime'";
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql.c_str(), (int)(sql.size()), &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const unsigned char* pName = sqlite3_column_text(stmt, 0);
+            if (pName != NULL)
+            {
+                indexedTables.insert(reinterpret_cast<const char*>(pName));
             }
-            
-            // sessionIds.push_back(std::make_pair<>(chatId, recordCount));
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    bool result = false;
+    for (std::vector<MSGDB_TABLE_STAT *>::iterator it = tables.begin(); it != tables.end(); ++it)
+    {
+        std::string name = "Chat_" + (*it)->chatId;
+        int64_t lastCreateTime = 0;
+        if (indexedTables.find(name) != indexedTables.cend())
+        {
+            sql = "SELECT CreateTime FROM " + name + " ORDER BY CreateTime DESC LIMIT 1";
+        }
+        else
+        {
+            sql = "SELECT MAX(CreateTime) FROM " + name;
+        }
+        if (queryInteger(db, sql, lastCreateTime))
+        {
+            (*it)->hasLastCreateTime = true;
+            (*it)->lastCreateTime = static_cast<uint32_t>(lastCreateTime);
+            result = true;
         }
     }
     
-    sqlite3_finalize(stmt);
     sqlite3_close(db);
+    return result;
+}
+
+static void loadMessageDbStatsCache(const std::string& cachePath, std::vector<MSGDB_STATS>& dbStats)
+{
+    std::string data = readFile(cachePath);
+    Json::Reader reader;
+    Json::Value cacheObj;
+    if (data.empty() || !reader.parse(data, cacheObj) || !cacheObj.isObject())
+    {
+        return;
+    }
+    
+    std::map<std::string, const Json::Value *> dbObjs;
+    const Json::Value& dbs = cacheObj["dbs"];
+    for (Json::ArrayIndex idx = 0; idx < dbs.size(); idx++)
+    {
+        dbObjs[dbs[idx]["fileId"].asString()] = &(dbs[idx]);
+    }
+    
+    for (std::vector<MSGDB_STATS>::iterator it = dbStats.begin(); it != dbStats.end(); ++it)
+    {
+        std::map<std::string, const Json::Value *>::const_iterator itDb = dbObjs.find(it->fileId);
+        if (itDb == dbObjs.cend() || it->modifiedTime == 0)
+        {
+            continue;
+        }
+        const Json::Value& dbObj = *(itDb->second);
+        if (dbObj["mtime"].asUInt() != it->modifiedTime || dbObj["size"].asUInt64() != it->size)
+        {
+            continue;
+        }
+        const Json::Value& tables = dbObj["tables"];
+        for (Json::ArrayIndex idx = 0; idx < tables.size(); idx++)
+        {
+            const Json::Value& tableObj = tables[idx];
+            // The last time is left out for the chats with session
+            MSGDB_TABLE_STAT tableStat = { tableObj[0].asString(), tableObj[1].asInt(), tableObj.size() > 2, tableObj.size() > 2 ? tableObj[2].asUInt() : 0 };
+            it->tables.push_back(tableStat);
+        }
+        it->cached = true;
+    }
+}
+
+static void saveMessageDbStatsCache(const std::string& cachePath, const std::vector<MSGDB_STATS>& dbStats)
+{
+    Json::Value dbs(Json::arrayValue);
+    for (std::vector<MSGDB_STATS>::const_iterator it = dbStats.cbegin(); it != dbStats.cend(); ++it)
+    {
+        // The stats of a database which failed to load are left out, so it is loaded again next time
+        if (it->modifiedTime == 0 || !(it->cached || it->loaded))
+        {
+            continue;
+        }
+        Json::Value tables(Json::arrayValue);
+        for (std::vector<MSGDB_TABLE_STAT>::const_iterator itTable = it->tables.cbegin(); itTable != it->tables.cend(); ++itTable)
+        {
+            Json::Value tableObj(Json::arrayValue);
+            tableObj.append(Json::Value(itTable->chatId));
+            tableObj.append(Json::Value(itTable->recordCount));
+            if (itTable->hasLastCreateTime)
+            {
+                tableObj.append(Json::Value(itTable->lastCreateTime));
+            }
+            tables.append(tableObj);
+        }
+        Json::Value dbObj(Json::objectValue);
+        dbObj["fileId"] = Json::Value(it->fileId);
+        dbObj["mtime"] = Json::Value(it->modifiedTime);
+        dbObj["size"] = Json::Value(static_cast<Json::UInt64>(it->size));
+        dbObj["tables"] = tables;
+        dbs.append(dbObj);
+    }
+    
+    Json::Value cacheObj(Json::objectValue);
+    cacheObj["dbs"] = dbs;
+    
+    Json::FastWriter writer;
+    writeFile(cachePath, writer.write(cacheObj));
+}
+
+bool SessionsParser::parseMessageDbs(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions)
+{
+    SessionHashCompare comp;
+    std::sort(sessions.begin(), sessions.end(), comp);
+
+    MessageDbFilter filter(userRoot);
+    ITunesFileVector dbs = m_iTunesDb->filter(filter);
+    const ITunesFile* file = m_iTunesDb->findITunesFile(combinePath(userRoot, "DB", "MM.sqlite"));
+    if (NULL != file)
+    {
+        dbs.push_back(const_cast<ITunesFile *>(file));
+    }
     
+    std::vector<MSGDB_STATS> dbStats(dbs.size());
+    for (size_t idx = 0; idx < dbs.size(); ++idx)
+    {
+        dbStats[idx].mmPath = m_iTunesDb->getRealPath(dbs[idx]);
+        dbStats[idx].fileId = dbs[idx]->getFileId();
+        dbStats[idx].modifiedTime = dbs[idx]->modifiedTime;
+        dbStats[idx].size = dbs[idx]->size;
+        dbStats[idx].cached = false;
+        dbStats[idx].loaded = false;
+    }
+    
+    std::string cachePath = m_cacheDir.empty() ? std::string() : combinePath(m_cacheDir, "msgdbs.json");
+    if (!cachePath.empty())
+    {
+        loadMessageDbStatsCache(cachePath, dbStats);
+    }
+    
+    // The databases are independent, so the tables are counted on all cores with a connection per database
+    std::atomic_size_t nextDb(0);
+    std::atomic_size_t numberOfUpdatedDbs(0);
+    const std::vector<Session>& sortedSessions = sessions;
+    auto worker = [&dbStats, &nextDb, &numberOfUpdatedDbs, &sortedSessions]()
+    {
+        size_t idx = 0;
+        while ((idx = nextDb++) < dbStats.size())
+        {
+            // The tables counted before a failure are still used for this parsing
+            if (!dbStats[idx].cached && loadMessageDbStats(dbStats[idx]))
+            {
+                dbStats[idx].loaded = true;
+                ++numberOfUpdatedDbs;
+            }
+            // Cached stats may miss the time of a chat whose session is gone since then
+            if (loadLastCreateTimes(dbStats[idx], sortedSessions))
+            {
+                ++numberOfUpdatedDbs;
+            }
+        }
+    };
+    size_t numberOfWorkers = std::min(static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1u)), dbStats.size());
+    std::vector<std::thread> threads;
+    for (size_t idx = 1; idx < numberOfWorkers; ++idx)
+    {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        it->join();
+    }
+    
+    if (!cachePath.empty() && numberOfUpdatedDbs > 0)
+    {
+        makeDirectory(m_cacheDir);
+        saveMessageDbStatsCache(cachePath, dbStats);
+    }
+
+    // Stats are applied in the order of the databases, the same as the serial scan
+    std::vector<Session> deletedSessions;
+    for (std::vector<MSGDB_STATS>::const_iterator itDb = dbStats.cbegin(); itDb != dbStats.cend(); ++itDb)
+    {
+        for (std::vector<MSGDB_TABLE_STAT>::const_iterator itTable = itDb->tables.cbegin(); itTable != itDb->tables.cend(); ++itTable)
+        {
+            std::vector<Session>::iterator it = std::lower_bound(sessions.begin(), sessions.end(), itTable->chatId, comp);
+            if (it != sessions.end() && it->getHash() == itTable->chatId)
+            {
+                it->setDbFile(itDb->mmPath);
+                it->setRecordCount(itTable->recordCount);
+            }
+            else
+            {
+                it = deletedSessions.emplace(deletedSessions.cend(), "", itTable->chatId, &user);
+                it->setDbFile(itDb->mmPath);
+                it->setLastMessageTime(itTable->lastCreateTime);
+                it->setRecordCount(itTable->recordCount);
+            }
+        }
+    }
+    
+    // Append deletedSessions at last as the lookup above needs SORTED sessions
+    for (std::vector<Session>::iterator it = deletedSessions.begin(); it != deletedSessions.end(); ++it)
+    {
+        // /session/data/c3/2488b928e0bf604ec1cb02b53f18a7
+        std::string relativePath = combinePath(userRoot, "/session/data/", it->getHash().substr(0, 2), it->getHash().substr(2));
+        const ITunesFile* file = m_iTunesDb->findITunesFile(relativePath);
+        if (NULL != file)
+        {
+            it->setExtFileName(file->getRelativePath()); // it->relativePath is formatted
+        }
+        
+        it->setDeleted(true);
+        sessions.push_back(*it);
+    }
+
     return true;
 }
 
 bool SessionsParser::parseCellData(const std::string& userRoot, Session& session)
 {
+    static const RawFieldPath FIELD_USRNAME("1.1.1");
+    static const RawFieldPath FIELD_MEMBER_IDS("1.3");
+    static const RawFieldPath FIELD_DISPLAYNAME("1.1.6");
+    static const RawFieldPath FIELD_NICKNAME("1.1.4");
+    static const RawFieldPath FIELD_PORTRAIT("1.1.14");
+    static const RawFieldPath FIELD_MEMBERS("1.5");
+    static const RawFieldPath FIELD_LAST_MESSAGE_TIME("2.7");
+    static const RawFieldPath FIELD_RECORD_COUNT("2.2");
+    static const RawFieldPath FIELD_MSG_TIME("10");
+    static const RawFieldPath FIELD_MSG_DISPLAYNAME("7");
+    
     std::string fileName = session.getExtFileName();
     if (startsWith(fileName, DIR_SEP) || startsWith(fileName, ALT_DIR_SEP))
     {
@@ -1330,44 +1702,44 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
 
     std::string value;
     int value2 = 0;
-    if (msg.parse("1.1.1", value))
+    if (msg.parse(FIELD_USRNAME, value))
     {
         if (session.isUsrNameEmpty() && (session.isHashEmpty() || md5(value) == session.getHash()))
         {
             session.setUsrName(value);
         }
     }
-    if (session.isMemberIdsEmpty() && msg.parse("1.3", value))
+    if (session.isMemberIdsEmpty() && msg.parse(FIELD_MEMBER_IDS, value))
     {
         session.setMemberIds(value);
     }
-    if (msg.parse("1.1.6", value))
+    if (msg.parse(FIELD_DISPLAYNAME, value))
     {
         session.setDisplayName(value);
     }
-    if (msg.parse("1.1.4", value))
+    if (msg.parse(FIELD_NICKNAME, value))
     {
         if (session.isDisplayNameEmpty())
         {
             session.setDisplayName(value);
         }
     }
-    if (msg.parse("1.1.14", value))
+    if (msg.parse(FIELD_PORTRAIT, value))
     {
         if (startsWith(value, "http://") || startsWith(value, "https://"))
         {
             session.setPortrait(value);
         }
     }
-    if (msg.parse("1.5", value))
+    if (msg.parse(FIELD_MEMBERS, value))
     {
         parseMembers(value, session);
     }
-    if (msg.parse("2.7", value2))
+    if (msg.parse(FIELD_LAST_MESSAGE_TIME, value2))
     {
         session.setLastMessageTime(static_cast<unsigned int>(value2));
     }
-    if (msg.parse("2.2", value2))
+    if (msg.parse(FIELD_RECORD_COUNT, value2))
     {
         if (session.getRecordCount() == 0)
         {
@@ -1396,12 +1768,12 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
             }
             std::string displayName;
             std::string msgTime;
-            if (msg2.parse("10", value))
+            if (msg2.parse(FIELD_MSG_TIME, value))
             {
                 msgTime = value;
             }
             
-            if (msg2.parse("7", value))
+            if (msg2.parse(FIELD_MSG_DISPLAYNAME, value))
             {
                 displayName = value;
             }
@@ -1409,7 +1781,7 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
             unsigned int modifiedTime = 0;
             if (items.size() > 1)
             {
-                modifiedTime = ITunesDb::parseModifiedTime((*it)->blob);
+                modifiedTime = (*it)->modifiedTime;
             }
             if (session.isDisplayNameEmpty() || (!displayName.empty() && modifiedTime > lastModifiedTime))
             {
@@ -1424,6 +1796,11 @@ bool SessionsParser::parseCellData(const std::string& userRoot, Session& session
 
 bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::vector<Session>& sessions)
 {
+    static const RawFieldPath FIELD_BLOCKS("1");
+    static const RawFieldPath FIELD_USRNAME("1");
+    static const RawFieldPath FIELD_NAME("2");
+    static const RawFieldPath FIELD_NAME2("3");
+    
     std::map<std::string, Session*> sessionMap;
     for (std::vector<Session>::iterator it = sessions.begin(); it != sessions.end(); ++it)
     {
@@ -1445,19 +1822,24 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
             RawMessage msg;
             if (msg.merge(reinterpret_cast<const char *>(&contents[0]), static_cast<int>(contents.size())))
             {
-                std::string value;
-                if (msg.parse("1", value))
+                const char *value = NULL;
+                size_t length = 0;
+                if (msg.parse(FIELD_BLOCKS, value, length))
                 {
                     uint32_t blockLen = 0;
-                    const char * data = value.c_str();
+                    const char * data = value;
                     const char * data1 = NULL;
-                    while ((data1 = calcVarint32Ptr(data, value.c_str() + value.size(), &blockLen)) != NULL)
+                    RawMessage msg2;
+                    while ((data1 = calcVarint32Ptr(data, value + length, &blockLen)) != NULL)
                     {
-                        RawMessage msg2;
+                        if (blockLen > static_cast<size_t>(value + length - data1))
+                        {
+                            break;
+                        }
                         if (msg2.merge(data1, static_cast<int>(blockLen)))
                         {
                             std::string usrName;
-                            if (msg2.parse("1", usrName))
+                            if (msg2.parse(FIELD_USRNAME, usrName))
                             {
                                 Session* session = NULL;
                                 std::map<std::string, Session*>::iterator it = sessionMap.find(usrName);
@@ -1484,11 +1866,11 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
                                 {
                                     std::string nameCand1;
                                     std::string nameCand2;
-                                    if (msg2.parse("2", nameCand1))
+                                    if (msg2.parse(FIELD_NAME, nameCand1))
                                     {
                                         // nameCand1 = value2;
                                     }
-                                    if (!msg2.parse("3", nameCand2))
+                                    if (!msg2.parse(FIELD_NAME2, nameCand2))
                                     {
                                         nameCand2 = "";
                                     }
@@ -1513,19 +1895,24 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
             RawMessage msg;
             if (msg.merge(reinterpret_cast<const char *>(&contents[0]), static_cast<int>(contents.size())))
             {
-                std::string value;
-                if (msg.parse("1", value))
+                const char *value = NULL;
+                size_t length = 0;
+                if (msg.parse(FIELD_BLOCKS, value, length))
                 {
                     uint32_t blockLen = 0;
-                    const char * data = value.c_str();
+                    const char * data = value;
                     const char * data1 = NULL;
-                    while ((data1 = calcVarint32Ptr(data, value.c_str() + value.size(), &blockLen)) != NULL)
+                    RawMessage msg2;
+                    while ((data1 = calcVarint32Ptr(data, value + length, &blockLen)) != NULL)
                     {
-                        RawMessage msg2;
+                        if (blockLen > static_cast<size_t>(value + length - data1))
+                        {
+                            break;
+                        }
                         if (msg2.merge(data1, static_cast<int>(blockLen)))
                         {
                             std::string value2;
-                            if (msg2.parse("1", value2))
+                            if (msg2.parse(FIELD_USRNAME, value2))
                             {
                                 Session* session = NULL;
                                 std::map<std::string, Session*>::iterator it = sessionMap.find(value2);
@@ -1551,11 +1938,11 @@ bool SessionsParser::parseSessionsInGroupApp(const std::string& userRoot, std::v
                                 if (NULL != session && session->isDisplayNameEmpty())
                                 {
                                     std::string name;
-                                    if (msg2.parse("2", value2))
+                                    if (msg2.parse(FIELD_NAME, value2))
                                     {
                                         name = value2;
                                     }
-                                    if (!msg2.parse("3", value2))
+                                    if (!msg2.parse(FIELD_NAME2, value2))
                                     {
                                         value2 = "";
                                     }
@@ -32,23 +32,23 @@ protected:
     std::string m_pattern;
 
 public:
-    bool operator() (const ITunesFile* s1, const T& s2) const    // less
+    bool operator() (const ITunesFile& s1, const T& s2) const    // less
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath < m_path;
+        return !s1.startsWith(m_path) && s1.compare(m_path) < 0;
     }
-    bool operator() (const T& s2, const ITunesFile* s1) const    // greater
+    bool operator() (const T& s2, const ITunesFile& s1) const    // greater
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath > m_path;
+        return !s1.startsWith(m_path) && s1.compare(m_path) > 0;
     }
     bool operator==(const ITunesFile* s) const
     {
-        return startsWith(s->relativePath, m_path) && (s->relativePath.find(m_pattern, m_path.size()) != std::string::npos);
+        return s->startsWith(m_path) && (std::strstr(s->relativePath + m_path.size(), m_pattern.c_str()) != NULL);
     }
     std::string parse(const ITunesFile* s) const
     {
         if (*this == s)
         {
-            return s->relativePath.substr(m_path.size());
+            return std::string(s->relativePath + m_path.size(), s->relativePathLength - m_path.size());
         }
         return std::string("");
     }
@@ -62,25 +62,25 @@ protected:
     std::regex m_pattern;
 
 public:
-    bool operator() (const ITunesFile* s1, const T& s2) const    // less
+    bool operator() (const ITunesFile& s1, const T& s2) const    // less
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath < m_path;
+        return !s1.startsWith(m_path) && s1.compare(m_path) < 0;
     }
-    bool operator() (const T& s2, const ITunesFile* s1) const    // greater
+    bool operator() (const T& s2, const ITunesFile& s1) const    // greater
     {
-        return !startsWith(s1->relativePath, m_path) && s1->relativePath > m_path;
+        return !s1.startsWith(m_path) && s1.compare(m_path) > 0;
     }
     bool operator==(const ITunesFile* s) const
     {
-        std::smatch sm;
-        return startsWith(s->relativePath, m_path) && std::regex_search(s->relativePath.begin() + m_path.size(), s->relativePath.end(), sm, m_pattern);
+        std::cmatch sm;
+        return s->startsWith(m_path) && std::regex_search(s->relativePath + m_path.size(), s->relativePath + s->relativePathLength, sm, m_pattern);
     }
     std::string parse(const ITunesFile* s) const
     {
-        std::smatch sm;
-        if (std::regex_search(s->relativePath.begin() + m_path.size(), s->relativePath.end(), sm, m_pattern))
+        std::cmatch sm;
+        if (std::regex_search(s->relativePath + m_path.size(), s->relativePath + s->relativePathLength, sm, m_pattern))
         {
-            return sm[1];
+            return sm[1].str();
         }
         return std::string("");
     }
@@ -122,7 +122,7 @@ public:
     
     bool operator==(const ITunesFile* s) const
     {
-        if (/*(s->relativePath.size() != (m_path.size() + 32 + 13)) || */!startsWith(s->relativePath, m_path)|| !endsWith(s->relativePath, m_suffix))
+        if (/*(s->relativePath.size() != (m_path.size() + 32 + 13)) || */!s->startsWith(m_path) || !s->endsWith(m_suffix))
         {
             return false;
         }
@@ -136,7 +136,7 @@ public:
     
     std::string parse(const ITunesFile* s) const
     {
-        return s->relativePath.substr(m_pathLen, s->relativePath.length() - m_pathLen - m_suffixLen);
+        return std::string(s->relativePath + m_pathLen, s->relativePathLength - m_pathLen - m_suffixLen);
         // return s->relativePath.substr(m_path.size()) : "";
         // return s->relativePath.size() > 32 ? s->relativePath.substr(m_path.size()) : "";
     }
@@ -226,13 +226,13 @@ public:
     
     bool operator==(const ITunesFile* s) const
     {
-        return startsWith(s->relativePath, m_path) && !endsWith(s->relativePath, m_suffix);
+        return s->startsWith(m_path) && !s->endsWith(m_suffix);
     }
     std::string parse(const ITunesFile* s) const
     {
         if (*this == s)
         {
-            return s->relativePath.substr(m_pattern.size());
+            return std::string(s->relativePath + m_pattern.size(), s->relativePathLength - m_pattern.size());
         }
         return std::string("");
     }
@@ -287,7 +287,10 @@ class FriendsParser
 {
 public:
     FriendsParser(bool detailedInfo = true);
+    // Rows are decoded in rowid ranges on all cores, the members of chatrooms are kept as xml until parseMembers
     bool parseWcdb(const std::string& mmPath, Friends& friends);
+    // Fills the missing member names of the chat with the ones of the chatroom contact
+    static bool parseMembers(const Friend& chatroom, Session& session);
 #ifndef NDEBUG
     void setOutputPath(const std::string& outputPath);
 #endif
@@ -311,17 +314,23 @@ private:
     ITunesDb *m_iTunesDbShare;
     std::string m_cellDataVersion;
     bool        m_detailedInfo;
+    std::string m_cacheDir;
 
 public:
     SessionsParser(ITunesDb *iTunesDb, ITunesDb *iTunesDbShare, const std::string& cellDataVersion, bool detailedInfo = true);
     
+    // Stats of the message databases are cached here, keyed by fileId and mtime of the database
+    void setCacheDirectory(const std::string& cacheDir)
+    {
+        m_cacheDir = cacheDir;
+    }
+    
     bool parse(const Friend& user, const Friends& friends, std::vector<Session>& sessions);
 
 private:
     bool parseUniversalSessions(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions);
     bool parseCellData(const std::string& userRoot, Session& session);
     bool parseMessageDbs(const Friend& user, const std::string& userRoot, std::vector<Session>& sessions);
-    bool parseMessageDb(const Friend& user, const std::string& mmPath, std::vector<Session>& sessions, std::vector<Session>& deletedSessions);
     
     bool parseSessionsInGroupApp(const std::string& userRoot, std::vector<Session>& sessions);
     
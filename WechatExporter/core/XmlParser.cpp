@@ -7,6 +7,9 @@
 //
 
 #include "XmlParser.h"
+#include <cstring>
+#include <cstdlib>
+#include <libxml/parserInternals.h>
 
 struct NodeValueHandler
 {
@@ -235,3 +238,309 @@ bool XmlParser::parseAttributesValue(const std::string& xpath, std::map<std::str
     AttributesHandler handler = {attributes};
     return parseWithHandler(xpath, handler);
 }
+
+XmlExtractor::XmlExtractor() : m_numberOfPendingSlots(0), m_ctxt(NULL)
+{
+}
+
+int XmlExtractor::addNode(const std::string& path, bool lastMatch/* = false*/)
+{
+    return addSlot(path, "", lastMatch);
+}
+
+int XmlExtractor::addAttribute(const std::string& path, const std::string& attributeName)
+{
+    return addSlot(path, attributeName, false);
+}
+
+int XmlExtractor::addSlot(const std::string& path, const std::string& attributeName, bool lastMatch)
+{
+    if (m_slots.size() >= MAX_SLOTS)
+    {
+        return -1;
+    }
+    
+    Slot slot;
+    slot.attributeName = attributeName;
+    slot.found = false;
+    slot.lastMatch = lastMatch;
+    slot.captureDepth = 0;
+    
+    std::string::size_type start = 0;
+    while (start < path.size())
+    {
+        std::string::size_type end = path.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = path.size();
+        }
+        if (end > start)
+        {
+            slot.segments.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    
+    m_slots.push_back(slot);
+    return static_cast<int>(m_slots.size() - 1);
+}
+
+bool XmlExtractor::extract(const std::string& xml, bool noError/* = false*/)
+{
+    for (std::vector<Slot>::iterator it = m_slots.begin(); it != m_slots.end(); ++it)
+    {
+        it->value.clear();
+        it->found = false;
+        it->captureDepth = 0;
+        it->elementName.clear();
+    }
+    m_candidates.clear();
+    m_capturingSlots.clear();
+    m_numberOfPendingSlots = m_slots.size();
+    if (xml.empty() || m_slots.empty())
+    {
+        return false;
+    }
+    
+    xmlSAXHandler saxHander;
+    memset(&saxHander, 0, sizeof(xmlSAXHandler));
+    saxHander.initialized = XML_SAX2_MAGIC;
+    saxHander.startElementNs = XmlExtractor::startElementNs;
+    saxHander.endElementNs = XmlExtractor::endElementNs;
+    saxHander.characters = XmlExtractor::characters;
+    saxHander.cdataBlock = XmlExtractor::characters;
+    
+    m_ctxt = xmlCreatePushParserCtxt(&saxHander, this, NULL, 0, NULL);
+    if (NULL == m_ctxt)
+    {
+        return false;
+    }
+    
+    int options = XML_PARSE_RECOVER;
+    if (noError)
+    {
+        options |= XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
+    }
+    xmlCtxtUseOptions(m_ctxt, options);
+    
+    // Stopped parser (all slots are filled) reports an error too
+    xmlParseChunk(m_ctxt, xml.c_str(), static_cast<int>(xml.size()), 1);
+    
+    xmlFreeParserCtxt(m_ctxt);
+    m_ctxt = NULL;
+    
+    for (std::vector<Slot>::const_iterator it = m_slots.cbegin(); it != m_slots.cend(); ++it)
+    {
+        if (it->found)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void XmlExtractor::startElement(const xmlChar* localName, int numberOfAttributes, const xmlChar** attrs)
+{
+    size_t depth = m_candidates.size();
+    uint64_t parentCandidates = m_candidates.empty() ? ~static_cast<uint64_t>(0) : m_candidates.back();
+    uint64_t candidates = 0;
+    
+    if (0 != parentCandidates)
+    {
+        const char* name = reinterpret_cast<const char*>(localName);
+        for (size_t idx = 0; idx < m_slots.size(); ++idx)
+        {
+            if ((parentCandidates & (static_cast<uint64_t>(1) << idx)) == 0)
+            {
+                continue;
+            }
+            
+            Slot& slot = m_slots[idx];
+            if ((slot.found && !slot.lastMatch) || slot.segments.size() <= depth)
+            {
+                continue;
+            }
+            const std::string& segment = slot.segments[depth];
+            if (segment[0] == '@' ? (slot.elementName != name) : (segment != "*" && segment != name))
+            {
+                continue;
+            }
+            
+            if (slot.segments.size() > depth + 1)
+            {
+                const std::string& nextSegment = slot.segments[depth + 1];
+                // An element without the attribute has no child to match
+                if (nextSegment[0] != '@' || (findAttribute(nextSegment.c_str() + 1, numberOfAttributes, attrs, slot.elementName) && !slot.elementName.empty()))
+                {
+                    candidates |= (static_cast<uint64_t>(1) << idx);
+                }
+                continue;
+            }
+            
+            // Slots taking the last match never complete, so the parser is not stopped before the end
+            bool completed = !slot.found && !slot.lastMatch;
+            slot.found = true;
+            if (slot.attributeName.empty())
+            {
+                slot.value.clear();
+                slot.captureDepth = depth + 1;
+                m_capturingSlots.push_back(static_cast<int>(idx));
+            }
+            else
+            {
+                std::string value;
+                if (findAttribute(slot.attributeName.c_str(), numberOfAttributes, attrs, value))
+                {
+                    slot.value.swap(value);
+                }
+                if (completed)
+                {
+                    --m_numberOfPendingSlots;
+                }
+            }
+        }
+    }
+    
+    m_candidates.push_back(candidates);
+    
+    if (0 == m_numberOfPendingSlots)
+    {
+        xmlStopParser(m_ctxt);
+    }
+}
+
+bool XmlExtractor::findAttribute(const char* name, int numberOfAttributes, const xmlChar** attrs, std::string& value)
+{
+    // attrs: localname/prefix/URI/value/end
+    for (int attrIdx = 0; attrIdx < numberOfAttributes; ++attrIdx)
+    {
+        const xmlChar** attr = attrs + attrIdx * 5;
+        if (xmlStrcmp(attr[0], BAD_CAST(name)) == 0)
+        {
+            assignAttributeValue(value, reinterpret_cast<const char*>(attr[3]), reinterpret_cast<const char*>(attr[4]));
+            return true;
+        }
+    }
+    return false;
+}
+
+// SAX2 keeps character references (predefined entities are turned into &#38; etc.) in attribute values
+void XmlExtractor::assignAttributeValue(std::string& value, const char* begin, const char* end)
+{
+    const char* amp = static_cast<const char*>(memchr(begin, '&', end - begin));
+    if (NULL == amp)
+    {
+        value.assign(begin, end - begin);
+        return;
+    }
+    
+    value.assign(begin, amp - begin);
+    const char* p = amp;
+    while (p < end)
+    {
+        if (*p != '&')
+        {
+            value.push_back(*p++);
+            continue;
+        }
+        const char* semicolon = static_cast<const char*>(memchr(p, ';', end - p));
+        if (NULL == semicolon)
+        {
+            value.append(p, end - p);
+            break;
+        }
+        
+        std::string entity(p + 1, semicolon - p - 1);
+        unsigned long ch = 0;
+        if (entity.size() > 1 && entity[0] == '#')
+        {
+            ch = (entity[1] == 'x' || entity[1] == 'X') ? std::strtoul(entity.c_str() + 2, NULL, 16) : std::strtoul(entity.c_str() + 1, NULL, 10);
+        }
+        else
+        {
+            static const char* const entities[] = { "amp", "lt", "gt", "quot", "apos" };
+            static const char chars[] = { '&', '<', '>', '"', '\'' };
+            for (size_t idx = 0; idx < sizeof(chars); ++idx)
+            {
+                if (entity == entities[idx])
+                {
+                    ch = static_cast<unsigned char>(chars[idx]);
+                    break;
+                }
+            }
+        }
+        
+        if (0 == ch)
+        {
+            value.append(p, semicolon - p + 1);
+        }
+        else
+        {
+            xmlChar buffer[8] = { 0 };
+            int len = xmlCopyCharMultiByte(buffer, static_cast<int>(ch));
+            value.append(reinterpret_cast<const char*>(buffer), len);
+        }
+        p = semicolon + 1;
+    }
+}
+
+void XmlExtractor::endElement()
+{
+    size_t depth = m_candidates.size();
+    std::vector<int>::iterator it = m_capturingSlots.begin();
+    while (it != m_capturingSlots.end())
+    {
+        if (m_slots[*it].captureDepth == depth)
+        {
+            m_slots[*it].captureDepth = 0;
+            if (!m_slots[*it].lastMatch)
+            {
+                --m_numberOfPendingSlots;
+            }
+            it = m_capturingSlots.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    
+    if (!m_candidates.empty())
+    {
+        m_candidates.pop_back();
+    }
+    
+    if (0 == m_numberOfPendingSlots)
+    {
+        xmlStopParser(m_ctxt);
+    }
+}
+
+void XmlExtractor::characters(const xmlChar* ch, int len)
+{
+    for (std::vector<int>::const_iterator it = m_capturingSlots.cbegin(); it != m_capturingSlots.cend(); ++it)
+    {
+        m_slots[*it].value.append(reinterpret_cast<const char*>(ch), len);
+    }
+}
+
+void XmlExtractor::startElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces, int nb_attributes, int nb_defaulted, const xmlChar** attrs)
+{
+    XmlExtractor* extractor = reinterpret_cast<XmlExtractor*>(ctx);
+    extractor->startElement(localName, nb_attributes, attrs);
+}
+
+void XmlExtractor::endElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI)
+{
+    XmlExtractor* extractor = reinterpret_cast<XmlExtractor*>(ctx);
+    extractor->endElement();
+}
+
+void XmlExtractor::characters(void* ctx, const xmlChar* ch, int len)
+{
+    XmlExtractor* extractor = reinterpret_cast<XmlExtractor*>(ctx);
+    if (!extractor->m_capturingSlots.empty())
+    {
+        extractor->characters(ch, len);
+    }
+}
@@ -12,6 +12,8 @@
 #include <cstdio>
 #include <string>
 #include <map>
+#include <vector>
+#include <cstdint>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
@@ -97,6 +99,73 @@ private:
     xmlXPathContextPtr m_xpathCtx;
 };
 
+// Extracts a fixed set of node values and attributes in a single SAX pass without building the DOM
+// Paths are absolute element paths, e.g.: /msg/appmsg/type, "*" matches any element
+// and "@name" matches the element named by the attribute "name" of its parent, e.g.: /sysmsg/@type/text
+// Only the first matched node of every path is taken, just like XmlParser::parseNodeValue,
+// unless lastMatch is set, then the last one is taken like XmlParser::parseNodesValue and the whole xml is parsed
+class XmlExtractor
+{
+public:
+    static const int MAX_SLOTS = 64;
+    
+    XmlExtractor();
+    
+    int addNode(const std::string& path, bool lastMatch = false);
+    int addAttribute(const std::string& path, const std::string& attributeName);
+    
+    bool extract(const std::string& xml, bool noError = false);
+    
+    // Node is found (the attribute may be absent)
+    bool hasValue(int slot) const
+    {
+        return m_slots[slot].found;
+    }
+    const std::string& getValue(int slot) const
+    {
+        return m_slots[slot].value;
+    }
+    bool getValue(int slot, std::string& value) const
+    {
+        if (m_slots[slot].found)
+        {
+            value = m_slots[slot].value;
+        }
+        return m_slots[slot].found;
+    }
+    
+private:
+    struct Slot
+    {
+        std::vector<std::string> segments;
+        std::string attributeName;
+        std::string value;
+        bool found;
+        bool lastMatch;
+        size_t captureDepth;
+        std::string elementName;    // For the "@name" segment after the matched parent
+    };
+    
+    int addSlot(const std::string& path, const std::string& attributeName, bool lastMatch);
+    
+    void startElement(const xmlChar* localName, int numberOfAttributes, const xmlChar** attrs);
+    static bool findAttribute(const char* name, int numberOfAttributes, const xmlChar** attrs, std::string& value);
+    void endElement();
+    void characters(const xmlChar* ch, int len);
+    static void assignAttributeValue(std::string& value, const char* begin, const char* end);
+    
+    static void startElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces, int nb_attributes, int nb_defaulted, const xmlChar** attrs);
+    static void endElementNs(void* ctx, const xmlChar* localName, const xmlChar* prefix, const xmlChar* URI);
+    static void characters(void* ctx, const xmlChar* ch, int len);
+    
+private:
+    std::vector<Slot> m_slots;
+    std::vector<uint64_t> m_candidates;  // slots still matching at every depth
+    std::vector<int> m_capturingSlots;
+    size_t m_numberOfPendingSlots;
+    xmlParserCtxtPtr m_ctxt;
+};
+
 inline std::string XmlParser::getNodeInnerText(xmlNodePtr node)
 {
     if (NULL == node->children)
@@ -0,0 +1,13 @@
+//
+//  bench_stubs.cpp
+//  WechatExporter
+//
+//  Audio conversion is not used by the benchmarks, this keeps them from linking the silk and lame codecs.
+//
+
+#include <string>
+
+bool silkToMp3(const std::string& silkPath, const std::string& mp3Path)
+{
+    return false;
+}
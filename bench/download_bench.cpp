@@ -0,0 +1,90 @@
+//
+//  download_bench.cpp
+//  WechatExporter
+//
+//  Downloads/sec of DownloadTask against the local stand-in server (http_server.py).
+//  The server reports the number of connections, which shows whether they are reused across downloads.
+//
+//  Build (from the repository root):
+//    g++ -std=c++17 -O2 -DNDEBUG -IWechatExporter/core -I/usr/include/libxml2 bench/download_bench.cpp bench/bench_stubs.cpp \
+//        WechatExporter/core/AsyncTask.cpp WechatExporter/core/AsyncExecutor.cpp WechatExporter/core/FileSystem.cpp \
+//        WechatExporter/core/Utils.cpp WechatExporter/core/Utils_md5.cpp WechatExporter/core/Utils_thread.cpp \
+//        -lcurl -lxml2 -lsqlite3 -lpthread -o download_bench
+//  Run:
+//    python3 bench/http_server.py --port 18925 &
+//    ./download_bench 18925 [downloads] [threads]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <unistd.h>
+#include "AsyncExecutor.h"
+#include "AsyncTask.h"
+#include "FileSystem.h"
+
+class BenchCallback : public AsyncExecutor::Callback
+{
+public:
+    std::atomic<int> succeeded;
+    std::atomic<int> failed;
+    
+    BenchCallback() : succeeded(0), failed(0)
+    {
+    }
+    
+    virtual void onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task)
+    {
+    }
+    
+    virtual void onTaskComplete(const AsyncExecutor* executor, const AsyncExecutor::Task *task, bool succeeded)
+    {
+        ++(succeeded ? this->succeeded : this->failed);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s port [downloads] [threads]\n", argv[0]);
+        return 1;
+    }
+    std::string port = argv[1];
+    int numberOfDownloads = argc > 2 ? atoi(argv[2]) : 1000;
+    int numberOfThreads = argc > 3 ? atoi(argv[3]) : 4;
+    
+    char cwd[4096] = { 0 };
+    if (NULL == getcwd(cwd, sizeof(cwd)))
+    {
+        return 1;
+    }
+    std::string outputDir = combinePath(cwd, "download_bench.out");
+    makeDirectory(outputDir);
+    
+    DownloadTask::initialize();
+    BenchCallback callback;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        AsyncExecutor executor(numberOfThreads, numberOfThreads, &callback);
+        std::vector<AsyncExecutor::Task *> tasks;
+        for (int idx = 0; idx < numberOfDownloads; ++idx)
+        {
+            std::string name = "f" + std::to_string(idx);
+            tasks.push_back(new DownloadTask("http://127.0.0.1:" + port + "/" + name, combinePath(outputDir, name), "", 0, name));
+        }
+        executor.addTasks(tasks);
+        executor.shutdown();
+        while (!executor.waitForCompltion(100))
+        {
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    DownloadTask::uninitialize();
+    
+    printf("%d downloads (%d failed) by %d threads in %.2fs: %.1f downloads/sec\n", static_cast<int>(callback.succeeded + callback.failed), static_cast<int>(callback.failed), numberOfThreads, seconds, (callback.succeeded + callback.failed) / seconds);
+    deleteDirectory(outputDir);
+    return 0;
+}
@@ -0,0 +1,166 @@
+//
+//  executor_bench.cpp
+//  WechatExporter
+//
+//  Tasks/sec and start latency of AsyncExecutor: producer threads add short CPU-bound tasks while the callbacks
+//  add follow-up ones, as TaskManager does with the copies waiting on downloads.
+//  1% of the tasks are high priority, their latency shows how far they jump ahead of the backlog.
+//
+//  Build (from the repository root):
+//    g++ -std=c++17 -O2 -DNDEBUG -IWechatExporter/core bench/executor_bench.cpp WechatExporter/core/AsyncExecutor.cpp \
+//        WechatExporter/core/Utils_thread.cpp -lpthread -o executor_bench
+//  Run:
+//    ./executor_bench [producers] [tasks per producer] [threads]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include "AsyncExecutor.h"
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+class LatencyRecorder
+{
+public:
+    void add(double latency, bool highPriority)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_latencies.push_back(latency);
+        if (highPriority)
+        {
+            m_highPriorityLatencies.push_back(latency);
+        }
+    }
+
+    void print(double seconds)
+    {
+        printf("%d tasks in %.2fs: %.0f tasks/s\n", static_cast<int>(m_latencies.size()), seconds, m_latencies.size() / seconds);
+        printPercentiles("all", m_latencies);
+        printPercentiles("high priority", m_highPriorityLatencies);
+    }
+
+private:
+    static void printPercentiles(const char *name, std::vector<double>& latencies)
+    {
+        if (latencies.empty())
+        {
+            return;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("  %s: p50 %.0fus, p99 %.0fus, p99.9 %.0fus, max %.0fus\n", name, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies[latencies.size() * 999 / 1000], latencies.back());
+    }
+
+    std::mutex m_mutex;
+    std::vector<double> m_latencies;
+    std::vector<double> m_highPriorityLatencies;
+};
+
+static LatencyRecorder s_recorder;
+
+class SpinTask : public AsyncExecutor::Task
+{
+public:
+    SpinTask(int spins, bool highPriority) : m_spins(spins), m_highPriority(highPriority), m_queuedTime(std::chrono::steady_clock::now())
+    {
+        if (highPriority)
+        {
+            setPriority(AsyncExecutor::PRIORITY_HIGH);
+        }
+    }
+
+    virtual int getType() const
+    {
+        return 0;
+    }
+
+    virtual bool run()
+    {
+        double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_queuedTime).count();
+        volatile int value = 0;
+        for (int idx = 0; idx < m_spins; ++idx)
+        {
+            value += idx;
+        }
+        s_recorder.add(latency, m_highPriority);
+        return true;
+    }
+
+private:
+    int m_spins;
+    bool m_highPriority;
+    TimePoint m_queuedTime;
+};
+
+// Every 10th task adds a follow-up one from its callback
+class BenchCallback : public AsyncExecutor::Callback
+{
+public:
+    BenchCallback(int numberOfFollowUps) : m_executor(NULL), m_numberOfFollowUps(numberOfFollowUps)
+    {
+    }
+
+    void setExecutor(AsyncExecutor *executor)
+    {
+        m_executor = executor;
+    }
+
+    virtual void onTaskStart(const AsyncExecutor* executor, const AsyncExecutor::Task *task)
+    {
+    }
+
+    virtual void onTaskComplete(const AsyncExecutor* executor, const AsyncExecutor::Task *task, bool succeeded)
+    {
+        if (m_numberOfFollowUps.fetch_sub(1) > 0)
+        {
+            m_executor->addTask(new SpinTask(200, false));
+        }
+    }
+
+private:
+    AsyncExecutor *m_executor;
+    std::atomic<int> m_numberOfFollowUps;
+};
+
+int main(int argc, char **argv)
+{
+    int numberOfProducers = argc > 1 ? atoi(argv[1]) : 2;
+    int numberOfTasks = argc > 2 ? atoi(argv[2]) : 50000;
+    int numberOfThreads = argc > 3 ? atoi(argv[3]) : 8;
+
+    BenchCallback callback(numberOfProducers * numberOfTasks / 10);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        AsyncExecutor executor(2, numberOfThreads, &callback);
+        callback.setExecutor(&executor);
+
+        std::vector<std::thread> producers;
+        for (int idx = 0; idx < numberOfProducers; ++idx)
+        {
+            producers.push_back(std::thread([&executor, numberOfTasks]() {
+                for (int taskIdx = 0; taskIdx < numberOfTasks; ++taskIdx)
+                {
+                    executor.addTask(new SpinTask(200, (taskIdx % 100) == 0));
+                }
+            }));
+        }
+        for (std::vector<std::thread>::iterator it = producers.begin(); it != producers.end(); ++it)
+        {
+            it->join();
+        }
+        executor.shutdown();
+        while (!executor.waitForCompltion(50))
+        {
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%d producers, %d threads: ", numberOfProducers, numberOfThreads);
+    s_recorder.print(seconds);
+    return 0;
+}
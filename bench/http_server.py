@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+#  http_server.py
+#  WechatExporter
+#
+#  Local stand-in of the media CDN for the download benchmarks.
+#  Serves a fixed body for any GET with keep-alive, optionally adding latency and errors:
+#    --latency: base latency of a request in ms
+#    --saturation: concurrent requests served at the base latency, each one beyond adds --penalty ms
+#    --error-rate: fraction of requests answered with 503
+#    --fail-host, --fail-rate: fraction of the requests to this host name (Host header) answered with 503, a host in trouble
+#  Prints the numbers of requests, errors, connections and the peak concurrency when it quits (Ctrl+C, SIGTERM or --duration).
+#
+
+import argparse
+import http.server
+import random
+import signal
+import socketserver
+import sys
+import threading
+import time
+
+stats = {'requests': 0, 'errors': 0, 'connections': 0, 'active': 0, 'peak': 0}
+lock = threading.Lock()
+args = None
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *a):
+        pass
+
+    def setup(self):
+        super().setup()
+        with lock:
+            stats['connections'] += 1
+
+    def do_GET(self):
+        with lock:
+            stats['requests'] += 1
+            stats['active'] += 1
+            stats['peak'] = max(stats['peak'], stats['active'])
+            active = stats['active']
+        try:
+            time.sleep((args.latency + args.penalty * max(0, active - args.saturation)) / 1000.0)
+            failing = args.fail_host and self.headers.get('Host', '').split(':')[0] == args.fail_host
+            if (failing and random.random() < args.fail_rate) or random.random() < args.error_rate:
+                with lock:
+                    stats['errors'] += 1
+                self.send_response(503)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            body = b'x' * args.size
+            self.send_response(200)
+            self.send_header('Content-Length', str(len(body)))
+            self.send_header('ETag', '"%d"' % args.size)
+            self.end_headers()
+            self.wfile.write(body)
+        finally:
+            with lock:
+                stats['active'] -= 1
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def report():
+    with lock:
+        print('requests %d, errors %d, connections %d, peak concurrency %d' % (stats['requests'], stats['errors'], stats['connections'], stats['peak']), flush=True)
+
+
+def main():
+    global args
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', type=int, default=18925)
+    parser.add_argument('--latency', type=float, default=20)
+    parser.add_argument('--saturation', type=int, default=1000)
+    parser.add_argument('--penalty', type=float, default=50)
+    parser.add_argument('--error-rate', type=float, default=0)
+    parser.add_argument('--fail-host', default='')
+    parser.add_argument('--fail-rate', type=float, default=1)
+    parser.add_argument('--size', type=int, default=2048)
+    parser.add_argument('--duration', type=float, default=0)
+    args = parser.parse_args()
+
+    server = Server(('127.0.0.1', args.port), Handler)
+    signal.signal(signal.SIGTERM, lambda signum, frame: threading.Thread(target=server.shutdown).start())
+    if args.duration > 0:
+        threading.Timer(args.duration, server.shutdown).start()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    report()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
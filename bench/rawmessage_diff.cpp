@@ -0,0 +1,333 @@
+//
+//  rawmessage_diff.cpp
+//  WechatExporter
+//
+//  Differential test of RawMessage against protobuf, parsed the way RawMessage did before it walked the wire data
+//  in place: a DynamicMessage of an empty type for the top level and UnknownFieldSet for the nested messages.
+//  Random messages, some of them corrupted or truncated, are looked up with the paths WechatParser uses and a few
+//  deeper ones. A scalar intermediate field fails the lookup on both sides.
+//  Known differences, counted but not compared:
+//    protobuf rejects a nested message with a malformed tail, RawMessage still finds the fields before it.
+//    UnknownFieldSet takes tags of up to 10 bytes in nested messages, RawMessage takes 5 bytes like the top level.
+//
+//  Build (from the repository root):
+//    g++ -std=c++17 -O2 -DNDEBUG -IWechatExporter/core bench/rawmessage_diff.cpp WechatExporter/core/RawMessage.cpp \
+//        WechatExporter/core/Utils_protobuf.cpp -lprotobuf -lpthread -o rawmessage_diff
+//  Run:
+//    ./rawmessage_diff [messages] [seed]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <random>
+#include <memory>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/unknown_field_set.h>
+#include "RawMessage.h"
+
+using google::protobuf::DescriptorPool;
+using google::protobuf::DynamicMessageFactory;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::Message;
+using google::protobuf::UnknownField;
+using google::protobuf::UnknownFieldSet;
+
+static const char* PATHS[] = { "1", "2", "3", "6", "7", "10", "1.1", "1.3", "1.5", "2.2", "2.7", "1.1.1", "1.1.4", "1.1.6", "1.1.14", "10.1.2", "10.2.2.2", "3.2.1", "6.6", "1.2.3.4", "7.7.7" };
+
+class MessageGenerator
+{
+public:
+    MessageGenerator(unsigned int seed) : m_random(seed)
+    {
+    }
+
+    std::string generate()
+    {
+        std::string data = message(0);
+        if (!data.empty() && uniform(10) == 0)
+        {
+            data[uniform(static_cast<unsigned int>(data.size()))] = static_cast<char>(uniform(256));
+        }
+        if (!data.empty() && uniform(20) == 0)
+        {
+            data.resize(uniform(static_cast<unsigned int>(data.size())));
+        }
+        return data;
+    }
+
+private:
+    unsigned int uniform(unsigned int limit)
+    {
+        return std::uniform_int_distribution<unsigned int>(0, limit - 1)(m_random);
+    }
+
+    static void appendVarint(std::string& data, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            data.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        data.push_back(static_cast<char>(value));
+    }
+
+    static void appendLittleEndian(std::string& data, uint64_t value, int size)
+    {
+        for (int idx = 0; idx < size; ++idx)
+        {
+            data.push_back(static_cast<char>(value >> (idx * 8)));
+        }
+    }
+
+    std::string message(int depth)
+    {
+        static const unsigned int fieldNumbers[] = { 1, 2, 3, 4, 5, 6, 7, 10, 14 };
+        static const int wireTypes[] = { WIRETYPE_VARINT, WIRETYPE_VARINT, WIRETYPE_FIXED64, WIRETYPE_LENGTH_DELIMITED, WIRETYPE_LENGTH_DELIMITED, WIRETYPE_LENGTH_DELIMITED, WIRETYPE_START_GROUP, WIRETYPE_FIXED32 };
+        static const uint64_t varints[] = { 0, 1, 300, 0x80000005ull, 0x8000000000000007ull };
+
+        std::string data;
+        unsigned int numberOfFields = uniform(7);
+        for (unsigned int idx = 0; idx < numberOfFields; ++idx)
+        {
+            unsigned int fieldNumber = fieldNumbers[uniform(sizeof(fieldNumbers) / sizeof(unsigned int))];
+            int wireType = wireTypes[uniform(sizeof(wireTypes) / sizeof(int))];
+            if (depth >= 3 && wireType == WIRETYPE_START_GROUP)
+            {
+                wireType = WIRETYPE_LENGTH_DELIMITED;
+            }
+            appendVarint(data, (fieldNumber << 3) | wireType);
+            switch (wireType)
+            {
+                case WIRETYPE_VARINT:
+                    appendVarint(data, uniform(6) == 5 ? uniform(1 << 20) : varints[uniform(5)]);
+                    break;
+                case WIRETYPE_FIXED64:
+                    appendLittleEndian(data, (static_cast<uint64_t>(m_random()) << 32) | m_random(), 8);
+                    break;
+                case WIRETYPE_FIXED32:
+                    appendLittleEndian(data, m_random(), 4);
+                    break;
+                case WIRETYPE_LENGTH_DELIMITED:
+                {
+                    std::string body;
+                    if (depth < 3 && uniform(10) < 6)
+                    {
+                        body = message(depth + 1);
+                    }
+                    else
+                    {
+                        body.resize(uniform(13));
+                        for (std::string::iterator it = body.begin(); it != body.end(); ++it)
+                        {
+                            *it = static_cast<char>(uniform(256));
+                        }
+                    }
+                    appendVarint(data, body.size());
+                    data += body;
+                    break;
+                }
+                case WIRETYPE_START_GROUP:
+                    data += message(depth + 1);
+                    appendVarint(data, (fieldNumber << 3) | WIRETYPE_END_GROUP);
+                    break;
+            }
+        }
+        return data;
+    }
+
+    std::mt19937 m_random;
+};
+
+// Parses into the unknown fields of a message without fields, as RawMessage::merge did
+class EmptyMessageParser
+{
+public:
+    EmptyMessageParser()
+    {
+        FileDescriptorProto file;
+        file.set_name("empty_message.proto");
+        file.add_message_type()->set_name("EmptyMessage");
+        m_pool.BuildFile(file);
+        m_factory.reset(new DynamicMessageFactory(&m_pool));
+        m_prototype = m_factory->GetPrototype(m_pool.FindMessageTypeByName("EmptyMessage"));
+    }
+
+    bool parse(const std::string& data, UnknownFieldSet& fields) const
+    {
+        std::unique_ptr<Message> message(m_prototype->New());
+        if (!message->ParseFromString(data))
+        {
+            return false;
+        }
+        fields.MergeFrom(message->GetReflection()->GetUnknownFields(*message));
+        return true;
+    }
+
+private:
+    DescriptorPool m_pool;
+    std::unique_ptr<DynamicMessageFactory> m_factory;
+    const Message *m_prototype;
+};
+
+static EmptyMessageParser s_parser;
+
+enum { LOOKUP_NOT_FOUND = 0, LOOKUP_FOUND, LOOKUP_REJECTED, LOOKUP_LONG_TAG };
+
+struct LOOKUP_RESULT
+{
+    bool found;
+    std::string value;
+    bool intFound;
+    int intValue;
+};
+
+// Copied out while the nested field sets are alive
+static void convertField(const UnknownField& uf, LOOKUP_RESULT& result)
+{
+    switch (uf.type())
+    {
+        case UnknownField::TYPE_VARINT:
+        case UnknownField::TYPE_FIXED32:
+        case UnknownField::TYPE_FIXED64:
+        {
+            uint64_t value = uf.type() == UnknownField::TYPE_VARINT ? uf.varint() : (uf.type() == UnknownField::TYPE_FIXED32 ? uf.fixed32() : uf.fixed64());
+            result.found = result.intFound = true;
+            result.value = std::to_string(value);
+            result.intValue = static_cast<int>(value);
+            break;
+        }
+        case UnknownField::TYPE_LENGTH_DELIMITED:
+            result.found = true;
+            result.value = uf.length_delimited();
+            break;
+        default:
+            break;
+    }
+}
+
+// The first field with the number wins, as RawMessage::find does
+static int findField(const UnknownFieldSet& fields, const RawFieldPath& path, int index, LOOKUP_RESULT& result)
+{
+    for (int idx = 0; idx < fields.field_count(); ++idx)
+    {
+        const UnknownField& uf = fields.field(idx);
+        if (uf.number() != static_cast<int>(path.getField(index)))
+        {
+            continue;
+        }
+        if (index == path.getDepth() - 1)
+        {
+            convertField(uf, result);
+            return LOOKUP_FOUND;
+        }
+        if (uf.type() == UnknownField::TYPE_GROUP)
+        {
+            return findField(uf.group(), path, index + 1, result);
+        }
+        if (uf.type() != UnknownField::TYPE_LENGTH_DELIMITED)
+        {
+            return LOOKUP_NOT_FOUND;
+        }
+        UnknownFieldSet nestedFields;
+        if (!nestedFields.ParseFromString(uf.length_delimited()))
+        {
+            return LOOKUP_REJECTED;
+        }
+        UnknownFieldSet fieldsWithShortTags;
+        if (!s_parser.parse(uf.length_delimited(), fieldsWithShortTags))
+        {
+            return LOOKUP_LONG_TAG;
+        }
+        return findField(nestedFields, path, index + 1, result);
+    }
+    return LOOKUP_NOT_FOUND;
+}
+
+static std::string formatResult(const LOOKUP_RESULT& result)
+{
+    std::string text = result.found ? ("\"" + result.value + "\"") : "-";
+    text += result.intFound ? (" " + std::to_string(result.intValue)) : " -";
+    return text;
+}
+
+static std::string toHex(const std::string& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (std::string::const_iterator it = data.cbegin(); it != data.cend(); ++it)
+    {
+        hex.push_back(digits[static_cast<unsigned char>(*it) >> 4]);
+        hex.push_back(digits[static_cast<unsigned char>(*it) & 0x0F]);
+    }
+    return hex;
+}
+
+int main(int argc, char **argv)
+{
+    int numberOfMessages = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned int seed = argc > 2 ? static_cast<unsigned int>(atoi(argv[2])) : 1;
+
+    std::vector<RawFieldPath> paths;
+    for (size_t idx = 0; idx < sizeof(PATHS) / sizeof(const char*); ++idx)
+    {
+        paths.push_back(RawFieldPath(PATHS[idx]));
+    }
+
+    MessageGenerator generator(seed);
+    int numberOfMismatches = 0;
+    int numberOfLookups = 0;
+    int numberOfRejected = 0;
+    int numberOfLongTags = 0;
+    int numberOfInvalid = 0;
+    for (int idx = 0; idx < numberOfMessages; ++idx)
+    {
+        std::string data = generator.generate();
+        RawMessage msg;
+        UnknownFieldSet fields;
+        bool merged = msg.merge(data.c_str(), static_cast<int>(data.size()));
+        if (merged != s_parser.parse(data, fields))
+        {
+            printf("message %d: merge %d, protobuf %d: %s\n", idx, merged ? 1 : 0, merged ? 0 : 1, toHex(data).c_str());
+            ++numberOfMismatches;
+            continue;
+        }
+        if (!merged)
+        {
+            ++numberOfInvalid;
+            continue;
+        }
+
+        for (size_t pathIdx = 0; pathIdx < paths.size(); ++pathIdx)
+        {
+            LOOKUP_RESULT expected = { false, "", false, 0 };
+            int lookup = findField(fields, paths[pathIdx], 0, expected);
+            if (lookup == LOOKUP_REJECTED)
+            {
+                ++numberOfRejected;
+                continue;
+            }
+            if (lookup == LOOKUP_LONG_TAG)
+            {
+                ++numberOfLongTags;
+                continue;
+            }
+            ++numberOfLookups;
+
+            LOOKUP_RESULT result = { false, "", false, 0 };
+            result.found = msg.parse(paths[pathIdx], result.value);
+            result.intFound = msg.parse(paths[pathIdx], result.intValue);
+            if (result.found != expected.found || result.intFound != expected.intFound || (result.found && result.value != expected.value) || (result.intFound && result.intValue != expected.intValue))
+            {
+                printf("message %d, path %s: %s, protobuf %s: %s\n", idx, PATHS[pathIdx], formatResult(result).c_str(), formatResult(expected).c_str(), toHex(data).c_str());
+                ++numberOfMismatches;
+            }
+        }
+    }
+
+    printf("%d messages (%d invalid), %d lookups, skipped: %d in nested messages rejected by protobuf, %d with long tags: %d mismatches\n", numberOfMessages, numberOfInvalid, numberOfLookups, numberOfRejected, numberOfLongTags, numberOfMismatches);
+    return numberOfMismatches == 0 ? 0 : 1;
+}
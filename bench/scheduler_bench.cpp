@@ -0,0 +1,115 @@
+//
+//  scheduler_bench.cpp
+//  WechatExporter
+//
+//  Downloads through TaskManager and its DownloadScheduler against the local stand-in server (http_server.py).
+//  Half of the downloads go to 127.0.0.1 and half to localhost, which the server can make flaky with --fail-host localhost.
+//  Reports when the downloads of the healthy host finished and when all of them did: retries of the failing host
+//  should not hold up the healthy one.
+//
+//  Build (from the repository root):
+//    g++ -std=c++17 -O2 -DNDEBUG -IWechatExporter/core -I/usr/include/libxml2 bench/scheduler_bench.cpp bench/bench_stubs.cpp \
+//        WechatExporter/core/TaskManager.cpp WechatExporter/core/AsyncTask.cpp WechatExporter/core/AsyncExecutor.cpp \
+//        WechatExporter/core/FileSystem.cpp WechatExporter/core/Utils.cpp WechatExporter/core/Utils_md5.cpp \
+//        WechatExporter/core/Utils_thread.cpp -lcurl -lxml2 -lsqlite3 -lpthread -o scheduler_bench
+//  Run:
+//    python3 bench/http_server.py --port 18925 --latency 20 --saturation 4 --error-rate 0.05 --fail-host localhost --fail-rate 0.2 &
+//    ./scheduler_bench 18925 [downloads]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include "TaskManager.h"
+#include "AsyncTask.h"
+#include "FileSystem.h"
+
+class BenchLogger : public Logger
+{
+public:
+    virtual void write(const std::string& log)
+    {
+    }
+    
+    virtual void debug(const std::string& log)
+    {
+    }
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s port [downloads]\n", argv[0]);
+        return 1;
+    }
+    std::string port = argv[1];
+    int numberOfDownloads = argc > 2 ? atoi(argv[2]) : 400;
+    
+    char cwd[4096] = { 0 };
+    if (NULL == getcwd(cwd, sizeof(cwd)))
+    {
+        return 1;
+    }
+    std::string outputDir = combinePath(cwd, "scheduler_bench.out");
+    deleteDirectory(outputDir);
+    makeDirectory(outputDir);
+    
+    DownloadTask::initialize();
+    BenchLogger logger;
+    std::vector<std::string> healthyOutputs;
+    double healthySeconds = 0;
+    double seconds = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        TaskManager taskManager(&logger);
+        for (int idx = 0; idx < numberOfDownloads; ++idx)
+        {
+            bool healthy = (idx % 2) == 0;
+            std::string name = "f" + std::to_string(idx);
+            std::string output = combinePath(outputDir, name);
+            // Avatars go ahead of emojis
+            taskManager.download(NULL, "http://" + std::string(healthy ? "127.0.0.1" : "localhost") + ":" + port + "/" + name, "", output, 0, "", (idx % 3) == 0 ? "avatar" : "emoji");
+            if (healthy)
+            {
+                healthyOutputs.push_back(output);
+            }
+        }
+        taskManager.shutdown();
+        
+        size_t numberOfHealthyDone = 0;
+        while (!taskManager.waitForCompltion(10))
+        {
+            while (numberOfHealthyDone < healthyOutputs.size() && existsFile(healthyOutputs[numberOfHealthyDone]))
+            {
+                ++numberOfHealthyDone;
+            }
+            if (numberOfHealthyDone == healthyOutputs.size() && healthySeconds == 0)
+            {
+                healthySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (healthySeconds == 0)
+        {
+            healthySeconds = seconds;
+        }
+    }
+    DownloadTask::uninitialize();
+    
+    size_t numberOfHealthyFiles = 0;
+    for (std::vector<std::string>::const_iterator it = healthyOutputs.cbegin(); it != healthyOutputs.cend(); ++it)
+    {
+        if (existsFile(*it))
+        {
+            ++numberOfHealthyFiles;
+        }
+    }
+    printf("%d downloads: healthy host done in %.2fs (%d/%d files), all done in %.2fs\n", numberOfDownloads, healthySeconds, static_cast<int>(numberOfHealthyFiles), static_cast<int>(healthyOutputs.size()), seconds);
+    deleteDirectory(outputDir);
+    return 0;
+}
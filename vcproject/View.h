@@ -79,6 +79,12 @@ private:
 
 		CLoadingHandler(HWND hWnd, const std::string& resDir, const std::string& backupDir, Logger* logger) : m_hWnd(hWnd), m_exp(resDir, backupDir, "", logger, NULL)
 		{
+			TCHAR szPath[MAX_PATH] = { 0 };
+			if (SUCCEEDED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA, NULL, SHGFP_TYPE_CURRENT, szPath)))
+			{
+				CW2A pszU8(CT2W(szPath), CP_UTF8);
+				m_exp.setCacheDirectory(combinePath((LPCSTR)pszU8, "WechatExporter"));
+			}
 		}
 
 		~CLoadingHandler()